@@ -0,0 +1,547 @@
+#include <stdlib.h>       // for malloc(), free()
+#include <string.h>       // for memcpy(), memset()
+#include <sys/types.h>    // for off_t
+
+#include "batchfile.h"
+#include "parseahead.h"
+#include "dotstuff.h"
+
+#define BF_READ_BUFFER_LEN 16384
+#define BF_COUNTS_LEN      28     // record length and the six counts
+
+/**
+ * @brief Parts of a record built separately, then joined in file order.
+ *
+ * Kept across messages so their memory is reused.
+ */
+typedef struct _bf_builder
+{
+   RenderBuffer record;     // counts, recipient and field tables, then the rest
+   RenderBuffer values;
+   RenderBuffer segments;
+   RenderBuffer strings;
+   RenderBuffer body;
+} BFBuilder;
+
+// Private, internal functions
+void bf_put_u32(char *ptr, uint32_t value);
+void bf_put_u64(char *ptr, uint64_t value);
+uint32_t bf_get_u32(const char *ptr);
+uint64_t bf_get_u64(const char *ptr);
+int bf_append_u32(RenderBuffer *rb, uint32_t value);
+int bf_add_string(BFBuilder *builder, const char *str, RenderBuffer *table);
+int bf_add_segment(BFBuilder *builder, BFSegmentKind kind, size_t offset, size_t len);
+int bf_build_body(BFBuilder *builder, const PAMessage *message, EmailLineJudge line_judger);
+int bf_build_record(BFBuilder *builder, const PAMessage *message, EmailLineJudge line_judger);
+int bf_build_stand_in(BFBuilder *builder);
+int bf_load_record(BatchFile *bf, BFMessage *message);
+void bf_body_writer(MParcel *parcel, const EmailBody *body);
+
+void bf_put_u32(char *ptr, uint32_t value)
+{
+   ptr[0] = value & 0xff;
+   ptr[1] = (value >> 8) & 0xff;
+   ptr[2] = (value >> 16) & 0xff;
+   ptr[3] = (value >> 24) & 0xff;
+}
+
+void bf_put_u64(char *ptr, uint64_t value)
+{
+   bf_put_u32(ptr, (uint32_t)value);
+   bf_put_u32(ptr + 4, (uint32_t)(value >> 32));
+}
+
+uint32_t bf_get_u32(const char *ptr)
+{
+   const unsigned char *uptr = (const unsigned char*)ptr;
+   return uptr[0] | (uptr[1] << 8) | (uptr[2] << 16) | ((uint32_t)uptr[3] << 24);
+}
+
+uint64_t bf_get_u64(const char *ptr)
+{
+   return bf_get_u32(ptr) | ((uint64_t)bf_get_u32(ptr + 4) << 32);
+}
+
+int bf_append_u32(RenderBuffer *rb, uint32_t value)
+{
+   char bytes[4];
+   bf_put_u32(bytes, value);
+   return rb_append(rb, bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Copy a string, \0 included, and put its offset in *table*.
+ */
+int bf_add_string(BFBuilder *builder, const char *str, RenderBuffer *table)
+{
+   return bf_append_u32(table, builder->strings.len)
+      && rb_append(&builder->strings, str, strlen(str) + 1);
+}
+
+int bf_add_segment(BFBuilder *builder, BFSegmentKind kind, size_t offset, size_t len)
+{
+   return bf_append_u32(&builder->segments, kind)
+      && bf_append_u32(&builder->segments, offset)
+      && bf_append_u32(&builder->segments, len);
+}
+
+/**
+ * @brief Judge the body lines once, the way smtp_send_body() would,
+ *        dot-stuffing the content and keeping the section lines aside.
+ */
+int bf_build_body(BFBuilder *builder, const PAMessage *message, EmailLineJudge line_judger)
+{
+   const char *line = message->arena + message->body_offset;
+   const char *end = message->arena + message->arena_len;
+   const char *line_end;
+   size_t content_start = 0;
+   DotStuffer stuffer;
+   STalker talker;
+
+   ds_init(&stuffer);
+   init_buffer_talker(&talker, &builder->body);
+
+   // Each line in the arena ends with a \n:
+   for (; line < end; line = line_end + 1)
+   {
+      line_end = memchr(line, '\n', end - line);
+
+      switch((*line_judger)(line, line_end - line))
+      {
+         case LJ_Continue:
+            ds_send_block(&stuffer, &talker, line, line_end - line);
+            ds_send_block(&stuffer, &talker, "\r\n", 2);
+            break;
+         case LJ_End_Section:
+            if (builder->body.len > content_start
+                && !bf_add_segment(builder, BF_CONTENT, content_start,
+                                   builder->body.len - content_start))
+               return 0;
+
+            // Keep the \n, as a section printer may look one past the line:
+            content_start = builder->body.len;
+            if (!rb_append(&builder->body, line, line_end - line + 1)
+                || !bf_add_segment(builder, BF_SECTION, content_start, line_end - line))
+               return 0;
+
+            content_start = builder->body.len;
+            break;
+         case LJ_End_Message:
+            goto end_message;
+      }
+   }
+
+  end_message:
+   if (builder->body.len > content_start
+       && !bf_add_segment(builder, BF_CONTENT, content_start,
+                          builder->body.len - content_start))
+      return 0;
+
+   return !builder->body.failed;
+}
+
+int bf_build_record(BFBuilder *builder, const PAMessage *message, EmailLineJudge line_judger)
+{
+   const RecipLink   *rptr;
+   const HeaderField *hptr;
+   const FieldValue  *vptr;
+   uint32_t recipient_count = 0, field_count = 0, value_count, values_total = 0;
+   char counts[BF_COUNTS_LEN];
+
+   rb_reset(&builder->record);
+   rb_reset(&builder->values);
+   rb_reset(&builder->segments);
+   rb_reset(&builder->strings);
+   rb_reset(&builder->body);
+
+   // Room for the counts, filled in last:
+   memset(counts, 0, sizeof(counts));
+   rb_append(&builder->record, counts, sizeof(counts));
+
+   for (rptr = message->recipients; rptr; rptr = rptr->next, ++recipient_count)
+      if (!bf_append_u32(&builder->record, rptr->rtype)
+          || !bf_add_string(builder, rptr->address, &builder->record))
+         return 0;
+
+   for (hptr = message->headers; hptr; hptr = hptr->next, ++field_count)
+   {
+      if (!bf_add_string(builder, hptr->name, &builder->record))
+         return 0;
+
+      for (value_count = 0, vptr = hptr->value; vptr; vptr = vptr->next, ++value_count)
+         if (!bf_add_string(builder, vptr->value, &builder->values))
+            return 0;
+
+      if (!bf_append_u32(&builder->record, value_count))
+         return 0;
+
+      values_total += value_count;
+   }
+
+   if (!bf_build_body(builder, message, line_judger))
+      return 0;
+
+   rb_append(&builder->record, builder->values.data, builder->values.len);
+   rb_append(&builder->record, builder->segments.data, builder->segments.len);
+   rb_append(&builder->record, builder->strings.data, builder->strings.len);
+   rb_append(&builder->record, builder->body.data, builder->body.len);
+
+   if (builder->record.failed || builder->values.failed || builder->segments.failed
+       || builder->strings.failed)
+      return 0;
+
+   bf_put_u32(&builder->record.data[0], builder->record.len - 4);
+   bf_put_u32(&builder->record.data[4], recipient_count);
+   bf_put_u32(&builder->record.data[8], field_count);
+   bf_put_u32(&builder->record.data[12], values_total);
+   bf_put_u32(&builder->record.data[16], builder->segments.len / 12);
+   bf_put_u32(&builder->record.data[20], builder->strings.len);
+   bf_put_u32(&builder->record.data[24], builder->body.len);
+
+   return 1;
+}
+
+/**
+ * @brief Build the record of a message that can't be sent: every count 0.
+ */
+int bf_build_stand_in(BFBuilder *builder)
+{
+   char counts[BF_COUNTS_LEN];
+
+   rb_reset(&builder->record);
+
+   memset(counts, 0, sizeof(counts));
+   bf_put_u32(counts, BF_COUNTS_LEN - 4);
+
+   return rb_append(&builder->record, counts, sizeof(counts));
+}
+
+int bf_compile(const MParcel *parcel,
+               FILE *source,
+               EmailLineJudge line_judger,
+               FILE *target,
+               unsigned long *count)
+{
+   char buffer[BF_READ_BUFFER_LEN];
+   char header[BF_HEADER_LEN];
+   char entry[8];
+   BuffControl bc;
+   BFBuilder builder;
+   RenderBuffer index;
+   PAMessage *message;
+   uint64_t offset = BF_HEADER_LEN;
+   unsigned long compiled = 0;
+   int result, success = 0;
+
+   memset(&builder, 0, sizeof(builder));
+   rb_init(&index);
+
+   init_buff_control(&bc, buffer, sizeof(buffer), bc_file_reader, (void*)source);
+
+   // Leave room for the header, which needs the index offset:
+   memset(header, 0, sizeof(header));
+   if (1 != fwrite(header, sizeof(header), 1, target))
+      goto write_failed;
+
+   while ((result = pa_read_message(parcel, line_judger, &bc, &message)) >= 0)
+   {
+      // Keep a stand-in, so every message keeps its index in the text:
+      if (result == 0)
+         result = bf_build_stand_in(&builder);
+      else
+      {
+         result = bf_build_record(&builder, message, line_judger);
+         pa_free_message(message);
+      }
+
+      bf_put_u64(entry, offset);
+      if (!result || !rb_append(&index, entry, sizeof(entry)))
+      {
+         mcb_log_message(parcel, "Out of memory while compiling a message.", NULL);
+         goto cleanup;
+      }
+
+      if (1 != fwrite(builder.record.data, builder.record.len, 1, target))
+         goto write_failed;
+
+      offset += builder.record.len;
+      ++compiled;
+   }
+
+   if (result == -2)
+      goto cleanup;
+
+   if (ferror(source))
+   {
+      mcb_log_message(parcel, "Failed to read the batch to compile.", NULL);
+      goto cleanup;
+   }
+
+   if (index.len && 1 != fwrite(index.data, index.len, 1, target))
+      goto write_failed;
+
+   memcpy(header, BF_MAGIC, 4);
+   bf_put_u32(&header[4], BF_VERSION);
+   bf_put_u32(&header[8], compiled);
+   bf_put_u32(&header[12], 0);
+   bf_put_u64(&header[16], offset);
+
+   if (fseeko(target, 0, SEEK_SET)
+       || 1 != fwrite(header, sizeof(header), 1, target)
+       || fflush(target))
+      goto write_failed;
+
+   if (count)
+      *count = compiled;
+
+   success = 1;
+   goto cleanup;
+
+  write_failed:
+   mcb_log_message(parcel, "Failed to write the compiled batch.", NULL);
+
+  cleanup:
+   rb_free(&index);
+   rb_free(&builder.record);
+   rb_free(&builder.values);
+   rb_free(&builder.segments);
+   rb_free(&builder.strings);
+   rb_free(&builder.body);
+
+   return success;
+}
+
+int bf_is_compiled(FILE *file)
+{
+   char magic[4];
+   int matched;
+
+   matched = 1 == fread(magic, sizeof(magic), 1, file)
+      && 0 == memcmp(magic, BF_MAGIC, sizeof(magic));
+
+   return 0 == fseeko(file, 0, SEEK_SET) && matched;
+}
+
+int bf_open(BatchFile *bf, const MParcel *parcel, FILE *file)
+{
+   char header[BF_HEADER_LEN];
+
+   memset(bf, 0, sizeof(BatchFile));
+   bf->parcel = parcel;
+   bf->file = file;
+
+   if (fseeko(file, 0, SEEK_SET)
+       || 1 != fread(header, sizeof(header), 1, file)
+       || memcmp(header, BF_MAGIC, 4))
+   {
+      mcb_log_message(parcel, "Not a compiled batch file.", NULL);
+      return 0;
+   }
+
+   if (bf_get_u32(&header[4]) != BF_VERSION)
+   {
+      mcb_log_message(parcel, "Unsupported compiled batch version.", NULL);
+      return 0;
+   }
+
+   bf->message_count = bf_get_u32(&header[8]);
+   bf->index_offset = bf_get_u64(&header[16]);
+
+   return 1;
+}
+
+/**
+ * @brief Read the record at the file position into a single block,
+ *        and build the links and segments in front of it.
+ */
+int bf_load_record(BatchFile *bf, BFMessage *message)
+{
+   char counts[BF_COUNTS_LEN];
+   uint32_t record_len, recipient_count, field_count, value_count;
+   uint32_t segment_count, strings_len, body_len;
+   uint32_t i, offset, values_used = 0;
+   size_t links_len, tables_len;
+   const char *table, *strings, *body;
+   char *record;
+
+   if (1 != fread(counts, sizeof(counts), 1, bf->file))
+      return 0;
+
+   record_len = bf_get_u32(&counts[0]);
+   recipient_count = bf_get_u32(&counts[4]);
+   field_count = bf_get_u32(&counts[8]);
+   value_count = bf_get_u32(&counts[12]);
+   segment_count = bf_get_u32(&counts[16]);
+   strings_len = bf_get_u32(&counts[20]);
+   body_len = bf_get_u32(&counts[24]);
+
+   tables_len = (size_t)recipient_count * 8 + (size_t)field_count * 8
+      + (size_t)value_count * 4 + (size_t)segment_count * 12;
+
+   if ((size_t)record_len != BF_COUNTS_LEN - 4 + tables_len + strings_len + body_len)
+      return 0;
+
+   links_len = recipient_count * sizeof(RecipLink)
+      + field_count * sizeof(HeaderField)
+      + value_count * sizeof(FieldValue)
+      + segment_count * sizeof(BFSegment);
+
+   message->block = calloc(1, links_len + tables_len + strings_len + body_len + 1);
+   if (!message->block)
+   {
+      mcb_log_message(bf->parcel, "Out of memory while loading a compiled message.", NULL);
+      return 0;
+   }
+
+   RecipLink   *rlink = (RecipLink*)message->block;
+   HeaderField *field = (HeaderField*)(rlink + recipient_count);
+   FieldValue  *fvalue = (FieldValue*)(field + field_count);
+   BFSegment   *segment = (BFSegment*)(fvalue + value_count);
+
+   record = (char*)message->block + links_len;
+   if (tables_len + strings_len + body_len
+       && 1 != fread(record, tables_len + strings_len + body_len, 1, bf->file))
+      goto damaged;
+
+   table = record;
+   strings = record + tables_len;
+   body = strings + strings_len;
+
+   // Every string must end inside the strings:
+   if (strings_len && strings[strings_len - 1] != '\0')
+      goto damaged;
+
+   message->recipients = recipient_count ? rlink : NULL;
+   for (i=0; i < recipient_count; ++i, table += 8)
+   {
+      rlink[i].rtype = (RecipType)bf_get_u32(table);
+      if (rlink[i].rtype > RT_SKIP || (offset = bf_get_u32(table + 4)) >= strings_len)
+         goto damaged;
+
+      rlink[i].address = strings + offset;
+      rlink[i].next = i + 1 < recipient_count ? &rlink[i+1] : NULL;
+   }
+
+   // The value table follows the field table:
+   const char *value_table = table + field_count * 8;
+
+   message->headers = field_count ? field : NULL;
+   for (i=0; i < field_count; ++i, table += 8)
+   {
+      uint32_t values = bf_get_u32(table + 4);
+
+      if ((offset = bf_get_u32(table)) >= strings_len
+          || values > value_count - values_used)
+         goto damaged;
+
+      field[i].name = strings + offset;
+      field[i].value = values ? &fvalue[values_used] : NULL;
+      field[i].next = i + 1 < field_count ? &field[i+1] : NULL;
+
+      for (; values; --values, ++values_used)
+      {
+         if ((offset = bf_get_u32(value_table + values_used * 4)) >= strings_len)
+            goto damaged;
+
+         fvalue[values_used].value = strings + offset;
+         fvalue[values_used].next = values > 1 ? &fvalue[values_used + 1] : NULL;
+      }
+   }
+
+   table = value_table + value_count * 4;
+
+   message->segments = segment;
+   message->segment_count = segment_count;
+   for (i=0; i < segment_count; ++i, table += 12)
+   {
+      uint32_t kind = bf_get_u32(table);
+      uint32_t len = bf_get_u32(table + 8);
+
+      offset = bf_get_u32(table + 4);
+      if (kind > BF_SECTION || offset > body_len || len > body_len - offset)
+         goto damaged;
+
+      segment[i].kind = (BFSegmentKind)kind;
+      segment[i].data = body + offset;
+      segment[i].len = len;
+   }
+
+   return 1;
+
+  damaged:
+   free(message->block);
+   memset(message, 0, sizeof(BFMessage));
+   return 0;
+}
+
+int bf_read_message(BatchFile *bf, unsigned long index, BFMessage *message)
+{
+   char entry[8];
+
+   memset(message, 0, sizeof(BFMessage));
+
+   if (index >= bf->message_count)
+      return 0;
+
+   if (fseeko(bf->file, (off_t)(bf->index_offset + (uint64_t)index * 8), SEEK_SET)
+       || 1 != fread(entry, sizeof(entry), 1, bf->file)
+       || fseeko(bf->file, (off_t)bf_get_u64(entry), SEEK_SET)
+       || !bf_load_record(bf, message))
+   {
+      mcb_log_message(bf->parcel, "Damaged message in compiled batch file.", NULL);
+      return 0;
+   }
+
+   return 1;
+}
+
+/**
+ * @brief EmailBodyWriter that sends the segments of a BFMessage.
+ */
+void bf_body_writer(MParcel *parcel, const EmailBody *body)
+{
+   const BFMessage *message = (const BFMessage*)body->writer_data;
+   const BFSegment *segment = message->segments;
+   const BFSegment *end = segment + message->segment_count;
+
+   for (; segment < end; ++segment)
+   {
+      if (segment->kind == BF_SECTION)
+         (*body->section_printer)(parcel, segment->data, segment->len);
+      else
+         parcel->total_sent += stk_simple_send_unlined(parcel->stalker, segment->data, segment->len);
+   }
+}
+
+void bf_send_message(MParcel *parcel, BFMessage *message, EmailSectionPrinter section_printer)
+{
+   EmailBody body = { NULL, NULL, section_printer, bf_body_writer, (void*)message, 0, NULL, NULL };
+   ContentClass content_class;
+   int i;
+
+   // A stand-in for a message that couldn't be compiled:
+   if (!message->recipients)
+      return;
+
+   cl_init(&content_class);
+
+   // The content is stored ready to send, so only mime borders are left out:
+   for (i = 0; i < message->segment_count; ++i)
+   {
+      if (message->segments[i].kind == BF_CONTENT)
+      {
+         body.size_hint += message->segments[i].len;
+         cl_scan(&content_class, message->segments[i].data, message->segments[i].len);
+      }
+   }
+
+   body.content_class = &content_class;
+
+   mcb_send_email_body(parcel, message->recipients, message->headers, &body);
+}
+
+void bf_free_message(BFMessage *message)
+{
+   free(message->block);
+   memset(message, 0, sizeof(BFMessage));
+}
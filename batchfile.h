@@ -0,0 +1,123 @@
+#ifndef BATCHFILE_H
+#define BATCHFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mailcb.h"
+
+/**
+ * Compiled batch files.
+ *
+ * The text batch format (\f between messages, \v between sections,
+ * +/-/# recipient prefixes) has to be read and judged line by line
+ * every time it is sent, and finding message N means reading the N-1
+ * before it.  bf_compile() does that work once, writing a binary file
+ * that sends with no line judging and seeks to any message directly.
+ *
+ * Layout, all integers little-endian:
+ *
+ * - Header, BF_HEADER_LEN bytes: the magic "MCBB", u32 version,
+ *   u32 message count, u32 reserved, u64 offset of the index.
+ * - One record per message: u32 length of the rest of the record,
+ *   then u32 counts of recipients, header fields, field values, body
+ *   segments, string bytes and body bytes, then the tables:
+ *   - recipients: u32 RecipType, u32 offset into the strings
+ *   - fields:     u32 name offset, u32 number of values
+ *   - values:     u32 offset, in field order
+ *   - segments:   u32 BFSegmentKind, u32 offset and u32 length in the body
+ *   then the \0-terminated strings and the body.
+ * - The index: a u64 file offset of each record.
+ *
+ * A message of the text batch that can't be sent has a record all the
+ * same, a stand-in with every count 0, so indexes are those of the
+ * text batch, for journals and shards.
+ *
+ * Body segments are either content, already in CRLF lines and
+ * dot-stuffed, or a section line for the EmailSectionPrinter, which
+ * must run at send time because mime borders belong to the session.
+ */
+
+#define BF_MAGIC "MCBB"
+#define BF_VERSION 1
+#define BF_HEADER_LEN 24
+
+typedef enum _bf_segment_kind
+{
+   BF_CONTENT = 0,
+   BF_SECTION
+} BFSegmentKind;
+
+typedef struct _bf_segment
+{
+   BFSegmentKind kind;
+   const char    *data;
+   size_t        len;
+} BFSegment;
+
+typedef struct _bf_message
+{
+   RecipLink   *recipients;
+   HeaderField *headers;
+   BFSegment   *segments;
+   int         segment_count;
+
+   void        *block;          // the one allocation holding everything above
+} BFMessage;
+
+typedef struct _batch_file
+{
+   const MParcel *parcel;       // for logging
+   FILE          *file;
+   unsigned long message_count;
+   uint64_t      index_offset;
+} BatchFile;
+
+/**
+ * @brief Convert a text batch to a compiled batch.
+ *
+ * Messages that mcb_send_email_simple() would not send are logged as
+ * it would, and compiled as stand-ins without recipients.  *target*
+ * must be seekable, since the header is completed last.
+ *
+ * @param count  If not NULL, set to the number of messages compiled,
+ *               stand-ins included.
+ *
+ * @return 1 for success, 0 if reading, writing, or memory failed.
+ */
+int bf_compile(const MParcel *parcel,
+               FILE *source,
+               EmailLineJudge line_judger,
+               FILE *target,
+               unsigned long *count);
+
+/**
+ * @brief Check for the compiled batch magic, leaving *file* at its start.
+ */
+int bf_is_compiled(FILE *file);
+
+/**
+ * @brief Read the header of a compiled batch.
+ *
+ * @return 1 if *file* is a compiled batch of a version this library reads.
+ */
+int bf_open(BatchFile *bf, const MParcel *parcel, FILE *file);
+
+/**
+ * @brief Load message *index*, counting from 0, with a single seek.
+ *
+ * @return 1 with *message* ready to send and later bf_free_message(),
+ *         0 if the index is out of range or the record is damaged.
+ *         A stand-in loads with no recipients.
+ */
+int bf_read_message(BatchFile *bf, unsigned long index, BFMessage *message);
+
+/**
+ * @brief Send a loaded message with mcb_send_email_body().
+ *
+ * Nothing is sent for a stand-in.
+ */
+void bf_send_message(MParcel *parcel, BFMessage *message, EmailSectionPrinter section_printer);
+
+void bf_free_message(BFMessage *message);
+
+#endif
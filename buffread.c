@@ -12,6 +12,7 @@
 const char *find_bc_end_of_line(const char *cur_line, const char *limit);
 const char *find_bc_start_of_next_line(const char *line_ending_char, const char *limit);
 void bc_read_into_buffer(BuffControl *bc);
+int bc_find_next_line(BuffControl *bc);
 
 /**
  * @brief Simple implementation of BReader function pointer using a FILE*
@@ -22,6 +23,20 @@ size_t bc_file_reader(void *filestream, char *buffer, int buffer_len)
    return fread(buffer, 1, buffer_len, f);
 }
 
+/**
+ * @brief Implementation of BReader function pointer using a BCMemorySource*
+ */
+size_t bc_memory_reader(void *memory_source, char *buffer, int buffer_len)
+{
+   BCMemorySource *source = (BCMemorySource*)memory_source;
+   size_t available = source->end - source->data;
+   size_t count = available < (size_t)buffer_len ? available : (size_t)buffer_len;
+
+   memcpy(buffer, source->data, count);
+   source->data += count;
+   return count;
+}
+
 /**
  * @brief Returns a pointer just past the last character of the line.
  *
@@ -92,6 +107,8 @@ void bc_read_into_buffer(BuffControl *bc)
    if (bytes_read == 0)
       bc->reached_EOF = 1;
 
+   bc->bytes_read += bytes_read;
+
    if (bc->log_reads)
       fprintf(stderr, "[34;1mread %4d characters into the buffer.[m\n", bytes_read);
 
@@ -181,6 +198,62 @@ int bc_get_current_line(BuffControl *bc, const char **line, int *line_len)
       return 0;
 }
 
+size_t bc_offset(const BuffControl *bc)
+{
+   if (bc->next_line)
+      return bc->bytes_read - (bc->end_of_data - bc->next_line);
+   else
+      return bc->bytes_read;
+}
+
+void bc_unget_line(BuffControl *bc)
+{
+   if (bc->cur_line)
+      bc->next_line = bc->cur_line;
+}
+
+int bc_skip_past_delimiter(BuffControl *bc, char delim)
+{
+   const char *ptr, *newline;
+   int in_line = 0;     // the buffer starts in the middle of a line
+
+   while (bc->next_line)
+   {
+      ptr = bc->next_line;
+
+      while (ptr < bc->end_of_data)
+      {
+         if (!in_line && *ptr == delim)
+         {
+            bc->next_line = ptr;
+            return bc_find_next_line(bc);
+         }
+
+         in_line = 0;
+         if (!(newline = (const char*)memchr(ptr, '\n', bc->end_of_data - ptr)))
+            break;
+
+         ptr = newline + 1;
+      }
+
+      if (bc->reached_EOF)
+         break;
+
+      // Keep the incomplete line, unless it fills the buffer:
+      if (ptr == bc->buffer && bc->end_of_data - ptr == bc->buff_len)
+      {
+         ptr = bc->end_of_data;
+         in_line = 1;
+      }
+
+      bc->next_line = ptr;
+      bc_read_into_buffer(bc);
+   }
+
+   bc->cur_line = bc->next_line = NULL;
+   return 0;
+}
+
 /**
  * @brief Through pointer parameters, this function returns the current line to the calling function.
  *
@@ -5,6 +5,15 @@ typedef size_t (*BReader)(void *source, char *buffer, int chars_to_read);
 
 size_t bc_file_reader(void *filestream, char *buffer, int chars_to_read);
 
+/** Source for bc_memory_reader(), advanced as it is read. */
+typedef struct _bc_memory_source
+{
+   const char *data;
+   const char *end;
+} BCMemorySource;
+
+size_t bc_memory_reader(void *memory_source, char *buffer, int chars_to_read);
+
 typedef struct _buff_control
 {
    char *buffer;
@@ -23,6 +32,9 @@ typedef struct _buff_control
    // flag to indicate EOF reached
    int reached_EOF;
 
+   // Total bytes the breader has delivered, for bc_offset()
+   size_t bytes_read;
+
    // Debugging flag
    int log_reads;
 
@@ -31,6 +43,28 @@ typedef struct _buff_control
 int bc_get_next_line(BuffControl *bc, const char **line, int *line_len);
 int bc_get_current_line(BuffControl *bc, const char **line, int *line_len);
 
+/**
+ * @brief Bytes of the source consumed through the current line, that
+ *        is, the offset of the next line from where reading began.
+ */
+size_t bc_offset(const BuffControl *bc);
+
+/**
+ * @brief Put back the line just read, for the next bc_get_next_line().
+ */
+void bc_unget_line(BuffControl *bc);
+
+/**
+ * @brief Skip ahead to the next line starting with *delim*, which
+ *        becomes the current line.
+ *
+ * The lines in between are not split and judged, only searched for
+ * their newlines, so skipping is much faster than reading them.
+ *
+ * @return 1 if a delimiter line was found, 0 at the end of the input.
+ */
+int bc_skip_past_delimiter(BuffControl *bc, char delim);
+
 void init_buff_control(BuffControl *bc,
                        char *buffer,
                        int buff_len,
@@ -0,0 +1,345 @@
+// -*- compile-command: "gcc -Wall -Werror -DCLASSIFY_MAIN -O2 -ggdb -o classify classify.c" -*-
+
+#include <stdio.h>
+#include <string.h>    // for memset()
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "classify.h"
+
+// Private, internal functions
+void cl_end_line(ContentClass *cc);
+void cl_scan_bytes(ContentClass *cc, const unsigned char *ptr, const unsigned char *end);
+int cl_scan_masks(ContentClass *cc, int width, unsigned special, unsigned lfs, unsigned crs);
+
+void cl_init(ContentClass *cc)
+{
+   memset(cc, 0, sizeof(ContentClass));
+}
+
+void cl_end_line(ContentClass *cc)
+{
+   if (cc->line_len > CL_LINE_MAX)
+      ++cc->long_lines;
+
+   ++cc->lines;
+   cc->line_len = 0;
+}
+
+/**
+ * @brief Classify bytes one at a time, for what the vector loops leave.
+ */
+void cl_scan_bytes(ContentClass *cc, const unsigned char *ptr, const unsigned char *end)
+{
+   unsigned char chr;
+
+   for (; ptr < end; ++ptr)
+   {
+      chr = *ptr;
+
+      if (cc->after_cr)
+      {
+         cc->after_cr = 0;
+         if (chr == '\n')
+         {
+            cl_end_line(cc);
+            continue;
+         }
+
+         // A bare CR is content, and no identity encoding may carry it:
+         ++cc->bare_crs;
+         ++cc->qp_escapes;
+         ++cc->bytes;
+         ++cc->line_len;
+      }
+
+      if (chr == '\n')
+         cl_end_line(cc);
+      else if (chr == '\r')
+         cc->after_cr = 1;
+      else
+      {
+         ++cc->bytes;
+         ++cc->line_len;
+
+         if (chr >= 0x80)
+         {
+            ++cc->high_bytes;
+            ++cc->qp_escapes;
+         }
+         else if ((chr < 0x20 && chr != '\t') || chr == 0x7f || chr == '=')
+         {
+            ++cc->qp_escapes;
+            if (!chr)
+               ++cc->nuls;
+         }
+      }
+   }
+}
+
+/**
+ * @brief Classify a vector of *width* bytes from the masks of its bytes.
+ *
+ * @param special  Bytes that are not printable ASCII, or are '='
+ * @param lfs      LFs
+ * @param crs      CRs
+ *
+ * @return 1 if done, 0 if bytes other than line breaks need cl_scan_bytes().
+ */
+int cl_scan_masks(ContentClass *cc, int width, unsigned special, unsigned lfs, unsigned crs)
+{
+   unsigned crlf_crs = crs & (lfs >> 1);
+   int start = 0, pos, len;
+
+   if (special & ~(lfs | crlf_crs))
+      return 0;
+
+   for (; lfs; lfs &= lfs - 1)
+   {
+      pos = __builtin_ctz(lfs);
+      len = pos - start - (pos > 0 && (crlf_crs >> (pos - 1)) & 1);
+
+      cc->bytes += len;
+      cc->line_len += len;
+      cl_end_line(cc);
+
+      start = pos + 1;
+   }
+
+   cc->bytes += width - start;
+   cc->line_len += width - start;
+
+   return 1;
+}
+
+void cl_scan(ContentClass *cc, const char *content, size_t len)
+{
+   const unsigned char *ptr = (const unsigned char*)content;
+   const unsigned char *end = ptr + len;
+
+#if defined(__AVX2__)
+   const __m256i spaces32 = _mm256_set1_epi8(' ');
+   const __m256i equals32 = _mm256_set1_epi8('=');
+   const __m256i dels32   = _mm256_set1_epi8(0x7f);
+   const __m256i lfs32    = _mm256_set1_epi8('\n');
+   const __m256i crs32    = _mm256_set1_epi8('\r');
+   while (ptr + 32 <= end)
+   {
+      // A CR ending the last vector decides how this one starts:
+      if (cc->after_cr)
+      {
+         cl_scan_bytes(cc, ptr, ptr + 1);
+         ++ptr;
+         continue;
+      }
+
+      __m256i block = _mm256_loadu_si256((const __m256i*)ptr);
+
+      // Signed, so bytes over 0x7f are less than a space, too:
+      unsigned special = (unsigned)_mm256_movemask_epi8(
+         _mm256_or_si256(_mm256_cmpgt_epi8(spaces32, block),
+                         _mm256_or_si256(_mm256_cmpeq_epi8(block, equals32),
+                                         _mm256_cmpeq_epi8(block, dels32))));
+
+      if (!special)
+      {
+         cc->bytes += 32;
+         cc->line_len += 32;
+      }
+      else if (!cl_scan_masks(cc, 32, special,
+                              (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lfs32)),
+                              (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, crs32))))
+         cl_scan_bytes(cc, ptr, ptr + 32);
+
+      ptr += 32;
+   }
+#endif
+
+#if defined(__SSE2__)
+   const __m128i spaces = _mm_set1_epi8(' ');
+   const __m128i equals = _mm_set1_epi8('=');
+   const __m128i dels   = _mm_set1_epi8(0x7f);
+   const __m128i lfs    = _mm_set1_epi8('\n');
+   const __m128i crs    = _mm_set1_epi8('\r');
+   while (ptr + 16 <= end)
+   {
+      // A CR ending the last vector decides how this one starts:
+      if (cc->after_cr)
+      {
+         cl_scan_bytes(cc, ptr, ptr + 1);
+         ++ptr;
+         continue;
+      }
+
+      __m128i block = _mm_loadu_si128((const __m128i*)ptr);
+
+      unsigned special = (unsigned)_mm_movemask_epi8(
+         _mm_or_si128(_mm_cmplt_epi8(block, spaces),
+                      _mm_or_si128(_mm_cmpeq_epi8(block, equals),
+                                   _mm_cmpeq_epi8(block, dels))));
+
+      if (!special)
+      {
+         cc->bytes += 16;
+         cc->line_len += 16;
+      }
+      else if (!cl_scan_masks(cc, 16, special,
+                              (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, lfs)),
+                              (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, crs))))
+         cl_scan_bytes(cc, ptr, ptr + 16);
+
+      ptr += 16;
+   }
+#endif
+
+   cl_scan_bytes(cc, ptr, end);
+}
+
+void cl_scan_line(ContentClass *cc, const char *line, size_t len)
+{
+   cl_scan(cc, line, len);
+
+   // The line's own break follows, so a CR ending it is bare:
+   if (cc->after_cr)
+   {
+      cc->after_cr = 0;
+      ++cc->bare_crs;
+      ++cc->qp_escapes;
+      ++cc->bytes;
+      ++cc->line_len;
+   }
+
+   cl_end_line(cc);
+}
+
+PartEncoding cl_choose_encoding(const ContentClass *cc, int allow_8bit)
+{
+   int as_is = !cc->nuls && !cc->bare_crs && !cc->after_cr
+      && !cc->long_lines && cc->line_len <= CL_LINE_MAX;
+
+   if (as_is && !cc->high_bytes)
+      return PE_7BIT;
+   else if (as_is && allow_8bit)
+      return PE_8BIT;
+
+   // Quoted-printable adds two bytes per escape, base64 a third of everything:
+   if (cc->qp_escapes * 6 > cc->bytes)
+      return PE_BASE64;
+   else
+      return PE_QUOTED_PRINTABLE;
+}
+
+int cl_has_8bit(const char *str, size_t len)
+{
+   const unsigned char *ptr = (const unsigned char*)str;
+   const unsigned char *end = ptr + len;
+
+   while (ptr < end)
+      if (*ptr++ >= 0x80)
+         return 1;
+
+   return 0;
+}
+
+
+#ifdef CLASSIFY_MAIN
+
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Reference implementation: every byte through cl_scan_bytes().
+ */
+void naive_scan(ContentClass *cc, const char *content, size_t len)
+{
+   cl_scan_bytes(cc, (const unsigned char*)content, (const unsigned char*)content + len);
+}
+
+double elapsed(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int same_class(const ContentClass *left, const ContentClass *right)
+{
+   return left->bytes == right->bytes
+      && left->lines == right->lines
+      && left->high_bytes == right->high_bytes
+      && left->nuls == right->nuls
+      && left->bare_crs == right->bare_crs
+      && left->long_lines == right->long_lines
+      && left->qp_escapes == right->qp_escapes
+      && left->line_len == right->line_len
+      && left->after_cr == right->after_cr;
+}
+
+int main(int argc, const char **argv)
+{
+   const size_t block_len = 1 << 20;
+   char *block = (char*)malloc(block_len);
+   size_t i;
+
+   // 72-character lines, with the odd UTF-8 letter, '=', and bare CR:
+   for (i=0; i < block_len; ++i)
+      block[i] = 'a' + (i % 26);
+   for (i=72; i+1 < block_len; i += 74)
+   {
+      block[i] = '\r';
+      block[i+1] = '\n';
+      if ((i / 74) % 40 == 0 && i+3 < block_len)
+      {
+         block[i+2] = (char)0xc3;
+         block[i+3] = (char)0xa9;
+      }
+      if ((i / 74) % 97 == 0 && i > 10)
+         block[i-5] = '=';
+      if ((i / 74) % 331 == 0 && i > 20)
+         block[i-17] = '\r';
+   }
+
+   ContentClass naive, fast, pieces;
+   struct timespec start;
+   int reps = 200, r;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+   {
+      cl_init(&naive);
+      naive_scan(&naive, block, block_len);
+   }
+   printf("naive:      %8.1f MB/s\n", reps * (block_len / 1e6) / elapsed(&start));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+   {
+      cl_init(&fast);
+      cl_scan(&fast, block, block_len);
+   }
+   printf("classifier: %8.1f MB/s (%zu lines, %zu 8-bit, %zu bare CR)\n",
+          reps * (block_len / 1e6) / elapsed(&start),
+          fast.lines,
+          fast.high_bytes,
+          fast.bare_crs);
+
+   // Same result when fed in odd-sized pieces, which split CRLFs:
+   size_t piece, done = 0;
+   cl_init(&pieces);
+   while (done < block_len)
+   {
+      piece = block_len - done < 1001 ? block_len - done : 1001;
+      cl_scan(&pieces, block + done, piece);
+      done += piece;
+   }
+
+   int ok = same_class(&naive, &fast) && same_class(&naive, &pieces);
+   printf("results %s\n", ok ? "match" : "DIFFER");
+
+   free(block);
+   return ok ? 0 : 1;
+}
+
+#endif
@@ -1,29 +1,65 @@
 #include "mailcb.h"
 #include <ctype.h>   // for isspace()
 #include <string.h>  // for memset, memcpy, etc
+#include <strings.h> // for strncasecmp
 
 #include "commparcel.h"
 
-CapString authstrings[] = {
-   {"PLAIN",        5, set_auth_plain},
-   {"LOGIN",        5, set_auth_login},
-   {"GSSAPI",       6, set_auth_gssapi},
-   {"DIGEST-MD5",  10, set_auth_digest_md5},
-   {"MD5",          3, set_auth_md5},
-   {"CRAM-MD5",     8, set_auth_cram_md5},
-   {"OAUTH10A",     8, set_auth_oauth10a},
-   {"OAUTHBEARER", 11, set_auth_oauthbearer},
-   {"XOAUTH",       6, set_auth_xoauth},
-   {"XOAUTH2",      7, set_auth_xoauth2}
+/**
+ * Setters indexed by SmtpKeyword.  Keywords without a setter are
+ * only recorded in SmtpCaps::cap_keywords.
+ */
+const Set_Cap_Func keyword_setters[SK_COUNT] = {
+   [SK_AUTH]                = set_auth,
+   [SK_SIZE]                = set_size,
+   [SK_STARTTLS]            = set_starttls,
+   [SK_ENHANCEDSTATUSCODES] = set_enhancedstatuscodes,
+   [SK_8BITMIME]            = set_8bitmime,
+   [SK_7BITMIME]            = set_7bitmime,
+   [SK_PIPELINING]          = set_pipelining,
+   [SK_SMTPUTF8]            = set_smtputf8,
+   [SK_CHUNKING]            = set_chunking,
+   [SK_DSN]                 = set_dsn,
+   [SK_BINARYMIME]          = set_binarymime,
+   [SK_REQUIRETLS]          = set_requiretls,
+   [SK_DELIVERBY]           = set_deliverby,
+   [SK_MT_PRIORITY]         = set_mt_priority,
+   [SK_LIMITS]              = set_limits
 };
 
-int authstrings_count = sizeof(authstrings) / sizeof(CapString);
-const CapString *authstring_end = &authstrings[sizeof(authstrings) / sizeof(CapString)];
+/** Setters indexed by SmtpAuthMech */
+const Set_Cap_Func auth_setters[SA_COUNT] = {
+   [SA_PLAIN]       = set_auth_plain,
+   [SA_LOGIN]       = set_auth_login,
+   [SA_GSSAPI]      = set_auth_gssapi,
+   [SA_DIGEST_MD5]  = set_auth_digest_md5,
+   [SA_MD5]         = set_auth_md5,
+   [SA_CRAM_MD5]    = set_auth_cram_md5,
+   [SA_OAUTH10A]    = set_auth_oauth10a,
+   [SA_OAUTHBEARER] = set_auth_oauthbearer,
+   [SA_XOAUTH]      = set_auth_xoauth,
+   [SA_XOAUTH2]     = set_auth_xoauth2
+};
 
 void clear_smtp_caps(MParcel *mp) { memset(&mp->caps, 0, sizeof(SmtpCaps)); }
 
+void set_keyword(MParcel *mp, SmtpKeyword keyword, const char *params, int len)
+{
+   if (keyword != SK_UNKNOWN)
+   {
+      mp->caps.cap_keywords |= 1ULL << keyword;
+
+      if (keyword_setters[keyword])
+         (*keyword_setters[keyword])(mp, params, len);
+   }
+}
+
 int get_size(const MParcel *mp) { return mp->caps.cap_size; }
-void set_size(MParcel *mp, const char *line, int len) { mp->caps.cap_size = atoi(line); }
+void set_size(MParcel *mp, const char *line, int len)
+{
+   mp->caps.cap_sizeext = 1;
+   mp->caps.cap_size = len ? atoi(line) : 0;
+}
 
 int get_starttls(const MParcel *mp)    { return mp->caps.cap_starttls != 0; }
 void set_starttls(MParcel *mp, const char *line, int len) { mp->caps.cap_starttls = 1; }
@@ -46,6 +82,58 @@ void set_chunking(MParcel *mp, const char *line, int len) { mp->caps.cap_chunkin
 int get_smtputf8(const MParcel *mp) { return mp->caps.cap_smtputf8 != 0; }
 void set_smtputf8(MParcel *mp, const char *line, int len) { mp->caps.cap_smtputf8 = 1; }
 
+int get_dsn(const MParcel *mp) { return mp->caps.cap_dsn != 0; }
+void set_dsn(MParcel *mp, const char *line, int len) { mp->caps.cap_dsn = 1; }
+
+int get_binarymime(const MParcel *mp) { return mp->caps.cap_binarymime != 0; }
+void set_binarymime(MParcel *mp, const char *line, int len) { mp->caps.cap_binarymime = 1; }
+
+int get_requiretls(const MParcel *mp) { return mp->caps.cap_requiretls != 0; }
+void set_requiretls(MParcel *mp, const char *line, int len) { mp->caps.cap_requiretls = 1; }
+
+int get_deliverby(const MParcel *mp) { return mp->caps.cap_deliverby != 0; }
+void set_deliverby(MParcel *mp, const char *line, int len)
+{
+   mp->caps.cap_deliverby = 1;
+   mp->caps.cap_deliverby_min = len ? atoi(line) : 0;
+}
+
+int get_mt_priority(const MParcel *mp) { return mp->caps.cap_mt_priority != 0; }
+void set_mt_priority(MParcel *mp, const char *line, int len) { mp->caps.cap_mt_priority = 1; }
+
+int get_limits_rcptmax(const MParcel *mp) { return mp->caps.cap_limits_rcptmax; }
+
+/**
+ * @brief Read the name=value pairs of the LIMITS keyword (RFC 9422).
+ */
+void set_limits(MParcel *mp, const char *line, int len)
+{
+   const char *end = line + len;
+   const char *ptr = line;
+   const char *name;
+
+   while (ptr < end)
+   {
+      while (ptr < end && isspace(*ptr))
+         ++ptr;
+
+      name = ptr;
+      while (ptr < end && *ptr != '=' && !isspace(*ptr))
+         ++ptr;
+
+      if (ptr < end && *ptr == '=')
+      {
+         if (ptr - name == 7 && 0 == strncasecmp(name, "RCPTMAX", 7))
+            mp->caps.cap_limits_rcptmax = atoi(ptr+1);
+         else if (ptr - name == 7 && 0 == strncasecmp(name, "MAILMAX", 7))
+            mp->caps.cap_limits_mailmax = atoi(ptr+1);
+      }
+
+      while (ptr < end && !isspace(*ptr))
+         ++ptr;
+   }
+}
+
 
 
 /** Authorization specific settings */
@@ -83,34 +171,102 @@ void set_auth_xoauth(MParcel *mp, const char *line, int len) { add_auth(mp); mp-
 int get_auth_xoauth2(const MParcel *mp) { return mp->caps.cap_auth_xoauth2 != 0; }
 void set_auth_xoauth2(MParcel *mp, const char *line, int len) { add_auth(mp); mp->caps.cap_auth_xoauth2 = 1; }
 
+/**
+ * @brief Set flags for each mechanism in the space-separated AUTH parameters.
+ */
 void set_auth(MParcel *mp, const char *line, int len)
 {
-   const char *end = line + len + 1; // make sure to include the terminating \r or \0
-   const char *ptr = line + 5;       // Skip "AUTH "
-   const char *cur = ptr;
+   const char *end = line + len;
+   const char *ptr = line;
+   const char *word;
+   SmtpAuthMech mech;
+
    while (ptr < end)
    {
-      if (isspace(*ptr))
-      {
-         // find matching authorization struct:
-         const CapString *curauth = authstrings;
-         while (0 != strncmp(cur, curauth->str, curauth->len))
-            ++curauth;
+      // Skip separating spaces, then find the end of the mechanism name:
+      while (ptr < end && isspace(*ptr))
+         ++ptr;
 
-         char *temp = (char*)(alloca(ptr - cur));
-         strncpy(temp, cur, ptr - cur);
-         temp[ptr-cur] = '\0';
+      word = ptr;
+      while (ptr < end && !isspace(*ptr))
+         ++ptr;
 
-         if (curauth < authstring_end)
-            (*curauth->set_cap)(mp, cur, ptr-cur);
+      if (ptr > word)
+      {
+         mech = smtp_auth_lookup(word, ptr - word);
+         if (auth_setters[mech])
+            (*auth_setters[mech])(mp, word, ptr - word);
          else
-            mcb_log_message(mp, "Unexpected authorization protocol: ", temp, ".", NULL);
+         {
+            char *temp = (char*)alloca(ptr - word + 1);
+            memcpy(temp, word, ptr - word);
+            temp[ptr-word] = '\0';
 
-         // Start next authorization protocol with character after the space:
-         // Skip past the space:
-         cur = ++ptr;
+            mcb_log_message(mp, "Unexpected authorization protocol: ", temp, ".", NULL);
+         }
       }
-      else
-         ++ptr;
+   }
+}
+
+
+/** POP3 capabilities */
+
+void clear_pop_caps(MParcel *mp) { memset(&mp->pop_caps, 0, sizeof(PopCaps)); }
+
+/**
+ * @brief Interpret one line of a CAPA response, like "EXPIRE 30" or "TOP".
+ */
+void set_pop_capa(MParcel *mp, const char *line, int len)
+{
+   int word_len = sk_keyword_len(line, len);
+   const char *params = line + word_len;
+   const char *end = line + len;
+
+   while (params < end && isspace(*params))
+      ++params;
+
+   switch(pop_capa_lookup(line, word_len))
+   {
+      case PC_TOP:
+         mp->pop_caps.cap_top = 1;
+         break;
+      case PC_USER:
+         mp->pop_caps.cap_user = 1;
+         break;
+      case PC_SASL:
+         mp->pop_caps.cap_sasl = 1;
+         break;
+      case PC_RESP_CODES:
+         mp->pop_caps.cap_resp_codes = 1;
+         break;
+      case PC_LOGIN_DELAY:
+         mp->pop_caps.cap_login_delay = params < end ? atoi(params) : 0;
+         break;
+      case PC_PIPELINING:
+         mp->pop_caps.cap_pipelining = 1;
+         break;
+      case PC_EXPIRE:
+         if (end - params >= 5 && 0 == strncasecmp(params, "NEVER", 5))
+            mp->pop_caps.cap_expire = -1;
+         else
+            mp->pop_caps.cap_expire = params < end ? atoi(params) : 0;
+         break;
+      case PC_UIDL:
+         mp->pop_caps.cap_uidl = 1;
+         break;
+      case PC_STLS:
+         mp->pop_caps.cap_stls = 1;
+         break;
+      case PC_UTF8:
+         mp->pop_caps.cap_utf8 = 1;
+         break;
+      case PC_AUTH_RESP_CODE:
+         mp->pop_caps.cap_auth_resp_code = 1;
+         break;
+      case PC_IMPLEMENTATION:
+      case PC_LANG:
+      case PC_UNKNOWN:
+      default:
+         break;
    }
 }
@@ -3,17 +3,19 @@
 
 #include "mailcb.h"
 
+/**
+ * Capability setters receive the keyword's parameters, which is
+ * the text following the keyword and its separating space.
+ */
 typedef void (*Set_Cap_Func)(MParcel *mp, const char *line, int len);
-typedef struct _cap_string
-{
-   const char   *str;
-   int          len;
-   Set_Cap_Func set_cap;
-} CapString;
-
 
 void clear_smtp_caps(MParcel *mp);
 
+/**
+ * @brief Record an EHLO keyword and pass its parameters to the keyword's setter.
+ */
+void set_keyword(MParcel *mp, SmtpKeyword keyword, const char *params, int len);
+
 int get_size(const MParcel *mp);
 void set_size(MParcel *mp, const char *line, int len);
 
@@ -38,6 +40,24 @@ void set_chunking(MParcel *mp, const char *line, int len);
 int get_smtputf8(const MParcel *mp);
 void set_smtputf8(MParcel *mp, const char *line, int len);
 
+int get_dsn(const MParcel *mp);
+void set_dsn(MParcel *mp, const char *line, int len);
+
+int get_binarymime(const MParcel *mp);
+void set_binarymime(MParcel *mp, const char *line, int len);
+
+int get_requiretls(const MParcel *mp);
+void set_requiretls(MParcel *mp, const char *line, int len);
+
+int get_deliverby(const MParcel *mp);
+void set_deliverby(MParcel *mp, const char *line, int len);
+
+int get_mt_priority(const MParcel *mp);
+void set_mt_priority(MParcel *mp, const char *line, int len);
+
+int get_limits_rcptmax(const MParcel *mp);
+void set_limits(MParcel *mp, const char *line, int len);
+
 
 
 int get_auth_plain(const MParcel *mp);
@@ -67,11 +87,17 @@ void set_auth_oauthbearer(MParcel *mp, const char *line, int len);
 int get_auth_xoauth(const MParcel *mp);
 void set_auth_xoauth(MParcel *mp, const char *line, int len);
 
-int get_auth_xoauths(const MParcel *mp);
+int get_auth_xoauth2(const MParcel *mp);
 void set_auth_xoauth2(MParcel *mp, const char *line, int len);
 
 void set_auth(MParcel *mp, const char *line, int len);
 
+/**
+ * POP capabilities, from the lines of a CAPA response.
+ */
+void clear_pop_caps(MParcel *mp);
+void set_pop_capa(MParcel *mp, const char *line, int len);
+
 
 
 #endif
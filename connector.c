@@ -0,0 +1,317 @@
+// -*- compile-command: "gcc -Wall -Werror -DCONNECTOR_MAIN -O2 -ggdb -o connector connector.c resolver.c -lpthread" -*-
+
+#include <stdio.h>
+#include <string.h>       // for memset()
+#include <errno.h>
+#include <time.h>         // for clock_gettime()
+#include <unistd.h>       // for close()
+#include <fcntl.h>        // for fcntl() to set O_NONBLOCK
+#include <poll.h>
+#include <netdb.h>        // for gai_strerror()
+#include <netinet/in.h>   // for IPPROTO_TCP
+
+#include "connector.h"
+
+// Private, internal functions
+long long cn_now_usecs(void);
+int cn_interleave(const ResolvedAddr *addrs, int count, int *order);
+int cn_start_attempt(const ResolvedAddr *addr, int *sock);
+
+long long cn_now_usecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Fill *order* with indexes into *addrs*, alternating address
+ *        families, starting with the family of the first address.
+ */
+int cn_interleave(const ResolvedAddr *addrs, int count, int *order)
+{
+   int first_family = addrs[0].family;
+   int i_same = 0, i_other = 0, filled = 0;
+   int want_same = 1;
+
+   while (filled < count)
+   {
+      while (i_same < count && addrs[i_same].family != first_family)
+         ++i_same;
+      while (i_other < count && addrs[i_other].family == first_family)
+         ++i_other;
+
+      if (i_same < count && (want_same || i_other >= count))
+         order[filled++] = i_same++;
+      else if (i_other < count)
+         order[filled++] = i_other++;
+
+      want_same = !want_same;
+   }
+
+   return filled;
+}
+
+/**
+ * @brief Create a non-blocking socket and begin connecting it.
+ *
+ * @return 1 if connected immediately, 0 if in progress, -1 on failure.
+ */
+int cn_start_attempt(const ResolvedAddr *addr, int *sock)
+{
+   *sock = socket(addr->family, SOCK_STREAM, IPPROTO_TCP);
+   if (*sock < 0)
+      return -1;
+
+   fcntl(*sock, F_SETFL, fcntl(*sock, F_GETFL) | O_NONBLOCK);
+
+   if (0 == connect(*sock, (const struct sockaddr*)&addr->addr, addr->addrlen))
+      return 1;
+   else if (errno == EINPROGRESS)
+      return 0;
+
+   close(*sock);
+   *sock = -1;
+   return -1;
+}
+
+int cn_connect(const char *host, int port, const ConnectTimes *times, ConnectOutcome *outcome)
+{
+   ResolvedAddr  addrs[RSV_MAX_ADDRS];
+   int           order[RSV_MAX_ADDRS];
+   struct pollfd fds[RSV_MAX_ADDRS];
+   int           fd_addr[RSV_MAX_ADDRS];          // index into addrs for each fds entry
+   long long     fd_deadline[RSV_MAX_ADDRS];
+   long long     fd_started[RSV_MAX_ADDRS];
+
+   ConnectOutcome dummy;
+   int count, next = 0, inflight = 0, timed_out = 0;
+   int winner = -1, winner_sock = -1;
+   int i, state, sock, sock_error;
+   socklen_t error_len;
+   long long now, start, next_start, overall_end, wait;
+
+   int attempt_delay = CN_DEFAULT_ATTEMPT_DELAY_MS;
+   int attempt_timeout = CN_DEFAULT_ATTEMPT_TIMEOUT_MS;
+   int overall_timeout = CN_DEFAULT_OVERALL_TIMEOUT_MS;
+
+   if (times)
+   {
+      if (times->attempt_delay_ms > 0)
+         attempt_delay = times->attempt_delay_ms;
+      if (times->attempt_timeout_ms > 0)
+         attempt_timeout = times->attempt_timeout_ms;
+      if (times->overall_timeout_ms > 0)
+         overall_timeout = times->overall_timeout_ms;
+   }
+
+   if (!outcome)
+      outcome = &dummy;
+   memset(outcome, 0, sizeof(ConnectOutcome));
+
+   count = rsv_resolve(host, port, addrs, RSV_MAX_ADDRS, &outcome->gai_error);
+   if (count == 0)
+   {
+      outcome->result = CN_NO_ADDRESS;
+      return -1;
+   }
+
+   cn_interleave(addrs, count, order);
+
+   start = next_start = cn_now_usecs();
+   overall_end = start + (long long)overall_timeout * 1000;
+
+   while (winner < 0)
+   {
+      now = cn_now_usecs();
+      if (now >= overall_end)
+      {
+         timed_out = 1;
+         break;
+      }
+
+      // Start the next candidate when it's due or nothing else is pending:
+      if (next < count && (inflight == 0 || now >= next_start))
+      {
+         int ai = order[next++];
+         ++outcome->attempts;
+
+         state = cn_start_attempt(&addrs[ai], &sock);
+         if (state > 0)
+         {
+            rsv_report(host, port, &addrs[ai], 1, 0);
+            winner = ai;
+            winner_sock = sock;
+            break;
+         }
+         else if (state == 0)
+         {
+            fds[inflight].fd = sock;
+            fds[inflight].events = POLLOUT;
+            fds[inflight].revents = 0;
+            fd_addr[inflight] = ai;
+            fd_started[inflight] = now;
+            fd_deadline[inflight] = now + (long long)attempt_timeout * 1000;
+            ++inflight;
+            next_start = now + (long long)attempt_delay * 1000;
+         }
+         else
+            rsv_report(host, port, &addrs[ai], 0, 0);
+
+         continue;
+      }
+
+      if (inflight == 0)
+         break;
+
+      // Sleep until something finishes or the next deadline arrives:
+      wait = overall_end - now;
+      if (next < count && next_start - now < wait)
+         wait = next_start - now;
+      for (i=0; i < inflight; ++i)
+         if (fd_deadline[i] - now < wait)
+            wait = fd_deadline[i] - now;
+
+      if (poll(fds, inflight, wait > 0 ? (int)((wait + 999) / 1000) : 0) < 0 && errno != EINTR)
+      {
+         outcome->result = CN_SYSTEM_ERROR;
+         break;
+      }
+
+      now = cn_now_usecs();
+
+      // Walk backwards so entries can be removed by moving the last one down:
+      for (i = inflight - 1; i >= 0; --i)
+      {
+         int ai = fd_addr[i];
+         int done = 0;
+
+         if (fds[i].revents)
+         {
+            sock_error = 0;
+            error_len = sizeof(sock_error);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &sock_error, &error_len);
+
+            if (sock_error == 0)
+            {
+               rsv_report(host, port, &addrs[ai], 1, (unsigned int)(now - fd_started[i]));
+               if (winner < 0)
+               {
+                  winner = ai;
+                  winner_sock = fds[i].fd;
+                  addrs[ai].connect_usecs = (unsigned int)(now - fd_started[i]);
+               }
+               else  // a tie, the other one got there first
+                  close(fds[i].fd);
+            }
+            else
+            {
+               rsv_report(host, port, &addrs[ai], 0, 0);
+               close(fds[i].fd);
+               // A failure lets the next candidate start right away:
+               next_start = now;
+            }
+            done = 1;
+         }
+         else if (now >= fd_deadline[i])
+         {
+            rsv_report(host, port, &addrs[ai], 0, 0);
+            close(fds[i].fd);
+            timed_out = 1;
+            next_start = now;
+            done = 1;
+         }
+
+         if (done)
+         {
+            --inflight;
+            fds[i] = fds[inflight];
+            fd_addr[i] = fd_addr[inflight];
+            fd_started[i] = fd_started[inflight];
+            fd_deadline[i] = fd_deadline[inflight];
+         }
+      }
+   }
+
+   // Abandon the attempts that lost the race or ran out of time:
+   for (i=0; i < inflight; ++i)
+      close(fds[i].fd);
+
+   outcome->elapsed_usecs = (unsigned int)(cn_now_usecs() - start);
+
+   if (winner >= 0)
+   {
+      fcntl(winner_sock, F_SETFL, fcntl(winner_sock, F_GETFL) & ~O_NONBLOCK);
+      outcome->result = CN_CONNECTED;
+      outcome->winner = addrs[winner];
+      outcome->winner.failures = 0;
+      return winner_sock;
+   }
+
+   if (outcome->result != CN_SYSTEM_ERROR)
+      outcome->result = timed_out ? CN_TIMED_OUT : CN_REFUSED;
+
+   return -1;
+}
+
+const char *cn_result_string(const ConnectOutcome *outcome)
+{
+   switch(outcome->result)
+   {
+      case CN_CONNECTED:
+         return "connected";
+      case CN_NO_ADDRESS:
+         return gai_strerror(outcome->gai_error);
+      case CN_REFUSED:
+         return "connection refused by every address";
+      case CN_TIMED_OUT:
+         return "connection timed out";
+      case CN_SYSTEM_ERROR:
+      default:
+         return "system error while connecting";
+   }
+}
+
+
+#ifdef CONNECTOR_MAIN
+
+#include <stdlib.h>   // for atoi()
+
+/**
+ * Usage: connector [host [port [attempt_timeout_ms]]]
+ *
+ * Try a blackholed address, like 10.255.255.1, to see the attempt
+ * deadline at work.
+ */
+int main(int argc, const char **argv)
+{
+   const char *host = argc > 1 ? argv[1] : "localhost";
+   int port = argc > 2 ? atoi(argv[2]) : 25;
+
+   ConnectTimes times = { 0 };
+   if (argc > 3)
+      times.attempt_timeout_ms = times.overall_timeout_ms = atoi(argv[3]);
+
+   ConnectOutcome outcome;
+   char desc[80];
+
+   int sock = cn_connect(host, port, &times, &outcome);
+
+   printf("%s:%d: %s after %u usecs and %d attempt(s)\n",
+          host, port,
+          cn_result_string(&outcome),
+          outcome.elapsed_usecs,
+          outcome.attempts);
+
+   if (sock >= 0)
+   {
+      printf("winner %s, handshake %u usecs\n",
+             rsv_describe(&outcome.winner, desc, sizeof(desc)),
+             outcome.winner.connect_usecs);
+      close(sock);
+   }
+
+   return sock < 0;
+}
+
+#endif // CONNECTOR_MAIN
@@ -0,0 +1,63 @@
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include "resolver.h"
+
+/**
+ * Connection racing in the style of RFC 8305 ("Happy Eyeballs").
+ *
+ * Candidate addresses from the resolver cache are interleaved by
+ * family, IPv6 and IPv4 taking turns after the resolver's first
+ * choice.  A new non-blocking connect is started every attempt delay,
+ * or at once when the previous attempts have failed, without
+ * abandoning the attempts already in flight.  The first socket to
+ * complete its handshake wins and is returned in blocking mode.
+ *
+ * Every attempt has its own deadline, and the whole race has another,
+ * so an address that drops SYN packets costs at most the attempt
+ * timeout instead of the kernel's multi-minute retry period.
+ */
+
+#define CN_DEFAULT_ATTEMPT_DELAY_MS    250
+#define CN_DEFAULT_ATTEMPT_TIMEOUT_MS  10000
+#define CN_DEFAULT_OVERALL_TIMEOUT_MS  30000
+
+/** Timing limits in milliseconds; 0 selects the default. */
+typedef struct _connect_times
+{
+   int attempt_delay_ms;     // wait before starting the next candidate
+   int attempt_timeout_ms;   // abandon a single candidate after this long
+   int overall_timeout_ms;   // abandon the whole race after this long
+} ConnectTimes;
+
+typedef enum _connect_result
+{
+   CN_CONNECTED = 0,
+   CN_NO_ADDRESS,            // the host name didn't resolve
+   CN_REFUSED,               // every candidate failed outright
+   CN_TIMED_OUT,             // no candidate finished before its deadline
+   CN_SYSTEM_ERROR           // socket() or poll() failed
+} ConnectResult;
+
+typedef struct _connect_outcome
+{
+   ConnectResult result;
+   int           gai_error;        // for CN_NO_ADDRESS
+   int           attempts;         // connects started
+   unsigned int  elapsed_usecs;    // time from first connect to result
+   ResolvedAddr  winner;           // for CN_CONNECTED
+} ConnectOutcome;
+
+/**
+ * @brief Race connections to the addresses of host:port.
+ *
+ * @param times    Timing limits, NULL for all defaults.
+ * @param outcome  If not NULL, receives the result and winning address.
+ *
+ * @return A connected, blocking socket, or -1.
+ */
+int cn_connect(const char *host, int port, const ConnectTimes *times, ConnectOutcome *outcome);
+
+const char *cn_result_string(const ConnectOutcome *outcome);
+
+#endif
@@ -0,0 +1,271 @@
+// -*- compile-command: "gcc -Wall -Werror -DDOTSTUFF_MAIN -O2 -ggdb -o dotstuff dotstuff.c" -*-
+
+#include <stdio.h>
+#include <string.h>    // for memchr(), memcpy()
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "dotstuff.h"
+
+// Private, internal function
+void ds_update_line_state(DotStuffer *ds, const char *in, size_t in_len);
+
+void ds_init(DotStuffer *ds)
+{
+   memset(ds, 0, sizeof(DotStuffer));
+   ds->line_state = 2;
+}
+
+/**
+ * @brief Set DotStuffer::line_state according to how the block ends.
+ */
+void ds_update_line_state(DotStuffer *ds, const char *in, size_t in_len)
+{
+   if (in_len == 0)
+      return;
+
+   const char *last = in + in_len - 1;
+
+   if (*last == '\r')
+      ds->line_state = 1;
+   else if (*last == '\n'
+            && ((in_len > 1 && *(last-1) == '\r') || (in_len == 1 && ds->line_state == 1)))
+      ds->line_state = 2;
+   else
+      ds->line_state = 0;
+}
+
+const char *ds_find_line_dot(int line_state, const char *ptr, const char *end)
+{
+   const char *start = ptr;
+
+   // The first two positions depend on the previous block:
+   if (ptr < end && *ptr == '.' && line_state == 2)
+      return ptr;
+   if (ptr+1 < end && *(ptr+1) == '.' && *ptr == '\n' && line_state == 1)
+      return ptr+1;
+
+   // From here on, the two preceding characters are in this block:
+   ptr += 2;
+
+#if defined(__AVX2__)
+   const __m256i dots32 = _mm256_set1_epi8('.');
+   const __m256i lfs32  = _mm256_set1_epi8('\n');
+   const __m256i crs32  = _mm256_set1_epi8('\r');
+   while (ptr + 32 <= end)
+   {
+      __m256i hit = _mm256_and_si256(
+         _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)ptr), dots32),
+         _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(ptr-1)), lfs32),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(ptr-2)), crs32)));
+
+      unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+      if (mask)
+         return ptr + __builtin_ctz(mask);
+
+      ptr += 32;
+   }
+#endif
+
+#if defined(__SSE2__)
+   const __m128i dots = _mm_set1_epi8('.');
+   const __m128i lfs  = _mm_set1_epi8('\n');
+   const __m128i crs  = _mm_set1_epi8('\r');
+   while (ptr + 16 <= end)
+   {
+      __m128i hit = _mm_and_si128(
+         _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)ptr), dots),
+         _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(ptr-1)), lfs),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(ptr-2)), crs)));
+
+      unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+      if (mask)
+         return ptr + __builtin_ctz(mask);
+
+      ptr += 16;
+   }
+#endif
+
+   // Scalar remainder, or the whole block without SIMD.  memchr()
+   // is itself vectorized by most C libraries.
+   while (ptr < end && (ptr = (const char*)memchr(ptr, '.', end - ptr)))
+   {
+      if (ptr - start >= 2 && *(ptr-1) == '\n' && *(ptr-2) == '\r')
+         return ptr;
+
+      ++ptr;
+   }
+
+   return NULL;
+}
+
+size_t ds_stuffed_max(size_t in_len)
+{
+   // Each added dot needs at least "\r\n." in the input:
+   return in_len + in_len / 3 + 1;
+}
+
+size_t ds_stuff(DotStuffer *ds, const char *in, size_t in_len, char *out)
+{
+   const char *ptr = in;
+   const char *end = in + in_len;
+   const char *dot;
+   char *optr = out;
+
+   while ((dot = ds_find_line_dot(ptr == in ? ds->line_state : 0, ptr, end)))
+   {
+      // Copy through the dot, then add its twin:
+      memcpy(optr, ptr, dot - ptr + 1);
+      optr += dot - ptr + 1;
+      *optr++ = '.';
+      ++ds->bytes_added;
+
+      ptr = dot + 1;
+   }
+
+   memcpy(optr, ptr, end - ptr);
+   optr += end - ptr;
+
+   ds->bytes_in += in_len;
+   ds_update_line_state(ds, in, in_len);
+
+   return optr - out;
+}
+
+size_t ds_send_block(DotStuffer *ds, const STalker *talker, const char *in, size_t in_len)
+{
+   const char *ptr = in;
+   const char *end = in + in_len;
+   const char *dot;
+   size_t bytes_sent = 0;
+
+   while ((dot = ds_find_line_dot(ptr == in ? ds->line_state : 0, ptr, end)))
+   {
+      // Send up to the dot, an extra dot, and let the original
+      // dot begin the next segment:
+      if (dot > ptr)
+         bytes_sent += (*talker->writer)(talker, ptr, dot - ptr);
+
+      bytes_sent += (*talker->writer)(talker, ".", 1);
+      ++ds->bytes_added;
+
+      ptr = dot;
+      if (ptr == in)
+      {
+         // Avoid finding the same dot again at the start of the block:
+         bytes_sent += (*talker->writer)(talker, ptr, 1);
+         ++ptr;
+      }
+   }
+
+   if (ptr < end)
+      bytes_sent += (*talker->writer)(talker, ptr, end - ptr);
+
+   ds->bytes_in += in_len;
+   ds_update_line_state(ds, in, in_len);
+
+   return bytes_sent;
+}
+
+
+#ifdef DOTSTUFF_MAIN
+
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Reference implementation: the per-line check the block stuffer replaces.
+ */
+size_t naive_stuff(const char *in, size_t in_len, char *out)
+{
+   const char *ptr = in;
+   const char *end = in + in_len;
+   char *optr = out;
+   int at_line_start = 1;
+
+   while (ptr < end)
+   {
+      if (at_line_start && *ptr == '.')
+         *optr++ = '.';
+
+      at_line_start = (*ptr == '\n' && ptr > in && *(ptr-1) == '\r');
+      *optr++ = *ptr++;
+   }
+
+   return optr - out;
+}
+
+double elapsed(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv)
+{
+   const size_t block_len = 1 << 20;
+   char *block = (char*)malloc(block_len);
+   char *out1 = (char*)malloc(ds_stuffed_max(block_len));
+   char *out2 = (char*)malloc(ds_stuffed_max(block_len));
+   size_t i, len1 = 0, len2 = 0;
+
+   // 72-character lines, with an occasional leading dot:
+   for (i=0; i < block_len; ++i)
+      block[i] = 'a' + (i % 26);
+   for (i=72; i+1 < block_len; i += 74)
+   {
+      block[i] = '\r';
+      block[i+1] = '\n';
+      if ((i / 74) % 50 == 0 && i+2 < block_len)
+         block[i+2] = '.';
+   }
+
+   DotStuffer ds;
+   struct timespec start;
+   int reps = 200, r;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+      len1 = naive_stuff(block, block_len, out1);
+   printf("naive:   %8.1f MB/s\n", reps * (block_len / 1e6) / elapsed(&start));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+   {
+      ds_init(&ds);
+      len2 = ds_stuff(&ds, block, block_len, out2);
+   }
+   printf("stuffer: %8.1f MB/s (%zu dots added)\n",
+          reps * (block_len / 1e6) / elapsed(&start),
+          ds.bytes_added);
+
+   // Same result when fed in odd-sized pieces:
+   size_t piece, done = 0, len3 = 0;
+   char *out3 = (char*)malloc(ds_stuffed_max(block_len));
+   ds_init(&ds);
+   while (done < block_len)
+   {
+      piece = block_len - done < 1001 ? block_len - done : 1001;
+      len3 += ds_stuff(&ds, block + done, piece, out3 + len3);
+      done += piece;
+   }
+
+   int ok = len1 == len2 && len2 == len3
+      && 0 == memcmp(out1, out2, len1) && 0 == memcmp(out1, out3, len1);
+
+   printf("outputs %s\n", ok ? "match" : "DIFFER");
+
+   free(block);
+   free(out1);
+   free(out2);
+   free(out3);
+
+   return !ok;
+}
+
+#endif // DOTSTUFF_MAIN
@@ -0,0 +1,54 @@
+#ifndef DOTSTUFF_H
+#define DOTSTUFF_H
+
+#include <sys/types.h>
+#include "socktalk.h"
+
+/**
+ * @brief State for RFC 5321 section 4.5.2 transparency over a stream of blocks.
+ *
+ * A dot that begins a line of DATA content must be doubled so the
+ * server doesn't mistake it for the end of the message.  The stuffer
+ * works on arbitrary blocks and remembers how much of a "\r\n" the
+ * previous block ended with, so a line break split across two blocks
+ * is still recognized.
+ */
+typedef struct _dot_stuffer
+{
+   int    line_state;    // 0: mid-line, 1: last byte was \r, 2: at start of a line
+   size_t bytes_in;      // content bytes passed through the stuffer
+   size_t bytes_added;   // dots inserted
+} DotStuffer;
+
+/** Initialize stuffer for the start of the DATA content (which starts a line). */
+void ds_init(DotStuffer *ds);
+
+/**
+ * @brief Find the first dot in [ptr, end) that starts a line.
+ *
+ * Uses SSE2 or AVX2 when available to examine 16 or 32 bytes per step.
+ *
+ * @param line_state The DotStuffer::line_state in effect before ptr.
+ * @return Pointer to the dot, or NULL if none.
+ */
+const char *ds_find_line_dot(int line_state, const char *ptr, const char *end);
+
+/** Worst-case output length of ds_stuff() for in_len input bytes. */
+size_t ds_stuffed_max(size_t in_len);
+
+/**
+ * @brief Copy a block to *out, doubling line-leading dots.
+ *
+ * @param out  Must have room for ds_stuffed_max(in_len) bytes.
+ * @return Number of bytes written to *out.
+ */
+size_t ds_stuff(DotStuffer *ds, const char *in, size_t in_len, char *out);
+
+/**
+ * @brief Send a block through a STalker, inserting dots without copying the block.
+ *
+ * @return Number of bytes written to the talker, including added dots.
+ */
+size_t ds_send_block(DotStuffer *ds, const STalker *talker, const char *in, size_t in_len);
+
+#endif
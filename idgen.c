@@ -0,0 +1,243 @@
+// -*- compile-command: "gcc -Wall -Werror -DIDGEN_MAIN -O2 -ggdb -o idgen idgen.c -lpthread" -*-
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>       // for memcpy(), memset()
+#include <errno.h>
+#include <pthread.h>      // for pthread_once(), pthread_atfork()
+#include <sys/random.h>   // for getrandom()
+
+#include "idgen.h"
+
+#define IDG_BLOCK_SIZE 64
+#define IDG_POOL_BLOCKS 8
+#define IDG_POOL_SIZE (IDG_BLOCK_SIZE * IDG_POOL_BLOCKS)
+#define IDG_KEY_SIZE 32
+
+typedef struct _idg_state
+{
+   uint32_t     key[8];
+   uint64_t     counter;
+   uint8_t      pool[IDG_POOL_SIZE];
+   size_t       available;      // unused bytes at the end of pool
+   unsigned int generation;     // fork generation when seeded
+   int          seeded;
+} IDGState;
+
+__thread IDGState idg_state;
+
+// Incremented in a child process so every thread state there reseeds:
+volatile unsigned int idg_fork_generation = 1;
+pthread_once_t idg_atfork_once = PTHREAD_ONCE_INIT;
+
+// Private, internal functions
+void idg_after_fork_child(void);
+void idg_register_atfork(void);
+int idg_get_seed(uint8_t *seed, size_t len);
+void idg_chacha_block(const uint32_t key[8], uint64_t counter, uint8_t *output);
+int idg_refill(IDGState *st);
+
+void idg_after_fork_child(void)
+{
+   ++idg_fork_generation;
+}
+
+void idg_register_atfork(void)
+{
+   pthread_atfork(NULL, NULL, idg_after_fork_child);
+}
+
+/**
+ * @brief Read a seed from the kernel, with /dev/urandom for kernels without getrandom().
+ */
+int idg_get_seed(uint8_t *seed, size_t len)
+{
+   ssize_t bytes_read;
+
+   do
+      bytes_read = getrandom(seed, len, 0);
+   while (bytes_read < 0 && errno == EINTR);
+
+   if (bytes_read == (ssize_t)len)
+      return 1;
+
+   FILE *dr = fopen("/dev/urandom", "r");
+   if (dr)
+   {
+      bytes_read = fread(seed, 1, len, dr);
+      fclose(dr);
+      return bytes_read == (ssize_t)len;
+   }
+
+   return 0;
+}
+
+#define IDG_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define IDG_QR(a, b, c, d)                      \
+   a += b; d ^= a; d = IDG_ROTL(d, 16);         \
+   c += d; b ^= c; b = IDG_ROTL(b, 12);         \
+   a += b; d ^= a; d = IDG_ROTL(d, 8);          \
+   c += d; b ^= c; b = IDG_ROTL(b, 7);
+
+/**
+ * @brief One 64-byte ChaCha20 block (RFC 8439) with a zero nonce.
+ */
+void idg_chacha_block(const uint32_t key[8], uint64_t counter, uint8_t *output)
+{
+   uint32_t input[16] = {
+      0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+      (uint32_t)counter, (uint32_t)(counter >> 32), 0, 0
+   };
+   uint32_t x[16];
+   int i;
+
+   memcpy(x, input, sizeof(x));
+
+   for (i=0; i < 10; ++i)
+   {
+      IDG_QR(x[0], x[4], x[ 8], x[12]);
+      IDG_QR(x[1], x[5], x[ 9], x[13]);
+      IDG_QR(x[2], x[6], x[10], x[14]);
+      IDG_QR(x[3], x[7], x[11], x[15]);
+      IDG_QR(x[0], x[5], x[10], x[15]);
+      IDG_QR(x[1], x[6], x[11], x[12]);
+      IDG_QR(x[2], x[7], x[ 8], x[13]);
+      IDG_QR(x[3], x[4], x[ 9], x[14]);
+   }
+
+   for (i=0; i < 16; ++i)
+   {
+      x[i] += input[i];
+      output[i*4]   = (uint8_t)x[i];
+      output[i*4+1] = (uint8_t)(x[i] >> 8);
+      output[i*4+2] = (uint8_t)(x[i] >> 16);
+      output[i*4+3] = (uint8_t)(x[i] >> 24);
+   }
+}
+
+/**
+ * @brief Generate a fresh pool, reseeding first if needed.
+ *
+ * The first IDG_KEY_SIZE bytes of each pool become the next key
+ * and are erased, leaving the remainder for callers.
+ */
+int idg_refill(IDGState *st)
+{
+   int i;
+
+   if (!st->seeded || st->generation != idg_fork_generation)
+   {
+      pthread_once(&idg_atfork_once, idg_register_atfork);
+
+      if (!idg_get_seed((uint8_t*)st->key, sizeof(st->key)))
+         return 0;
+
+      st->counter = 0;
+      st->generation = idg_fork_generation;
+      st->seeded = 1;
+   }
+
+   for (i=0; i < IDG_POOL_BLOCKS; ++i)
+      idg_chacha_block(st->key, st->counter++, &st->pool[i * IDG_BLOCK_SIZE]);
+
+   memcpy(st->key, st->pool, IDG_KEY_SIZE);
+   memset(st->pool, 0, IDG_KEY_SIZE);
+   st->available = IDG_POOL_SIZE - IDG_KEY_SIZE;
+
+   return 1;
+}
+
+int idg_random_bytes(void *buffer, size_t len)
+{
+   IDGState *st = &idg_state;
+   uint8_t *target = (uint8_t*)buffer;
+   uint8_t *source;
+   size_t chunk;
+
+   while (len > 0)
+   {
+      if (st->available == 0 || st->generation != idg_fork_generation)
+         if (!idg_refill(st))
+            return 0;
+
+      chunk = len < st->available ? len : st->available;
+      source = &st->pool[IDG_POOL_SIZE - st->available];
+
+      memcpy(target, source, chunk);
+      // Don't leave used output behind:
+      memset(source, 0, chunk);
+
+      st->available -= chunk;
+      target += chunk;
+      len -= chunk;
+   }
+
+   return 1;
+}
+
+
+#ifdef IDGEN_MAIN
+
+#include <time.h>
+
+/**
+ * The per-call approach idg_random_bytes() replaces.
+ */
+int urandom_bytes(void *buffer, size_t len)
+{
+   FILE *dr = fopen("/dev/urandom", "r");
+   if (dr)
+   {
+      size_t bytes_read = fread(buffer, 1, len, dr);
+      fclose(dr);
+      return bytes_read == len;
+   }
+   return 0;
+}
+
+double elapsed(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv)
+{
+   const int reps = 200000;
+   uint8_t buffer[16];
+   struct timespec start;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i < reps; ++i)
+      urandom_bytes(buffer, sizeof(buffer));
+   double old_secs = elapsed(&start);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i < reps; ++i)
+      idg_random_bytes(buffer, sizeof(buffer));
+   double new_secs = elapsed(&start);
+
+   printf("fopen(/dev/urandom): %8.1f ns per 16-byte GUID seed\n", old_secs * 1e9 / reps);
+   printf("thread-local pool:   %8.1f ns per 16-byte GUID seed\n", new_secs * 1e9 / reps);
+
+   // RFC 8439 appendix A.1 test vector #1: zero key, zero nonce, block 0
+   uint32_t key[8];
+   uint8_t block[64];
+   const uint8_t expected[8] = { 0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90 };
+
+   memset(key, 0, sizeof(key));
+   idg_chacha_block(key, 0, block);
+
+   if (memcmp(block, expected, sizeof(expected)))
+   {
+      printf("ChaCha20 block function does not match RFC 8439 test vector.\n");
+      return 1;
+   }
+
+   return 0;
+}
+
+#endif // IDGEN_MAIN
@@ -0,0 +1,23 @@
+#ifndef IDGEN_H
+#define IDGEN_H
+
+#include <stddef.h>
+
+/**
+ * Thread-local random source for GUIDs, MIME boundaries, and Message-IDs.
+ *
+ * Each thread keeps a ChaCha20 keystream generator seeded once from
+ * getrandom().  Output is produced a pool at a time, and the key is
+ * replaced from the keystream after every refill, so earlier output
+ * can't be reconstructed from a later state.  A fork() makes the child
+ * reseed before its next use.
+ */
+
+/**
+ * @brief Fill buffer with len random bytes.
+ *
+ * @return 1 for success, 0 if no seed could be obtained from the kernel.
+ */
+int idg_random_bytes(void *buffer, size_t len);
+
+#endif
@@ -0,0 +1,469 @@
+#include <stdlib.h>       // for malloc(), realloc(), free()
+#include <string.h>       // for strlen(), memmove(), strerror()
+#include <errno.h>
+#include <limits.h>       // for ULONG_MAX
+#include <unistd.h>       // for fsync(), ftruncate()
+
+#include "journal.h"
+
+#define JN_INITIAL_ENTRIES 4
+#define JN_STATUS_LEN      12     // room for " <status>:" before each address
+
+// Private, internal functions
+char *jn_format_statuses(const RecipLink *recipients);
+void jn_write_line(Journal *jn, const JNEntry *entry);
+void jn_drain(Journal *jn);
+void jn_sync(Journal *jn);
+int jn_trim_torn_line(FILE *file);
+int jn_line_confirmed(const char *line);
+int jn_read_line(FILE *file, char **line, size_t *line_size, JNLine *parsed);
+int jn_merge_open(JNMergeSource *source, const MParcel *parcel, const char *path);
+int jn_merge_next(JNMergeSource *source);
+
+/**
+ * @brief Make the " <status>:<address>" list of an M line.
+ */
+char *jn_format_statuses(const RecipLink *recipients)
+{
+   const RecipLink *ptr;
+   size_t len = 1;
+   char *statuses, *end;
+
+   for (ptr = recipients; ptr; ptr = ptr->next)
+      if (ptr->rtype != RT_SKIP)
+         len += JN_STATUS_LEN + strlen(ptr->address);
+
+   if (!(statuses = (char*)malloc(len)))
+      return NULL;
+
+   end = statuses;
+   *end = '\0';
+
+   for (ptr = recipients; ptr; ptr = ptr->next)
+      if (ptr->rtype != RT_SKIP)
+         end += sprintf(end, " %d:%s", ptr->rcpt_status, ptr->address);
+
+   return statuses;
+}
+
+void jn_write_line(Journal *jn, const JNEntry *entry)
+{
+   fprintf(jn->file,
+           "%c %lu %lld %lld%s\n",
+           entry->unsent ? 'S' : 'M',
+           entry->index,
+           (long long)entry->offset,
+           (long long)entry->end,
+           entry->statuses ? entry->statuses : "");
+}
+
+/**
+ * @brief Write the oldest messages, in order, as far as they are complete.
+ */
+void jn_drain(Journal *jn)
+{
+   JNEntry *entry;
+   int written = 0;
+
+   while (jn->count)
+   {
+      entry = jn->entries;
+      if (!entry->ended || !(entry->unsent || entry->statuses))
+         break;
+
+      jn_write_line(jn, entry);
+      free(entry->statuses);
+
+      memmove(jn->entries, jn->entries + 1, --jn->count * sizeof(JNEntry));
+      ++written;
+   }
+
+   if (written)
+   {
+      // Out of the process at once, to the disk by the group:
+      fflush(jn->file);
+
+      jn->unsynced += written;
+      if (jn->unsynced >= jn->sync_group)
+         jn_sync(jn);
+   }
+}
+
+void jn_sync(Journal *jn)
+{
+   if (fflush(jn->file) || fsync(fileno(jn->file)))
+      mcb_log_message(jn->parcel, "Failed to sync the journal, ", strerror(errno), NULL);
+
+   jn->unsynced = 0;
+}
+
+/**
+ * @brief Cut off a final line left incomplete by a crash, so that
+ *        appending doesn't run into it.
+ */
+int jn_trim_torn_line(FILE *file)
+{
+   off_t end, pos;
+
+   if (fseeko(file, 0, SEEK_END) || (end = ftello(file)) < 0)
+      return 0;
+
+   for (pos = end; pos > 0; --pos)
+   {
+      if (fseeko(file, pos - 1, SEEK_SET))
+         return 0;
+      if (fgetc(file) == '\n')
+         break;
+   }
+
+   if (pos < end && ftruncate(fileno(file), pos))
+      return 0;
+
+   // Switching from reading to writing takes a seek:
+   return fseeko(file, 0, SEEK_END) == 0;
+}
+
+int jn_open(Journal *jn, const MParcel *parcel, const char *path, int resuming, int sync_group)
+{
+   memset(jn, 0, sizeof(Journal));
+   jn->parcel = parcel;
+   jn->sync_group = sync_group > 0 ? sync_group : JN_DEFAULT_SYNC_GROUP;
+
+   if (!(jn->file = fopen(path, resuming ? "a+" : "w")))
+   {
+      mcb_log_message(parcel, "Failed to open journal \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   if (resuming && !jn_trim_torn_line(jn->file))
+   {
+      mcb_log_message(parcel, "Failed to trim journal \"", path, "\", ", strerror(errno), NULL);
+      fclose(jn->file);
+      jn->file = NULL;
+      return 0;
+   }
+
+   return 1;
+}
+
+int jn_begin_message(Journal *jn, unsigned long index, off_t offset)
+{
+   JNEntry *entry;
+
+   if (jn->count == jn->size)
+   {
+      int size = jn->size ? jn->size * 2 : JN_INITIAL_ENTRIES;
+      JNEntry *entries = (JNEntry*)realloc(jn->entries, size * sizeof(JNEntry));
+      if (!entries)
+      {
+         mcb_log_message(jn->parcel, "Out of memory for the journal.", NULL);
+         return 0;
+      }
+
+      jn->entries = entries;
+      jn->size = size;
+   }
+
+   entry = &jn->entries[jn->count++];
+   memset(entry, 0, sizeof(JNEntry));
+   entry->index = index;
+   entry->offset = offset;
+
+   return 1;
+}
+
+void jn_end_message(Journal *jn, off_t end)
+{
+   JNEntry *entry;
+
+   if (!jn->count)
+      return;
+
+   entry = &jn->entries[jn->count - 1];
+   entry->end = end;
+   entry->ended = 1;
+
+   if (!entry->statuses)
+   {
+      if (end == entry->offset)
+      {
+         // Nothing was read, so there was no message:
+         --jn->count;
+         return;
+      }
+
+      // Unless its verdict is yet to come, it wasn't sent:
+      if (!(jn->count == 1 && jn->parcel->pending_message))
+         entry->unsent = 1;
+   }
+
+   jn_drain(jn);
+}
+
+void jn_record(Journal *jn, const RecipLink *recipients)
+{
+   JNEntry *entry = jn->entries;
+   JNEntry *end = jn->entries + jn->count;
+
+   while (entry < end && (entry->statuses || entry->unsent))
+      ++entry;
+
+   if (entry == end)
+   {
+      mcb_log_message(jn->parcel, "Journal reported a message it wasn't told of.", NULL);
+      return;
+   }
+
+   if (!(entry->statuses = jn_format_statuses(recipients)))
+   {
+      mcb_log_message(jn->parcel, "Out of memory for the journal.", NULL);
+      return;
+   }
+
+   jn_drain(jn);
+}
+
+void jn_close(Journal *jn)
+{
+   int i;
+
+   if (!jn->file)
+      return;
+
+   jn_drain(jn);
+
+   // Messages begun but not recorded stay unconfirmed, for resuming:
+   for (i = 0; i < jn->count; ++i)
+      free(jn->entries[i].statuses);
+
+   jn_sync(jn);
+   fclose(jn->file);
+
+   free(jn->entries);
+   memset(jn, 0, sizeof(Journal));
+}
+
+/**
+ * @brief Check that every recipient of an M line has a verdict.
+ */
+int jn_line_confirmed(const char *line)
+{
+   const char *ptr;
+
+   if (*line == 'S')
+      return 1;
+
+   // Each status follows a space and ends at a colon:
+   for (ptr = line; (ptr = strchr(ptr, ' ')); ++ptr)
+   {
+      const char *colon = strchr(ptr, ':');
+      const char *space = strchr(ptr + 1, ' ');
+
+      if (colon && (!space || colon < space) && atoi(ptr + 1) == 0)
+         return 0;
+   }
+
+   return 1;
+}
+
+/**
+ * @brief Read the next complete line of a journal.
+ *
+ * @return 1 with the line parsed, 0 at the end or at a torn final line.
+ */
+int jn_read_line(FILE *file, char **line, size_t *line_size, JNLine *parsed)
+{
+   ssize_t line_len;
+
+   while ((line_len = getline(line, line_size, file)) > 0)
+   {
+      // A torn line, from a crash mid-write:
+      if ((*line)[line_len - 1] != '\n')
+         break;
+
+      if (sscanf(*line, "%c %lu %lld %lld",
+                 &parsed->kind, &parsed->index, &parsed->offset, &parsed->end) == 4
+          && (parsed->kind == 'M' || parsed->kind == 'S'))
+         return 1;
+   }
+
+   return 0;
+}
+
+int jn_find_resume_point(const MParcel *parcel, const char *path, JNResumePoint *point)
+{
+   FILE *file;
+   char *line = NULL;
+   size_t line_size = 0;
+   JNLine parsed;
+
+   unsigned long previous = 0;
+   int started = 0;
+   int stuck = 0;       // at an unconfirmed message, whose run will be resent
+
+   memset(point, 0, sizeof(JNResumePoint));
+
+   if (!(file = fopen(path, "r")))
+   {
+      if (errno == ENOENT)
+         return 1;
+
+      mcb_log_message(parcel, "Failed to read journal \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   while (jn_read_line(file, &line, &line_size, &parsed))
+   {
+      // Indexes only go back where a resumed run begins, at the
+      // resume point as it was then, which is the one here:
+      if (started && parsed.index <= previous)
+         stuck = 0;
+
+      previous = parsed.index;
+      started = 1;
+
+      if (stuck)
+         continue;
+
+      if (jn_line_confirmed(line))
+      {
+         point->index = parsed.index + 1;
+         point->offset = parsed.end;
+      }
+      else
+      {
+         point->index = parsed.index;
+         point->offset = parsed.offset;
+         stuck = 1;
+      }
+   }
+
+   free(line);
+   fclose(file);
+
+   return 1;
+}
+
+/**
+ * @brief Find where each resumed run of a journal begins, so that
+ *        jn_merge() can drop the lines they replace.
+ */
+int jn_merge_open(JNMergeSource *source, const MParcel *parcel, const char *path)
+{
+   JNLine parsed;
+   unsigned long previous = 0;
+   int started = 0;
+   int run;
+
+   memset(source, 0, sizeof(JNMergeSource));
+
+   if (!(source->file = fopen(path, "r")))
+   {
+      mcb_log_message(parcel, "Failed to read journal \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   while (jn_read_line(source->file, &source->line, &source->line_size, &parsed))
+   {
+      if (!started || parsed.index <= previous)
+      {
+         if (source->run_count == source->run_size)
+         {
+            int size = source->run_size ? source->run_size * 2 : JN_INITIAL_ENTRIES;
+            unsigned long *limits = (unsigned long*)realloc(source->limits, size * sizeof(unsigned long));
+            if (!limits)
+            {
+               mcb_log_message(parcel, "Out of memory for the journal.", NULL);
+               return 0;
+            }
+
+            source->limits = limits;
+            source->run_size = size;
+         }
+
+         source->limits[source->run_count++] = parsed.index;
+      }
+
+      previous = parsed.index;
+      started = 1;
+   }
+
+   // A line stands unless a later run begins at or before its index:
+   for (run = 0; run < source->run_count; ++run)
+      source->limits[run] = run + 1 < source->run_count ? source->limits[run + 1] : ULONG_MAX;
+
+   for (run = source->run_count - 2; run >= 0; --run)
+      if (source->limits[run + 1] < source->limits[run])
+         source->limits[run] = source->limits[run + 1];
+
+   rewind(source->file);
+   source->run = -1;
+   return 1;
+}
+
+/**
+ * @brief Move to the source's next line that stands.
+ */
+int jn_merge_next(JNMergeSource *source)
+{
+   int started = source->run >= 0;
+   unsigned long previous = source->current.index;
+
+   while (jn_read_line(source->file, &source->line, &source->line_size, &source->current))
+   {
+      if (!started || source->current.index <= previous)
+         ++source->run;
+
+      started = 1;
+      previous = source->current.index;
+
+      if (source->current.index < source->limits[source->run])
+         return 1;
+   }
+
+   return source->valid = 0;
+}
+
+int jn_merge(const MParcel *parcel, const char **paths, int count, FILE *out)
+{
+   JNMergeSource *sources;
+   JNMergeSource *next;
+   int i, result = 1;
+
+   if (!(sources = (JNMergeSource*)calloc(count, sizeof(JNMergeSource))))
+   {
+      mcb_log_message(parcel, "Out of memory for the journal.", NULL);
+      return 0;
+   }
+
+   for (i = 0; i < count && result; ++i)
+      if ((result = jn_merge_open(&sources[i], parcel, paths[i])))
+         sources[i].valid = jn_merge_next(&sources[i]);
+
+   // Each source is in index order, so take the least of their lines:
+   while (result)
+   {
+      next = NULL;
+      for (i = 0; i < count; ++i)
+         if (sources[i].valid && (!next || sources[i].current.index < next->current.index))
+            next = &sources[i];
+
+      if (!next)
+         break;
+
+      fputs(next->line, out);
+      next->valid = jn_merge_next(next);
+   }
+
+   for (i = 0; i < count; ++i)
+   {
+      if (sources[i].file)
+         fclose(sources[i].file);
+      free(sources[i].line);
+      free(sources[i].limits);
+   }
+
+   free(sources);
+
+   return result;
+}
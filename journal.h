@@ -0,0 +1,163 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <sys/types.h>    // for off_t
+#include "mailcb.h"
+
+/**
+ * Checkpoint journal for batch sends.
+ *
+ * An append-only text file with one line per message of the batch,
+ * in input order, so a batch interrupted by a crash can be resumed
+ * without resending what the server already took:
+ *
+ *     M <index> <offset> <end> <status>:<address> ...
+ *     S <index> <offset> <end>
+ *
+ * An M line gives the RecipLink::rcpt_status of each recipient of a
+ * message that was sent.  An S line marks a message that was not sent
+ * because it couldn't be, for lack of recipients or a complete body.
+ * *index* counts messages from the start of the input, and *offset*
+ * and *end* are the byte offsets of the message and the one after.  A
+ * compiled batch seeks by index, so its offsets count messages instead.
+ *
+ * Lines are flushed as they are written, so the journal survives the
+ * death of the process, and fsync()'d every Journal::sync_group
+ * messages, so it survives the loss of the machine with at most that
+ * many messages unaccounted for.
+ *
+ * A message is confirmed once every recipient has a verdict, any
+ * non-zero status.  A refusal of the whole transaction, at MAIL FROM
+ * or of its first RCPT TO for too many recipients, is the verdict of
+ * every recipient it kept.  A status of 0 means the server never
+ * answered for the recipient, as when the connection failed, so the
+ * message may not have been delivered.  Resuming starts at the first
+ * message not confirmed; 4xx recipients are left in the journal for
+ * whoever retries them.
+ *
+ * A shard of a batch (see shard.h) journals only its own messages,
+ * with their indexes in the whole batch, so the gaps between lines
+ * are other shards' and resuming only looks at the lines there are.
+ * Where a run resumed, the index goes back, and the lines of the
+ * earlier run from there on are replaced.
+ *
+ * With MParcel::pipeline_messages, a message's verdict arrives while
+ * the next one is on its way, so the journal holds a short queue of
+ * messages begun but not yet recorded.
+ */
+
+#define JN_DEFAULT_SYNC_GROUP 32
+
+typedef struct _jn_entry
+{
+   unsigned long index;
+   off_t         offset;
+   off_t         end;
+   int           ended;      // jn_end_message() was called
+   int           unsent;     // for an S line
+   char          *statuses;  // for an M line, once reported
+} JNEntry;
+
+typedef struct _journal
+{
+   const MParcel *parcel;  // for logging
+   FILE          *file;
+   int           sync_group;
+   int           unsynced;
+
+   JNEntry       *entries;  // messages begun and not yet written, oldest first
+   int           count;
+   int           size;
+} Journal;
+
+/** A journal line as read back. */
+typedef struct _jn_line
+{
+   char          kind;     // 'M' or 'S'
+   unsigned long index;
+   long long     offset;
+   long long     end;
+} JNLine;
+
+/** One journal being merged by jn_merge(). */
+typedef struct _jn_merge_source
+{
+   FILE          *file;
+   char          *line;
+   size_t        line_size;
+   JNLine        current;
+   int           valid;     // *current* holds a line to merge
+
+   unsigned long *limits;   // per run, the least index a later run replaces
+   int           run_count;
+   int           run_size;
+   int           run;
+} JNMergeSource;
+
+typedef struct _jn_resume_point
+{
+   unsigned long index;    // first message not confirmed
+   off_t         offset;   // where it starts
+} JNResumePoint;
+
+/**
+ * @brief Open a journal.
+ *
+ * @param resuming    Append to the journal, rather than starting anew.
+ * @param sync_group  Messages per fsync(), JN_DEFAULT_SYNC_GROUP if 0.
+ *
+ * @return 1 for success, 0 if the file can't be opened.
+ */
+int jn_open(Journal *jn, const MParcel *parcel, const char *path, int resuming, int sync_group);
+
+/**
+ * @brief Note the message about to be sent, before it is sent.
+ */
+int jn_begin_message(Journal *jn, unsigned long index, off_t offset);
+
+/**
+ * @brief Note that the message begun last has been handed to the library.
+ *
+ * If its recipients haven't been recorded and its verdict is not
+ * pending in MParcel::pending_message, the message wasn't sent.  If
+ * *end* is the message's own offset, nothing was read, and there was
+ * no message after all.
+ */
+void jn_end_message(Journal *jn, off_t end);
+
+/**
+ * @brief Write the recipient statuses of the oldest message begun.
+ *
+ * Call from MParcel::report_recipients, which reports messages in
+ * the order they were sent.
+ */
+void jn_record(Journal *jn, const RecipLink *recipients);
+
+/**
+ * @brief Write what remains, and close the file with a final fsync().
+ */
+void jn_close(Journal *jn);
+
+/**
+ * @brief Read a journal to find where to resume its batch.
+ *
+ * A torn final line, from a crash while it was written, is ignored,
+ * and jn_open() cuts it off before appending.  A journal that doesn't
+ * exist resumes at the start.
+ *
+ * @return 1 with *point* set, 0 if the journal can't be read.
+ */
+int jn_find_resume_point(const MParcel *parcel, const char *path, JNResumePoint *point);
+
+/**
+ * @brief Combine the journals of a sharded batch into one, in index order.
+ *
+ * Where a journal was resumed, the lines of messages sent again are
+ * replaced by the later ones.
+ *
+ * @return 1 for success, 0 if a journal can't be read.
+ */
+int jn_merge(const MParcel *parcel, const char **paths, int count, FILE *out);
+
+#endif
@@ -1,20 +1,29 @@
+// -*- compile-command: "make mailcb_stress" -*-
 #include <code64.h>      // for encoding username and password
 
 #include <netdb.h>       // For getaddrinfo() and supporting structures
 #include <arpa/inet.h>   // Functions that convert addrinfo member values.
 /* #include <netinet/in.h>  // conversion from addr (not working, not using) */
+#include <netinet/tcp.h> // for TCP_NODELAY
 
 #include <string.h>      // for memset()
 #include <assert.h>
 #include <unistd.h>      // for close();
 #include <stdarg.h>      // for va_args in advise() and log()
 #include <ctype.h>       // for isspace()
+#include <pthread.h>     // for pthread_once()
 
 #include "socktalk.h"
 #include "mailcb.h"
 #include "commparcel.h"
 
 #include "mailcb_internal.h"
+#include "idgen.h"
+#include "connector.h"
+#include "mxdeliver.h"
+#include "sharedbody.h"
+#include "uring.h"
+#include "tlsmem.h"
 
 /**
  * @brief Convert uint8 value to two hex chars. Used by mcb_make_guid().
@@ -91,66 +100,39 @@ void log_ssl_error(MParcel *parcel, const SSL *ssl, int ret)
  * Unlike other functions in this library, this function **does not**
  * clean up after itself. A successfully calling this function must
  * explicitely close the socket handle.
+ *
+ * Host addresses come from the resolver cache (see resolver.h) and
+ * are raced under the deadlines in MParcel::connect_times (see
+ * connector.h).  The outcome, including the address that won, is left
+ * in MParcel::connect_outcome.
  */
-int get_connected_socket(const char *host_url, int port)
+int get_connected_socket(MParcel *parcel, const char *host_url, int port)
 {
-   struct addrinfo hints;
-   struct addrinfo *ai_chain, *rp;
-
-   int exit_value;
-   int open_socket = -1, temp_socket = -1;
+   char desc[80];
+   int nodelay = 1;
+   int osocket = cn_connect(host_url, port, &parcel->connect_times, &parcel->connect_outcome);
 
-   int port_buffer_len = mcb_digits_in_base(port, 10) + 1;
-   char *port_buffer = (char*)alloca(port_buffer_len);
-   if (mcb_itoa_buff(port, 10, port_buffer, port_buffer_len))
+   if (osocket >= 0)
    {
-      memset((void*)&hints, 0, sizeof(struct addrinfo));
-      hints.ai_family = AF_INET;
-      hints.ai_socktype = SOCK_STREAM;
-      hints.ai_flags = AI_CANONNAME;
-      hints.ai_protocol = IPPROTO_TCP;
-
-      exit_value = getaddrinfo(host_url, port_buffer, &hints, &ai_chain);
-
-      if (exit_value==0)
-      {
-         rp = ai_chain;
-         while (rp)
-         {
-            if ((rp->ai_family == PF_INET || rp->ai_family == PF_INET6)
-                && rp->ai_socktype == SOCK_STREAM
-                && rp->ai_protocol == IPPROTO_TCP)
-            {
-               temp_socket = socket(rp->ai_family,
-                                    rp->ai_socktype,
-                                    rp->ai_protocol);
-
-               break;
-            }
-
-            rp = rp->ai_next;
-         }
-
-         if (temp_socket >= 0)
-         {
-            if (0 == connect(temp_socket, rp->ai_addr, rp->ai_addrlen))
-               open_socket = temp_socket;
-            else
-               close(temp_socket);
-         }
-
-         freeaddrinfo(ai_chain);
-      }
-      else // exit_value != 0 getaddrinfo call failed
-      {
-         fprintf(stderr,
-                 "Failed to open socket for %s : %d: %s.\n",
-                 host_url,
-                 port,
-                 gai_strerror(exit_value));
-      }
+      // Each command is written whole and then waits for its reply, so
+      // Nagle's algorithm can only hold back the end of a message, like
+      // the "." after rendered content, until the server's delayed ACK:
+      setsockopt(osocket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+      mcb_advise_message(parcel,
+                         "Connected to ",
+                         rsv_describe(&parcel->connect_outcome.winner, desc, sizeof(desc)),
+                         NULL);
    }
-   return open_socket;
+   else
+      mcb_log_message(parcel,
+                      "Failed to connect to ",
+                      host_url,
+                      ": ",
+                      cn_result_string(&parcel->connect_outcome),
+                      NULL);
+
+   return osocket;
 }
 
 /**
@@ -167,14 +149,57 @@ int get_connected_socket(const char *host_url, int port)
  * STARTTLS capability hadn't been advertised, so that meant
  * I couldn't simply check the use_tls flag and then call for
  * STARTTLS.  GMail seems to work similarly, though not identically.
+ *
+ * With MParcel::tls_memory_bio, the session runs through memory BIOs,
+ * see tlsmem.h.
  */
 void open_ssl(MParcel *parcel, int socket_handle, ServerReady talker_user)
 {
-   const SSL_METHOD *method;
    SSL_CTX *context;
-   SSL *ssl;
-   int connect_outcome;
+   SSL *ssl = NULL;
+   STalker talker;
+   int started;
+
+   ssl_init_library();
 
+   context = ssl_new_context(parcel);
+   if (context)
+   {
+      if (parcel->tls_memory_bio)
+         started = tm_start(parcel, &talker, context, socket_handle);
+      else if ((started = NULL != (ssl = ssl_start(parcel, context, socket_handle))))
+         init_ssl_talker(&talker, ssl);
+
+      if (started)
+      {
+         STalker *old_talker = parcel->stalker;
+         parcel->stalker = &talker;
+
+         if (stk_ktls_send(&talker))
+            mcb_advise_message(parcel, "Kernel TLS offload is active.", NULL);
+
+         // Gmail advertises different capabilities after SSL initialization:
+         if (mcb_is_opening_smtp(parcel))
+            smtp_initialize_session(parcel);
+
+         (*talker_user)(parcel);
+         mcb_smtp_flush_pipeline(parcel);
+
+         parcel->stalker = old_talker;
+
+         tm_end_talker(parcel, &talker, 0);
+         if (ssl)
+            SSL_free(ssl);
+      }
+
+      SSL_CTX_free(context);
+   }
+}
+
+pthread_once_t ssl_init_once = PTHREAD_ONCE_INIT;
+
+void ssl_load_library(void)
+{
    OpenSSL_add_all_algorithms();
    /* err_load_bio_strings(); */
    ERR_load_crypto_strings();
@@ -182,6 +207,28 @@ void open_ssl(MParcel *parcel, int socket_handle, ServerReady talker_user)
 
    /* openssl_config(null); */
    SSL_library_init();
+}
+
+/**
+ * @brief Initialize OpenSSL once for the process, however many threads
+ *        start TLS sessions at the same time.
+ *
+ * OpenSSL 1.0 keeps its tables in globals that must not be loaded
+ * twice at once.  Later versions initialize themselves safely, but
+ * one call is still cheaper than one per session.
+ */
+void ssl_init_library(void)
+{
+   pthread_once(&ssl_init_once, ssl_load_library);
+}
+
+/**
+ * @brief Make a client SSL_CTX, logging the reason for failure if NULL.
+ */
+SSL_CTX *ssl_new_context(MParcel *parcel)
+{
+   const SSL_METHOD *method;
+   SSL_CTX *context;
 
    method = SSLv23_client_method();
    if (method)
@@ -200,54 +247,131 @@ void open_ssl(MParcel *parcel, int socket_handle, ServerReady talker_user)
          /* ssl_ctx_set_options(context, ctx_flags); */
          SSL_CTX_set_options(context, SSL_OP_NO_SSLv2);
 
-         ssl = SSL_new(context);
-         if (ssl)
-         {
-            SSL_set_fd(ssl, socket_handle);
+#ifdef SSL_OP_ENABLE_KTLS
+         // Let the kernel encrypt records if it can, see stk_ktls_send():
+         SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
 
-            connect_outcome = SSL_connect(ssl);
+         return context;
+      }
+      else
+         mcb_log_message(parcel, "Failed to initiate an SSL context.", NULL);
+   }
+   else
+      mcb_log_message(parcel, "Failed to find SSL client method.", NULL);
 
-            if (connect_outcome == 1)
-            {
-               STalker *old_talker = parcel->stalker;
+   return NULL;
+}
 
-               STalker talker;
-               init_ssl_talker(&talker, ssl);
-               parcel->stalker = &talker;
+/**
+ * @brief Perform the TLS handshake on an open socket.
+ *
+ * @return The connected SSL handle, which the caller must SSL_free(),
+ *         or NULL if the handshake failed.
+ */
+SSL *ssl_start(MParcel *parcel, SSL_CTX *context, int socket_handle)
+{
+   SSL *ssl;
+   int connect_outcome;
 
-               // Gmail advertises different capabilities after SSL initialization:
-               if (mcb_is_opening_smtp(parcel))
-                  smtp_initialize_session(parcel);
+   ssl = SSL_new(context);
+   if (ssl)
+   {
+      SSL_set_fd(ssl, socket_handle);
 
-               (*talker_user)(parcel);
+      connect_outcome = SSL_connect(ssl);
 
-               parcel->stalker = old_talker;
-            }
-            else if (connect_outcome == 0)
-            {
-               // failed with controlled shutdown
-               log_ssl_error(parcel, ssl, connect_outcome);
-               mcb_log_message(parcel, "ssl connection failed and was cleaned up.", NULL);
-            }
-            else
-            {
-               log_ssl_error(parcel, ssl, connect_outcome);
-               mcb_log_message(parcel, "ssl connection failed and aborted.", NULL);
-               mcb_log_message(parcel, "host: ", parcel->host_url, ", from: ", parcel->from, NULL);
-            }
+      if (connect_outcome == 1)
+         return ssl;
+      else if (connect_outcome == 0)
+      {
+         // failed with controlled shutdown
+         log_ssl_error(parcel, ssl, connect_outcome);
+         mcb_log_message(parcel, "ssl connection failed and was cleaned up.", NULL);
+      }
+      else
+      {
+         log_ssl_error(parcel, ssl, connect_outcome);
+         mcb_log_message(parcel, "ssl connection failed and aborted.", NULL);
+         mcb_log_message(parcel, "host: ", parcel->host_url, ", from: ", parcel->from, NULL);
+      }
 
-            SSL_free(ssl);
-         }
-         else
-            mcb_log_message(parcel, "Failed to create a new SSL instance.", NULL);
+      SSL_free(ssl);
+   }
+   else
+      mcb_log_message(parcel, "Failed to create a new SSL instance.", NULL);
+
+   return NULL;
+}
+
+void body_block_init(BodyBlock *bb)
+{
+   bb->len = 0;
+   ds_init(&bb->stuffer);
+}
+
+/**
+ * @brief Add a content line, which will be terminated with CRLF, to the block.
+ *
+ * Lines too long to fit in the block are sent directly, after
+ * flushing what was already collected to preserve the order.
+ */
+void body_block_add_line(MParcel *parcel, BodyBlock *bb, const char *line, int line_len)
+{
+   if (bb->len + line_len + 2 > sizeof(bb->buffer))
+   {
+      body_block_flush(parcel, bb);
+
+      if (line_len + 2 > sizeof(bb->buffer))
+      {
+         size_t dots_before = bb->stuffer.bytes_added;
 
-         SSL_CTX_free(context);
+         parcel->total_sent += ds_send_block(&bb->stuffer, parcel->stalker, line, line_len);
+         parcel->total_sent += ds_send_block(&bb->stuffer, parcel->stalker, "\r\n", 2);
+         parcel->total_stuffed += bb->stuffer.bytes_added - dots_before;
+         return;
       }
-      else
-         mcb_log_message(parcel, "Failed to initiate an SSL context.", NULL);
    }
+
+   memcpy(&bb->buffer[bb->len], line, line_len);
+   bb->len += line_len;
+   bb->buffer[bb->len++] = '\r';
+   bb->buffer[bb->len++] = '\n';
+}
+
+/**
+ * @brief Add a content line in quoted-printable, which may make several lines.
+ *
+ * *encoded* is working space, reused from line to line.
+ */
+void body_block_add_qp_line(MParcel *parcel,
+                            BodyBlock *bb,
+                            PCBuff *encoded,
+                            const char *line,
+                            int line_len)
+{
+   encoded->len = 0;
+
+   // Less the final CRLF, which body_block_add_line() restores:
+   if (line_len && pc_encode(encoded, line, line_len, PE_QUOTED_PRINTABLE) && encoded->len >= 2)
+      body_block_add_line(parcel, bb, encoded->data, encoded->len - 2);
    else
-      mcb_log_message(parcel, "Failed to find SSL client method.", NULL);
+      body_block_add_line(parcel, bb, line, line_len);
+}
+
+/**
+ * @brief Send collected lines, doubling any dot that begins a line.
+ */
+void body_block_flush(MParcel *parcel, BodyBlock *bb)
+{
+   size_t dots_before = bb->stuffer.bytes_added;
+
+   if (bb->len)
+   {
+      parcel->total_sent += ds_send_block(&bb->stuffer, parcel->stalker, bb->buffer, bb->len);
+      parcel->total_stuffed += bb->stuffer.bytes_added - dots_before;
+      bb->len = 0;
+   }
 }
 
 /**
@@ -472,11 +596,16 @@ void mcb_advise_message(const MParcel *mp, ...)
 
       va_start(ap, mp);
 
+      // The pieces of one message stay together, whatever other threads write:
+      flockfile(msgfile);
+
       while((str = va_arg(ap, char*)))
          fputs(str, msgfile);
 
       fputc('\n', msgfile);
 
+      funlockfile(msgfile);
+
       va_end(ap);
    }
 }
@@ -495,11 +624,16 @@ void mcb_log_message(const MParcel *mp, ...)
       FILE *msgfile = mp->logfile ? mp->logfile : stdout;
       va_start(ap, mp);
 
+      // Parcels of several threads may share a log file:
+      flockfile(msgfile);
+
       while((str = va_arg(ap, char*)))
          fputs(str, msgfile);
 
       fputc('\n', msgfile);
 
+      funlockfile(msgfile);
+
       va_end(ap);
    }
 }
@@ -589,8 +723,11 @@ int mcb_itoa_buff(int value, int base, char *buffer, int buffer_len)
  * - + 4 characters for the hyphens separating the sections,
  * - + 1 for \0 terminator.
  *
- * The function returns 0 if it can't read 16 bytes from /dev/urandom
+ * The function returns 0 if the thread's random pool can't be seeded
  * or if *buffer_len* == 0 (no room for final \0).
+ *
+ * The random bytes come from idg_random_bytes(), a thread-local pool,
+ * so generating a GUID usually involves no system calls.
  * 
  * The result will be truncated if the *buffer_len* parameter
  * indicates that the buffer is too small.
@@ -613,46 +750,35 @@ int mcb_make_guid(char *guid_buffer, int buffer_len)
    uint8_t *version_byte = &buffer[6];
    uint8_t *variant_byte = &buffer[8];
 
-   size_t bytes_read;
-
-   FILE *dr = fopen("/dev/urandom", "r");
-   if (dr)
+   if (idg_random_bytes(buffer, sizeof(buffer)))
    {
-      bytes_read = fread(buffer, 1, 16, dr);
-      if (bytes_read == 16)
+      while (bptr < bend && tptr+1 < tend)
       {
-         while (bptr < bend && tptr+1 < tend)
-         {
-            // Modify bytes for version and variant
-            if (bptr == version_byte)
-               *bptr = 64 | ( *bptr & 15 );  // Set first 4 bits to 1000
-            else if (bptr == variant_byte)
-               *bptr = 128 | (*bptr & 63 );  // Set first 2 bits to 10
+         // Modify bytes for version and variant
+         if (bptr == version_byte)
+            *bptr = 64 | ( *bptr & 15 );  // Set first 4 bits to 1000
+         else if (bptr == variant_byte)
+            *bptr = 128 | (*bptr & 63 );  // Set first 2 bits to 10
 
-            hexify_digit(tptr, *(uint8_t*)bptr);
+         hexify_digit(tptr, *(uint8_t*)bptr);
 
-            ++bptr;
-            tptr += 2;
+         ++bptr;
+         tptr += 2;
 
-            // Add hyphens
-            switch(bptr - buffer)
-            {
-               case 4:
-               case 6:
-               case 8:
-               case 10:
-                  if (tptr < tend)
-                     *tptr++ = '-';
-                  break;
-               default:
-                  break;
-            }
+         // Add hyphens
+         switch(bptr - buffer)
+         {
+            case 4:
+            case 6:
+            case 8:
+            case 10:
+               if (tptr < tend)
+                  *tptr++ = '-';
+               break;
+            default:
+               break;
          }
       }
-      else
-         return 0;
-
-      fclose(dr);
    }
    else
       return 0;
@@ -662,6 +788,36 @@ int mcb_make_guid(char *guid_buffer, int buffer_len)
 }
 
 
+/**
+ * @brief Writes a Message-ID header value, "<GUID@domain>", to the buffer.
+ *
+ * @return 1 for success, 0 if the buffer is too small or no GUID could be made.
+ */
+int mcb_make_message_id(char *buffer, int buffer_len, const char *domain)
+{
+   char guid[37];
+   int domain_len = strlen(domain);
+
+   // Brackets, GUID, '@', domain, and \0
+   if (buffer_len < 1 + 36 + 1 + domain_len + 1 + 1)
+      return 0;
+
+   if (!mcb_make_guid(guid, sizeof(guid)))
+      return 0;
+
+   char *ptr = buffer;
+   *ptr++ = '<';
+   memcpy(ptr, guid, 36);
+   ptr += 36;
+   *ptr++ = '@';
+   memcpy(ptr, domain, domain_len);
+   ptr += domain_len;
+   *ptr++ = '>';
+   *ptr = '\0';
+
+   return 1;
+}
+
 /**
  * @brief Simple callback function for init_buff_control().
  */
@@ -675,6 +831,33 @@ int mcb_is_opening_smtp(const MParcel *parcel)
   return !parcel->pop_reader;
 }
 
+/**
+ * @brief Give up on the session in the middle of a transaction.
+ *
+ * The connection is shut down, so the server drops the unfinished
+ * message rather than take what follows for its content, and the
+ * session is marked broken, so nothing more is sent on it: later
+ * messages leave their recipients at 0 until a new session.
+ */
+void mcb_abandon_session(MParcel *parcel)
+{
+   const STalker *talker = parcel->stalker;
+   int socket_handle = -1;
+
+   parcel->session_broken = 1;
+
+   if (!talker || talker->render_buffer)
+      return;
+
+   if (talker->ssl_handle && !talker->tls_session)
+      socket_handle = SSL_get_fd(talker->ssl_handle);
+   else
+      socket_handle = talker->socket_handle;
+
+   if (socket_handle >= 0)
+      shutdown(socket_handle, SHUT_RDWR);
+}
+
 /**
  * @brief Initialize connection with specified URL on specified port.
  *        Initializes TLS if requested.
@@ -693,12 +876,14 @@ void mcb_prepare_talker(MParcel *parcel, ServerReady talker_user)
    int         socket_response;
    int         smtp_mode_socket = 0;
 
-   int osocket = get_connected_socket(host, port);
+   int osocket = get_connected_socket(parcel, host, port);
    if (osocket > 0)
    {
       STalker talker;
-      init_sock_talker(&talker, osocket);
+      if (!ur_init_talker(&talker, osocket))
+         init_sock_talker(&talker, osocket);
       parcel->stalker = &talker;
+      parcel->session_broken = 0;
 
       if (mcb_is_opening_smtp(parcel))
       {
@@ -744,8 +929,12 @@ void mcb_prepare_talker(MParcel *parcel, ServerReady talker_user)
             open_ssl(parcel, osocket, talker_user);
       }
       else // Not using TLS
+      {
          (*talker_user)(parcel);
+         mcb_smtp_flush_pipeline(parcel);
+      }
 
+      ur_end_talker(&talker);
       close(osocket);
    }
 }
@@ -818,11 +1007,51 @@ void mcb_parse_header_line(const char *buffer,
 
       *value_len = spaces - *value;
    }
-   else
+
+   // Without a colon, the line is neither a name nor a value.
+}
+
+/**
+ * @brief Send CAPA and record the response in MParcel::pop_caps.
+ *
+ * @return 1 if the server listed its capabilities, 0 if it doesn't support CAPA.
+ */
+int mcb_pop_request_capabilities(MParcel *parcel)
+{
+   char buffer[1024];
+   const char *line;
+   int line_len;
+   int confirmed = 0;
+
+   clear_pop_caps(parcel);
+
+   mcb_send_data(parcel, "CAPA", NULL);
+
+   BuffControl bc;
+   init_buff_control(&bc,
+                     buffer,
+                     sizeof(buffer),
+                     mcb_talker_reader,
+                     (void*)parcel->stalker);
+
+   while (bc_get_next_line(&bc, &line, &line_len))
    {
-      *name = buffer;
-      *name_len = spaces - buffer;
+      if (!confirmed)
+      {
+         // -ERR is a single line, so there's nothing to purge:
+         if (*line != '+')
+            return 0;
+
+         confirmed = 1;
+      }
+      else if (line_len == 1 && *line == '.')
+         break;
+      else
+         set_pop_capa(parcel, line, line_len);
    }
+
+   parcel->pop_caps.capa_received = confirmed;
+   return confirmed;
 }
 
 void mcb_greet_pop_server(MParcel *parcel)
@@ -835,6 +1064,8 @@ void mcb_greet_pop_server(MParcel *parcel)
    // Usually, this will be somethiing like "+OK Dovecot ready."
    bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
 
+   mcb_pop_request_capabilities(parcel);
+
    mcb_send_data(parcel, "USER ", parcel->login, NULL);
    bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
    buffer[bytes_read] = '\0';
@@ -869,6 +1100,106 @@ void mcb_greet_pop_server(MParcel *parcel)
    }
 }
 
+/**
+ * @brief Send the message content through the end of the message.
+ *
+ * Lines come from EmailBody::bc unless the body has its own writer.
+ * The DATA content is not terminated: that's left to the caller.
+ */
+void smtp_send_body(MParcel *parcel, const EmailBody *body)
+{
+   BuffControl *bc = body->bc;
+   EmailLineJudge line_judger = body->line_judger;
+   EmailSectionPrinter section_printer = body->section_printer;
+   const char *line;
+   int        line_len;
+   BodyBlock  block;
+   PCBuff     encoded;
+
+   if (body->writer)
+   {
+      (*body->writer)(parcel, body);
+      goto end_body;
+   }
+
+   body_block_init(&block);
+   memset(&encoded, 0, sizeof(encoded));
+
+   // Lines before the first mime border go as they are:
+   parcel->section_encoded = 0;
+
+   if (bc_get_current_line(bc, &line, &line_len))
+   {
+      if (LJ_End_Section == (*line_judger)(line, line_len))
+         (*section_printer)(parcel, line, line_len);
+
+      // Loop to read and send lines until end of message:
+      while (bc_get_next_line(bc, &line, &line_len))
+      {
+         switch((*line_judger)(line, line_len))
+         {
+            case LJ_Continue:
+               if (parcel->section_encoded)
+                  body_block_add_qp_line(parcel, &block, &encoded, line, line_len);
+               else
+                  body_block_add_line(parcel, &block, line, line_len);
+               break;
+            case LJ_End_Section:
+               // Section printer writes directly, so send what precedes it:
+               body_block_flush(parcel, &block);
+               (*section_printer)(parcel, line, line_len);
+               break;
+            case LJ_End_Message:
+               goto end_message;
+         }
+      }
+   }
+
+  end_message:
+   body_block_flush(parcel, &block);
+   free(encoded.data);
+   parcel->section_encoded = 0;
+
+  end_body:
+   if (mcb_smtp_get_multipart_flag(parcel))
+      mcb_smtp_send_mime_end(parcel);
+}
+
+/**
+ * @brief Render headers and body into a RenderBuffer instead of a server.
+ *
+ * The result is ready-to-send DATA content, dot-stuffed and without
+ * the terminating ".".  To: and Cc: list every recipient, since the
+ * rendering will be sent before the servers have passed judgement.
+ *
+ * @return 1 for success, 0 if memory ran out.
+ */
+int mcb_render_message(MParcel *parcel,
+                       RecipLink *recipients,
+                       const HeaderField *headers,
+                       const EmailBody *body,
+                       RenderBuffer *rb)
+{
+   STalker *old_talker = parcel->stalker;
+   int old_total_sent = parcel->total_sent;
+
+   STalker talker;
+   init_buffer_talker(&talker, rb);
+   parcel->stalker = &talker;
+
+   smtp_write_headers(parcel, recipients, headers, body, 0);
+   smtp_send_body(parcel, body);
+
+   // Nothing has been sent yet:
+   parcel->stalker = old_talker;
+   parcel->total_sent = old_total_sent;
+
+   return !rb->failed;
+}
+
+/**
+ * @brief Send one message whose content is read from *bc*, see mcb_send_email_body().
+ */
 void mcb_send_email_new(MParcel *parcel,
                         RecipLink *recipients,
                         const HeaderField *headers,
@@ -876,65 +1207,509 @@ void mcb_send_email_new(MParcel *parcel,
                         EmailLineJudge line_judger,
                         EmailSectionPrinter section_printer)
 {
-   const char *line;
-   int        line_len;
+   EmailBody body = { bc, line_judger, section_printer, NULL, NULL, 0, NULL, NULL };
+   mcb_send_email_body(parcel, recipients, headers, &body);
+}
 
-   if (smtp_send_envelope(parcel, recipients))
+/**
+ * @brief Send one message, in several transactions if there are more
+ *        recipients than the server takes in one.
+ *
+ * The first transaction streams the message straight from its source.
+ * If its envelope leaves recipients over, the message is rendered once
+ * instead, and the same bytes go to each successive transaction.
+ *
+ * With MParcel::pipeline_messages, the verdict on the final
+ * transaction is read with the next message's envelope, and the
+ * recipients are reported then.
+ *
+ * If EmailBody::size_hint gives the size of the content, the size of
+ * the message is declared with SIZE= on MAIL FROM, and a message over
+ * the server's SIZE limit isn't sent at all: its recipients get 552.
+ *
+ * If EmailBody::content_class gives the class of the content, the
+ * mime sections declare the cheapest transfer encoding the server
+ * takes, see smtp_classify_message().
+ *
+ * With MParcel::separate_envelopes, a message to several recipients
+ * is rendered once and sent to each alone, see sb_send_separately().
+ */
+void mcb_send_email_body(MParcel *parcel,
+                         RecipLink *recipients,
+                         const HeaderField *headers,
+                         const EmailBody *body)
+{
+   const char   *line;
+   int          line_len;
+   RecipLink    *batch = recipients, *next = NULL;
+   RenderBuffer rendered;
+   int          consumed = 0;    // the message has been read from its source
+   int          connected = 1;
+   int          deferred = 0;    // the verdict and report wait for the next envelope
+
+   if (parcel->session_broken && !parcel->mx_delivery)
    {
-      if (parcel->OnlySendEnvelope)
-      {
-         ;
-      }
-      else if (smtp_send_headers(parcel, recipients, headers))
+      // Anything sent now would be lost, or taken out of turn:
+      mcb_log_message(parcel, "Message not sent, the session was lost.", NULL);
+      for (batch = recipients; batch; batch = batch->next)
+         batch->rcpt_status = 0;
+      connected = 0;
+   }
+   else if (parcel->separate_envelopes && !parcel->mx_delivery && recipients && recipients->next)
+   {
+      sb_send_separately(parcel, recipients, headers, body);
+      return;
+   }
+
+   // Mail exchangers differ, so only their common ground is certain:
+   smtp_classify_message(parcel,
+                         recipients,
+                         headers,
+                         body,
+                         !parcel->mx_delivery && parcel->caps.cap_8bitmime);
+
+   if (parcel->mx_delivery)
+   {
+      mxd_send_email(parcel->mx_delivery, recipients, headers, body);
+      smtp_clear_classification(parcel);
+      return;
+   }
+
+   rb_init(&rendered);
+
+   // No use uploading what the server will refuse for its size:
+   parcel->message_size = smtp_estimate_size(parcel, recipients, headers, body);
+   if (!connected || !smtp_size_fits(parcel, recipients, NULL))
+      batch = NULL;
+
+   while (batch && connected)
+   {
+      if (smtp_send_envelope(parcel, batch, &next))
       {
-         if (bc_get_current_line(bc, &line, &line_len))
+         if (parcel->OnlySendEnvelope)
          {
-            if (LJ_End_Section == (*line_judger)(line, line_len))
-               (*section_printer)(parcel, line, line_len);
-
-            // Loop to read and send lines until end of message:
-            while (bc_get_next_line(bc, &line, &line_len))
+            connected = smtp_reset_transaction(parcel);
+            goto next_batch;
+         }
+         else if (!consumed && !next)
+         {
+            // Everyone fit, so there is no need to keep a copy:
+            smtp_send_headers(parcel, batch, headers, body);
+            smtp_send_body(parcel, body);
+            consumed = 1;
+         }
+         else
+         {
+            if (!consumed)
             {
-               switch((*line_judger)(line, line_len))
+               consumed = 1;
+               if (!mcb_render_message(parcel, recipients, headers, body, &rendered))
                {
-                  case LJ_Continue:
-                     mcb_send_line(parcel, line, line_len);
-                     break;
-                  case LJ_End_Section:
-                     (*section_printer)(parcel, line, line_len);
-                     break;
-                  case LJ_End_Message:
-                     goto end_message;
+                  // Ending DATA now would deliver an empty message,
+                  // so nobody from here on gets it, and the server,
+                  // still in DATA, must not read what follows:
+                  mcb_log_message(parcel, "Out of memory while rendering message.", NULL);
+                  for (; batch; batch = batch->next)
+                     batch->rcpt_status = 0;
+                  mcb_abandon_session(parcel);
+                  connected = 0;
+                  break;
                }
-            }
-         }
 
-        end_message:
-
-         if (mcb_smtp_get_multipart_flag(parcel))
-            mcb_smtp_send_mime_end(parcel);
+               // Later transactions can declare the exact size:
+               parcel->message_size = rendered.len;
+            }
 
-         mcb_send_data(parcel, ".", NULL);
+            if (!smtp_send_rendered(parcel, &rendered))
+            {
+               smtp_fail_transaction(batch, next, 0);
+               connected = 0;
+               goto next_batch;
+            }
+         }
 
-         goto bypass_failure_flush;
+         if (!next && smtp_defer_data_verdict(parcel, recipients, batch))
+            deferred = 1;
+         else
+            connected = 0 != smtp_finish_data(parcel, batch, next);
       }
       else
-         mcb_log_message(parcel, "Headers not accepted.", NULL);
+      {
+         mcb_log_message(parcel, "Envelope not accepted.", NULL);
+         connected = smtp_reset_transaction(parcel);
+      }
+
+     next_batch:
+      batch = next;
    }
-   else
-      mcb_log_message(parcel, "Envelope not accepted.", NULL);
 
-   // skip or failure_flush:
+   if (!connected)
+      parcel->session_broken = 1;
+
    // flush message after envelope or header failure:
-   while (bc_get_next_line(bc, &line, &line_len))
-      if (LJ_End_Message == (*line_judger)(line, line_len))
-         break;
+   if (!consumed && !body->writer)
+      while (bc_get_next_line(body->bc, &line, &line_len))
+         if (LJ_End_Message == (*body->line_judger)(line, line_len))
+            break;
+
+   rb_free(&rendered);
+   parcel->message_size = 0;
+   smtp_clear_classification(parcel);
 
-  bypass_failure_flush:
    // Send recipients results even if envelope fails
    // in case a RCPT_TO failure caused the envelope failure.
-   if (parcel->report_recipients)
+   if (parcel->report_recipients && !deferred)
       (*parcel->report_recipients)(parcel, recipients);
 }
 
 
+
+#ifdef MAILCB_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>      // for atoi(), exit()
+#include <strings.h>     // for strncasecmp()
+#include <signal.h>
+#include <time.h>
+#include <openssl/x509.h>
+
+#include "loopback.h"
+
+#define STRESS_THREADS     64
+#define STRESS_SESSIONS    20      // per thread
+#define STRESS_MESSAGES    10      // per session
+#define STRESS_RECIPIENTS  3       // per message
+
+#define STRESS_DOTTED_LINE ".Dotted line."
+#define STRESS_LAST_LINE   "End of stress message."
+
+const char *stress_body =
+   "\v\n"
+   "A message sent by one of many threads at once.\n"
+   STRESS_DOTTED_LINE "\n"
+   STRESS_LAST_LINE "\n";
+
+const char *stress_recipients[STRESS_RECIPIENTS] = {
+   "first@stress.test",
+   "second@stress.test",
+   "third@stress.test"
+};
+
+typedef struct _stress_thread
+{
+   pthread_t     thread;
+   int           index;
+   int           port;
+   int           use_tls;
+   int           memory_bio;
+   int           sessions;
+   int           messages;
+   FILE          *log;          // shared by every thread
+   unsigned long accepted;      // recipients
+   unsigned long refused;
+} StressThread;
+
+SSL_CTX *stress_server_context = NULL;
+
+/**
+ * @brief A context with a new self-signed certificate, so the loopback
+ *        server can offer STARTTLS without files.
+ */
+SSL_CTX *stress_make_context(void)
+{
+   SSL_CTX      *context = SSL_CTX_new(TLS_server_method());
+   EVP_PKEY_CTX *key_context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+   EVP_PKEY     *key = NULL;
+   X509         *cert = X509_new();
+
+   if (!context || !key_context || !cert
+       || EVP_PKEY_keygen_init(key_context) <= 0
+       || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_context, NID_X9_62_prime256v1) <= 0
+       || EVP_PKEY_keygen(key_context, &key) <= 0)
+   {
+      printf("Failed to make a key for the loopback server.\n");
+      exit(1);
+   }
+
+   ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+   X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+   X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+   X509_set_pubkey(cert, key);
+   X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                              (const unsigned char*)"localhost", -1, -1, 0);
+   X509_set_issuer_name(cert, X509_get_subject_name(cert));
+
+   if (!X509_sign(cert, key, EVP_sha256())
+       || !SSL_CTX_use_certificate(context, cert)
+       || !SSL_CTX_use_PrivateKey(context, key))
+   {
+      printf("Failed to make a certificate for the loopback server.\n");
+      exit(1);
+   }
+
+   X509_free(cert);
+   EVP_PKEY_free(key);
+   EVP_PKEY_CTX_free(key_context);
+
+   return context;
+}
+
+/**
+ * @brief Answer one client, as a pipelining server would, and judge
+ *        each message by its content.
+ *
+ * A message is accepted only if it arrived whole, its dotted line
+ * stuffed and its last line last.
+ */
+void stress_serve_connection(LBConnection *lc)
+{
+   const char *line;
+   int line_len;
+   int in_data = 0, saw_dot = 0, saw_end = 0;
+
+   lb_send(lc, "220 stress.test ready\r\n");
+
+   while (lb_next_line(lc, &line, &line_len))
+   {
+      if (in_data)
+      {
+         if (lb_line_is(line, line_len, "."))
+         {
+            lb_send(lc, saw_dot && saw_end ? "250 OK\r\n" : "554 Content damaged\r\n");
+            in_data = saw_dot = saw_end = 0;
+         }
+         else
+         {
+            saw_dot |= lb_line_is(line, line_len, "." STRESS_DOTTED_LINE);
+            saw_end = lb_line_is(line, line_len, STRESS_LAST_LINE);
+         }
+      }
+      else if (0 == strncasecmp(line, "EHLO", 4))
+         lb_send(lc,
+                     "250-stress.test\r\n"
+                     "250-PIPELINING\r\n"
+                     "250-8BITMIME\r\n"
+                     "250-STARTTLS\r\n"
+                     "250 SIZE 1000000\r\n");
+      else if (0 == strncasecmp(line, "STARTTLS", 8))
+      {
+         lb_send(lc, "220 Ready to start TLS\r\n");
+
+         lc->ssl = SSL_new(stress_server_context);
+         SSL_set_fd(lc->ssl, lc->socket_handle);
+         if (lc->start != lc->len || SSL_accept(lc->ssl) != 1)
+            break;
+      }
+      else if (0 == strncasecmp(line, "DATA", 4))
+      {
+         lb_send(lc, "354 Go ahead\r\n");
+         in_data = 1;
+      }
+      else if (0 == strncasecmp(line, "QUIT", 4))
+      {
+         lb_send(lc, "221 Bye\r\n");
+         break;
+      }
+      else
+         lb_send(lc, "250 OK\r\n");
+   }
+}
+
+void stress_report(MParcel *parcel, RecipLink *chain)
+{
+   StressThread *st = (StressThread*)parcel->data;
+
+   for (; chain; chain = chain->next)
+   {
+      if (chain->rcpt_status == 250)
+         ++st->accepted;
+      else
+         ++st->refused;
+   }
+}
+
+void stress_session(MParcel *parcel)
+{
+   StressThread *st = (StressThread*)parcel->data;
+   char buffer[1024];
+   BuffControl bc;
+   BCMemorySource source;
+   RecipLink recipients[STRESS_RECIPIENTS];
+   FieldValue subject_value = { "Stress test", NULL };
+   HeaderField subject = { "Subject", &subject_value, NULL };
+   const char *line;
+   int line_len, message, i;
+
+   for (message = 0; message < st->messages; ++message)
+   {
+      memset(recipients, 0, sizeof(recipients));
+      for (i = 0; i < STRESS_RECIPIENTS; ++i)
+      {
+         recipients[i].address = stress_recipients[i];
+         if (i + 1 < STRESS_RECIPIENTS)
+            recipients[i].next = &recipients[i + 1];
+      }
+
+      source.data = stress_body;
+      source.end = stress_body + strlen(stress_body);
+      init_buff_control(&bc, buffer, sizeof(buffer), bc_memory_reader, (void*)&source);
+
+      // Make the section line current, as mcb_send_email_simple() leaves it:
+      bc_get_next_line(&bc, &line, &line_len);
+
+      mcb_send_email_new(parcel, recipients, &subject, &bc, mcb_basic_line_judger, mcb_basic_section_printer);
+   }
+
+   mcb_smtp_quit_server(parcel);
+}
+
+void *stress_thread(void *data)
+{
+   StressThread *st = (StressThread*)data;
+   MParcel parcel;
+   char thread_number[12], session_number[12];
+   int session;
+
+   memset(&parcel, 0, sizeof(MParcel));
+   parcel.host_url = "127.0.0.1";
+   parcel.host_port = st->port;
+   parcel.starttls = st->use_tls;
+   parcel.tls_memory_bio = st->memory_bio;
+   parcel.from = "sender@stress.test";
+   parcel.logfile = st->log;
+   parcel.data = st;
+   parcel.report_recipients = stress_report;
+
+   snprintf(thread_number, sizeof(thread_number), "%d", st->index);
+
+   for (session = 0; session < st->sessions; ++session)
+   {
+      mcb_prepare_talker(&parcel, stress_session);
+
+      snprintf(session_number, sizeof(session_number), "%d", session);
+      mcb_log_message(&parcel, "Thread ", thread_number, ", session ", session_number, " done.", NULL);
+   }
+
+   return NULL;
+}
+
+/**
+ * @brief Count the log's lines, which must each be whole, for a
+ *        thread's session.
+ */
+int stress_check_log(FILE *log, int expected)
+{
+   char line[256], rest;
+   int thread, session, count = 0, damaged = 0;
+
+   rewind(log);
+   while (fgets(line, sizeof(line), log))
+   {
+      if (3 == sscanf(line, "Thread %d, session %d done.%c", &thread, &session, &rest) && rest == '\n')
+         ++count;
+      else if (!damaged++)
+         printf("Damaged or unexpected log line: %s", line);
+   }
+
+   printf("%d of %d session log lines whole, %d others.\n", count, expected, damaged);
+   return count == expected && !damaged;
+}
+
+int main(int argc, const char **argv)
+{
+   LBServer server = { stress_serve_connection, NULL };
+   StressThread *threads;
+   int arg, thread_count = STRESS_THREADS, i;
+   int sessions = STRESS_SESSIONS, messages = STRESS_MESSAGES;
+   int use_tls = 0, memory_bio = 0, numbers = 0;
+   unsigned long accepted = 0, refused = 0, expected;
+   struct timespec start, now;
+   FILE *log;
+   double secs;
+
+   for (arg = 1; arg < argc; ++arg)
+   {
+      if (0 == strcmp(argv[arg], "-t"))
+         use_tls = 1;
+      else if (0 == strcmp(argv[arg], "-m"))
+         use_tls = memory_bio = 1;
+      else if (numbers == 0)
+         thread_count = atoi(argv[arg]), ++numbers;
+      else if (numbers == 1)
+         sessions = atoi(argv[arg]), ++numbers;
+      else
+         messages = atoi(argv[arg]);
+   }
+
+   if (thread_count < 1 || sessions < 1 || messages < 1)
+   {
+      printf("Usage: %s [-t | -m] [threads [sessions [messages]]]\n", argv[0]);
+      return 1;
+   }
+
+   // A TLS session bound to its socket could raise it, see mailcb.h:
+   signal(SIGPIPE, SIG_IGN);
+
+   // Made before the server forks, for its STARTTLS:
+   stress_server_context = stress_make_context();
+   if (!lb_start(&server))
+      return 1;
+
+   if (!(log = tmpfile()) || !(threads = (StressThread*)calloc(thread_count, sizeof(StressThread))))
+   {
+      printf("Failed to prepare the stress test.\n");
+      lb_stop(&server);
+      return 1;
+   }
+
+   printf("%d threads, %d sessions each, of %d messages to %d recipients, %s:\n",
+          thread_count, sessions, messages, STRESS_RECIPIENTS,
+          memory_bio ? "TLS through memory BIOs" : use_tls ? "TLS" : "plain");
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (i = 0; i < thread_count; ++i)
+   {
+      threads[i].index = i;
+      threads[i].port = server.port;
+      threads[i].use_tls = use_tls;
+      threads[i].memory_bio = memory_bio;
+      threads[i].sessions = sessions;
+      threads[i].messages = messages;
+      threads[i].log = log;
+
+      if (pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i]))
+      {
+         printf("Failed to start thread %d.\n", i);
+         thread_count = i;
+         break;
+      }
+   }
+
+   for (i = 0; i < thread_count; ++i)
+   {
+      pthread_join(threads[i].thread, NULL);
+      accepted += threads[i].accepted;
+      refused += threads[i].refused;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+   lb_stop(&server);
+
+   expected = (unsigned long)thread_count * sessions * messages * STRESS_RECIPIENTS;
+   printf("%lu of %lu recipients accepted, %lu refused, in %.3f s: %.0f sessions/s, %.0f messages/s.\n",
+          accepted, expected, refused, secs,
+          thread_count * sessions / secs,
+          (double)thread_count * sessions * messages / secs);
+
+   i = stress_check_log(log, thread_count * sessions) && accepted == expected;
+
+   fclose(log);
+   free(threads);
+
+   return !i;
+}
+
+#endif  // MAILCB_MAIN
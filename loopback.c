@@ -0,0 +1,150 @@
+#include <stdio.h>        // for perror()
+#include <stdlib.h>       // for calloc(), free(), exit()
+#include <string.h>       // for memset(), memchr(), memmove()
+#include <signal.h>       // for kill()
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // for TCP_NODELAY
+#include <arpa/inet.h>
+
+#include "loopback.h"
+
+// Private, internal functions
+void *lb_serve_connection(void *data);
+void lb_serve(LBServer *server, int listener);
+
+int lb_send(LBConnection *lc, const char *reply)
+{
+   int len = strlen(reply);
+
+   if (lc->ssl)
+      return len == SSL_write(lc->ssl, reply, len);
+   else
+      return len == send(lc->socket_handle, reply, len, MSG_NOSIGNAL);
+}
+
+int lb_next_line(LBConnection *lc, const char **line, int *line_len)
+{
+   char *eol;
+   int  received;
+
+   while (!(eol = (char*)memchr(lc->buffer + lc->start, '\n', lc->len - lc->start)))
+   {
+      memmove(lc->buffer, lc->buffer + lc->start, lc->len - lc->start);
+      lc->len -= lc->start;
+      lc->start = 0;
+
+      if (lc->len == sizeof(lc->buffer))
+         return 0;
+
+      if (lc->ssl)
+         received = SSL_read(lc->ssl, lc->buffer + lc->len, sizeof(lc->buffer) - lc->len);
+      else
+         received = recv(lc->socket_handle, lc->buffer + lc->len, sizeof(lc->buffer) - lc->len, 0);
+
+      if (received <= 0)
+         return 0;
+
+      lc->len += received;
+   }
+
+   *line = lc->buffer + lc->start;
+   *line_len = eol - *line;
+   if (*line_len && eol[-1] == '\r')
+      --*line_len;
+
+   lc->start = eol + 1 - lc->buffer;
+   return 1;
+}
+
+int lb_line_is(const char *line, int line_len, const char *value)
+{
+   return line_len == (int)strlen(value) && 0 == memcmp(line, value, line_len);
+}
+
+void *lb_serve_connection(void *data)
+{
+   LBConnection *lc = (LBConnection*)data;
+   LBServer *server = (LBServer*)lc->data;
+
+   lc->data = server->data;
+   (*server->handler)(lc);
+
+   if (lc->ssl)
+      SSL_free(lc->ssl);
+   close(lc->socket_handle);
+   free(lc);
+
+   return NULL;
+}
+
+/**
+ * @brief Accept connections, in the server's process, a thread for each.
+ */
+void lb_serve(LBServer *server, int listener)
+{
+   LBConnection *lc;
+   pthread_t thread;
+   int sock, nodelay = 1;
+
+   while ((sock = accept(listener, NULL, NULL)) >= 0)
+   {
+      if (!(lc = (LBConnection*)calloc(1, sizeof(LBConnection))))
+         exit(1);
+
+      // Pipelined replies go one at a time, and mustn't wait for ACKs:
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+      lc->socket_handle = sock;
+      lc->data = server;
+      if (pthread_create(&thread, NULL, lb_serve_connection, lc))
+         exit(1);
+      pthread_detach(thread);
+   }
+
+   exit(0);
+}
+
+int lb_start(LBServer *server)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   int listener;
+
+   listener = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (listener < 0
+       || bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+       || listen(listener, 1024)
+       || getsockname(listener, (struct sockaddr*)&addr, &addr_len))
+   {
+      perror("loopback server");
+      if (listener >= 0)
+         close(listener);
+      return 0;
+   }
+
+   server->port = ntohs(addr.sin_port);
+   if (!(server->process = fork()))
+      lb_serve(server, listener);
+   close(listener);
+
+   if (server->process < 0)
+   {
+      perror("loopback server");
+      return 0;
+   }
+
+   return 1;
+}
+
+void lb_stop(LBServer *server)
+{
+   kill(server->process, SIGTERM);
+   waitpid(server->process, NULL, 0);
+}
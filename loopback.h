@@ -0,0 +1,61 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+/**
+ * Loopback SMTP server for the demonstration and stress mains, like
+ * those of sendpool.c and libmailcb.c; it isn't part of the library.
+ *
+ * lb_start() listens on a free loopback port and forks a process that
+ * gives each connection a thread of its own, running the server's
+ * handler.  The handler reads the client's lines with lb_next_line()
+ * and answers with lb_send(), through TLS once it has set
+ * LBConnection::ssl, as after STARTTLS.  The connection is closed
+ * when the handler returns.
+ */
+
+typedef struct _lb_connection
+{
+   int  socket_handle;
+   SSL  *ssl;               // set by the handler to talk through TLS, freed with the connection
+   void *data;              // LBServer::data
+   char buffer[16384];
+   int  len;
+   int  start;              // of the next line
+} LBConnection;
+
+typedef void (*LBHandler)(LBConnection *lc);
+
+typedef struct _lb_server
+{
+   LBHandler handler;
+   void      *data;         // for the handler, as LBConnection::data
+   int       port;          // set by lb_start()
+   pid_t     process;
+} LBServer;
+
+/**
+ * @brief Start serving in a new process.
+ *
+ * @return 1 if it started, 0 after perror().
+ */
+int lb_start(LBServer *server);
+
+/** @brief End the server's process, and wait for it. */
+void lb_stop(LBServer *server);
+
+/** @brief Send a reply, all of it or nothing: 1 if it went. */
+int lb_send(LBConnection *lc, const char *reply);
+
+/**
+ * @brief Point *line* at the next line, without its line ending, reading as needed.
+ *
+ * @return 1 for a line, 0 when the client has gone.
+ */
+int lb_next_line(LBConnection *lc, const char **line, int *line_len);
+
+int lb_line_is(const char *line, int line_len, const char *value);
+
+#endif
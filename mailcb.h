@@ -4,10 +4,17 @@
 #include <sys/types.h>
 #include "socktalk.h"
 #include "buffread.h"
+#include "partcache.h"
+#include "classify.h"
+#include "connector.h"
+#include "smtpkeys.h"
 
 // prototype for MParcel to be used for function pointer
 struct _comm_parcel;
 struct _pop_closure;
+struct _mx_delivery;
+struct _rate_limits;
+struct _pending_message;
 
 typedef struct _field_value
 {
@@ -46,6 +53,7 @@ typedef struct _recip_link
    struct _recip_link *next;
    int                rcpt_status;
    int                enh_status;
+   long long          rcpt_issued;   // when the token of its RCPT TO was taken, see ratelimit.h
 } RecipLink;
 
 typedef struct _smtp_args
@@ -76,7 +84,17 @@ typedef struct _smtp_caps
    int cap_pipelining;
    int cap_chunking;
    int cap_smtputf8;
-   int cap_size;
+   int cap_size;              // SIZE limit in bytes, 0 if no limit was declared
+   int cap_sizeext;           // SIZE keyword present, with or without a limit
+   int cap_dsn;
+   int cap_binarymime;
+   int cap_requiretls;
+   int cap_deliverby;
+   int cap_deliverby_min;     // minimum by-time, in seconds, of DELIVERBY
+   int cap_mt_priority;
+   int cap_limits_rcptmax;    // LIMITS RCPTMAX, recipients per transaction, 0 if undeclared
+   int cap_limits_mailmax;    // LIMITS MAILMAX, transactions per session, 0 if undeclared
+   int cap_rcpt_limit_seen;   // not advertised: recipients accepted before a 452 this session
    int cap_auth_any;
    int cap_auth_plain;        // use base64 encoding
    int cap_auth_login;        // use base64 encoding
@@ -88,8 +106,35 @@ typedef struct _smtp_caps
    int cap_auth_oauthbearer;
    int cap_auth_xoauth;
    int cap_auth_xoauth2;
+
+   /** Bit (1 << SmtpKeyword) set for every recognized EHLO keyword */
+   unsigned long long cap_keywords;
 } SmtpCaps;
 
+typedef struct _pop_caps
+{
+   /** Server-reported capabilities from the POP3 CAPA command */
+   int capa_received;
+   int cap_top;
+   int cap_user;
+   int cap_sasl;
+   int cap_resp_codes;
+   int cap_login_delay;       // seconds
+   int cap_pipelining;
+   int cap_expire;            // days, -1 for NEVER
+   int cap_uidl;
+   int cap_stls;
+   int cap_utf8;
+   int cap_auth_resp_code;
+} PopCaps;
+
+/** SMTP replies read from the server ahead of being consumed, as happens when pipelining. */
+typedef struct _smtp_replies
+{
+   char data[1024];
+   int  len;
+} SmtpReplies;
+
 typedef void (*ServerReady)(struct _comm_parcel *parcel);
 typedef void(*ReportEnvelopeRecipients)(struct _comm_parcel *parcel, RecipLink *rchain);
 typedef int (*NextPOPMessageHeader)(struct _comm_parcel *parcel, struct _pop_closure *pop_closure );
@@ -107,6 +152,10 @@ typedef struct _comm_parcel
    int host_port;
    int starttls;
 
+   /** Connection deadlines (0 for defaults) and the address that accepted the connection. */
+   ConnectTimes connect_times;
+   ConnectOutcome connect_outcome;
+
    /** account login credentials */
    const char *login;
    const char *password;
@@ -120,6 +169,7 @@ typedef struct _comm_parcel
    /** Data transfer tracking maintained by STalker */
    int total_sent;
    int total_read;
+   int total_stuffed;   // dots added to DATA content for transparency
 
    /** Message and logging flags and targets */
    int verbose;
@@ -129,18 +179,72 @@ typedef struct _comm_parcel
 
    /** SMTP operations variables */
    const char *from;   // from field in SMTP envelope
+   const char *helo_name;   // name announced with EHLO, host_url if NULL
    SmtpCaps caps;      // SMTP capabilities as reported by EHLO response
+   SmtpReplies replies;   // read-ahead for smtp_read_reply()
    ReportEnvelopeRecipients report_recipients;
    int OnlySendEnvelope;
+   int max_rcpt_per_transaction;   // split larger recipient lists, 0 for the server's limit
+   int pipeline_messages;   // with PIPELINING, send the next envelope before the last message's verdict
+   int separate_envelopes;  // render each message once and send it to each recipient alone, see sharedbody.h
+   int chunked_transfer;    // the envelope ends without DATA, for content sent with BDAT, see rawmsg.h
+   int tls_memory_bio;      // run TLS through memory BIOs, batching the socket I/O, see tlsmem.h
+   struct _pending_message *pending_message;   // the message awaiting that verdict
+   int session_broken;      // the connection was lost or abandoned, so nothing more is sent on it
+   size_t message_size;   // of the message being sent, for SIZE= on MAIL FROM; 0 if unknown
+   PartEncoding body_encoding;   // declared by the mime borders of the message being sent
+   int body_classified;   // body_encoding was chosen from the content; if not, borders declare quoted-printable
+   int section_encoded;   // the lines of the current mime section are encoded to body_encoding
+   int body_8bit;       // the content has 8-bit bytes, for BODY=8BITMIME
+   int message_utf8;    // the envelope or headers have UTF-8, for SMTPUTF8
    char multipart_boundary[37];
+   PartCache *part_cache;   // optional cache of encoded MIME parts, shared between messages
+   struct _mx_delivery *mx_delivery;   // if set, deliver to each domain's MX instead of the host
+   struct _rate_limits *rate_limits;   // if set, pace MAIL FROM and RCPT TO, see ratelimit.h
 
    /** POP operations variables */
    int pop_reader;
    PopMessageUser pop_message_receiver;
+   PopCaps pop_caps;   // POP capabilities as reported by CAPA response
 
 } MParcel;
 
 
+/**
+ * Threads
+ *
+ * The library is reentrant for one MParcel per thread: every function
+ * works only on the parcel, talker, and buffers it is given, so threads
+ * with their own parcels may run sessions at the same time.  What the
+ * threads share is safe to share:
+ *
+ * - OpenSSL is initialized once for the process, see ssl_init_library().
+ * - The resolver cache (resolver.h) is guarded by a mutex.
+ * - The message-id generator (idgen.h) and the io_uring ring (uring.h)
+ *   belong to each thread.
+ * - mcb_log_message() and mcb_advise_message() write a message with
+ *   the FILE locked, so parcels may share MParcel::logfile, and lines
+ *   of different threads never mix.
+ * - The capability tables of smtpkeys.c and commparcel.c are constant.
+ *
+ * A parcel, and what it points to, belongs to one thread at a time:
+ * its STalker, PartCache, MXDelivery, and PendingMessage are not
+ * locked, so a PartCache, for one, is needed for each thread.  The
+ * RateLimits is the exception: it is locked, so parcels can share it.
+ *
+ * A TLS session bound to its socket writes with write(), so a server
+ * that drops the connection raises SIGPIPE; a threaded program should
+ * ignore it, as the mailer does, and so does a kTLS session sending
+ * from a file.  Plain and memory-BIO sessions send with MSG_NOSIGNAL,
+ * and block SIGPIPE around the sendfile() of spilled parts and raw
+ * messages, taking any it raised.
+ *
+ * libmailcb.c, built with -DMAILCB_MAIN (make mailcb_stress), runs
+ * concurrent sessions from many threads against a loopback server.
+ * sendpool.h runs such sessions for a program, sharing the messages
+ * between worker threads and relays.
+ */
+
 /** Public functions, all should start with mcb_ */
 
 void mcb_advise_message(const MParcel *mp, ...);
@@ -157,10 +261,12 @@ int mcb_digits_in_base(int value, int base);
 int mcb_itoa_buff(int value, int base, char *buffer, int buffer_len);
 
 int mcb_make_guid(char *guid_buffer, int buffer_len);
+int mcb_make_message_id(char *buffer, int buffer_len, const char *domain);
 
 size_t mcb_talker_reader(void *stalker, char *buffer, int buffer_len);
 
 int mcb_is_opening_smtp(const MParcel *parcel);
+void mcb_abandon_session(MParcel *parcel);
 
 void mcb_parse_header_line(const char *buffer,
                            const char *end,
@@ -169,12 +275,58 @@ void mcb_parse_header_line(const char *buffer,
                            const char **value,
                            int *value_len);
 
+/**
+ * An SMTP envelope sent a step at a time, by a caller that does its
+ * own reading and waiting, see mcb_smtp_envelope_start().
+ */
+typedef struct _smtp_envelope
+{
+   RecipLink *recipients;    // of the transaction, from the first
+   RecipLink *cursor;        // the next to send RCPT TO for
+   RecipLink *judging;       // the next whose RCPT TO reply is due
+   RecipLink *stop;          // the first not sent RCPT TO in this transaction
+   RecipLink *next;          // the first left for another transaction, NULL if none
+   int stage;                // what mcb_smtp_envelope_write() does next, see mailcb_internal.h
+   int pipelined;            // the whole envelope goes out before its replies are read
+   int send_data;            // DATA ends the envelope; not so with OnlySendEnvelope or chunked_transfer
+   int limit;                // recipients per transaction, 0 for no limit
+   int awaiting_mail;        // the reply to MAIL FROM is still due
+   int mail_ok;
+   int data_sent;
+   int replies_due;          // to pass to mcb_smtp_envelope_reply() before writing again
+   int recipients_sent;
+   int recipients_judged;
+   int recipients_accepted;
+   int judgement;            // of the last RCPT TO, -1 once the transaction takes no more
+   int ready;                // the server awaits the content, or BDAT
+   int reply_status;         // the reply that ended the envelope, if it failed
+   long long mail_issued;    // when the token of MAIL FROM was taken, see ratelimit.h
+   long long issued;         // and of the last command paced
+   long long due_usecs;      // when the token taken for the next command comes, 0 if none is waited on
+   long long wait_usecs;     // before calling mcb_smtp_envelope_write() again
+} SmtpEnvelope;
+
 /**
  * SMTP section. SMTP functions found in mailcb_smtp.c
  */
 
 int mcb_smtp_greet_server(MParcel *parcel);
+int mcb_smtp_has_keyword(const MParcel *parcel, SmtpKeyword keyword);
+void mcb_smtp_parse_ehlo_reply(MParcel *parcel, const char *reply, int reply_len);
 int mcb_smtp_authorize_session(MParcel *parcel);
+int mcb_smtp_flush_pipeline(MParcel *parcel);
+
+struct _email_body;
+void mcb_smtp_classify_message(MParcel *parcel,
+                               const RecipLink *recipients,
+                               const HeaderField *headers,
+                               const struct _email_body *body);
+
+void mcb_smtp_envelope_start(MParcel *parcel, SmtpEnvelope *envelope, RecipLink *recipients);
+int mcb_smtp_envelope_write(MParcel *parcel, SmtpEnvelope *envelope);
+void mcb_smtp_envelope_reply(MParcel *parcel, SmtpEnvelope *envelope, const char *reply);
+void mcb_smtp_envelope_fail(MParcel *parcel, SmtpEnvelope *envelope);
+int mcb_smtp_envelope_verdict(MParcel *parcel, SmtpEnvelope *envelope, const char *reply);
 
 void mcb_smtp_clear_multipart_flag(MParcel *parcel);
 void mcb_smtp_set_multipart_flag(MParcel *parcel);
@@ -182,6 +334,16 @@ int mcb_smtp_get_multipart_flag(const MParcel *parcel);
 
 void mcb_smtp_send_mime_announcement(MParcel *parcel);
 void mcb_smtp_send_mime_border(MParcel *parcel, const char *content_type, const char *charset);
+void mcb_smtp_send_mime_border_encoded(MParcel *parcel,
+                                       const char *content_type,
+                                       const char *charset,
+                                       PartEncoding encoding);
+int mcb_smtp_send_cached_part(MParcel *parcel,
+                              const char *content_type,
+                              const char *charset,
+                              const char *content,
+                              size_t content_len,
+                              PartEncoding encoding);
 
 void mcb_smtp_send_mime_end(MParcel *parcel);
 
@@ -193,6 +355,7 @@ void mcb_smtp_quit_server(MParcel *parcel);
 
 
 void mcb_greet_pop_server(MParcel *parcel);
+int mcb_pop_request_capabilities(MParcel *parcel);
 
 void mcb_prepare_talker(MParcel *parcel, ServerReady talker_user);
 
@@ -206,6 +369,33 @@ typedef enum _line_judge_outcomes
 typedef LJOutcomes (*EmailLineJudge)(const char *line, int line_len);
 typedef void (*EmailSectionPrinter)(MParcel *parcel, const char *line, int line_len);
 
+struct _email_body;
+
+/**
+ * @brief Pointer to function that writes ready-made DATA content.
+ *
+ * The content must already be dot-stuffed.  Section lines should still
+ * go to EmailBody::section_printer, which knows the mime borders.  As
+ * EmailBody::header_writer, it writes complete header field lines.
+ */
+typedef void (*EmailBodyWriter)(MParcel *parcel, const struct _email_body *body);
+
+/**
+ * @brief The content of a message: lines to be read from a BuffControl
+ *        and judged one at a time, or a writer with its own data.
+ */
+typedef struct _email_body
+{
+   BuffControl         *bc;
+   EmailLineJudge      line_judger;
+   EmailSectionPrinter section_printer;
+   EmailBodyWriter     writer;          // if set, used instead of bc and line_judger
+   void                *writer_data;
+   size_t              size_hint;       // bytes of content, if known, for SIZE=; 0 if not
+   const ContentClass  *content_class;  // the content's, if known, to pick the transfer encoding
+   EmailBodyWriter     header_writer;   // if set, writes header fields of its own, after the HeaderField chain
+} EmailBody;
+
 /**
  * @brief Pointer to function that judges and optionally acts on specific lines.
  *
@@ -223,6 +413,17 @@ void mcb_send_email_new(MParcel *parcel,
                         EmailLineJudge line_judger,
                         EmailSectionPrinter section_printer);
 
+void mcb_send_email_body(MParcel *parcel,
+                         RecipLink *recipients,
+                         const HeaderField *headers,
+                         const EmailBody *body);
+
+int mcb_render_message(MParcel *parcel,
+                       RecipLink *recipients,
+                       const HeaderField *headers,
+                       const EmailBody *body,
+                       RenderBuffer *rb);
+
 void mcb_send_email_simple(MParcel *parcel,
                            BuffControl *bc,
                            EmailLineJudge line_judger,
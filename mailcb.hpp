@@ -0,0 +1,1088 @@
+#ifndef MAILCB_HPP
+#define MAILCB_HPP
+
+/**
+ * libmailcb++: SMTP sessions as C++20 coroutines.
+ *
+ * The C library runs one session per call, blocking in its talkers
+ * until each reply arrives, so a thread is needed for every session
+ * in flight.  Here, a session is a Connection whose operations,
+ * connect(), authorize(), send() and quit(), are awaited by a
+ * coroutine, and a Loop runs any number of those coroutines on one
+ * thread, resuming each when its socket is ready:
+ *
+ * ~~~
+ * mcb::Task<void> deliver(mcb::Loop &loop, const MParcel &settings, mcb::Message &message)
+ * {
+ *    auto connection = co_await mcb::Connection::connect(loop, settings);
+ *    co_await connection->authorize();
+ *    co_await connection->send(message);
+ *    co_await connection->quit();
+ * }
+ *
+ * for (auto &message : messages)
+ *    loop.spawn(deliver(loop, settings, message));
+ * loop.run();
+ * ~~~
+ *
+ * Sockets are non-blocking and watched with epoll.  TLS, after
+ * STARTTLS, runs through memory BIOs, as with MParcel::tls_memory_bio,
+ * so OpenSSL never waits on the socket.  The library still does the
+ * work that doesn't wait: mcb_render_message() renders the message,
+ * mcb_smtp_parse_ehlo_reply() reads the capabilities, the steps of
+ * mcb_smtp_envelope_start() write the envelope and judge its replies,
+ * and rsv_resolve() supplies the addresses, from its cache after the
+ * first lookup.
+ *
+ * A Connection owns its socket and TLS session, and a Message owns the
+ * strings and chains it is sent with, so both are released with their
+ * unique_ptr or scope.  Failures of the connection, or replies that
+ * end the session, are thrown as mcb::Error; a message refused by the
+ * server is not a failure, and send() reports it in the recipients'
+ * RecipLink::rcpt_status.
+ *
+ * Build with -std=c++20, and link with -lmailcb -lssl -lcrypto -lcode64.
+ */
+
+#include <coroutine>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>        // for gai_strerror()
+#include <unistd.h>       // for close()
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // for TCP_NODELAY
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/conf.h>
+#include <openssl/bio.h>
+
+extern "C"
+{
+#include <code64.h>
+#include "mailcb.h"
+#include "resolver.h"
+}
+
+#define MCB_CORO_READ_LEN   16384   // bytes read from the socket at once
+#define MCB_CORO_FLUSH_LEN  65536   // ciphertext waiting that forces a write
+
+// Longest wait on a socket, RFC 5321's least for most replies:
+#ifndef MCB_CORO_TIMEOUT_MS
+#define MCB_CORO_TIMEOUT_MS 300000
+#endif
+
+namespace mcb
+{
+
+/** @brief A failed connection, or a reply that ends the session. */
+class Error : public std::runtime_error
+{
+public:
+   explicit Error(const std::string &what, int status = 0)
+      : std::runtime_error(what), status(status) { }
+
+   int status;   // the server's reply, 0 for a failure of the connection
+};
+
+/** @brief A complete reply, every line of it if multiline. */
+struct Reply
+{
+   int         status = 0;
+   std::string text;
+
+   bool ok() const { return status >= 200 && status < 300; }
+};
+
+template <typename T = void> class Task;
+
+namespace detail
+{
+   struct PromiseBase
+   {
+      std::coroutine_handle<> continuation;
+      std::exception_ptr      error;
+
+      /** Resume the awaiting coroutine, in place of returning to the Loop. */
+      struct FinalAwaiter
+      {
+         bool await_ready() noexcept { return false; }
+
+         template <typename P>
+         std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept
+         {
+            std::coroutine_handle<> next = done.promise().continuation;
+            return next ? next : std::noop_coroutine();
+         }
+
+         void await_resume() noexcept { }
+      };
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      FinalAwaiter final_suspend() noexcept { return {}; }
+      void unhandled_exception() { error = std::current_exception(); }
+   };
+
+   template <typename T>
+   struct Promise : PromiseBase
+   {
+      std::optional<T> value;
+
+      Task<T> get_return_object();
+      void return_value(T result) { value = std::move(result); }
+
+      T take()
+      {
+         if (error)
+            std::rethrow_exception(error);
+         return std::move(*value);
+      }
+   };
+
+   template <>
+   struct Promise<void> : PromiseBase
+   {
+      Task<void> get_return_object();
+      void return_void() { }
+
+      void take()
+      {
+         if (error)
+            std::rethrow_exception(error);
+      }
+   };
+
+   /** The frame of Loop::spawn(), which frees itself at its end. */
+   struct Detached
+   {
+      struct promise_type
+      {
+         Detached get_return_object() noexcept { return {}; }
+         std::suspend_never initial_suspend() noexcept { return {}; }
+         std::suspend_never final_suspend() noexcept { return {}; }
+         void return_void() noexcept { }
+         void unhandled_exception() noexcept { std::terminate(); }
+      };
+   };
+}
+
+/**
+ * @brief A coroutine that starts when awaited, and resumes its awaiter
+ *        with its result or exception when it ends.
+ */
+template <typename T>
+class Task
+{
+public:
+   using promise_type = detail::Promise<T>;
+   using handle_type = std::coroutine_handle<promise_type>;
+
+   explicit Task(handle_type handle) : handle_(handle) { }
+   Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) { }
+   Task(const Task&) = delete;
+   Task &operator=(const Task&) = delete;
+
+   ~Task()
+   {
+      if (handle_)
+         handle_.destroy();
+   }
+
+   bool await_ready() const noexcept { return false; }
+
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+   {
+      handle_.promise().continuation = awaiter;
+      return handle_;
+   }
+
+   T await_resume() { return handle_.promise().take(); }
+
+private:
+   handle_type handle_;
+};
+
+namespace detail
+{
+   template <typename T>
+   Task<T> Promise<T>::get_return_object()
+   {
+      return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+   }
+
+   inline Task<void> Promise<void>::get_return_object()
+   {
+      return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+   }
+}
+
+/**
+ * @brief Runs coroutines on one thread, resuming each when the socket
+ *        it waits on is ready, or its sleep is over.
+ *
+ * A coroutine that waits longer than the Loop's timeout is resumed
+ * with an Error instead, so a server that stops answering ends only
+ * its own session.
+ */
+class Loop
+{
+public:
+   explicit Loop(int timeout_ms = MCB_CORO_TIMEOUT_MS) : timeout_(timeout_ms)
+   {
+      if ((epoll_handle_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+         throw Error(std::string("Failed to create an epoll instance, ") + strerror(errno));
+   }
+
+   ~Loop()
+   {
+      if (tls_context_)
+         SSL_CTX_free(tls_context_);
+      close(epoll_handle_);
+   }
+
+   Loop(const Loop&) = delete;
+   Loop &operator=(const Loop&) = delete;
+
+   /** An awaitable that resumes when *fd* can be read. */
+   auto readable(int fd) { return Wait{ *this, fd, EPOLLIN }; }
+
+   /** An awaitable that resumes when *fd* can be written. */
+   auto writable(int fd) { return Wait{ *this, fd, EPOLLOUT }; }
+
+   /** An awaitable that resumes after *delay*, as for a rate limit's token. */
+   auto sleep(std::chrono::microseconds delay) { return Wait{ *this, -1, 0, delay }; }
+
+   /**
+    * @brief Start a coroutine that nothing awaits, to run until it ends.
+    *
+    * It runs at once, until it first waits.  If it throws, run()
+    * throws the first such exception after the others have ended.
+    */
+   void spawn(Task<void> task)
+   {
+      ++pending_;
+      detach(std::move(task));
+   }
+
+   /** @brief Resume waiting coroutines until every spawned one has ended. */
+   void run()
+   {
+      struct epoll_event events[64];
+      int count, i, wait_ms;
+      Wait *wait;
+
+      while (pending_ > 0)
+      {
+         wait_ms = -1;
+         if (!deadlines_.empty())
+         {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadlines_.begin()->first - Clock::now());
+            wait_ms = left.count() > 0 ? (int)left.count() : 0;
+         }
+
+         if ((count = epoll_wait(epoll_handle_, events, 64, wait_ms)) < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            throw Error(std::string("epoll_wait failed, ") + strerror(errno));
+         }
+
+         for (i = 0; i < count; ++i)
+         {
+            wait = (Wait*)events[i].data.ptr;
+            deadlines_.erase(wait->deadline);
+            wait->waiter.resume();
+         }
+
+         // Then the waits whose time is up, no longer watched, and the sleeps:
+         auto now = Clock::now();
+         while (!deadlines_.empty() && deadlines_.begin()->first <= now)
+         {
+            wait = deadlines_.begin()->second;
+            deadlines_.erase(deadlines_.begin());
+
+            if (wait->fd >= 0)
+            {
+               epoll_ctl(epoll_handle_, EPOLL_CTL_DEL, wait->fd, NULL);
+               wait->timed_out = true;
+            }
+            wait->waiter.resume();
+         }
+      }
+
+      if (error_)
+         std::rethrow_exception(std::exchange(error_, nullptr));
+   }
+
+   /** @brief The context of every Connection's TLS session, made when first needed. */
+   SSL_CTX *tls_context()
+   {
+      if (!tls_context_ && !(tls_context_ = SSL_CTX_new(TLS_client_method())))
+         throw Error("Failed to create an SSL context.");
+      return tls_context_;
+   }
+
+private:
+   using Clock = std::chrono::steady_clock;
+   struct Wait;
+   using Deadlines = std::multimap<Clock::time_point, Wait*>;
+
+   /** The awaitable, in the waiting coroutine's frame until it resumes. */
+   struct Wait
+   {
+      Loop                    &loop;
+      int                     fd;         // -1 for a sleep
+      uint32_t                events;
+      Clock::duration         delay;      // of a sleep
+      std::coroutine_handle<> waiter;
+      Deadlines::iterator     deadline;
+      bool                    timed_out;
+
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+         waiter = handle;
+         timed_out = false;
+         loop.watch(*this);
+      }
+
+      void await_resume() const
+      {
+         if (timed_out)
+            throw Error("No reply in " + std::to_string(loop.timeout_.count() / 1000) + " seconds.");
+      }
+   };
+
+   /**
+    * @brief Resume the waiter once when its socket is ready, or its time is up.
+    *
+    * A closed socket leaves the epoll set, so a new socket with the
+    * same number is added again.  A sleep only has its time.
+    */
+   void watch(Wait &wait)
+   {
+      struct epoll_event event = {};
+      event.events = wait.events | EPOLLONESHOT;
+      event.data.ptr = &wait;
+
+      if (wait.fd < 0)
+      {
+         wait.deadline = deadlines_.emplace(Clock::now() + wait.delay, &wait);
+         return;
+      }
+
+      if (epoll_ctl(epoll_handle_, EPOLL_CTL_MOD, wait.fd, &event)
+          && (errno != ENOENT || epoll_ctl(epoll_handle_, EPOLL_CTL_ADD, wait.fd, &event)))
+         throw Error(std::string("Failed to watch a socket, ") + strerror(errno));
+
+      wait.deadline = deadlines_.emplace(Clock::now() + timeout_, &wait);
+   }
+
+   detail::Detached detach(Task<void> task)
+   {
+      try
+      {
+         co_await task;
+      }
+      catch (...)
+      {
+         if (!error_)
+            error_ = std::current_exception();
+      }
+
+      --pending_;
+   }
+
+   int                       epoll_handle_ = -1;
+   std::chrono::milliseconds timeout_;
+   Deadlines                 deadlines_;
+   unsigned long             pending_ = 0;
+   std::exception_ptr        error_;
+   SSL_CTX                   *tls_context_ = nullptr;
+};
+
+/**
+ * @brief A message, and the recipients and header fields it is sent
+ *        with, owning the strings the library's chains point to.
+ *
+ * The body is read with mcb_basic_line_judger() and
+ * mcb_basic_section_printer(), so a line of "\v#text/html" starts a
+ * mime section, as in the mailer's batch files.  A body that doesn't
+ * begin with such a line is sent as plain text.
+ *
+ * Since the chains point into the message, it can be moved but not copied.
+ */
+class Message
+{
+public:
+   Message() = default;
+   Message(Message&&) = default;
+   Message &operator=(Message&&) = default;
+   Message(const Message&) = delete;
+   Message &operator=(const Message&) = delete;
+
+   void add_recipient(std::string_view address, RecipType rtype = RT_TO)
+   {
+      RecipLink &link = recipients_.emplace_back();
+      link.rtype = rtype;
+      link.address = keep(address);
+
+      if (recipients_.size() > 1)
+         recipients_[recipients_.size() - 2].next = &link;
+   }
+
+   /** @brief Add a header field, or another line of the last one if *name* is empty. */
+   void add_header(std::string_view name, std::string_view value)
+   {
+      FieldValue &field_value = values_.emplace_back();
+      field_value.value = keep(value);
+
+      if (name.empty() && !headers_.empty())
+      {
+         FieldValue *last = headers_.back().value;
+         while (last->next)
+            last = last->next;
+         last->next = &field_value;
+         return;
+      }
+
+      HeaderField &field = headers_.emplace_back();
+      field.name = keep(name);
+      field.value = &field_value;
+
+      if (headers_.size() > 1)
+         headers_[headers_.size() - 2].next = &field;
+   }
+
+   void set_body(std::string body)
+   {
+      // The first line is taken for a section line, as in the batch format:
+      if (body.empty() || body[0] != '\v')
+         body.insert(0, "\n");
+      body_ = std::move(body);
+   }
+
+   /** @brief The recipients, with their rcpt_status after send(). */
+   RecipLink *recipients() { return recipients_.empty() ? nullptr : &recipients_.front(); }
+   const HeaderField *headers() const { return headers_.empty() ? nullptr : &headers_.front(); }
+   const std::string &body() const { return body_; }
+
+private:
+   const char *keep(std::string_view text) { return strings_.emplace_back(text).c_str(); }
+
+   // Elements of a deque stay in place as it grows, and when it is moved:
+   std::deque<std::string> strings_;
+   std::deque<RecipLink>   recipients_;
+   std::deque<FieldValue>  values_;
+   std::deque<HeaderField> headers_;
+   std::string             body_;
+};
+
+/**
+ * @brief An SMTP session on a non-blocking socket.
+ *
+ * Each connection has its own copy of the settings MParcel, which
+ * keeps the server's capabilities and renders its messages.
+ */
+class Connection
+{
+public:
+   /**
+    * @brief Connect to MParcel::host_url and host_port, and read the
+    *        greeting and the EHLO reply, with STARTTLS and a second
+    *        EHLO if MParcel::starttls.
+    *
+    * Like the library, addresses are tried in the resolver's order,
+    * and the connection uses no TLS unless the server offers STARTTLS,
+    * which is an Error if MParcel::starttls asked for it.
+    */
+   static Task<std::unique_ptr<Connection>> connect(Loop &loop, const MParcel &settings)
+   {
+      std::unique_ptr<Connection> connection(new Connection(loop, settings));
+      MParcel &parcel = connection->parcel_;
+
+      co_await connection->open();
+
+      Reply greeting = co_await connection->read_reply();
+      if (!greeting.ok())
+         throw Error("The server refused the session: " + greeting.text, greeting.status);
+
+      co_await connection->greet();
+
+      if (parcel.starttls)
+      {
+         if (!parcel.caps.cap_starttls)
+            throw Error(std::string(parcel.host_url) + " doesn't offer STARTTLS.");
+
+         co_await connection->start_tls();
+
+         // The capabilities may change with TLS:
+         co_await connection->greet();
+      }
+
+      co_return connection;
+   }
+
+   ~Connection()
+   {
+      if (ssl_)
+         SSL_free(ssl_);
+      if (socket_handle_ >= 0)
+         close(socket_handle_);
+      rb_free(&rendered_);
+      rb_free(&commands_);
+   }
+
+   Connection(const Connection&) = delete;
+   Connection &operator=(const Connection&) = delete;
+
+   const SmtpCaps &caps() const { return parcel_.caps; }
+   bool secure() const { return ssl_ != nullptr; }
+   MParcel &parcel() { return parcel_; }
+
+   /**
+    * @brief Log in with AUTH PLAIN, or AUTH LOGIN if the server doesn't
+    *        offer PLAIN, as mcb_smtp_authorize_session(), if the settings
+    *        have a login.
+    */
+   Task<void> authorize()
+   {
+      if (!parcel_.login)
+         co_return;
+
+      const char *password = parcel_.password ? parcel_.password : "";
+
+      if (parcel_.caps.cap_auth_plain)
+      {
+         // The login and the password, each after a \0 (RFC 4616):
+         std::string credentials = std::string(1, '\0') + parcel_.login + '\0' + password;
+
+         Reply reply = co_await command("AUTH PLAIN " + encode(credentials));
+         if (!reply.ok())
+            throw Error(std::string("For login name, ") + parcel_.login
+                        + ", the password was not accepted by the server. " + reply.text,
+                        reply.status);
+         co_return;
+      }
+
+      if (!parcel_.caps.cap_auth_login)
+         throw Error(std::string(parcel_.host_url) + " doesn't offer AUTH PLAIN or LOGIN.");
+
+      Reply reply = co_await command("AUTH LOGIN");
+      if (reply.status / 100 != 3)
+         throw Error("Authorization request failed with " + reply.text, reply.status);
+
+      reply = co_await command(encode(parcel_.login));
+      if (reply.status / 100 != 3)
+         throw Error(std::string("Login name, ") + parcel_.login + ", not accepted by the server. " + reply.text,
+                     reply.status);
+
+      reply = co_await command(encode(password));
+      if (!reply.ok())
+         throw Error(std::string("For login name, ") + parcel_.login
+                     + ", the password was not accepted by the server. " + reply.text,
+                     reply.status);
+   }
+
+   /** @brief Send a command line, without its CRLF, and read the reply. */
+   Task<Reply> command(std::string line)
+   {
+      line += "\r\n";
+      co_await write(line);
+      co_return co_await read_reply();
+   }
+
+   /**
+    * @brief Send one message, in as many transactions as the server's
+    *        recipient limit needs.
+    *
+    * The envelope is the library's, from mcb_smtp_envelope_start(), so
+    * MAIL FROM declares SIZE=, BODY=8BITMIME and SMTPUTF8 as the server
+    * takes them, the recipients are split by smtp_rcpt_limit() and
+    * 452 replies, and MParcel::rate_limits paces the commands, the
+    * coroutine sleeping for their tokens.  With PIPELINING, each
+    * envelope goes in one write, and the content and its final "." in
+    * another.
+    *
+    * Every recipient's reply is left in its RecipLink::rcpt_status,
+    * replaced by the verdict on the content for those that were
+    * accepted if it is a refusal.  A message over the server's SIZE
+    * limit isn't sent: its recipients get 552.
+    *
+    * @return The verdict on the content, or the reply that ended the
+    *         transaction before it; of the first transaction that
+    *         failed, if any did.
+    */
+   Task<int> send(Message &message)
+   {
+      RecipLink    *recipients = message.recipients();
+      RecipLink    *rptr;
+      SmtpEnvelope envelope;
+      int          status, result = 0;
+
+      if (!recipients)
+         throw Error("A message without recipients can't be sent.");
+
+      render(message);
+
+      if (parcel_.caps.cap_size && rendered_.len > (size_t)parcel_.caps.cap_size)
+      {
+         for (rptr = recipients; rptr; rptr = rptr->next)
+            if (rptr->rtype != RT_SKIP)
+               rptr->rcpt_status = 552;
+         co_return 552;
+      }
+
+      for (rptr = recipients; rptr; rptr = envelope.next)
+      {
+         mcb_smtp_envelope_start(&parcel_, &envelope, rptr);
+         co_await send_envelope(envelope);
+
+         if (envelope.ready && envelope.send_data)
+         {
+            co_await write(std::string_view(rendered_.data, rendered_.len), ".\r\n");
+            Reply verdict = co_await read_reply();
+            status = mcb_smtp_envelope_verdict(&parcel_, &envelope, verdict.text.c_str());
+         }
+         else
+         {
+            co_await command("RSET");
+            status = envelope.ready ? 250 : envelope.reply_status;
+         }
+
+         if (!result || result / 100 == 2)
+            result = status;
+      }
+
+      co_return result;
+   }
+
+   /** @brief End the session, with a close_notify alert after TLS. */
+   Task<void> quit()
+   {
+      co_await command("QUIT");
+
+      if (ssl_)
+      {
+         SSL_shutdown(ssl_);
+
+         // The server may not wait for it:
+         try
+         {
+            co_await flush_cipher();
+         }
+         catch (const Error&)
+         {
+         }
+      }
+   }
+
+private:
+   Connection(Loop &loop, const MParcel &settings) : loop_(loop), parcel_(settings)
+   {
+      parcel_.stalker = nullptr;
+      parcel_.pending_message = nullptr;
+      parcel_.mx_delivery = nullptr;
+      parcel_.chunked_transfer = 0;   // the content always follows DATA
+      memset(&parcel_.caps, 0, sizeof(parcel_.caps));
+      memset(&parcel_.replies, 0, sizeof(parcel_.replies));
+      rb_init(&rendered_);
+      rb_init(&commands_);
+   }
+
+   /** @brief Connect to the host's addresses in turn, until one accepts. */
+   Task<void> open()
+   {
+      ResolvedAddr addrs[RSV_MAX_ADDRS];
+      int          count, index, gai_error = 0, error = 0;
+      socklen_t    error_len;
+      int          nodelay = 1;
+
+      if (!(count = rsv_resolve(parcel_.host_url, parcel_.host_port, addrs, RSV_MAX_ADDRS, &gai_error)))
+         throw Error(std::string("Failed to resolve ") + parcel_.host_url + ", " + gai_strerror(gai_error));
+
+      for (index = 0; index < count; ++index)
+      {
+         const ResolvedAddr &addr = addrs[index];
+         auto started = std::chrono::steady_clock::now();
+
+         socket_handle_ = socket(addr.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+         if (socket_handle_ < 0)
+            continue;
+
+         if (::connect(socket_handle_, (const struct sockaddr*)&addr.addr, addr.addrlen))
+         {
+            if (errno == EINPROGRESS)
+            {
+               co_await loop_.writable(socket_handle_);
+
+               error_len = sizeof(error);
+               if (getsockopt(socket_handle_, SOL_SOCKET, SO_ERROR, &error, &error_len))
+                  error = errno;
+            }
+            else
+               error = errno;
+         }
+         else
+            error = 0;
+
+         auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+         rsv_report(parcel_.host_url, parcel_.host_port, &addr, !error, (unsigned int)usecs.count());
+
+         if (!error)
+         {
+            setsockopt(socket_handle_, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            co_return;
+         }
+
+         close(socket_handle_);
+         socket_handle_ = -1;
+      }
+
+      throw Error(std::string("Failed to connect to ") + parcel_.host_url + ", "
+                  + strerror(error ? error : ECONNREFUSED));
+   }
+
+   /** @brief Send EHLO, and take the capabilities from the reply. */
+   Task<void> greet()
+   {
+      Reply reply = co_await command(std::string("EHLO ")
+                                     + (parcel_.helo_name ? parcel_.helo_name : parcel_.host_url));
+      if (!reply.ok())
+         throw Error("EHLO was refused: " + reply.text, reply.status);
+
+      mcb_smtp_parse_ehlo_reply(&parcel_, reply.text.data(), (int)reply.text.size());
+   }
+
+   /** @brief Send STARTTLS, and perform the handshake through memory BIOs. */
+   Task<void> start_tls()
+   {
+      int result;
+
+      Reply reply = co_await command("STARTTLS");
+      if (!reply.ok())
+         throw Error("STARTTLS failed: " + reply.text, reply.status);
+
+      // Anything read past the reply would have been injected before TLS:
+      if (!unread().empty())
+         throw Error("The server sent data ahead of the TLS handshake.");
+
+      if (!(ssl_ = SSL_new(loop_.tls_context())))
+         throw Error("Failed to create a new SSL instance.");
+
+      read_bio_ = BIO_new(BIO_s_mem());
+      write_bio_ = BIO_new(BIO_s_mem());
+      if (!read_bio_ || !write_bio_)
+      {
+         BIO_free(read_bio_);
+         BIO_free(write_bio_);
+         throw Error("Failed to create memory BIOs.");
+      }
+
+      // An empty read BIO means "wait for more", not end of file:
+      BIO_set_mem_eof_return(read_bio_, -1);
+
+      // The SSL owns the BIOs from here:
+      SSL_set_bio(ssl_, read_bio_, write_bio_);
+      SSL_set_connect_state(ssl_);
+      SSL_set_tlsext_host_name(ssl_, parcel_.host_url);
+
+      // The client's Finished message is left waiting, to go with EHLO:
+      while ((result = SSL_connect(ssl_)) != 1)
+      {
+         if (SSL_get_error(ssl_, result) != SSL_ERROR_WANT_READ)
+            throw Error("The TLS handshake failed.");
+
+         co_await flush_cipher();
+         co_await fill_cipher();
+      }
+   }
+
+   /** @brief Read a whole reply, the last line being "nnn " or short. */
+   Task<Reply> read_reply()
+   {
+      Reply       reply;
+      size_t      eol;
+      char        *buffer;
+      std::string_view line;
+
+      while (1)
+      {
+         while ((eol = input_.find('\n', input_pos_)) == std::string::npos)
+         {
+            input_.erase(0, input_pos_);
+            input_pos_ = 0;
+
+            size_t used = input_.size();
+            input_.resize(used + MCB_CORO_READ_LEN);
+            buffer = input_.data() + used;
+            input_.resize(used + co_await read_some(buffer, MCB_CORO_READ_LEN));
+         }
+
+         line = std::string_view(input_).substr(input_pos_, eol + 1 - input_pos_);
+         input_pos_ = eol + 1;
+         reply.text.append(line);
+
+         if (line.size() < 4 || line[3] != '-')
+         {
+            reply.status = atoi(reply.text.c_str() + reply.text.size() - line.size());
+            break;
+         }
+      }
+
+      if (input_pos_ == input_.size())
+      {
+         input_.clear();
+         input_pos_ = 0;
+      }
+
+      co_return reply;
+   }
+
+   std::string_view unread() const { return std::string_view(input_).substr(input_pos_); }
+
+   /** @brief Send plaintext, through TLS once it has started, in one write. */
+   Task<void> write(std::string_view data, std::string_view more = {})
+   {
+      if (!ssl_)
+      {
+         co_await write_raw(data, more);
+         co_return;
+      }
+
+      for (std::string_view part : { data, more })
+      {
+         while (!part.empty())
+         {
+            int written = SSL_write(ssl_, part.data(), part.size() > INT32_MAX ? INT32_MAX : (int)part.size());
+            if (written <= 0)
+               throw Error("Writing through TLS failed.");
+
+            part.remove_prefix(written);
+            if (BIO_ctrl_pending(write_bio_) >= MCB_CORO_FLUSH_LEN)
+               co_await flush_cipher();
+         }
+      }
+
+      co_await flush_cipher();
+   }
+
+   /** @brief Send to the socket, waiting while it is full. */
+   Task<void> write_raw(std::string_view data, std::string_view more = {})
+   {
+      struct iovec  iov[2];
+      struct msghdr msg = {};
+      ssize_t       sent;
+
+      while (!data.empty() || !more.empty())
+      {
+         iov[0].iov_base = (void*)data.data();
+         iov[0].iov_len = data.size();
+         iov[1].iov_base = (void*)more.data();
+         iov[1].iov_len = more.size();
+         msg.msg_iov = iov;
+         msg.msg_iovlen = 2;
+
+         if ((sent = sendmsg(socket_handle_, &msg, MSG_NOSIGNAL)) < 0)
+         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+               co_await loop_.writable(socket_handle_);
+            else if (errno != EINTR)
+               throw Error(std::string("Sending to ") + parcel_.host_url + " failed, " + strerror(errno));
+            continue;
+         }
+
+         size_t from_data = (size_t)sent < data.size() ? (size_t)sent : data.size();
+         data.remove_prefix(from_data);
+         more.remove_prefix((size_t)sent - from_data);
+      }
+   }
+
+   /** @brief Read what has arrived from the socket, waiting for some. */
+   Task<size_t> read_raw(char *buffer, size_t buffer_len)
+   {
+      ssize_t received;
+
+      while ((received = recv(socket_handle_, buffer, buffer_len, 0)) <= 0)
+      {
+         if (!received)
+            throw Error(std::string(parcel_.host_url) + " closed the connection.");
+         else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            co_await loop_.readable(socket_handle_);
+         else if (errno != EINTR)
+            throw Error(std::string("Reading from ") + parcel_.host_url + " failed, " + strerror(errno));
+      }
+
+      co_return (size_t)received;
+   }
+
+   /** @brief Read plaintext, decrypting what has arrived once TLS has started. */
+   Task<size_t> read_some(char *buffer, size_t buffer_len)
+   {
+      int result;
+
+      if (!ssl_)
+         co_return co_await read_raw(buffer, buffer_len);
+
+      while ((result = SSL_read(ssl_, buffer, buffer_len > INT32_MAX ? INT32_MAX : (int)buffer_len)) <= 0)
+      {
+         if (SSL_get_error(ssl_, result) != SSL_ERROR_WANT_READ)
+            throw Error(std::string("The TLS session with ") + parcel_.host_url + " failed.");
+
+         // A key update, for one, may be waiting to go:
+         co_await flush_cipher();
+         co_await fill_cipher();
+      }
+
+      co_return (size_t)result;
+   }
+
+   /** @brief Send the ciphertext waiting in the write BIO. */
+   Task<void> flush_cipher()
+   {
+      char *data;
+      long len = BIO_get_mem_data(write_bio_, &data);
+
+      if (len > 0)
+         co_await write_raw(std::string_view(data, len));
+
+      (void)BIO_reset(write_bio_);
+   }
+
+   /** @brief Give OpenSSL the ciphertext that has arrived, waiting for some. */
+   Task<void> fill_cipher()
+   {
+      cipher_.resize(MCB_CORO_READ_LEN);
+      size_t received = co_await read_raw(cipher_.data(), cipher_.size());
+
+      if ((int)received != BIO_write(read_bio_, cipher_.data(), (int)received))
+         throw Error("Failed to pass ciphertext to OpenSSL.");
+   }
+
+   /**
+    * @brief Send the envelope's commands as the library's steps leave
+    *        them in commands_, and pass it the replies.
+    *
+    * A failure of the connection ends the envelope, as in
+    * smtp_send_envelope(), before it is thrown.
+    */
+   Task<void> send_envelope(SmtpEnvelope &envelope)
+   {
+      STalker talker;
+      int     due;
+
+      init_buffer_talker(&talker, &commands_);
+
+      try
+      {
+         while (1)
+         {
+            rb_reset(&commands_);
+            parcel_.stalker = &talker;
+            due = mcb_smtp_envelope_write(&parcel_, &envelope);
+            parcel_.stalker = nullptr;
+
+            if (commands_.failed)
+               throw Error("Out of memory for the envelope.");
+            if (commands_.len)
+               co_await write(std::string_view(commands_.data, commands_.len));
+
+            if (due)
+            {
+               while (due--)
+               {
+                  Reply reply = co_await read_reply();
+                  mcb_smtp_envelope_reply(&parcel_, &envelope, reply.text.c_str());
+               }
+            }
+            else if (envelope.wait_usecs)
+               co_await loop_.sleep(std::chrono::microseconds(envelope.wait_usecs));
+            else
+               break;
+         }
+      }
+      catch (const Error&)
+      {
+         mcb_smtp_envelope_fail(&parcel_, &envelope);
+         throw;
+      }
+   }
+
+   /**
+    * @brief Render the message into rendered_, the DATA content without
+    *        its ".", classified as mcb_send_email_body() would for
+    *        MAIL FROM and the mime borders.
+    */
+   void render(Message &message)
+   {
+      char           buffer[4096];
+      BuffControl    bc;
+      BCMemorySource source = { message.body().data(), message.body().data() + message.body().size() };
+      ContentClass   content_class;
+      EmailBody      body = { &bc, mcb_basic_line_judger, mcb_basic_section_printer,
+                              NULL, NULL, message.body().size(), &content_class, NULL };
+
+      const char     *line;
+      int            line_len;
+
+      cl_init(&content_class);
+      cl_scan(&content_class, message.body().data(), message.body().size());
+      mcb_smtp_classify_message(&parcel_, message.recipients(), message.headers(), &body);
+
+      init_buff_control(&bc, buffer, sizeof(buffer), bc_memory_reader, &source);
+
+      // Make the section line current, as mcb_send_email_simple() leaves it:
+      bc_get_next_line(&bc, &line, &line_len);
+
+      rb_reset(&rendered_);
+      if (!mcb_render_message(&parcel_, message.recipients(), message.headers(), &body, &rendered_))
+         throw Error("Out of memory to render a message.");
+
+      parcel_.message_size = rendered_.len;
+   }
+
+   static std::string encode(std::string_view text)
+   {
+      uint32_t buffer[256];
+
+      if (text.size() > sizeof(buffer) / 4 * 3 - 3)
+         throw Error("Credentials too long to encode.");
+
+      c64_encode_to_buffer(text.data(), text.size(), buffer, sizeof(buffer));
+      return std::string((const char*)buffer);
+   }
+
+   Loop              &loop_;
+   MParcel           parcel_;
+   int               socket_handle_ = -1;
+   SSL               *ssl_ = nullptr;
+   BIO               *read_bio_ = nullptr;
+   BIO               *write_bio_ = nullptr;
+   std::string       input_;         // plaintext read ahead of the replies consumed
+   size_t            input_pos_ = 0;
+   std::vector<char> cipher_;
+   RenderBuffer      rendered_;
+   RenderBuffer      commands_;      // the envelope's commands, before they are written
+};
+
+}  // namespace mcb
+
+#endif  // MAILCB_HPP
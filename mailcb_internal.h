@@ -11,27 +11,121 @@
 
 #include "socktalk.h"
 #include "mailcb.h"
+#include "dotstuff.h"
 
 /** Utility function for mcb_make_guid(). */
 void hexify_digit(char *target, uint8_t value);
 
 /** Functions that support establishing a connection. */
 void log_ssl_error(MParcel *parcel, const SSL *ssl, int ret);
-int get_connected_socket(const char *host_url, int port);
+int get_connected_socket(MParcel *parcel, const char *host_url, int port);
 void open_ssl(MParcel *parcel, int socket_handle, ServerReady talker_user);
+void ssl_init_library(void);
+SSL_CTX *ssl_new_context(MParcel *parcel);
+SSL *ssl_start(MParcel *parcel, SSL_CTX *context, int socket_handle);
 
 
 /** SMTP server access functions */
 void smtp_initialize_session(MParcel *parcel);
+const char *smtp_helo_name(const MParcel *parcel);
+int smtp_take_replies(SmtpReplies *replies, int count, char *buffer, int buffer_len);
+int smtp_read_reply(MParcel *parcel, char *buffer, int buffer_len);
+void smtp_discard_replies(MParcel *parcel);
 void smtp_parse_capability_response(MParcel *parcel, const char *line, int line_len);
 void smtp_parse_greeting_response(MParcel *parcel, const char *buffer, int buffer_len);
 
 int rcpt_status_ok(const RecipLink *rlink);
 
-int smtp_send_envelope(MParcel *parcel, RecipLink *recipients);
+/**
+ * @brief A message whose end-of-data reply is still to be read.
+ *
+ * Holds copies of the recipients, since the caller's chain is gone by
+ * the time the reply arrives, see MParcel::pipeline_messages.
+ */
+typedef struct _pending_message
+{
+   RecipLink *recipients;   // the whole chain, for MParcel::report_recipients
+   RecipLink *batch;        // the recipients of the final transaction
+} PendingMessage;
+
+/** What mcb_smtp_envelope_write() does next, see SmtpEnvelope::stage. */
+typedef enum _smtp_envelope_stage
+{
+   SE_MAIL = 0,      // send MAIL FROM
+   SE_RCPT,          // send the next RCPT TO, or end the recipients
+   SE_DATA,          // send DATA, or end without it
+   SE_REPLIES,       // wait for the replies due
+   SE_CLOSE_EMPTY,   // send the "." of an empty message, see smtp_envelope_end_pipelined()
+   SE_CLOSING,       // wait for its reply
+   SE_DONE
+} SmtpEnvelopeStage;
+
+int smtp_rcpt_limit(const MParcel *parcel);
+int smtp_reply_too_many_recipients(int reply_status, const char *reply);
+void smtp_answer_recipients(RecipLink *recipients, int reply_status);
+int smtp_judge_rcpt_reply(MParcel *parcel, RecipLink *rlink, const char *reply, int rcpts_before, RecipLink **next);
+void smtp_send_mail_from(MParcel *parcel);
+int smtp_message_has_utf8(const MParcel *parcel,
+                          const RecipLink *recipients,
+                          const HeaderField *headers);
+void smtp_classify_message(MParcel *parcel,
+                           const RecipLink *recipients,
+                           const HeaderField *headers,
+                           const EmailBody *body,
+                           int allow_8bit);
+void smtp_clear_classification(MParcel *parcel);
+size_t smtp_estimate_size(MParcel *parcel,
+                          RecipLink *recipients,
+                          const HeaderField *headers,
+                          const EmailBody *body);
+int smtp_size_fits(MParcel *parcel, RecipLink *recipients, const RecipLink *stop);
+int smtp_send_envelope(MParcel *parcel, RecipLink *recipients, RecipLink **next);
+int smtp_envelope_pace(MParcel *parcel, SmtpEnvelope *envelope, const char *recipient);
+void smtp_envelope_mail_reply(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply);
+void smtp_envelope_rcpt_reply(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply);
+int smtp_envelope_judging(SmtpEnvelope *envelope);
+void smtp_envelope_end_pipelined(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply);
+int smtp_send_rendered(MParcel *parcel, const RenderBuffer *rb);
+int smtp_finish_data(MParcel *parcel, RecipLink *recipients, const RecipLink *stop);
+int smtp_read_data_verdict(MParcel *parcel, RecipLink *recipients, const RecipLink *stop);
+int smtp_judge_data_verdict(MParcel *parcel, RecipLink *recipients, const RecipLink *stop, const char *reply);
+void smtp_fail_transaction(RecipLink *recipients, const RecipLink *stop, int reply_status);
+int smtp_defer_data_verdict(MParcel *parcel, const RecipLink *recipients, const RecipLink *batch);
+int smtp_reset_transaction(MParcel *parcel);
+int smtp_authorize_plain(MParcel *parcel);
 int smtp_send_headers(MParcel *parcel,
                      RecipLink *recipients,
-                     const HeaderField *headers);
+                     const HeaderField *headers,
+                     const EmailBody *body);
+void smtp_send_message_id(MParcel *parcel, const HeaderField *headers);
+int smtp_write_headers(MParcel *parcel,
+                       RecipLink *recipients,
+                       const HeaderField *headers,
+                       const EmailBody *body,
+                       int only_accepted);
+void smtp_send_body(MParcel *parcel, const EmailBody *body);
+
+/**
+ * @brief Staging buffer that sends DATA content in large, dot-stuffed blocks.
+ *
+ * Lines are collected with their CRLFs and written when the buffer
+ * fills, rather than with two writes per line.
+ */
+typedef struct _body_block
+{
+   char       buffer[8192];
+   int        len;
+   DotStuffer stuffer;
+} BodyBlock;
+
+void body_block_init(BodyBlock *bb);
+void body_block_add_line(MParcel *parcel, BodyBlock *bb, const char *line, int line_len);
+void body_block_add_qp_line(MParcel *parcel,
+                            BodyBlock *bb,
+                            PCBuff *encoded,
+                            const char *line,
+                            int line_len);
+void body_block_flush(MParcel *parcel, BodyBlock *bb);
 
 /** POP server access functions */
 
@@ -1,30 +1,19 @@
 #include <code64.h>
+#include <stdlib.h>       // for malloc(), free()
 #include <string.h>
+#include <strings.h>      // for strcasecmp()
 
 #include "socktalk.h"
 #include "mailcb.h"
 #include "commparcel.h"
+#include "ratelimit.h"
+#include "tlsmem.h"
+#include "uring.h"
 
 #include "mailcb_internal.h"
 
 
 
-CapString capstrings[] = {
-   /* {"AUTH",                 4, set_auth}, */
-   {"SIZE",                 4, set_size},
-   {"STARTTLS",             8, set_starttls},
-   {"ENHANCEDSTATUSCODES", 19, set_enhancedstatuscodes},
-   {"8BITMIME",             8, set_8bitmime},
-   {"7BITMIME",             8, set_7bitmime},
-   {"PIPELINING",          10, set_pipelining},
-   {"SMTPUTF8",             8, set_smtputf8},
-   {"CHUNKING",             8, set_chunking}
-};
-
-int capstrings_count = sizeof(capstrings) / sizeof(CapString);
-const CapString *capstring_end = &capstrings[sizeof(capstrings) / sizeof(CapString)];
-
-
 /**
  * @brief Send EHLO and process the response to the MParcel Caps member.
  */
@@ -33,24 +22,132 @@ void smtp_initialize_session(MParcel *parcel)
    char buffer[1024];
    int bytes_read;
 
-   mcb_send_data(parcel, "EHLO ", parcel->host_url, NULL);
+   mcb_send_data(parcel, "EHLO ", smtp_helo_name(parcel), NULL);
    bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
    smtp_parse_greeting_response(parcel, buffer, bytes_read);
 }
 
 /**
- * @brief Used by smtp_parse_greeting_response() to interpret the EHLO response.
+ * @brief The name to announce in EHLO: MParcel::helo_name if set, otherwise the host.
  */
-void smtp_parse_capability_response(MParcel *parcel, const char *line, int line_len)
+const char *smtp_helo_name(const MParcel *parcel)
+{
+   return parcel->helo_name ? parcel->helo_name : parcel->host_url;
+}
+
+/**
+ * @brief Move the first *count* bytes of read-ahead into *buffer*, as
+ *        much as fits, and drop them from the read-ahead.
+ *
+ * @return Bytes copied to *buffer*.
+ */
+int smtp_take_replies(SmtpReplies *replies, int count, char *buffer, int buffer_len)
+{
+   int copied = count < buffer_len ? count : buffer_len;
+
+   memcpy(buffer, replies->data, copied);
+   memmove(replies->data, &replies->data[count], replies->len - count);
+   replies->len -= count;
+
+   return copied;
+}
+
+/**
+ * @brief Read one complete, possibly multi-line, reply.
+ *
+ * Unlike mcb_recv_data(), which returns whatever a single read
+ * produces, this function keeps reading until the final line of the
+ * reply.  Anything that arrives after it, like the replies to
+ * pipelined commands, is kept in MParcel::replies for the next call.
+ * Lines that don't fit in *buffer* are dropped.
+ *
+ * @return Bytes in *buffer*, with a terminating \0 added.  0 if the
+ *         connection closed or failed before the reply was complete.
+ */
+int smtp_read_reply(MParcel *parcel, char *buffer, int buffer_len)
 {
-   const CapString *ptr = capstrings;
-   while (ptr < capstring_end)
+   SmtpReplies *replies = &parcel->replies;
+   const char *line, *eol, *end;
+   int copied = 0;
+   int bytes_read;
+
+   while (1)
    {
-      if (0 == strncmp(line, ptr->str, ptr->len))
-         (*ptr->set_cap)(parcel, line, ptr->len);
+      line = replies->data;
+      end = replies->data + replies->len;
+
+      while ((eol = memchr(line, '\n', end - line)))
+      {
+         // A hyphen after the status marks a line with more to follow:
+         int last = (eol - line < 4) || line[3] != '-';
+         line = eol + 1;
+
+         if (last)
+         {
+            copied += smtp_take_replies(replies,
+                                        line - replies->data,
+                                        &buffer[copied],
+                                        buffer_len - copied - 1);
+            buffer[copied] = '\0';
+            return copied;
+         }
+      }
+
+      if (replies->len == sizeof(replies->data))
+      {
+         // Make room by collecting the complete lines so far:
+         if (line == replies->data)
+            break;   // a single line too long for SMTP
+         copied += smtp_take_replies(replies,
+                                     line - replies->data,
+                                     &buffer[copied],
+                                     buffer_len - copied - 1);
+      }
 
-      ++ptr;
+      bytes_read = (*parcel->stalker->reader)(parcel->stalker,
+                                              &replies->data[replies->len],
+                                              sizeof(replies->data) - replies->len);
+      if (bytes_read <= 0)
+         break;
+
+      replies->len += bytes_read;
+      parcel->total_read += bytes_read;
    }
+
+   smtp_discard_replies(parcel);
+   buffer[0] = '\0';
+   return 0;
+}
+
+/**
+ * @brief Forget any read-ahead.
+ *
+ * For when the connection changes, and after STARTTLS, where bytes
+ * that came before the TLS handshake must not pass for replies that
+ * followed it.
+ */
+void smtp_discard_replies(MParcel *parcel)
+{
+   parcel->replies.len = 0;
+}
+
+/**
+ * @brief Used by smtp_parse_greeting_response() to interpret an EHLO response line.
+ *
+ * The keyword is identified with a single dispatch, then its parameters
+ * (like the SIZE value or the AUTH mechanism list) go to its setter.
+ */
+void smtp_parse_capability_response(MParcel *parcel, const char *line, int line_len)
+{
+   int keyword_len = sk_keyword_len(line, line_len);
+   const char *params = line + keyword_len;
+   const char *end = line + line_len;
+
+   // Skip the space, or the '=' of the obsolete "AUTH=LOGIN" form:
+   while (params < end && (*params == ' ' || *params == '='))
+      ++params;
+
+   set_keyword(parcel, smtp_keyword_lookup(line, keyword_len), params, end - params);
 }
 
 /**
@@ -85,12 +182,7 @@ void smtp_parse_greeting_response(MParcel *parcel, const char *buffer, int buffe
             break;
          default:
             if (status == 250)
-            {
-               if (0 == strncmp(line, "AUTH", 4))
-                  set_auth(parcel, line, line_len);
-               else
-                  smtp_parse_capability_response(parcel, line, line_len);
-            }
+               smtp_parse_capability_response(parcel, line, line_len);
 
             ptr += advance_chars;
             break;
@@ -99,79 +191,909 @@ void smtp_parse_greeting_response(MParcel *parcel, const char *buffer, int buffe
 }
 
 /**
- * @brief Improved function that individually tracks address acceptance.
+ * @brief The most recipients to send in one transaction, 0 for no limit.
+ *
+ * The smallest of MParcel::max_rcpt_per_transaction, the server's
+ * LIMITS RCPTMAX, and the limit the server revealed with a 452 reply.
  */
-int smtp_send_envelope(MParcel *parcel, RecipLink *recipients)
+int smtp_rcpt_limit(const MParcel *parcel)
 {
-   if (!recipients)
+   int candidates[3] = { parcel->max_rcpt_per_transaction,
+                         parcel->caps.cap_limits_rcptmax,
+                         parcel->caps.cap_rcpt_limit_seen };
+   int i, limit = 0;
+
+   for (i=0; i < 3; ++i)
+      if (candidates[i] > 0 && (limit == 0 || candidates[i] < limit))
+         limit = candidates[i];
+
+   return limit;
+}
+
+/**
+ * @brief Returns 1 if a RCPT TO reply means the transaction can take no more recipients.
+ *
+ * RFC 5321 section 4.5.3.1.10 prescribes 452 for "too many
+ * recipients".  Servers also use 452 for a full mailbox, which is
+ * told apart by an enhanced status code other than 4.5.3.
+ */
+int smtp_reply_too_many_recipients(int reply_status, const char *reply)
+{
+   if (reply_status != 452)
       return 0;
 
-   char buffer[1024];
-   RecipLink *ptr = recipients;
-   int bytes_read;
-   int recipients_accepted = 0;
-   int reply_status;
-   mcb_send_data(parcel, "MAIL FROM: <", parcel->from, ">", NULL);
-   bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
+   const char *text = reply + 3;
+   while (*text == ' ' || *text == '-')
+      ++text;
 
-   reply_status = atoi(buffer);
-   if (reply_status >= 200 && reply_status < 300)
+   // No enhanced status code to say otherwise:
+   if (text[0] < '0' || text[0] > '9' || text[1] != '.')
+      return 1;
+
+   return 0 == strncmp(text, "4.5.3", 5);
+}
+
+/**
+ * @brief Give every recipient from *recipients* on the reply that
+ *        turned the whole transaction down.
+ *
+ * The message won't go to them in another transaction, so like a
+ * RCPT TO refusal, the reply is their verdict, and a journal sees
+ * that the server answered.
+ */
+void smtp_answer_recipients(RecipLink *recipients, int reply_status)
+{
+   for (; recipients; recipients = recipients->next)
+      if (recipients->rtype != RT_SKIP)
+         recipients->rcpt_status = reply_status;
+}
+
+/**
+ * @brief Record the server's reply to RCPT TO in the recipient's link.
+ *
+ * @param rcpts_before  Recipients sent earlier in this transaction.
+ * @param next          Set to *rlink* if it must wait for another transaction.
+ *
+ * @return 1 if accepted, 0 if turned down, -1 if the transaction can
+ *         take no more recipients.
+ */
+int smtp_judge_rcpt_reply(MParcel *parcel, RecipLink *rlink, const char *reply, int rcpts_before, RecipLink **next)
+{
+   int reply_status = atoi(reply);
+
+   if (smtp_reply_too_many_recipients(reply_status, reply))
    {
-      while (ptr)
+      rlink->rcpt_status = 0;
+
+      if (rcpts_before > 0)
       {
-         if (ptr->rtype != RT_SKIP)
-         {
-            mcb_send_data(parcel, "RCPT TO: <", ptr->address, ">", NULL);
+         // Remember the limit for the rest of the session:
+         parcel->caps.cap_rcpt_limit_seen = rcpts_before;
+         *next = rlink;
+      }
+      else
+      {
+         mcb_log_message(parcel,
+                         "Server took no recipients, starting with ",
+                         rlink->address,
+                         ", \"",
+                         reply,
+                         "\"",
+                         NULL);
+         smtp_answer_recipients(rlink, reply_status);
+      }
+      return -1;
+   }
 
-            bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
-            buffer[bytes_read] = '\0';
+   rlink->rcpt_status = reply_status;
 
-            reply_status = atoi(buffer);
-            ptr->rcpt_status = reply_status;
+   if (reply_status >= 200 && reply_status < 300)
+      return 1;
 
-            if (reply_status >= 200 && reply_status < 300)
-               ++recipients_accepted;
-            else
-               mcb_log_message(parcel,
-                               "Recipient, ",
-                               *ptr,
-                               ", was turned down by the server, \"",
-                               buffer,
-                               "\"",
-                               NULL);
-         }
+   mcb_log_message(parcel,
+                   "Recipient, ",
+                   rlink->address,
+                   ", was turned down by the server, \"",
+                   reply,
+                   "\"",
+                   NULL);
+   return 0;
+}
 
-         ptr = ptr->next;
-      }
+/**
+ * @brief Send MAIL FROM, declaring MParcel::message_size if the server
+ *        takes SIZE and the size is known.
+ *
+ * BODY=8BITMIME and SMTPUTF8 are declared, if the server takes them,
+ * for a message with MParcel::body_8bit or MParcel::message_utf8.
+ */
+void smtp_send_mail_from(MParcel *parcel)
+{
+   char size[32];
+   const char *body = "";
+   const char *utf8 = "";
 
-      if (recipients_accepted)
-      {
-         mcb_send_data(parcel, "DATA", NULL);
-         bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
-         reply_status = atoi(buffer);
-         if (reply_status >= 200 && reply_status < 400)
+   *size = '\0';
+   if (parcel->caps.cap_sizeext && parcel->message_size)
+      snprintf(size, sizeof(size), " SIZE=%lu", (unsigned long)parcel->message_size);
+
+   if (parcel->body_8bit && parcel->caps.cap_8bitmime)
+      body = " BODY=8BITMIME";
+
+   if (parcel->message_utf8 && parcel->caps.cap_smtputf8)
+      utf8 = " SMTPUTF8";
+
+   mcb_send_data(parcel, "MAIL FROM: <", parcel->from, ">", size, body, utf8, NULL);
+}
+
+/**
+ * @brief Report if the sender, a recipient, or a header has UTF-8.
+ */
+int smtp_message_has_utf8(const MParcel *parcel,
+                          const RecipLink *recipients,
+                          const HeaderField *headers)
+{
+   const FieldValue *value;
+
+   if (parcel->from && cl_has_8bit(parcel->from, strlen(parcel->from)))
+      return 1;
+
+   for (; recipients; recipients = recipients->next)
+      if (cl_has_8bit(recipients->address, strlen(recipients->address)))
+         return 1;
+
+   for (; headers; headers = headers->next)
+      for (value = headers->value; value; value = value->next)
+         if (cl_has_8bit(value->value, strlen(value->value)))
             return 1;
+
+   return 0;
+}
+
+/**
+ * @brief Choose how the message's content goes out, given what the server takes.
+ *
+ * Content that EmailBody::content_class shows needs no encoding goes
+ * out as it is.  Content that needs encoding is sent in
+ * quoted-printable, since base64 can't be written a line at a time,
+ * but only in mime sections, whose borders declare it.  Lines before
+ * the first border, and the ready-made content of an
+ * EmailBody::writer, can't be re-encoded, so go out as they are.
+ * Without a class, sections declare quoted-printable, as they always
+ * have.
+ *
+ * 8-bit content is declared with BODY=8BITMIME if the server takes
+ * it, in case some of it goes out as it is.
+ *
+ * @param allow_8bit  Every server the message goes to takes 8BITMIME.
+ */
+void smtp_classify_message(MParcel *parcel,
+                           const RecipLink *recipients,
+                           const HeaderField *headers,
+                           const EmailBody *body,
+                           int allow_8bit)
+{
+   const ContentClass *cc = body->content_class;
+   PartEncoding encoding;
+
+   smtp_clear_classification(parcel);
+   parcel->message_utf8 = smtp_message_has_utf8(parcel, recipients, headers);
+
+   if (!cc)
+      return;
+
+   encoding = cl_choose_encoding(cc, allow_8bit);
+   if (encoding == PE_BASE64)
+      encoding = PE_QUOTED_PRINTABLE;
+
+   if (encoding != PE_QUOTED_PRINTABLE || !body->writer)
+   {
+      parcel->body_encoding = encoding;
+      parcel->body_classified = 1;
+   }
+
+   parcel->body_8bit = cc->high_bytes != 0;
+}
+
+/**
+ * @brief Classify a message as mcb_send_email_body() does, for a
+ *        caller that renders and sends it by other means, as do the
+ *        coroutines of mailcb.hpp.
+ *
+ * The choice is for the session's server, and holds until the next
+ * message is classified.
+ */
+void mcb_smtp_classify_message(MParcel *parcel,
+                               const RecipLink *recipients,
+                               const HeaderField *headers,
+                               const EmailBody *body)
+{
+   smtp_classify_message(parcel, recipients, headers, body, parcel->caps.cap_8bitmime);
+}
+
+void smtp_clear_classification(MParcel *parcel)
+{
+   parcel->body_encoding = PE_QUOTED_PRINTABLE;
+   parcel->body_classified = 0;
+   parcel->section_encoded = 0;
+   parcel->body_8bit = 0;
+   parcel->message_utf8 = 0;
+}
+
+/**
+ * @brief Estimate the size of a message for SIZE=, without sending it.
+ *
+ * The headers are rendered, so they are counted exactly.  The content
+ * is EmailBody::size_hint, which is only an estimate, so the whole is
+ * too.
+ *
+ * @return The size in bytes, 0 if the content's size is unknown.
+ */
+size_t smtp_estimate_size(MParcel *parcel,
+                          RecipLink *recipients,
+                          const HeaderField *headers,
+                          const EmailBody *body)
+{
+   STalker *old_talker = parcel->stalker;
+   int old_total_sent = parcel->total_sent;
+   RenderBuffer rb;
+   STalker talker;
+   size_t size;
+
+   if (!body->size_hint)
+      return 0;
+
+   rb_init(&rb);
+   init_buffer_talker(&talker, &rb);
+   parcel->stalker = &talker;
+
+   smtp_write_headers(parcel, recipients, headers, body, 0);
+
+   parcel->stalker = old_talker;
+   parcel->total_sent = old_total_sent;
+
+   size = rb.len + body->size_hint;
+   rb_free(&rb);
+
+   return size;
+}
+
+/**
+ * @brief Refuse, before uploading it, a message larger than the server's SIZE limit.
+ *
+ * The recipients up to *stop* get the status a server would give,
+ * 552, so they count as refused rather than untried.
+ *
+ * @return 1 if the message fits or its size is unknown.
+ */
+int smtp_size_fits(MParcel *parcel, RecipLink *recipients, const RecipLink *stop)
+{
+   char size[24], limit[24];
+
+   if (!parcel->caps.cap_size || !parcel->message_size
+       || parcel->message_size <= (size_t)parcel->caps.cap_size)
+      return 1;
+
+   snprintf(size, sizeof(size), "%lu", (unsigned long)parcel->message_size);
+   snprintf(limit, sizeof(limit), "%d", parcel->caps.cap_size);
+   mcb_log_message(parcel,
+                   "Message of ",
+                   size,
+                   " bytes exceeds the server's SIZE limit of ",
+                   limit,
+                   ", not sent.",
+                   NULL);
+
+   for (; recipients && recipients != stop; recipients = recipients->next)
+      if (recipients->rtype != RT_SKIP)
+         recipients->rcpt_status = 552;
+
+   return 0;
+}
+
+/**
+ * @brief Improved function that individually tracks address acceptance.
+ *
+ * When there are more recipients than one transaction may carry,
+ * either from smtp_rcpt_limit() or because the server answers a RCPT
+ * TO with 452, the envelope stops there and *next* is set to the
+ * first recipient left over.  The caller sends those in another
+ * transaction on the same connection.  Left-over recipients have a
+ * RecipLink::rcpt_status of 0.
+ *
+ * If the server offers PIPELINING, the whole envelope goes out
+ * without waiting, and if a message from MParcel::pipeline_messages
+ * is still waiting for its verdict, that reply comes first and is
+ * read before the envelope's replies.
+ *
+ * With MParcel::chunked_transfer, the envelope ends without DATA, for
+ * content the caller sends with BDAT.
+ *
+ * With MParcel::rate_limits, MAIL FROM and each RCPT TO wait for
+ * their tokens, and their replies adapt the rates, see ratelimit.h.
+ * The pipelined commands written before a wait are sent before it,
+ * even by a talker that holds its writes for the next read.
+ *
+ * The steps are those of mcb_smtp_envelope_start(), with the talker
+ * doing the waiting.
+ *
+ * @return 1 if the server is ready for the DATA content.  If not, the
+ *         caller should reset the transaction before starting another.
+ */
+int smtp_send_envelope(MParcel *parcel, RecipLink *recipients, RecipLink **next)
+{
+   SmtpEnvelope envelope;
+   char buffer[1024];
+   int replies_due, flushed = 0;
+
+   mcb_smtp_envelope_start(parcel, &envelope, recipients);
+
+   while ((replies_due = mcb_smtp_envelope_write(parcel, &envelope)) || envelope.wait_usecs)
+   {
+      if (!replies_due)
+      {
+         // These talkers hold writes for the next read, which would
+         // keep the commands already paced back until every token came:
+         if (!tm_send_waiting(parcel->stalker) || !ur_flush(parcel->stalker))
+            mcb_smtp_envelope_fail(parcel, &envelope);
          else
+            rl_sleep_usecs(envelope.wait_usecs);
+         continue;
+      }
+
+      // The previous message's verdict is the first reply in line:
+      if (!flushed)
+      {
+         mcb_smtp_flush_pipeline(parcel);
+         flushed = 1;
+      }
+
+      while (replies_due--)
+      {
+         if (!smtp_read_reply(parcel, buffer, sizeof(buffer)))
          {
-            buffer[bytes_read] = '\0';
-            mcb_log_message(parcel, "Envelope transmission failed, \"", buffer, "\"", NULL);
+            mcb_smtp_envelope_fail(parcel, &envelope);
+            break;
          }
+
+         mcb_smtp_envelope_reply(parcel, &envelope, buffer);
       }
+   }
+
+   *next = envelope.next;
+   return envelope.ready;
+}
+
+/**
+ * @brief Begin an envelope for *recipients*, to be sent a step at a
+ *        time with mcb_smtp_envelope_write() and mcb_smtp_envelope_reply().
+ *
+ * This is smtp_send_envelope() for a caller that waits on the server
+ * by its own means, like the coroutines of mailcb.hpp.  The commands
+ * go to the parcel's talker, which may be a buffer talker the caller
+ * sends from:
+ *
+ * ~~~
+ * mcb_smtp_envelope_start(parcel, &envelope, recipients);
+ * while ((due = mcb_smtp_envelope_write(parcel, &envelope)) || envelope.wait_usecs)
+ *    if (due)
+ *       (read that many replies, passing each to mcb_smtp_envelope_reply())
+ *    else
+ *       (wait envelope.wait_usecs for a rate limit's token)
+ * ~~~
+ *
+ * Then SmtpEnvelope::ready says if the server awaits the content, as
+ * smtp_send_envelope() returns, SmtpEnvelope::next is its *next*,
+ * and the recipients have the statuses it leaves.
+ */
+void mcb_smtp_envelope_start(MParcel *parcel, SmtpEnvelope *envelope, RecipLink *recipients)
+{
+   memset(envelope, 0, sizeof(SmtpEnvelope));
+
+   envelope->recipients = recipients;
+   envelope->cursor = recipients;
+   envelope->judging = recipients;
+   envelope->stop = recipients;
+   envelope->stage = recipients ? SE_MAIL : SE_DONE;
+   envelope->pipelined = parcel->caps.cap_pipelining;
+   envelope->send_data = !parcel->OnlySendEnvelope && !parcel->chunked_transfer;
+   envelope->limit = smtp_rcpt_limit(parcel);
+}
+
+/**
+ * @brief Send the envelope's next commands: one at a time, or with
+ *        PIPELINING, all of them.
+ *
+ * @return The replies the server now owes, to be read and passed to
+ *         mcb_smtp_envelope_reply() before calling this again.  If 0,
+ *         either SmtpEnvelope::wait_usecs is set, and the next command
+ *         waits that long for its token, or the envelope is over.
+ */
+int mcb_smtp_envelope_write(MParcel *parcel, SmtpEnvelope *envelope)
+{
+   envelope->wait_usecs = 0;
+
+   while (1)
+   {
+      switch (envelope->stage)
+      {
+         case SE_MAIL:
+            if (!smtp_envelope_pace(parcel, envelope, NULL))
+               return 0;
+
+            envelope->mail_issued = envelope->issued;
+            smtp_send_mail_from(parcel);
+            envelope->awaiting_mail = 1;
+            ++envelope->replies_due;
+
+            envelope->stage = envelope->pipelined ? SE_RCPT : SE_REPLIES;
+            break;
+
+         case SE_RCPT:
+            while (envelope->cursor && envelope->cursor->rtype == RT_SKIP)
+               envelope->cursor = envelope->cursor->next;
+
+            if (!envelope->cursor || (envelope->limit && envelope->recipients_sent >= envelope->limit))
+            {
+               // Without pipelining, MAIL FROM was accepted before the first RCPT TO:
+               if (!envelope->pipelined)
+                  envelope->next = envelope->cursor;
+
+               envelope->stage = SE_DATA;
+               break;
+            }
+
+            if (!smtp_envelope_pace(parcel, envelope, envelope->cursor->address))
+               return 0;
+
+            envelope->cursor->rcpt_issued = envelope->issued;
+            mcb_send_data(parcel, "RCPT TO: <", envelope->cursor->address, ">", NULL);
+            ++envelope->recipients_sent;
+            ++envelope->replies_due;
+
+            envelope->cursor = envelope->cursor->next;
+            envelope->stop = envelope->cursor;
+
+            if (!envelope->pipelined)
+               envelope->stage = SE_REPLIES;
+            break;
+
+         case SE_DATA:
+            if (!envelope->pipelined && !envelope->recipients_accepted)
+            {
+               mcb_log_message(parcel, "Emailing aborted for lack of approved recipients.", NULL);
+               envelope->stage = SE_DONE;
+               break;
+            }
+
+            if (envelope->send_data)
+            {
+               mcb_send_data(parcel, "DATA", NULL);
+               envelope->data_sent = 1;
+               ++envelope->replies_due;
+            }
+            else if (!envelope->pipelined)
+            {
+               // Leave the transaction open for the caller to reset, or for BDAT:
+               envelope->ready = 1;
+               envelope->stage = SE_DONE;
+               break;
+            }
+
+            envelope->stage = SE_REPLIES;
+            break;
+
+         case SE_CLOSE_EMPTY:
+            mcb_send_data(parcel, ".", NULL);
+            ++envelope->replies_due;
+            envelope->stage = SE_CLOSING;
+            break;
+
+         case SE_REPLIES:
+         case SE_CLOSING:
+         case SE_DONE:
+            return envelope->replies_due;
+      }
+   }
+}
+
+/**
+ * @brief Take the token for the next command, and report if it may go.
+ *
+ * A token still to come is kept in SmtpEnvelope::due_usecs, with
+ * SmtpEnvelope::wait_usecs set to the time left.
+ */
+int smtp_envelope_pace(MParcel *parcel, SmtpEnvelope *envelope, const char *recipient)
+{
+   long long now;
+
+   if (!envelope->due_usecs)
+   {
+      envelope->issued = rl_reserve(parcel, recipient, &envelope->due_usecs);
+      if (!envelope->due_usecs)
+         return 1;
+   }
+
+   now = rl_now_usecs();
+   if (now < envelope->due_usecs)
+   {
+      envelope->wait_usecs = envelope->due_usecs - now;
+      return 0;
+   }
+
+   envelope->due_usecs = 0;
+   return 1;
+}
+
+/**
+ * @brief Give the envelope the next reply the server owes it, in the
+ *        order of the commands.
+ */
+void mcb_smtp_envelope_reply(MParcel *parcel, SmtpEnvelope *envelope, const char *reply)
+{
+   int reply_status = atoi(reply);
+
+   --envelope->replies_due;
+
+   if (envelope->stage == SE_CLOSING)
+      // The empty message is discarded, whatever the reply:
+      envelope->stage = SE_DONE;
+   else if (envelope->awaiting_mail)
+      smtp_envelope_mail_reply(parcel, envelope, reply_status, reply);
+   else if (smtp_envelope_judging(envelope))
+      smtp_envelope_rcpt_reply(parcel, envelope, reply_status, reply);
+   else if (!envelope->pipelined)
+   {
+      if (reply_status >= 200 && reply_status < 400)
+         envelope->ready = 1;
       else
-         mcb_log_message(parcel, "Emailing aborted for lack of approved recipients.", NULL);
+      {
+         mcb_log_message(parcel, "Envelope transmission failed, \"", reply, "\"", NULL);
+         smtp_fail_transaction(envelope->recipients, envelope->stop, reply_status);
+         envelope->reply_status = reply_status;
+      }
+
+      envelope->stage = SE_DONE;
    }
-   else
+
+   // The last reply is to DATA, if it was sent:
+   if (envelope->pipelined && envelope->stage == SE_REPLIES && !envelope->replies_due)
+      smtp_envelope_end_pipelined(parcel, envelope, reply_status, reply);
+}
+
+void smtp_envelope_mail_reply(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply)
+{
+   envelope->awaiting_mail = 0;
+
+   rl_note_reply(parcel, NULL, reply_status, reply, envelope->mail_issued);
+   envelope->mail_ok = reply_status >= 200 && reply_status < 300;
+
+   if (!envelope->mail_ok)
    {
       mcb_log_message(parcel,
                   "From field (",
                   parcel->from,
                   ") of SMTP envelope caused an error,\"",
-                  buffer,
+                  reply,
                   "\"",
                   NULL);
+      smtp_answer_recipients(envelope->recipients, reply_status);
+      envelope->reply_status = reply_status;
    }
-   
-   return 0;
+
+   if (!envelope->pipelined)
+      envelope->stage = envelope->mail_ok ? SE_RCPT : SE_DONE;
+}
+
+void smtp_envelope_rcpt_reply(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply)
+{
+   RecipLink *rlink = envelope->judging;
+
+   envelope->judging = rlink->next;
+
+   if (envelope->mail_ok)
+      rl_note_reply(parcel, rlink->address, reply_status, reply, rlink->rcpt_issued);
+
+   // Once the server has had enough, the rest wait for the next
+   // transaction, unless it was the transaction it turned down:
+   if (!envelope->mail_ok || envelope->judgement < 0)
+   {
+      if (envelope->next)
+         rlink->rcpt_status = 0;
+   }
+   else
+   {
+      envelope->judgement = smtp_judge_rcpt_reply(parcel,
+                                                  rlink,
+                                                  reply,
+                                                  envelope->recipients_judged++,
+                                                  &envelope->next);
+      if (envelope->judgement > 0)
+         ++envelope->recipients_accepted;
+      else if (!envelope->reply_status)
+         envelope->reply_status = reply_status;
+   }
+
+   if (!envelope->pipelined)
+      envelope->stage = envelope->judgement < 0 ? SE_DATA : SE_RCPT;
+}
+
+/**
+ * @brief Report if a reply to RCPT TO is due, skipping the RT_SKIP
+ *        recipients, which had none.
+ */
+int smtp_envelope_judging(SmtpEnvelope *envelope)
+{
+   while (envelope->judging != envelope->stop && envelope->judging->rtype == RT_SKIP)
+      envelope->judging = envelope->judging->next;
+
+   return envelope->judging != envelope->stop;
+}
+
+/**
+ * @brief Judge a pipelined envelope once its last reply is in.
+ *
+ * Since the DATA command goes out before the server has judged the
+ * recipients, a server that (against RFC 2920) answers it with 354
+ * though it accepted nobody gets an empty message, which it discards.
+ */
+void smtp_envelope_end_pipelined(MParcel *parcel, SmtpEnvelope *envelope, int reply_status, const char *reply)
+{
+   envelope->stage = SE_DONE;
+
+   if (envelope->mail_ok && envelope->judgement >= 0)
+      envelope->next = envelope->stop;
+
+   if (!envelope->data_sent)
+   {
+      // Leave the transaction open for the caller to reset, or for BDAT:
+      envelope->ready = envelope->recipients_accepted > 0;
+      return;
+   }
+
+   if (reply_status >= 300 && reply_status < 400)
+   {
+      if (envelope->recipients_accepted)
+         envelope->ready = 1;
+      else
+         // Close the empty message, and let the caller reset:
+         envelope->stage = SE_CLOSE_EMPTY;
+   }
+   else if (envelope->mail_ok && envelope->recipients_accepted)
+   {
+      mcb_log_message(parcel, "Envelope transmission failed, \"", reply, "\"", NULL);
+      smtp_fail_transaction(envelope->recipients, envelope->stop, reply_status);
+      envelope->reply_status = reply_status;
+   }
+
+   if (envelope->mail_ok && !envelope->recipients_accepted)
+      mcb_log_message(parcel, "Emailing aborted for lack of approved recipients.", NULL);
+}
+
+/**
+ * @brief End the envelope for a connection that failed before its
+ *        replies were all read.
+ */
+void mcb_smtp_envelope_fail(MParcel *parcel, SmtpEnvelope *envelope)
+{
+   mcb_log_message(parcel, "Connection failed while reading envelope replies.", NULL);
+   smtp_fail_transaction(envelope->recipients, envelope->stop, 0);
+
+   envelope->ready = 0;
+   envelope->reply_status = 0;
+   envelope->replies_due = 0;
+   envelope->stage = SE_DONE;
+}
+
+/**
+ * @brief Judge the reply to the end of the envelope's content, as
+ *        smtp_finish_data() does.
+ *
+ * @return The reply status.
+ */
+int mcb_smtp_envelope_verdict(MParcel *parcel, SmtpEnvelope *envelope, const char *reply)
+{
+   return smtp_judge_data_verdict(parcel, envelope->recipients, envelope->stop, reply);
+}
+
+/**
+ * @brief Write rendered DATA content to the server.
+ *
+ * @return 1 if every byte was written.
+ */
+int smtp_send_rendered(MParcel *parcel, const RenderBuffer *rb)
+{
+   const char *ptr = rb->data;
+   const char *end = ptr + rb->len;
+   int chunk, bytes_sent;
+
+   while (ptr < end)
+   {
+      chunk = end - ptr > 65536 ? 65536 : end - ptr;
+      bytes_sent = (*parcel->stalker->writer)(parcel->stalker, ptr, chunk);
+      if (bytes_sent <= 0)
+         return 0;
+
+      parcel->total_sent += bytes_sent;
+      ptr += bytes_sent;
+   }
+
+   return 1;
+}
+
+/**
+ * @brief End the DATA content and read the server's verdict on the message.
+ *
+ * If the message is refused, the recipients the server had accepted,
+ * from *recipients* up to *stop*, get the refusal status, so
+ * MParcel::report_recipients shows that they will not receive it.
+ *
+ * @return Reply status, 0 if the connection failed.
+ */
+int smtp_finish_data(MParcel *parcel, RecipLink *recipients, const RecipLink *stop)
+{
+   mcb_send_data(parcel, ".", NULL);
+   return smtp_read_data_verdict(parcel, recipients, stop);
+}
+
+/**
+ * @brief Read the reply to the end of DATA, as for smtp_finish_data().
+ */
+int smtp_read_data_verdict(MParcel *parcel, RecipLink *recipients, const RecipLink *stop)
+{
+   char buffer[1024];
+
+   if (!smtp_read_reply(parcel, buffer, sizeof(buffer)))
+      *buffer = '\0';
+
+   return smtp_judge_data_verdict(parcel, recipients, stop, buffer);
+}
+
+/**
+ * @brief Judge the reply to the end of DATA, as for smtp_finish_data().
+ *
+ * An empty reply is a failed connection.
+ */
+int smtp_judge_data_verdict(MParcel *parcel, RecipLink *recipients, const RecipLink *stop, const char *reply)
+{
+   int reply_status = atoi(reply);
+
+   if (reply_status < 200 || reply_status >= 300)
+   {
+      mcb_log_message(parcel, "Message not accepted after DATA, \"", reply, "\"", NULL);
+      smtp_fail_transaction(recipients, stop, reply_status);
+   }
+
+   return reply_status;
+}
+
+/**
+ * @brief Give the recipients the server had accepted, from *recipients*
+ *        up to *stop*, the status of a transaction that failed after
+ *        their RCPT TO.
+ *
+ * A refused DATA, or a refused message, passes its reply status; a
+ * connection that failed passes 0.  Either way, neither
+ * MParcel::report_recipients nor a journal takes them for delivered.
+ */
+void smtp_fail_transaction(RecipLink *recipients, const RecipLink *stop, int reply_status)
+{
+   for (; recipients && recipients != stop; recipients = recipients->next)
+      if (recipients->rtype != RT_SKIP && rcpt_status_ok(recipients))
+         recipients->rcpt_status = reply_status;
+}
+
+/**
+ * @brief End the DATA content of a message's final transaction, leaving
+ *        the reply to be read with the next envelope.
+ *
+ * Only if MParcel::pipeline_messages is set and the server offers
+ * PIPELINING.  The recipients are copied, and are reported through
+ * MParcel::report_recipients once mcb_smtp_flush_pipeline() has read
+ * the verdict, so the caller must not report them itself.
+ *
+ * @param recipients  The message's recipient chain.
+ * @param batch       The first recipient of the final transaction.
+ *
+ * @return 1 if the verdict was deferred, 0 if the caller should use
+ *         smtp_finish_data() instead.
+ */
+int smtp_defer_data_verdict(MParcel *parcel, const RecipLink *recipients, const RecipLink *batch)
+{
+   const RecipLink *ptr;
+   RecipLink *copy, *tail = NULL;
+   PendingMessage *pm;
+   char *strings;
+   size_t size = sizeof(PendingMessage);
+
+   if (!parcel->pipeline_messages || !parcel->caps.cap_pipelining)
+      return 0;
+
+   // Only one verdict may be outstanding:
+   mcb_smtp_flush_pipeline(parcel);
+
+   for (ptr = recipients; ptr; ptr = ptr->next)
+      size += sizeof(RecipLink) + strlen(ptr->address) + 1;
+
+   if (!(pm = (PendingMessage*)malloc(size)))
+      return 0;
+
+   memset(pm, 0, sizeof(PendingMessage));
+   copy = (RecipLink*)(pm + 1);
+   for (ptr = recipients; ptr; ptr = ptr->next)
+      ++copy;
+   strings = (char*)copy;
+
+   copy = (RecipLink*)(pm + 1);
+   for (ptr = recipients; ptr; ptr = ptr->next, ++copy)
+   {
+      *copy = *ptr;
+      copy->next = NULL;
+      copy->address = strcpy(strings, ptr->address);
+      strings += strlen(strings) + 1;
+
+      if (tail)
+         tail->next = copy;
+      else
+         pm->recipients = copy;
+      tail = copy;
+
+      if (ptr == batch)
+         pm->batch = copy;
+   }
+
+   mcb_send_data(parcel, ".", NULL);
+   parcel->pending_message = pm;
+
+   return 1;
+}
+
+/**
+ * @brief Read the verdict on a message whose DATA ended without waiting for it.
+ *
+ * Its recipients then go to MParcel::report_recipients.  With
+ * MParcel::pipeline_messages set, call this after the last message of
+ * a session; the library also calls it before any command whose reply
+ * would otherwise be read out of turn.
+ *
+ * @return 1 if there was nothing to read or the connection is still
+ *         usable, 0 if the connection failed.
+ */
+int mcb_smtp_flush_pipeline(MParcel *parcel)
+{
+   PendingMessage *pm = parcel->pending_message;
+   int reply_status;
+
+   if (!pm)
+      return 1;
+
+   parcel->pending_message = NULL;
+
+   reply_status = smtp_read_data_verdict(parcel, pm->batch, NULL);
+
+   if (parcel->report_recipients)
+      (*parcel->report_recipients)(parcel, pm->recipients);
+
+   free(pm);
+
+   return reply_status != 0;
+}
+
+/**
+ * @brief Abandon the current mail transaction with RSET.
+ *
+ * @return 1 if the server confirmed the reset.
+ */
+int smtp_reset_transaction(MParcel *parcel)
+{
+   char buffer[1024];
+   int reply_status = 0;
+
+   mcb_send_data(parcel, "RSET", NULL);
+   if (smtp_read_reply(parcel, buffer, sizeof(buffer)))
+      reply_status = atoi(buffer);
+
+   return reply_status >= 200 && reply_status < 300;
 }
 
 /**
@@ -179,7 +1101,64 @@ int smtp_send_envelope(MParcel *parcel, RecipLink *recipients)
  */
 int smtp_send_headers(MParcel *parcel,
                       RecipLink *recipients,
-                      const HeaderField *headers)
+                      const HeaderField *headers,
+                      const EmailBody *body)
+{
+   return smtp_write_headers(parcel, recipients, headers, body, 1);
+}
+
+/**
+ * @brief Write a Message-ID: field, unless *headers* already has one.
+ *
+ * The domain is the sender's, or else the name announced in EHLO.
+ */
+void smtp_send_message_id(MParcel *parcel, const HeaderField *headers)
+{
+   char domain[256];
+   char message_id[1 + 36 + 1 + sizeof(domain) + 1];
+   const char *at;
+   int domain_len;
+
+   for (; headers; headers = headers->next)
+      if (0 == strcasecmp(headers->name, "Message-ID"))
+         return;
+
+   if (parcel->from && (at = strrchr(parcel->from, '@')) && at[1])
+   {
+      ++at;
+      domain_len = strcspn(at, ">");
+   }
+   else if ((at = smtp_helo_name(parcel)))
+      domain_len = strlen(at);
+   else
+   {
+      at = "localhost";
+      domain_len = strlen(at);
+   }
+
+   snprintf(domain, sizeof(domain), "%.*s", domain_len, at);
+
+   if (mcb_make_message_id(message_id, sizeof(message_id), domain))
+      mcb_send_data(parcel, "Message-ID: ", message_id, NULL);
+}
+
+/**
+ * @brief Write the From:, To:, Cc: and caller's headers, ending with a blank line.
+ *
+ * The caller's headers are *headers*, then any EmailBody::header_writer
+ * writes.  A Message-ID: is added if *headers* lacks one, but not with
+ * a header_writer, whose fields may include their own.
+ *
+ * With *only_accepted* set, To: and Cc: list only the recipients the
+ * server accepted.  Otherwise all are listed, as needed when one
+ * rendering goes to several servers, each of which sees only some of
+ * the recipients.
+ */
+int smtp_write_headers(MParcel *parcel,
+                       RecipLink *recipients,
+                       const HeaderField *headers,
+                       const EmailBody *body,
+                       int only_accepted)
 {
    if (!recipients)
       return 0;
@@ -194,7 +1173,7 @@ int smtp_send_headers(MParcel *parcel,
    rptr = recipients;
    while (rptr)
    {
-      if (rptr->rcpt_status < 300)
+      if (!only_accepted || rptr->rcpt_status < 300)
       {
          switch(rptr->rtype)
          {
@@ -224,7 +1203,7 @@ int smtp_send_headers(MParcel *parcel,
       needs_comma = 0;
       while (rptr)
       {
-         if (rcpt_status_ok(rptr) && rptr->rtype == RT_TO)
+         if ((!only_accepted || rcpt_status_ok(rptr)) && rptr->rtype == RT_TO)
          {
             if (needs_comma)
                mcb_send_unlined_data(parcel, ", ");
@@ -248,7 +1227,7 @@ int smtp_send_headers(MParcel *parcel,
       needs_comma = 0;
       while (rptr)
       {
-         if (rcpt_status_ok(rptr) && rptr->rtype == RT_CC)
+         if ((!only_accepted || rcpt_status_ok(rptr)) && rptr->rtype == RT_CC)
          {
             if (needs_comma)
                mcb_send_unlined_data(parcel, ", ");
@@ -269,6 +1248,14 @@ int smtp_send_headers(MParcel *parcel,
    const FieldValue *vptr;
    while (hptr)
    {
+      // A field can be empty:
+      if (!hptr->value)
+      {
+         mcb_send_data(parcel, hptr->name, ":", NULL);
+         hptr = hptr->next;
+         continue;
+      }
+
       mcb_send_data(parcel, hptr->name, ": ", hptr->value->value, NULL);
 
       vptr = hptr->value->next;
@@ -281,6 +1268,11 @@ int smtp_send_headers(MParcel *parcel,
       hptr = hptr->next;
    }
 
+   if (body->header_writer)
+      (*body->header_writer)(parcel, body);
+   else
+      smtp_send_message_id(parcel, headers);
+
    if (mcb_smtp_get_multipart_flag(parcel))
       mcb_smtp_send_mime_announcement(parcel);
    
@@ -301,7 +1293,7 @@ int mcb_smtp_greet_server(MParcel *parcel)
    char buffer[1024];
    int bytes_read;
 
-   mcb_send_data(parcel, "EHLO ", parcel->host_url, NULL);
+   mcb_send_data(parcel, "EHLO ", smtp_helo_name(parcel), NULL);
    bytes_read = mcb_recv_data(parcel, buffer, sizeof(buffer));
    smtp_parse_greeting_response(parcel, buffer, bytes_read);
 
@@ -314,6 +1306,23 @@ int mcb_smtp_greet_server(MParcel *parcel)
    }
 }
 
+/**
+ * @brief Returns 1 if the server's EHLO response included the keyword.
+ */
+int mcb_smtp_has_keyword(const MParcel *parcel, SmtpKeyword keyword)
+{
+   return (parcel->caps.cap_keywords & (1ULL << keyword)) != 0;
+}
+
+/**
+ * @brief Set MParcel::caps from an EHLO reply read by other means than
+ *        the parcel's talker, as by the coroutines of mailcb.hpp.
+ */
+void mcb_smtp_parse_ehlo_reply(MParcel *parcel, const char *reply, int reply_len)
+{
+   smtp_parse_greeting_response(parcel, reply, reply_len);
+}
+
 /**
  * @brief Send account credentials to the SMTP server.
  */
@@ -335,9 +1344,10 @@ int mcb_smtp_authorize_session(MParcel *parcel)
    // LOGIN accepts separate login and password submissions
 
 
-   if (auth_type)
+   if (use_plain)
+      return smtp_authorize_plain(parcel);
+   else if (auth_type)
    {
-      /* mcb_send_data(parcel, "AUTH ", auth_type, NULL); */
       mcb_send_data(parcel, "AUTH LOGIN", NULL);
       bytes_received = mcb_recv_data(parcel, buffer, sizeof(buffer));
       buffer[bytes_received] = '\0';
@@ -399,6 +1409,52 @@ int mcb_smtp_authorize_session(MParcel *parcel)
    return 0;
 }
 
+/**
+ * @brief Log in with AUTH PLAIN, whose one response carries the login
+ *        and the password, each after a \0 (RFC 4616).
+ */
+int smtp_authorize_plain(MParcel *parcel)
+{
+   char credentials[512];
+   char buffer[1024];
+   int bytes_received;
+
+   const char *login = parcel->login;
+   const char *password = parcel->password;
+   size_t login_len = strlen(login);
+   size_t password_len = strlen(password);
+
+   if (login_len + password_len + 2 > sizeof(credentials))
+   {
+      mcb_log_message(parcel, "Login name and password are too long for AUTH PLAIN.", NULL);
+      return 0;
+   }
+
+   credentials[0] = '\0';
+   memcpy(&credentials[1], login, login_len);
+   credentials[1 + login_len] = '\0';
+   memcpy(&credentials[2 + login_len], password, password_len);
+
+   c64_encode_to_buffer(credentials, login_len + password_len + 2, (uint32_t*)&buffer, sizeof(buffer));
+   memset(credentials, 0, sizeof(credentials));
+
+   mcb_send_data(parcel, "AUTH PLAIN ", buffer, NULL);
+   bytes_received = mcb_recv_data(parcel, buffer, sizeof(buffer) - 1);
+   buffer[bytes_received > 0 ? bytes_received : 0] = '\0';
+
+   if (atoi(buffer) >= 200 && atoi(buffer) < 300)
+      return 1;
+
+   mcb_log_message(parcel,
+                   "For login name, ",
+                   login,
+                   ", the password was not accepted by the server.",
+                   " (",
+                   buffer,
+                   ")",
+                   NULL);
+   return 0;
+}
 
 void mcb_smtp_clear_multipart_flag(MParcel *parcel)
 {
@@ -439,10 +1495,31 @@ void mcb_smtp_send_mime_announcement(MParcel *parcel)
 /**
  * @brief Used by the calling process to initialiate a new mime section.
  *
- * The section will use the border value generated earlier, when the multipart started.
+ * The section will use the border value generated earlier, when the multipart started,
+ * and the transfer encoding smtp_classify_message() chose for the message.
  */
 void mcb_smtp_send_mime_border(MParcel *parcel, const char *content_type, const char *charset)
 {
+   PartEncoding encoding = parcel->body_classified ? parcel->body_encoding : PE_QUOTED_PRINTABLE;
+
+   mcb_smtp_send_mime_border_encoded(parcel, content_type, charset, encoding);
+
+   // The section's lines are to be encoded as they are sent:
+   parcel->section_encoded = parcel->body_classified && encoding == PE_QUOTED_PRINTABLE;
+}
+
+/**
+ * @brief Begin a new mime section, declaring the given transfer encoding.
+ *
+ * The caller sends the section's content already encoded.
+ */
+void mcb_smtp_send_mime_border_encoded(MParcel *parcel,
+                                       const char *content_type,
+                                       const char *charset,
+                                       PartEncoding encoding)
+{
+   parcel->section_encoded = 0;
+
    mcb_send_data(parcel, "--", parcel->multipart_boundary, NULL);
    mcb_send_data(parcel,
                  "Content-Type: ",
@@ -450,10 +1527,60 @@ void mcb_smtp_send_mime_border(MParcel *parcel, const char *content_type, const
                  "; charset=",
                  (charset?charset:"iso-8859-1"),
                  NULL);
-   mcb_send_data(parcel, "Content-Transfer-Encoding: quoted-printable", NULL);
+   mcb_send_data(parcel, "Content-Transfer-Encoding: ", pc_encoding_name(encoding), NULL);
    mcb_send_data_endline(parcel);
 }
 
+/**
+ * @brief Send a complete mime section whose encoded body comes from MParcel::part_cache.
+ *
+ * Intended for use in an EmailSectionPrinter when the same attachment
+ * or alternative part goes out with many messages.  The content is
+ * encoded only the first time it is seen; later calls write the cached,
+ * already dot-stuffed bytes straight to the server.
+ *
+ * @return 1 if the section was sent, 0 if there is no cache or encoding failed.
+ */
+int mcb_smtp_send_cached_part(MParcel *parcel,
+                              const char *content_type,
+                              const char *charset,
+                              const char *content,
+                              size_t content_len,
+                              PartEncoding encoding)
+{
+   const PartEntry *entry;
+   const char *data;
+   size_t data_len;
+   int fd;
+   off_t offset;
+
+   if (!parcel->part_cache)
+   {
+      mcb_log_message(parcel, "No part cache available for cached mime section.", NULL);
+      return 0;
+   }
+
+   entry = pc_get_part(parcel->part_cache, content, content_len, encoding);
+
+   // A spilled part goes from the spill file, with sendfile() if the talker can:
+   if (entry && pc_entry_file(parcel->part_cache, entry, &fd, &offset))
+   {
+      mcb_smtp_send_mime_border_encoded(parcel, content_type, charset, encoding);
+      parcel->total_sent += stk_send_file(parcel->stalker, fd, offset, entry->data_len);
+      return 1;
+   }
+
+   if (entry && pc_entry_bytes(parcel->part_cache, entry, &data, &data_len))
+   {
+      mcb_smtp_send_mime_border_encoded(parcel, content_type, charset, encoding);
+      parcel->total_sent += stk_simple_send_unlined(parcel->stalker, data, data_len);
+      return 1;
+   }
+
+   mcb_log_message(parcel, "Failed to encode cached mime section.", NULL);
+   return 0;
+}
+
 void mcb_smtp_send_mime_end(MParcel *parcel)
 {
    mcb_send_data(parcel, "--", parcel->multipart_boundary, "--", NULL);
@@ -468,6 +1595,7 @@ void mcb_smtp_send_mime_end(MParcel *parcel)
 void mcb_smtp_quit_server(MParcel *parcel)
 {
    char buffer[1024];
+   mcb_smtp_flush_pipeline(parcel);
    mcb_send_data(parcel, "QUIT", NULL);
    mcb_recv_data(parcel, buffer, sizeof(buffer));
 
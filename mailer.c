@@ -2,8 +2,20 @@
 #include <alloca.h>
 #include <unistd.h>  // for close() function
 #include <string.h>  // for memcpy, memset.
+#include <dirent.h>  // for scandir(), for raw messages
+#include <sys/stat.h>
+
+#include <signal.h>  // for ignoring SIGPIPE with direct MX delivery
 
 #include "mailcb.h"
+#include "mxdeliver.h"
+#include "parseahead.h"
+#include "batchfile.h"
+#include "journal.h"
+#include "shard.h"
+#include "mailmerge.h"
+#include "rawmsg.h"
+#include "ratelimit.h"
 #include <readini.h>
 
 #define SECTION_DELIM '\v'
@@ -16,6 +28,22 @@ typedef struct _mailer_data
 {
    int  read_file;
    FILE *file_to_read;
+   int  direct_mx;
+   int  parse_ahead;   // queue depth for parsing in a background thread, 0 to parse inline
+   int  compiled;      // file_to_read is a compiled batch, see bf_compile()
+
+   const char    *template_path;  // mail-merge template, with file_to_read its data, see mailmerge.h
+
+   const char    *raw_path;       // .eml file or Maildir to send as it is, see rawmsg.h
+   const char    **raw_recipients;   // envelope recipients from the command line
+   int           raw_recipient_count;
+
+   const char    *journal_path;   // checkpoint journal, see journal.h
+   Journal       *journal;        // open while sending
+   int           resume;          // continue the batch the journal records
+   unsigned long first_index;     // of the first message sent, when resuming
+
+   Shard         shard;           // Shard::count is 0 unless --shard
 } MailerData;
 
 
@@ -24,6 +52,14 @@ typedef struct _mailer_data
 /*************************************************************************/
 
 void emails_from_file(MParcel *parcel);
+void emails_from_parse_ahead(MParcel *parcel);
+void emails_from_compiled(MParcel *parcel);
+void emails_from_template(MParcel *parcel);
+void emails_from_raw(MParcel *parcel);
+int raw_message_paths(MParcel *parcel, const char *path, char ***paths);
+int raw_collect_directory(const char *dir, char ***paths, int *count);
+int compile_batch(MParcel *parcel, const char *path);
+int resume_from_journal(MParcel *parcel);
 void collect_email_recipients(MParcel *parcel, BuffControl *bc);
 void collect_email_headers(MParcel *parcel, BuffControl *bc, RecipLink *recips);
 void email_from_file_final_send(MParcel *parcel, BuffControl *bc,
@@ -44,21 +80,458 @@ void section_printer(MParcel *parcel, const char *line, int line_len);
  */
 void emails_from_file(MParcel *parcel)
 {
-   FILE *efile = ((MailerData*)parcel->data)->file_to_read;
+   MailerData *md = (MailerData*)parcel->data;
+   FILE *efile = md->file_to_read;
    char buffer[1024];
 
    int use_new_mailer = 1;
 
-   BuffControl bc;
-   init_buff_control(&bc, buffer, sizeof(buffer), bc_file_reader, (void*)efile);
+   Journal journal;
+   unsigned long index = md->first_index;
+   off_t base_offset;
 
-   while (!bc.reached_EOF)
+   if (md->journal_path)
    {
-      if (use_new_mailer)
-         mcb_send_email_simple(parcel, &bc, line_judger, section_printer);
-      else
-         collect_email_recipients(parcel, &bc);
+      if (!jn_open(&journal, parcel, md->journal_path, md->resume, 0))
+         return;
+
+      md->journal = &journal;
+   }
+
+   if (md->raw_path)
+      emails_from_raw(parcel);
+   else if (md->template_path)
+      emails_from_template(parcel);
+   else if (md->compiled)
+      emails_from_compiled(parcel);
+   else if (md->parse_ahead)
+      emails_from_parse_ahead(parcel);
+   else
+   {
+      BuffControl bc;
+
+      // Before the first read moves it:
+      if ((base_offset = ftello(efile)) < 0)
+         base_offset = 0;
+
+      init_buff_control(&bc, buffer, sizeof(buffer), bc_file_reader, (void*)efile);
+
+      while (!bc.reached_EOF)
+      {
+         if (md->shard.count && !sh_seek_own_message(&md->shard, &bc, &index))
+            break;
+
+         if (md->journal)
+            jn_begin_message(md->journal, index, base_offset + bc_offset(&bc));
+
+         if (use_new_mailer)
+            mcb_send_email_simple(parcel, &bc, line_judger, section_printer);
+         else
+            collect_email_recipients(parcel, &bc);
+
+         if (md->journal)
+            jn_end_message(md->journal, base_offset + bc_offset(&bc));
+
+         ++index;
+      }
+
+      // Report the last message if its verdict is still outstanding:
+      mcb_smtp_flush_pipeline(parcel);
+   }
+
+   if (md->journal)
+   {
+      jn_close(md->journal);
+      md->journal = NULL;
+   }
+}
+
+/**
+ * @brief Alternative to emails_from_file() that parses in a background thread.
+ *
+ * While this thread waits on the server, the parser thread prepares
+ * the next messages.
+ */
+void emails_from_parse_ahead(MParcel *parcel)
+{
+   MailerData *md = (MailerData*)parcel->data;
+   PAQueue queue;
+   PAMessage *message;
+   PAStats stats;
+
+   if (!pa_start(&queue,
+                 parcel,
+                 md->file_to_read,
+                 line_judger,
+                 md->parse_ahead,
+                 md->shard.count ? &md->shard : NULL))
+   {
+      mcb_log_message(parcel, "Failed to start the parse-ahead thread.", NULL);
+      return;
+   }
+
+   while ((message = pa_next(&queue)))
+   {
+      if (md->journal)
+         jn_begin_message(md->journal, md->first_index + message->index, message->offset);
+
+      pa_send_message(&queue, parcel, message, section_printer);
+
+      if (md->journal)
+         jn_end_message(md->journal, message->end_offset);
+
+      pa_free_message(message);
+   }
+
+   mcb_smtp_flush_pipeline(parcel);
+
+   pa_get_stats(&queue, &stats);
+   pa_stop(&queue);
+
+   if (parcel->verbose)
+      printf("Parse-ahead: %lu messages, %lu skipped, depth %.1f average, %d most; "
+             "sender waited %lu times for %.3f s, parser waited %lu times for %.3f s.\n",
+             stats.messages,
+             stats.skipped,
+             stats.sent ? (double)stats.depth_total / stats.sent : 0.0,
+             stats.max_depth,
+             stats.sender_stalls,
+             stats.sender_stall_usecs / 1e6,
+             stats.parser_stalls,
+             stats.parser_stall_usecs / 1e6);
+}
+
+/**
+ * @brief Alternative to emails_from_file() for a batch compiled with -C.
+ *
+ * The messages need no parsing, so they are sent straight from the file.
+ */
+void emails_from_compiled(MParcel *parcel)
+{
+   MailerData *md = (MailerData*)parcel->data;
+   BatchFile bf;
+   BFMessage message;
+   unsigned long index;
+
+   if (!bf_open(&bf, parcel, md->file_to_read))
+      return;
+
+   // Messages are found by index, so a resumed batch needs no seeking:
+   for (index = md->first_index; index < bf.message_count; ++index)
+   {
+      // Sharding by index needs no reading at all:
+      if (md->shard.count && !md->shard.by_recipient && !sh_owns_index(&md->shard, index))
+         continue;
+
+      if (!bf_read_message(&bf, index, &message))
+         continue;
+
+      if (md->shard.by_recipient && !sh_owns_recipients(&md->shard, message.recipients))
+      {
+         bf_free_message(&message);
+         continue;
+      }
+
+      if (md->journal)
+         jn_begin_message(md->journal, index, index);
+
+      bf_send_message(parcel, &message, section_printer);
+      bf_free_message(&message);
+
+      if (md->journal)
+         jn_end_message(md->journal, index + 1);
+   }
+
+   mcb_smtp_flush_pipeline(parcel);
+}
+
+/**
+ * @brief Alternative to emails_from_file() for a mail-merge template, -T.
+ *
+ * The input is the merge data, and each row is a message, with the
+ * row's index for its journal offsets.
+ */
+void emails_from_template(MParcel *parcel)
+{
+   MailerData *md = (MailerData*)parcel->data;
+   MMTemplate mt;
+   MMData data;
+   unsigned long index;
+
+   if (!mm_compile(&mt, parcel, md->template_path))
+      return;
+
+   if (!mm_open_data(&data, parcel, md->file_to_read))
+   {
+      mm_free_template(&mt);
+      return;
+   }
+
+   if (mm_bind(&mt, &data, parcel))
+   {
+      while (mm_next_row(&data))
+      {
+         index = data.row;
+
+         if (index < md->first_index)
+            continue;
+
+         if (md->shard.count && !md->shard.by_recipient && !sh_owns_index(&md->shard, index))
+            continue;
+
+         if (md->shard.by_recipient && !sh_owns_recipients(&md->shard, mm_recipients(&mt, &data)))
+            continue;
+
+         if (md->journal)
+            jn_begin_message(md->journal, index, index);
+
+         mm_send_message(parcel, &mt, &data, section_printer);
+
+         if (md->journal)
+            jn_end_message(md->journal, index + 1);
+      }
+
+      mcb_smtp_flush_pipeline(parcel);
    }
+
+   mm_free_data(&data);
+   mm_free_template(&mt);
+}
+
+/**
+ * @brief Alternative to emails_from_file() for raw messages, -R.
+ *
+ * Each file is a message, sent as it is, to the recipients on the
+ * command line or, without them, those of its sidecar.  The journal
+ * offsets are indexes in the sorted list of files.
+ */
+void emails_from_raw(MParcel *parcel)
+{
+   MailerData *md = (MailerData*)parcel->data;
+   RecipLink *arg_recipients = NULL, *recipients, *link;
+   RawMessage rm;
+   char **paths;
+   int count, index;
+
+   if (parcel->mx_delivery)
+   {
+      mcb_log_message(parcel, "Raw messages go through a relay, not -x.", NULL);
+      return;
+   }
+
+   if ((count = raw_message_paths(parcel, md->raw_path, &paths)) < 0)
+      return;
+
+   // The command line's recipients, for every message:
+   for (index = md->raw_recipient_count - 1; index >= 0; --index)
+   {
+      link = (RecipLink*)alloca(sizeof(RecipLink));
+      memset(link, 0, sizeof(RecipLink));
+      link->address = md->raw_recipients[index];
+      link->next = arg_recipients;
+      arg_recipients = link;
+   }
+
+   for (index = md->first_index; index < count; ++index)
+   {
+      if (md->shard.count && !md->shard.by_recipient && !sh_owns_index(&md->shard, index))
+         continue;
+
+      recipients = arg_recipients ? arg_recipients : rm_read_sidecar(parcel, paths[index]);
+
+      if (md->shard.by_recipient && !sh_owns_recipients(&md->shard, recipients))
+         goto next_message;
+
+      if (md->journal)
+         jn_begin_message(md->journal, index, index);
+
+      if (!recipients)
+         mcb_log_message(parcel, "No recipients for \"", paths[index], "\", which will now not be sent.", NULL);
+      else if (rm_open(&rm, parcel, paths[index]))
+      {
+         rm_send(parcel, &rm, recipients);
+         rm_close(&rm);
+      }
+
+      if (md->journal)
+         jn_end_message(md->journal, index + 1);
+
+     next_message:
+      if (recipients != arg_recipients)
+         free(recipients);
+   }
+
+   for (index = 0; index < count; ++index)
+      free(paths[index]);
+   free(paths);
+}
+
+/**
+ * @brief List the messages of -R: a file, a Maildir's new/ and cur/
+ *        messages, or the files of any other directory, in name order.
+ *
+ * @return Number of paths in **paths*, to free, or -1 for failure.
+ */
+int raw_message_paths(MParcel *parcel, const char *path, char ***paths)
+{
+   struct stat st;
+   char *sub;
+   int count = 0, maildir = 0;
+   const char **subdir, *subdirs[] = { "new", "cur", NULL };
+
+   *paths = NULL;
+
+   if (stat(path, &st))
+   {
+      mcb_log_message(parcel, "Failed to find \"", path, "\", ", strerror(errno), NULL);
+      return -1;
+   }
+
+   if (!S_ISDIR(st.st_mode))
+   {
+      if ((*paths = (char**)malloc(sizeof(char*))) && (**paths = strdup(path)))
+         return 1;
+
+      free(*paths);
+      goto out_of_memory;
+   }
+
+   sub = (char*)alloca(strlen(path) + 5);
+   for (subdir = subdirs; *subdir; ++subdir)
+   {
+      sprintf(sub, "%s/%s", path, *subdir);
+      if (0 == stat(sub, &st) && S_ISDIR(st.st_mode))
+      {
+         maildir = 1;
+         if (!raw_collect_directory(sub, paths, &count))
+            goto out_of_memory;
+      }
+   }
+
+   if (!maildir && !raw_collect_directory(path, paths, &count))
+      goto out_of_memory;
+
+   return count;
+
+  out_of_memory:
+   mcb_log_message(parcel, "Out of memory listing \"", path, "\".", NULL);
+   return -1;
+}
+
+/**
+ * @brief Add the message files of *dir* to *paths*, skipping hidden
+ *        files and sidecars.
+ */
+int raw_collect_directory(const char *dir, char ***paths, int *count)
+{
+   struct dirent **entries;
+   struct stat st;
+   size_t name_len, suffix_len = strlen(RM_SIDECAR_SUFFIX);
+   char *path, **grown;
+   int entry_count, index, result = 1;
+
+   if ((entry_count = scandir(dir, &entries, NULL, alphasort)) < 0)
+      return 1;
+
+   for (index = 0; index < entry_count; ++index)
+   {
+      name_len = strlen(entries[index]->d_name);
+
+      if (result
+          && *entries[index]->d_name != '.'
+          && !(name_len > suffix_len
+               && 0 == strcmp(entries[index]->d_name + name_len - suffix_len, RM_SIDECAR_SUFFIX)))
+      {
+         if (!(path = (char*)malloc(strlen(dir) + name_len + 2)))
+            result = 0;
+         else
+         {
+            sprintf(path, "%s/%s", dir, entries[index]->d_name);
+
+            if (stat(path, &st) || !S_ISREG(st.st_mode))
+               free(path);
+            else if (!(grown = (char**)realloc(*paths, (*count + 1) * sizeof(char*))))
+            {
+               free(path);
+               result = 0;
+            }
+            else
+            {
+               *paths = grown;
+               (*paths)[(*count)++] = path;
+            }
+         }
+      }
+
+      free(entries[index]);
+   }
+
+   free(entries);
+   return result;
+}
+
+/**
+ * @brief Write the input batch, compiled, to *path*, instead of sending it.
+ */
+int compile_batch(MParcel *parcel, const char *path)
+{
+   FILE *target;
+   unsigned long count = 0;
+   int result;
+
+   if (!(target = fopen(path, "wb")))
+   {
+      mcb_log_message(parcel, "Failed to open \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   result = bf_compile(parcel, ((MailerData*)parcel->data)->file_to_read, line_judger, target, &count);
+   fclose(target);
+
+   if (result && parcel->verbose)
+      printf("Compiled %lu messages to %s.\n", count, path);
+
+   return result;
+}
+
+/**
+ * @brief Skip the messages the journal has confirmed, for --resume.
+ *
+ * A text batch seeks to the first message not confirmed; a compiled
+ * batch or merge data only needs its index.
+ */
+int resume_from_journal(MParcel *parcel)
+{
+   MailerData *md = (MailerData*)parcel->data;
+   JNResumePoint point;
+
+   if (!md->journal_path)
+   {
+      mcb_log_message(parcel, "Resuming needs a journal, -j.", NULL);
+      return 0;
+   }
+
+   if (md->file_to_read == stdin)
+   {
+      mcb_log_message(parcel, "Can't resume reading from stdin.", NULL);
+      return 0;
+   }
+
+   if (!jn_find_resume_point(parcel, md->journal_path, &point))
+      return 0;
+
+   if (!md->compiled && !md->template_path && !md->raw_path && fseeko(md->file_to_read, point.offset, SEEK_SET))
+   {
+      mcb_log_message(parcel, "Failed to seek to the resume point, ", strerror(errno), NULL);
+      return 0;
+   }
+
+   md->first_index = point.index;
+
+   if (parcel->verbose)
+      printf("Resuming at message %lu.\n", point.index);
+
+   return 1;
 }
 
 /**
@@ -294,6 +767,11 @@ void collect_email_headers(MParcel *parcel, BuffControl *bc, RecipLink *recips)
  */
 void report_recipients(MParcel *parcel, RecipLink *rchain)
 {
+   MailerData *md = (MailerData*)parcel->data;
+
+   if (md->journal)
+      jn_record(md->journal, rchain);
+
    if (parcel->verbose)
    {
       int cur_len, max_len = 0;
@@ -469,6 +947,43 @@ void talker_user(MParcel *parcel)
       mcb_greet_pop_server(parcel);
 }
 
+/**
+ * @brief Send the emails without a relay, straight to the recipients' mail exchangers.
+ */
+void deliver_direct_to_mx(MParcel *parcel)
+{
+   MXDelivery mxd;
+
+   if (!((MailerData*)parcel->data)->read_file)
+   {
+      mcb_log_message(parcel, "No file from which to read emails.", NULL);
+      return;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   mxd_init(&mxd, parcel);
+   if (parcel->host_url)
+      mxd_set_resolver(&mxd, mxd_fixed_resolver, (void*)parcel->host_url);
+   if (parcel->host_port)
+      mxd.port = parcel->host_port;
+
+   parcel->mx_delivery = &mxd;
+   parcel->report_recipients = report_recipients;
+
+   emails_from_file(parcel);
+
+   mxd_close(&mxd);
+   parcel->mx_delivery = NULL;
+
+   if (parcel->verbose)
+      printf("%lu messages, %lu transactions, %lu connections opened, %lu reused.\n",
+             mxd.messages,
+             mxd.transactions,
+             mxd.connections_opened,
+             mxd.connections_reused);
+}
+
 /**
  * @brief Conditionally sets an execution flag.
  *
@@ -566,7 +1081,10 @@ void begin_after_read_config_attempt(const ri_Section *root, void* mparcel)
       }
    }
 
-   mcb_prepare_talker(parcel, talker_user);
+   if (((MailerData*)parcel->data)->direct_mx)
+      deliver_direct_to_mx(parcel);
+   else
+      mcb_prepare_talker(parcel, talker_user);
 }
 
 void write_guid(void)
@@ -580,19 +1098,40 @@ void show_usage(void)
 {
    const char* text = 
       "-a account to use\n"
+      "-b depth: parse up to depth messages ahead in a background thread\n"
       "-c config file path\n"
+      "-C path: compile the input file into a binary batch at path, then exit\n"
+      "-e send each recipient the message alone, rendering it once\n"
       "-f from email address\n"
       "-h host url\n"
       "-g generate version 4/variant 1 GUID\n"
       "-i email input file, '-' for stdin\n"
+      "-j path: journal each message's recipient statuses, for resuming\n"
       "-l login name\n"
+      "-m pipeline messages: send each envelope before the last message's verdict\n"
+      "-M run TLS through memory BIOs, batching its socket reads and writes\n"
+      "-n most recipients per transaction (default: the server's limit)\n"
+      "-o connect timeout, in seconds\n"
       "-p port number\n"
       "-r POP3 reader\n"
       "-q quiet, suppress error messages\n"
+      "-R path: send an .eml file, or a Maildir's messages, as they are, to the\n"
+      "   recipients that follow the options, or else those of each file's .rcpt sidecar\n"
       "-s skip sending of emails\n"
       "-t use TLS encryption\n"
+      "-T template: send the template once per row of the CSV or TSV -i input\n"
       "-v generate verbose output\n"
-      "-w password\n";
+      "-w password\n"
+      "-x deliver directly to each recipient domain's MX\n"
+      "   (with -h, the host stands in for every MX)\n"
+      "--resume skip the messages the -j journal confirms as sent\n"
+      "--shard i/N: send only shard i (from 0) of N, by message index\n"
+      "--shard-by-recipient: with --shard, by a hash of the first recipient\n"
+      "--merge journal...: combine shards' -j journals in index order, to stdout\n"
+      "--rate n: start at most n transactions (MAIL FROM) a second from the\n"
+      "   account, slowing if the server throttles; a message split by a\n"
+      "   recipient limit takes one for each part\n"
+      "--domain-rate n: send to at most n recipients a second of each domain\n";
 
    printf("%s\n", text);
 }
@@ -614,6 +1153,12 @@ int main(int argc, const char** argv)
 
    const char *config_file_path = "./mailer.conf";
    const char *input_file_path = NULL;
+   const char *compile_path = NULL;
+   int shard_by_recipient = 0;
+   double account_rate = 0, domain_rate = 0;
+   RateLimits rate_limits;
+
+   md.raw_recipients = (const char**)alloca(argc * sizeof(const char*));
 
    // Advise access to help if command called with no arguments:
    if (argc == 1)
@@ -635,6 +1180,41 @@ int main(int argc, const char** argv)
             md.read_file = 1;
             goto continue_next_arg;
          }
+         else if (0 == strcmp(str, "--resume"))
+         {
+            md.resume = 1;
+            goto continue_next_arg;
+         }
+         else if (0 == strcmp(str, "--shard") && cur_arg + 1 < end_arg)
+         {
+            if (!sh_parse(&md.shard, *++cur_arg, MESSAGE_DELIM))
+            {
+               printf("--shard needs i/N, with i less than N.\n");
+               goto abort_program;
+            }
+            goto continue_next_arg;
+         }
+         else if (0 == strcmp(str, "--shard-by-recipient"))
+         {
+            shard_by_recipient = 1;
+            goto continue_next_arg;
+         }
+         else if (0 == strcmp(str, "--rate") && cur_arg + 1 < end_arg)
+         {
+            account_rate = atof(*++cur_arg);
+            goto continue_next_arg;
+         }
+         else if (0 == strcmp(str, "--domain-rate") && cur_arg + 1 < end_arg)
+         {
+            domain_rate = atof(*++cur_arg);
+            goto continue_next_arg;
+         }
+         else if (0 == strcmp(str, "--merge"))
+         {
+            // The rest of the arguments are journals:
+            ++cur_arg;
+            return !jn_merge(&mparcel, cur_arg, end_arg - cur_arg, stdout);
+         }
 
          while (*++str)
          {
@@ -647,6 +1227,20 @@ int main(int argc, const char** argv)
                      goto continue_next_arg;
                   }
                   break;
+               case 'b':  // parse ahead in the background
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     md.parse_ahead = atoi(*++cur_arg);
+                     goto continue_next_arg;
+                  }
+                  break;
+               case 'C':  // compile the input
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     compile_path = *++cur_arg;
+                     goto continue_next_arg;
+                  }
+                  break;
                case 'c':  // config file
                   if (cur_arg + 1 < end_arg)
                   {
@@ -654,6 +1248,9 @@ int main(int argc, const char** argv)
                      goto continue_next_arg;
                   }
                   break;
+               case 'e':  // each recipient alone
+                  mparcel.separate_envelopes = 1;
+                  break;
                case 'f':  // from
                   if (cur_arg + 1 < end_arg)
                   {
@@ -680,6 +1277,13 @@ int main(int argc, const char** argv)
                      goto continue_next_arg;
                   }
                   break;
+               case 'j':  // checkpoint journal
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     md.journal_path = *++cur_arg;
+                     goto continue_next_arg;
+                  }
+                  break;
                case 'l':  // login
                   if (cur_arg + 1 < end_arg)
                   {
@@ -687,6 +1291,27 @@ int main(int argc, const char** argv)
                      goto continue_next_arg;
                   }
                   break;
+               case 'm':  // pipeline messages
+                  mparcel.pipeline_messages = 1;
+                  break;
+               case 'M':  // memory-BIO TLS
+                  mparcel.tls_memory_bio = 1;
+                  break;
+               case 'n':  // recipients per transaction
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     mparcel.max_rcpt_per_transaction = atoi(*++cur_arg);
+                     goto continue_next_arg;
+                  }
+                  break;
+               case 'o':  // connect timeout
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     mparcel.connect_times.overall_timeout_ms = 1000 * atoi(*++cur_arg);
+                     mparcel.connect_times.attempt_timeout_ms = mparcel.connect_times.overall_timeout_ms;
+                     goto continue_next_arg;
+                  }
+                  break;
                case 'p':  // port
                   if (cur_arg + 1 < end_arg)
                   {
@@ -702,12 +1327,27 @@ int main(int argc, const char** argv)
                case 'q':  // quiet, suppress error messages
                   mparcel.quiet = 1;
                   break;
+               case 'R':  // raw messages
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     md.raw_path = *++cur_arg;
+                     md.read_file = 1;
+                     goto continue_next_arg;
+                  }
+                  break;
                case 's':  // suppress emails 
                   mparcel.OnlySendEnvelope = 1;
                   break;
                case 't':   // tls
                   mparcel.starttls = 1;
                   break;
+               case 'T':  // mail-merge template
+                  if (cur_arg + 1 < end_arg)
+                  {
+                     md.template_path = *++cur_arg;
+                     goto continue_next_arg;
+                  }
+                  break;
                case 'v':  // verbose messages
                   mparcel.verbose = 1;
                   break;
@@ -717,6 +1357,10 @@ int main(int argc, const char** argv)
                      mparcel.password = *++cur_arg;
                      goto continue_next_arg;
                   }
+                  break;
+               case 'x':  // direct to MX
+                  md.direct_mx = 1;
+                  break;
                default:
                   printf("'%c' is not a valid argument.\n", *str);
                case '?':  // show help
@@ -726,6 +1370,9 @@ int main(int argc, const char** argv)
             }
          }
       }
+      else if (cur_arg != argv)
+         // Envelope recipients, for -R:
+         md.raw_recipients[md.raw_recipient_count++] = str;
 
      continue_next_arg:
       ++cur_arg;
@@ -742,7 +1389,10 @@ int main(int argc, const char** argv)
       {
          md.file_to_read = fopen(input_file_path, "r");
          if (md.file_to_read)
+         {
             md.read_file = 1;
+            md.compiled = !md.template_path && bf_is_compiled(md.file_to_read);
+         }
          else
          {
             mcb_log_message(&mparcel,
@@ -757,6 +1407,45 @@ int main(int argc, const char** argv)
       }
    } // end of while (cur_arg < end_arg)
 
+   if (compile_path)
+   {
+      int compiled = 0;
+
+      if (!md.read_file)
+         mcb_log_message(&mparcel, "No file to compile.", NULL);
+      else if (md.compiled)
+         mcb_log_message(&mparcel, "The input is already compiled.", NULL);
+      else if (md.template_path)
+         mcb_log_message(&mparcel, "Merge data can't be compiled.", NULL);
+      else if (md.raw_path)
+         mcb_log_message(&mparcel, "Raw messages can't be compiled.", NULL);
+      else
+         compiled = compile_batch(&mparcel, compile_path);
+
+      if (md.file_to_read && md.file_to_read != stdin)
+         fclose(md.file_to_read);
+
+      return !compiled;
+   }
+
+   md.shard.by_recipient = shard_by_recipient;
+
+   if (md.resume && md.read_file && !resume_from_journal(&mparcel))
+   {
+      if (md.file_to_read != stdin)
+         fclose(md.file_to_read);
+
+      return 1;
+   }
+
+
+   if (account_rate > 0 || domain_rate > 0)
+   {
+      rl_init(&rate_limits);
+      rl_set_limit(&rate_limits, RL_ACCOUNT, NULL, account_rate, 1);
+      rl_set_limit(&rate_limits, RL_DOMAIN, NULL, domain_rate, 1);
+      mparcel.rate_limits = &rate_limits;
+   }
 
    int access_result;
    if (config_file_path
@@ -776,6 +1465,9 @@ int main(int argc, const char** argv)
    if (md.file_to_read && md.file_to_read != stdin)
       fclose(md.file_to_read);
 
+   if (mparcel.rate_limits)
+      rl_free(&rate_limits);
+
   abort_program:
    return 0;
 }
@@ -0,0 +1,744 @@
+#include <stdlib.h>       // for malloc(), realloc(), free()
+#include <string.h>       // for memcpy(), memset(), strerror()
+#include <errno.h>
+#include <alloca.h>
+
+#include "mailmerge.h"
+
+#define MM_READ_CHUNK   65536
+#define MM_MAX_COLUMNS  1024
+
+/**
+ * @brief What the EmailBodyWriters of a message need, through EmailBody::writer_data.
+ */
+typedef struct _mm_message
+{
+   MMTemplate   *mt;
+   const MMData *md;
+} MMMessage;
+
+// Private, internal functions
+int mm_read_file(FILE *file, char **text, size_t *len);
+int mm_add_text(MMTemplate *mt, const char *str, size_t len, size_t *offset);
+int mm_add_piece(MMTemplate *mt, MMPieceKind kind, size_t offset, size_t len);
+int mm_add_text_piece(MMTemplate *mt, const char *str, size_t len, int line_start);
+int mm_add_line(MMTemplate *mt, const char *line, size_t len);
+int mm_add_recipient(MMTemplate *mt, const MParcel *parcel, const char *line, size_t len);
+const char *mm_find_slot(const char *ptr, const char *end,
+                         const char **name, size_t *name_len, const char **after);
+int mm_find_column(const MMData *md, const char *name, size_t len);
+int mm_parse_row(MMData *md, const char **fields, size_t *lengths, int max_fields);
+void mm_piece_data(const MMTemplate *mt, const MMData *md, const MMPiece *piece,
+                   const char **data, size_t *len);
+void mm_write_pieces(MParcel *parcel, const EmailBody *body, int first, int last);
+void mm_header_writer(MParcel *parcel, const EmailBody *body);
+void mm_body_writer(MParcel *parcel, const EmailBody *body);
+
+/**
+ * @brief Read a whole file into a \0-terminated buffer.
+ */
+int mm_read_file(FILE *file, char **text, size_t *len)
+{
+   size_t size = MM_READ_CHUNK, got;
+   char *buffer = (char*)malloc(size + 1), *newbuff;
+
+   *len = 0;
+   if (!buffer)
+      return 0;
+
+   while ((got = fread(buffer + *len, 1, size - *len, file)) > 0)
+   {
+      *len += got;
+      if (*len == size)
+      {
+         if (!(newbuff = (char*)realloc(buffer, size * 2 + 1)))
+         {
+            free(buffer);
+            return 0;
+         }
+
+         buffer = newbuff;
+         size *= 2;
+      }
+   }
+
+   if (ferror(file))
+   {
+      free(buffer);
+      return 0;
+   }
+
+   buffer[*len] = '\0';
+   *text = buffer;
+   return 1;
+}
+
+int mm_add_text(MMTemplate *mt, const char *str, size_t len, size_t *offset)
+{
+   char *newtext;
+   size_t newsize;
+
+   if (mt->text_len + len > mt->text_size)
+   {
+      newsize = mt->text_size ? mt->text_size * 2 : 1024;
+      while (newsize < mt->text_len + len)
+         newsize *= 2;
+
+      if (!(newtext = (char*)realloc(mt->text, newsize)))
+         return 0;
+
+      mt->text = newtext;
+      mt->text_size = newsize;
+   }
+
+   if (offset)
+      *offset = mt->text_len;
+
+   memcpy(mt->text + mt->text_len, str, len);
+   mt->text_len += len;
+   return 1;
+}
+
+int mm_add_piece(MMTemplate *mt, MMPieceKind kind, size_t offset, size_t len)
+{
+   MMPiece *newpieces;
+
+   if (mt->piece_count == mt->piece_size)
+   {
+      int newsize = mt->piece_size ? mt->piece_size * 2 : 32;
+      if (!(newpieces = (MMPiece*)realloc(mt->pieces, newsize * sizeof(MMPiece))))
+         return 0;
+
+      mt->pieces = newpieces;
+      mt->piece_size = newsize;
+   }
+
+   mt->pieces[mt->piece_count].kind = kind;
+   mt->pieces[mt->piece_count].offset = offset;
+   mt->pieces[mt->piece_count].len = len;
+   mt->pieces[mt->piece_count].column = -1;
+   ++mt->piece_count;
+
+   return 1;
+}
+
+/**
+ * @brief Add text, joining it to the text piece before it if there is one.
+ *
+ * A dot starting a line inside a piece is stuffed here, once; a dot
+ * starting a piece may follow a value, so it is left to mm_write_pieces().
+ *
+ * @param line_start  *str* starts a line of the template.
+ */
+int mm_add_text_piece(MMTemplate *mt, const char *str, size_t len, int line_start)
+{
+   MMPiece *last = mt->piece_count ? &mt->pieces[mt->piece_count - 1] : NULL;
+   size_t offset;
+
+   if (!len)
+      return 1;
+
+   if (last && last->kind == MM_TEXT && last->offset + last->len == mt->text_len)
+   {
+      if (line_start && *str == '.')
+      {
+         if (!mm_add_text(mt, ".", 1, NULL))
+            return 0;
+         ++last->len;
+      }
+
+      if (!mm_add_text(mt, str, len, NULL))
+         return 0;
+
+      last->len += len;
+      return 1;
+   }
+
+   return mm_add_text(mt, str, len, &offset)
+      && mm_add_piece(mt, MM_TEXT, offset, len);
+}
+
+/**
+ * @brief Find the next {{name}} between *ptr* and *end*.
+ *
+ * @return Where the slot starts, with *name*, *name_len* and *after*,
+ *         past the closing braces, set, or NULL if there is no
+ *         complete slot.
+ */
+const char *mm_find_slot(const char *ptr, const char *end,
+                         const char **name, size_t *name_len, const char **after)
+{
+   const char *open, *close;
+
+   for (open = ptr; open + 1 < end; ++open)
+   {
+      if (open[0] != MM_SLOT_OPEN[0] || open[1] != MM_SLOT_OPEN[1])
+         continue;
+
+      for (close = open + 2; close + 1 < end; ++close)
+      {
+         if (close[0] == MM_SLOT_CLOSE[0] && close[1] == MM_SLOT_CLOSE[1])
+         {
+            *after = close + 2;
+            *name = open + 2;
+            while (*name < close && (**name == ' ' || **name == '\t'))
+               ++*name;
+
+            while (close > *name && (close[-1] == ' ' || close[-1] == '\t'))
+               --close;
+
+            *name_len = close - *name;
+            return open;
+         }
+      }
+
+      break;
+   }
+
+   return NULL;
+}
+
+/**
+ * @brief Add a line of header fields or body, with its slots, and a CRLF.
+ */
+int mm_add_line(MMTemplate *mt, const char *line, size_t len)
+{
+   const char *ptr = line, *end = line + len, *slot, *name, *after;
+   size_t name_len, offset;
+   int line_start = 1;
+
+   while ((slot = mm_find_slot(ptr, end, &name, &name_len, &after)))
+   {
+      if (!mm_add_text_piece(mt, ptr, slot - ptr, line_start)
+          || !mm_add_text(mt, name, name_len, &offset)
+          || !mm_add_piece(mt, MM_SLOT, offset, name_len))
+         return 0;
+
+      line_start = 0;
+      ptr = after;
+   }
+
+   return mm_add_text_piece(mt, ptr, end - ptr, line_start)
+      && mm_add_text_piece(mt, "\r\n", 2, 0);
+}
+
+/**
+ * @brief Add a recipient line, an address or a single {{name}}.
+ *
+ * @return 1 for success, 0 if memory failed or, after logging it, the
+ *         line mixes an address and slots.
+ */
+int mm_add_recipient(MMTemplate *mt, const MParcel *parcel, const char *line, size_t len)
+{
+   const char *end = line + len, *slot, *name, *after;
+   MMRecipient *recip, *newrecips;
+   size_t name_len;
+
+   if (!(newrecips = (MMRecipient*)realloc(mt->recipients,
+                                           (mt->recipient_count + 1) * sizeof(MMRecipient))))
+      return 0;
+
+   mt->recipients = newrecips;
+   recip = &mt->recipients[mt->recipient_count];
+   memset(recip, 0, sizeof(MMRecipient));
+   recip->column = -1;
+
+   switch(len ? *line : '\0')
+   {
+      case '+':
+         recip->rtype = RT_CC;
+         break;
+      case '-':
+         recip->rtype = RT_BCC;
+         break;
+      case '#':
+         recip->rtype = RT_SKIP;
+         break;
+      default:
+         recip->rtype = RT_TO;
+         break;
+   }
+
+   if (recip->rtype != RT_TO)
+      ++line;
+
+   while (line < end && (*line == ' ' || *line == '\t'))
+      ++line;
+   while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+      --end;
+
+   if ((slot = mm_find_slot(line, end, &name, &name_len, &after)))
+   {
+      if (slot != line || after != end)
+      {
+         mcb_log_message(parcel, "A template recipient must be an address or a single "
+                         MM_SLOT_OPEN "column" MM_SLOT_CLOSE ".", NULL);
+         return 0;
+      }
+
+      recip->slot = 1;
+      if (!mm_add_text(mt, name, name_len, &recip->offset))
+         return 0;
+
+      // mm_bind() compares names as strings:
+      if (!mm_add_text(mt, "", 1, NULL))
+         return 0;
+   }
+   else if (!mm_add_text(mt, line, end - line, &recip->offset)
+            || !mm_add_text(mt, "", 1, NULL))
+      return 0;
+
+   ++mt->recipient_count;
+   return 1;
+}
+
+int mm_compile(MMTemplate *mt, const MParcel *parcel, const char *path)
+{
+   FILE *file;
+   char *source = NULL, *line, *end, *eol;
+   size_t source_len, line_len, offset;
+   int in_recipients = 1, in_headers = 1, result = 0;
+
+   memset(mt, 0, sizeof(MMTemplate));
+
+   if (!(file = fopen(path, "r")))
+   {
+      mcb_log_message(parcel, "Failed to open template \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   if (!mm_read_file(file, &source, &source_len))
+   {
+      mcb_log_message(parcel, "Failed to read template \"", path, "\".", NULL);
+      fclose(file);
+      return 0;
+   }
+
+   fclose(file);
+
+   for (line = source, end = source + source_len; line < end; line = eol + 1)
+   {
+      if (!(eol = (char*)memchr(line, '\n', end - line)))
+         eol = end;
+
+      line_len = eol - line;
+      if (line_len && line[line_len - 1] == '\r')
+         --line_len;
+
+      // Only the first message of a batch file:
+      if (line_len && *line == '\f')
+         break;
+
+      if (in_recipients)
+      {
+         if (line_len && *line == '\v')
+            in_recipients = 0;
+         else if (line_len && !mm_add_recipient(mt, parcel, line, line_len))
+            goto failed;
+      }
+      else if (line_len && *line == '\v' && (line_len == 1 || line[1] == '#'))
+      {
+         // A section line ends the header fields, and is the body's first piece:
+         if (in_headers)
+         {
+            in_headers = 0;
+            mt->body_start = mt->piece_count;
+         }
+
+         if (!mm_add_text(mt, line, line_len, &offset)
+             || !mm_add_piece(mt, MM_SECTION, offset, line_len))
+            goto failed;
+      }
+      else if (!mm_add_line(mt, line, line_len))
+         goto failed;
+   }
+
+   if (in_headers)
+      mt->body_start = mt->piece_count;
+
+   if (!mt->recipient_count)
+   {
+      mcb_log_message(parcel, "Template \"", path, "\" has no recipients.", NULL);
+      goto failed_logged;
+   }
+
+   // A value and perhaps a stuffed dot per piece:
+   mt->iov_size = mt->piece_count * 2 + 1;
+
+   if (!(mt->iov = (struct iovec*)malloc(mt->iov_size * sizeof(struct iovec)))
+       || !(mt->links = (RecipLink*)malloc(mt->recipient_count * sizeof(RecipLink))))
+      goto failed;
+
+   result = 1;
+   goto done;
+
+  failed:
+   mcb_log_message(parcel, "Failed to compile template \"", path, "\".", NULL);
+  failed_logged:
+   mm_free_template(mt);
+  done:
+   free(source);
+   return result;
+}
+
+void mm_free_template(MMTemplate *mt)
+{
+   free(mt->text);
+   free(mt->recipients);
+   free(mt->links);
+   free(mt->pieces);
+   free(mt->iov);
+   memset(mt, 0, sizeof(MMTemplate));
+}
+
+/**
+ * @brief Parse the row at MMData::next, unquoting its fields in place.
+ *
+ * Fields past *max_fields* are parsed and dropped.  MMData::broken is
+ * set if a quoted field holds a line break.
+ *
+ * @return The number of fields in the row, -1 at the end of the data.
+ */
+int mm_parse_row(MMData *md, const char **fields, size_t *lengths, int max_fields)
+{
+   char *ptr = md->next, *end = md->text + md->len, *start, *out;
+   char delimiter = md->delimiter, chr;
+   int count = 0;
+
+   if (ptr >= end)
+      return -1;
+
+   while (1)
+   {
+      start = out = ptr;
+
+      if (delimiter == ',' && *ptr == '"')
+      {
+         // RFC 4180: "" is a quote, and anything else up to the closing quote is the value:
+         for (++ptr; ptr < end; *out++ = *ptr++)
+         {
+            if (*ptr == '"')
+            {
+               if (ptr + 1 < end && ptr[1] == '"')
+                  ++ptr;
+               else
+               {
+                  ++ptr;
+                  break;
+               }
+            }
+            else if (*ptr == '\r' || *ptr == '\n')
+               md->broken = 1;
+         }
+
+         // Stray characters after the closing quote are kept:
+         while (ptr < end && *ptr != delimiter && *ptr != '\r' && *ptr != '\n')
+            *out++ = *ptr++;
+      }
+      else
+      {
+         while (ptr < end && *ptr != delimiter && *ptr != '\r' && *ptr != '\n')
+            ++ptr;
+         out = ptr;
+      }
+
+      // The \0 may land on the terminator, so read it first:
+      chr = ptr < end ? *ptr : '\n';
+      *out = '\0';
+
+      if (count < max_fields)
+      {
+         fields[count] = start;
+         lengths[count] = out - start;
+      }
+      ++count;
+
+      if (ptr < end)
+         ++ptr;
+
+      if (chr != delimiter)
+      {
+         if (chr == '\r' && ptr < end && *ptr == '\n')
+            ++ptr;
+         break;
+      }
+   }
+
+   md->next = ptr;
+   return count;
+}
+
+int mm_open_data(MMData *md, const MParcel *parcel, FILE *file)
+{
+   const char *eol;
+   int count;
+
+   memset(md, 0, sizeof(MMData));
+   md->parcel = parcel;
+
+   if (!mm_read_file(file, &md->text, &md->len))
+   {
+      mcb_log_message(parcel, "Failed to read the merge data.", NULL);
+      return 0;
+   }
+
+   md->next = md->text;
+
+   // A tab in the names makes it TSV:
+   if (!(eol = (const char*)memchr(md->text, '\n', md->len)))
+      eol = md->text + md->len;
+   md->delimiter = memchr(md->text, '\t', eol - md->text) ? '\t' : ',';
+
+   if (!(md->names = (const char**)malloc(MM_MAX_COLUMNS * sizeof(const char*)))
+       || !(md->lengths = (size_t*)malloc(MM_MAX_COLUMNS * sizeof(size_t))))
+      goto out_of_memory;
+
+   if ((count = mm_parse_row(md, md->names, md->lengths, MM_MAX_COLUMNS)) < 0)
+   {
+      mcb_log_message(parcel, "The merge data has no column names.", NULL);
+      mm_free_data(md);
+      return 0;
+   }
+
+   if (count > MM_MAX_COLUMNS)
+   {
+      mcb_log_message(parcel, "The merge data has too many columns, the last are ignored.", NULL);
+      count = MM_MAX_COLUMNS;
+   }
+
+   md->column_count = count;
+   md->broken = 0;
+
+   if (!(md->values = (const char**)malloc(count * sizeof(const char*))))
+      goto out_of_memory;
+
+   return 1;
+
+  out_of_memory:
+   mcb_log_message(parcel, "Out of memory for the merge data.", NULL);
+   mm_free_data(md);
+   return 0;
+}
+
+void mm_free_data(MMData *md)
+{
+   free(md->text);
+   free(md->names);
+   free(md->values);
+   free(md->lengths);
+   memset(md, 0, sizeof(MMData));
+}
+
+int mm_find_column(const MMData *md, const char *name, size_t len)
+{
+   int column;
+
+   for (column = 0; column < md->column_count; ++column)
+      if (strlen(md->names[column]) == len && 0 == memcmp(md->names[column], name, len))
+         return column;
+
+   return -1;
+}
+
+int mm_bind(MMTemplate *mt, const MMData *md, const MParcel *parcel)
+{
+   MMPiece *piece = mt->pieces, *end = piece + mt->piece_count;
+   int i, result = 1;
+
+   for (; piece < end; ++piece)
+   {
+      if (piece->kind != MM_SLOT)
+         continue;
+
+      if ((piece->column = mm_find_column(md, mt->text + piece->offset, piece->len)) < 0)
+      {
+         char *name = (char*)alloca(piece->len + 1);
+         memcpy(name, mt->text + piece->offset, piece->len);
+         name[piece->len] = '\0';
+
+         mcb_log_message(parcel, "The merge data has no column \"", name, "\".", NULL);
+         result = 0;
+      }
+   }
+
+   for (i = 0; i < mt->recipient_count; ++i)
+   {
+      MMRecipient *recip = &mt->recipients[i];
+      const char *name = mt->text + recip->offset;
+
+      if (recip->slot && (recip->column = mm_find_column(md, name, strlen(name))) < 0)
+      {
+         mcb_log_message(parcel, "The merge data has no column \"", name, "\".", NULL);
+         result = 0;
+      }
+   }
+
+   return result;
+}
+
+int mm_next_row(MMData *md)
+{
+   int count, i;
+
+   do
+   {
+      md->broken = 0;
+      if ((count = mm_parse_row(md, md->values, md->lengths, md->column_count)) < 0)
+         return 0;
+   }
+   // Skip blank lines:
+   while (count == 1 && md->lengths[0] == 0);
+
+   // A short row leaves the last columns empty:
+   for (i = count; i < md->column_count; ++i)
+   {
+      md->values[i] = "";
+      md->lengths[i] = 0;
+   }
+
+   md->row = md->rows++;
+   return 1;
+}
+
+RecipLink *mm_recipients(MMTemplate *mt, const MMData *md)
+{
+   RecipLink *head = NULL, **tail = &head, *link;
+   const MMRecipient *recip;
+   const char *address;
+   int i;
+
+   for (i = 0; i < mt->recipient_count; ++i)
+   {
+      recip = &mt->recipients[i];
+      address = recip->slot ? md->values[recip->column] : mt->text + recip->offset;
+
+      if (!*address)
+         continue;
+
+      link = &mt->links[i];
+      memset(link, 0, sizeof(RecipLink));
+      link->rtype = recip->rtype;
+      link->address = address;
+
+      *tail = link;
+      tail = &link->next;
+   }
+
+   return head;
+}
+
+void mm_piece_data(const MMTemplate *mt, const MMData *md, const MMPiece *piece,
+                   const char **data, size_t *len)
+{
+   if (piece->kind == MM_SLOT)
+   {
+      *data = md->values[piece->column];
+      *len = md->lengths[piece->column];
+   }
+   else
+   {
+      *data = mt->text + piece->offset;
+      *len = piece->len;
+   }
+}
+
+/**
+ * @brief Write pieces *first* up to *last* as iovecs, a section line at a time.
+ */
+void mm_write_pieces(MParcel *parcel, const EmailBody *body, int first, int last)
+{
+   const MMMessage *message = (const MMMessage*)body->writer_data;
+   MMTemplate *mt = message->mt;
+   const MMPiece *piece = mt->pieces + first, *end = mt->pieces + last;
+   const char *data;
+   size_t len;
+   int count = 0, at_line_start = 1;
+
+   for (; piece < end; ++piece)
+   {
+      if (piece->kind == MM_SECTION)
+      {
+         if (count)
+            parcel->total_sent += stk_send_iovec(parcel->stalker, mt->iov, count);
+         count = 0;
+
+         (*body->section_printer)(parcel, mt->text + piece->offset, piece->len);
+         at_line_start = 1;
+         continue;
+      }
+
+      mm_piece_data(mt, message->md, piece, &data, &len);
+      if (!len)
+         continue;
+
+      if (at_line_start && *data == '.')
+      {
+         mt->iov[count].iov_base = (void*)".";
+         mt->iov[count].iov_len = 1;
+         ++count;
+      }
+
+      mt->iov[count].iov_base = (void*)data;
+      mt->iov[count].iov_len = len;
+      ++count;
+
+      at_line_start = data[len - 1] == '\n';
+   }
+
+   if (count)
+      parcel->total_sent += stk_send_iovec(parcel->stalker, mt->iov, count);
+}
+
+void mm_header_writer(MParcel *parcel, const EmailBody *body)
+{
+   mm_write_pieces(parcel, body, 0, ((const MMMessage*)body->writer_data)->mt->body_start);
+}
+
+void mm_body_writer(MParcel *parcel, const EmailBody *body)
+{
+   MMTemplate *mt = ((const MMMessage*)body->writer_data)->mt;
+   mm_write_pieces(parcel, body, mt->body_start, mt->piece_count);
+}
+
+void mm_send_message(MParcel *parcel,
+                     MMTemplate *mt,
+                     const MMData *md,
+                     EmailSectionPrinter section_printer)
+{
+   MMMessage message = { mt, md };
+   EmailBody body = { NULL, NULL, section_printer, mm_body_writer, (void*)&message,
+                      0, NULL, mm_header_writer };
+   ContentClass content_class;
+   RecipLink *recipients;
+   const char *data;
+   size_t len;
+   int i;
+
+   if (md->broken)
+   {
+      mcb_log_message(parcel, "A merge value has a line break, the row is not sent.", NULL);
+      return;
+   }
+
+   if (!(recipients = mm_recipients(mt, md)))
+   {
+      mcb_log_message(parcel, "A merge row has no recipients, it is not sent.", NULL);
+      return;
+   }
+
+   cl_init(&content_class);
+
+   for (i = mt->body_start; i < mt->piece_count; ++i)
+   {
+      if (mt->pieces[i].kind != MM_SECTION)
+      {
+         mm_piece_data(mt, md, &mt->pieces[i], &data, &len);
+         body.size_hint += len;
+         cl_scan(&content_class, data, len);
+      }
+   }
+
+   body.content_class = &content_class;
+
+   mcb_send_email_body(parcel, recipients, NULL, &body);
+}
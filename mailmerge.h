@@ -0,0 +1,143 @@
+#ifndef MAILMERGE_H
+#define MAILMERGE_H
+
+#include <stdio.h>
+#include <sys/uio.h>      // for struct iovec
+#include "mailcb.h"
+
+/**
+ * Mail merge: one template, sent once per row of a merge data file.
+ *
+ * The template is one message of the text batch format, recipients,
+ * \v, header fields, then the body with its \v# section lines, in
+ * which {{name}} stands for the value of column *name* of the merge
+ * data.  A recipient line is an address or a single {{name}}, after
+ * the usual +/-/# prefix.
+ *
+ * mm_compile() turns the template, once, into pieces: text, already
+ * in CRLF lines and dot-stuffed, slots naming a column, and section
+ * lines.  Each message is then a list of iovecs, text pieces and
+ * values straight from the merge data, written with stk_send_iovec(),
+ * so no message is ever built as a string.  The only dots left to
+ * stuff are those that begin a piece at the start of a line, and
+ * each of those is one more iovec.
+ *
+ * The merge data is CSV (RFC 4180) or, if its first line has a tab,
+ * TSV, with the column names in the first line.  It is read into
+ * memory whole and its fields are unquoted in place, so a row's
+ * values are pointers into it.  A value with a line break would break
+ * the message apart, so its row is not sent.
+ */
+
+#define MM_SLOT_OPEN  "{{"
+#define MM_SLOT_CLOSE "}}"
+
+typedef enum _mm_piece_kind
+{
+   MM_TEXT = 0,
+   MM_SLOT,
+   MM_SECTION
+} MMPieceKind;
+
+typedef struct _mm_piece
+{
+   MMPieceKind kind;
+   size_t      offset;    // of the text or section line in MMTemplate::text,
+   size_t      len;       //    or of the column name of a slot
+   int         column;    // of a slot, once bound by mm_bind()
+} MMPiece;
+
+typedef struct _mm_recipient
+{
+   RecipType   rtype;
+   size_t      offset;    // of the address in MMTemplate::text, if it is not a slot
+   int         slot;      // 1 if the address is column *column*
+   int         column;
+} MMRecipient;
+
+typedef struct _mm_template
+{
+   char         *text;          // the strings of the pieces, and column names
+   size_t       text_len;
+   size_t       text_size;
+
+   MMRecipient  *recipients;
+   int          recipient_count;
+   RecipLink    *links;         // a RecipLink per recipient, reused by each message
+
+   MMPiece      *pieces;        // header fields first, then the body
+   int          piece_count;
+   int          piece_size;
+   int          body_start;     // index of the first piece of the body
+
+   struct iovec *iov;           // working space for a message, reused
+   int          iov_size;
+} MMTemplate;
+
+typedef struct _mm_data
+{
+   const MParcel *parcel;       // for logging
+   char          *text;         // the whole file, unquoted in place
+   size_t        len;
+   char          delimiter;     // ',' or '\t'
+   char          *next;         // start of the next row
+
+   const char    **names;       // of the columns
+   int           column_count;
+
+   const char    **values;      // of the current row, \0-terminated
+   size_t        *lengths;
+   unsigned long row;           // index of the current row, from 0
+   unsigned long rows;          // rows read so far
+   int           broken;        // the current row has a value with a line break
+} MMData;
+
+/**
+ * @brief Compile a template file.
+ *
+ * @return 1 for success, 0 if the template can't be read or is malformed.
+ */
+int mm_compile(MMTemplate *mt, const MParcel *parcel, const char *path);
+void mm_free_template(MMTemplate *mt);
+
+/**
+ * @brief Read merge data, and the column names from its first line.
+ *
+ * @return 1 for success, 0 if reading or memory failed.
+ */
+int mm_open_data(MMData *md, const MParcel *parcel, FILE *file);
+void mm_free_data(MMData *md);
+
+/**
+ * @brief Find the column of each slot of the template.
+ *
+ * @return 1 for success, 0, after logging it, if a slot names no column.
+ */
+int mm_bind(MMTemplate *mt, const MMData *md, const MParcel *parcel);
+
+/**
+ * @brief Move to the next row.  The first call reads the first row.
+ *
+ * @return 1 with the row's values in MMData::values, 0 at the end.
+ */
+int mm_next_row(MMData *md);
+
+/**
+ * @brief The recipients of the current row, as a chain for mcb_send_email_body().
+ *
+ * The chain belongs to the template and is reused by the next row.
+ * Recipients whose address is empty in this row are left out.
+ *
+ * @return The chain, NULL if no recipient has an address.
+ */
+RecipLink *mm_recipients(MMTemplate *mt, const MMData *md);
+
+/**
+ * @brief Send the message of the current row with mcb_send_email_body().
+ */
+void mm_send_message(MParcel *parcel,
+                     MMTemplate *mt,
+                     const MMData *md,
+                     EmailSectionPrinter section_printer);
+
+#endif
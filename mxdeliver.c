@@ -0,0 +1,665 @@
+#include <stdio.h>
+#include <stdlib.h>       // for malloc(), free()
+#include <string.h>       // for memset(), strcasecmp()
+#include <strings.h>
+#include <unistd.h>       // for close(), gethostname()
+#include <poll.h>
+#include <netdb.h>        // for h_errno
+#include <arpa/nameser.h>
+#include <resolv.h>       // for res_query(), dn_expand()
+
+#include "socktalk.h"
+#include "mailcb.h"
+#include "mailcb_internal.h"
+#include "mxdeliver.h"
+#include "uring.h"
+#include "tlsmem.h"
+
+typedef enum _mxd_outcome
+{
+   MXD_DONE = 0,     // the server accepted or refused the message
+   MXD_REFUSED,      // the server turned down the envelope
+   MXD_BROKEN        // the connection failed, so another try may succeed
+} MXDOutcome;
+
+// Private, internal functions
+const char *mxd_address_domain(const char *address);
+int mxd_lookup(MXDelivery *mxd, const char *domain, MXHost *hosts);
+void mxd_activate(MXDelivery *mxd, MXConnection *conn);
+int mxd_connection_idle_ok(const MXConnection *conn);
+MXConnection *mxd_open_connection(MXDelivery *mxd, const char *host);
+MXConnection *mxd_get_connection(MXDelivery *mxd, const char *host, int *reused);
+void mxd_drop_connection(MXDelivery *mxd, MXConnection *conn);
+MXDOutcome mxd_transaction(MXDelivery *mxd, MXConnection *conn, RecipLink **resume);
+int mxd_send_domain(MXDelivery *mxd, const char *domain, RecipLink *group);
+
+void mxd_init(MXDelivery *mxd, MParcel *parcel)
+{
+   memset(mxd, 0, sizeof(MXDelivery));
+   mxd->parcel = parcel;
+   mxd->resolver = mxd_dns_resolver;
+   mxd->port = MXD_DEFAULT_PORT;
+   mxd->mx_ttl = MXD_DEFAULT_MX_TTL;
+   mxd->max_connections = MXD_DEFAULT_MAX_CONNECTIONS;
+   mxd->use_starttls = 1;
+   rb_init(&mxd->rendered);
+
+   if (!parcel->helo_name)
+   {
+      if (gethostname(mxd->helo_buffer, sizeof(mxd->helo_buffer)) || !*mxd->helo_buffer)
+         snprintf(mxd->helo_buffer, sizeof(mxd->helo_buffer), "localhost");
+      mxd->helo_buffer[sizeof(mxd->helo_buffer)-1] = '\0';
+      parcel->helo_name = mxd->helo_buffer;
+   }
+}
+
+void mxd_set_resolver(MXDelivery *mxd, MXResolver resolver, void *data)
+{
+   mxd->resolver = resolver;
+   mxd->resolver_data = data;
+}
+
+void mxd_close(MXDelivery *mxd)
+{
+   MXCacheEntry *entry;
+
+   while (mxd->pool)
+      mxd_drop_connection(mxd, mxd->pool);
+
+   while ((entry = mxd->mx_cache))
+   {
+      mxd->mx_cache = entry->next;
+      free(entry);
+   }
+
+   if (mxd->ssl_context)
+   {
+      SSL_CTX_free(mxd->ssl_context);
+      mxd->ssl_context = NULL;
+   }
+
+   rb_free(&mxd->rendered);
+}
+
+int mxd_dns_resolver(void *data, const char *domain, MXHost *hosts, int max_hosts)
+{
+   unsigned char answer[4096];
+   char name[MXD_HOST_LEN];
+   ns_msg msg;
+   ns_rr rr;
+   int answer_len, i, j, record_count;
+   int count = 0;
+
+   answer_len = res_query(domain, ns_c_in, ns_t_mx, answer, sizeof(answer));
+   if (answer_len < 0)
+   {
+      // The domain exists but has no MX: it is its own exchanger.
+      if (h_errno == NO_DATA)
+         goto implicit_mx;
+
+      // Only a domain that doesn't exist is a lasting failure.  A
+      // timeout or a server failure (TRY_AGAIN, NO_RECOVERY) may
+      // clear up by the next try.
+      if (h_errno == HOST_NOT_FOUND)
+         return 0;
+
+      return -1;
+   }
+
+   if (ns_initparse(answer, answer_len, &msg) < 0)
+      return -1;
+
+   record_count = ns_msg_count(msg, ns_s_an);
+   for (i=0; i < record_count && count < max_hosts; ++i)
+   {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_mx)
+         continue;
+
+      const unsigned char *rdata = ns_rr_rdata(rr);
+      int preference = ns_get16(rdata);
+
+      if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 2, name, sizeof(name)) < 0)
+         continue;
+
+      // Null MX: the domain accepts no mail at all.
+      if (*name == '\0')
+         return 0;
+
+      // Keep the list ordered by preference:
+      j = count++;
+      while (j > 0 && hosts[j-1].preference > preference)
+      {
+         hosts[j] = hosts[j-1];
+         --j;
+      }
+      hosts[j].preference = preference;
+      snprintf(hosts[j].name, sizeof(hosts[j].name), "%s", name);
+   }
+
+   if (count)
+      return count;
+
+  implicit_mx:
+   if (max_hosts < 1)
+      return 0;
+
+   hosts[0].preference = 0;
+   snprintf(hosts[0].name, sizeof(hosts[0].name), "%s", domain);
+   return 1;
+}
+
+int mxd_fixed_resolver(void *data, const char *domain, MXHost *hosts, int max_hosts)
+{
+   if (!data || max_hosts < 1)
+      return 0;
+
+   hosts[0].preference = 0;
+   snprintf(hosts[0].name, sizeof(hosts[0].name), "%s", (const char*)data);
+   return 1;
+}
+
+/**
+ * @brief Pointer to the domain part of an address, NULL if there is none.
+ */
+const char *mxd_address_domain(const char *address)
+{
+   const char *at = strrchr(address, '@');
+   if (at && at[1])
+      return at + 1;
+   else
+      return NULL;
+}
+
+/**
+ * @brief Get the MX hosts for *domain* from the cache or the resolver.
+ */
+int mxd_lookup(MXDelivery *mxd, const char *domain, MXHost *hosts)
+{
+   MXCacheEntry **link = &mxd->mx_cache;
+   MXCacheEntry *entry;
+   time_t now = time(NULL);
+
+   ++mxd->mx_lookups;
+
+   while ((entry = *link))
+   {
+      if (entry->expires <= now)
+      {
+         *link = entry->next;
+         free(entry);
+         continue;
+      }
+
+      if (0 == strcasecmp(entry->domain, domain))
+      {
+         ++mxd->mx_cache_hits;
+         memcpy(hosts, entry->hosts, entry->host_count * sizeof(MXHost));
+         return entry->host_count;
+      }
+
+      link = &entry->next;
+   }
+
+   int count = (*mxd->resolver)(mxd->resolver_data, domain, hosts, MXD_MAX_HOSTS);
+
+   // A failure for now is not remembered, so the next message tries again:
+   if (count < 0)
+      return count;
+
+   if (mxd->mx_ttl > 0 && (entry = (MXCacheEntry*)malloc(sizeof(MXCacheEntry))))
+   {
+      snprintf(entry->domain, sizeof(entry->domain), "%s", domain);
+      entry->expires = now + mxd->mx_ttl;
+      entry->host_count = count;
+      memcpy(entry->hosts, hosts, count * sizeof(MXHost));
+      entry->next = mxd->mx_cache;
+      mxd->mx_cache = entry;
+   }
+
+   return count;
+}
+
+/**
+ * @brief Point the parcel at a pooled connection for the next transaction.
+ */
+void mxd_activate(MXDelivery *mxd, MXConnection *conn)
+{
+   MParcel *parcel = mxd->parcel;
+   parcel->stalker = &conn->talker;
+   parcel->host_url = conn->host;
+   parcel->caps = conn->caps;
+   smtp_discard_replies(parcel);
+}
+
+/**
+ * @brief Returns 0 if an idle connection has been closed or spoken to
+ *        by the server (likely a 421 timeout notice) since its last use.
+ *
+ * TLS connections are not checked, since unread TLS records are not
+ * necessarily SMTP replies.  A stale one is caught when it fails.
+ */
+int mxd_connection_idle_ok(const MXConnection *conn)
+{
+   struct pollfd pfd = { conn->socket_handle, POLLIN, 0 };
+
+   if (conn->ssl || conn->talker.tls_session)
+      return 1;
+
+   return 0 == poll(&pfd, 1, 0);
+}
+
+/**
+ * @brief Connect, read the greeting, send EHLO, and start TLS if possible.
+ */
+MXConnection *mxd_open_connection(MXDelivery *mxd, const char *host)
+{
+   MParcel *parcel = mxd->parcel;
+   char buffer[4096];
+   int socket_handle;
+
+   socket_handle = get_connected_socket(parcel, host, mxd->port);
+   if (socket_handle < 0)
+      return NULL;
+
+   MXConnection *conn = (MXConnection*)malloc(sizeof(MXConnection));
+   if (!conn)
+   {
+      close(socket_handle);
+      return NULL;
+   }
+
+   memset(conn, 0, sizeof(MXConnection));
+   snprintf(conn->host, sizeof(conn->host), "%s", host);
+   conn->port = mxd->port;
+   conn->socket_handle = socket_handle;
+   if (!ur_init_talker(&conn->talker, socket_handle))
+      init_sock_talker(&conn->talker, socket_handle);
+
+   mxd_activate(mxd, conn);
+
+   if (!smtp_read_reply(parcel, buffer, sizeof(buffer)) || atoi(buffer) != 220)
+   {
+      mcb_log_message(parcel, "Mail exchanger ", host, " refused the session: ", buffer, NULL);
+      goto abandon_connection;
+   }
+
+   mcb_send_data(parcel, "EHLO ", smtp_helo_name(parcel), NULL);
+   smtp_read_reply(parcel, buffer, sizeof(buffer));
+   smtp_parse_greeting_response(parcel, buffer, strlen(buffer));
+
+   if (mxd->use_starttls && parcel->caps.cap_starttls)
+   {
+      mcb_send_data(parcel, "STARTTLS", NULL);
+      if (!smtp_read_reply(parcel, buffer, sizeof(buffer)) || atoi(buffer) != 220)
+      {
+         mcb_log_message(parcel, "STARTTLS failed (", buffer, ") at ", host, NULL);
+         goto abandon_connection;
+      }
+
+      smtp_discard_replies(parcel);
+
+      if (!mxd->ssl_context)
+      {
+         ssl_init_library();
+         if (!(mxd->ssl_context = ssl_new_context(parcel)))
+            goto abandon_connection;
+      }
+
+      ur_end_talker(&conn->talker);
+
+      if (parcel->tls_memory_bio)
+      {
+         if (!tm_start(parcel, &conn->talker, mxd->ssl_context, socket_handle))
+            goto abandon_connection;
+      }
+      else if ((conn->ssl = ssl_start(parcel, mxd->ssl_context, socket_handle)))
+      {
+         init_ssl_talker(&conn->talker, conn->ssl);
+         conn->talker.socket_handle = socket_handle;
+      }
+      else
+         goto abandon_connection;
+
+      if (stk_ktls_send(&conn->talker))
+         mcb_advise_message(parcel, "Kernel TLS offload is active for ", host, ".", NULL);
+
+      // Capabilities may differ once the session is encrypted:
+      mcb_send_data(parcel, "EHLO ", smtp_helo_name(parcel), NULL);
+      smtp_read_reply(parcel, buffer, sizeof(buffer));
+      smtp_parse_greeting_response(parcel, buffer, strlen(buffer));
+   }
+
+   conn->caps = parcel->caps;
+   conn->last_used = time(NULL);
+
+   ++mxd->connections_opened;
+   return conn;
+
+  abandon_connection:
+   tm_end_talker(parcel, &conn->talker, 0);
+   ur_end_talker(&conn->talker);
+   if (conn->ssl)
+      SSL_free(conn->ssl);
+   close(socket_handle);
+   free(conn);
+   return NULL;
+}
+
+/**
+ * @brief Find a usable pooled connection to *host*, or open one.
+ */
+MXConnection *mxd_get_connection(MXDelivery *mxd, const char *host, int *reused)
+{
+   MXConnection *conn, *oldest = NULL;
+   int count = 0;
+
+   *reused = 0;
+
+   conn = mxd->pool;
+   while (conn)
+   {
+      MXConnection *next = conn->next;
+
+      if (!conn->broken && conn->port == mxd->port && 0 == strcasecmp(conn->host, host))
+      {
+         if (mxd_connection_idle_ok(conn))
+         {
+            ++mxd->connections_reused;
+            *reused = 1;
+            return conn;
+         }
+
+         conn->broken = 1;
+      }
+
+      if (conn->broken)
+         mxd_drop_connection(mxd, conn);
+      else
+      {
+         ++count;
+         if (!oldest || conn->last_used < oldest->last_used)
+            oldest = conn;
+      }
+
+      conn = next;
+   }
+
+   if (count >= mxd->max_connections && oldest)
+      mxd_drop_connection(mxd, oldest);
+
+   if ((conn = mxd_open_connection(mxd, host)))
+   {
+      conn->next = mxd->pool;
+      mxd->pool = conn;
+   }
+
+   return conn;
+}
+
+/**
+ * @brief Remove a connection from the pool, saying QUIT if it's still healthy.
+ */
+void mxd_drop_connection(MXDelivery *mxd, MXConnection *conn)
+{
+   MXConnection **link = &mxd->pool;
+   while (*link && *link != conn)
+      link = &(*link)->next;
+   if (*link)
+      *link = conn->next;
+
+   if (!conn->broken)
+   {
+      STalker *old_talker = mxd->parcel->stalker;
+      mxd->parcel->stalker = &conn->talker;
+      mcb_smtp_quit_server(mxd->parcel);
+      mxd->parcel->stalker = old_talker;
+   }
+
+   if (conn->ssl)
+   {
+      if (!conn->broken)
+         SSL_shutdown(conn->ssl);
+      SSL_free(conn->ssl);
+   }
+
+   tm_end_talker(mxd->parcel, &conn->talker, !conn->broken);
+   ur_end_talker(&conn->talker);
+   close(conn->socket_handle);
+   free(conn);
+}
+
+/**
+ * @brief Run the mail transactions for a group of recipients on an active connection.
+ *
+ * A group larger than the server's recipient limit goes out in
+ * several transactions.  *resume* starts at the first recipient to
+ * send and, if the connection breaks, is left at the first recipient
+ * of the unfinished transaction so a retry elsewhere doesn't repeat
+ * the ones that were completed.
+ */
+MXDOutcome mxd_transaction(MXDelivery *mxd, MXConnection *conn, RecipLink **resume)
+{
+   MParcel *parcel = mxd->parcel;
+   RecipLink *ptr, *batch, *next;
+   int accepted = 0;
+
+   for (ptr = *resume; ptr; ptr = ptr->next)
+      ptr->rcpt_status = 0;
+
+   // Each MX has its own SIZE limit:
+   if (!smtp_size_fits(parcel, *resume, NULL))
+      return MXD_REFUSED;
+
+   while ((batch = *resume))
+   {
+      ++mxd->transactions;
+      ++conn->transactions;
+      conn->last_used = time(NULL);
+
+      if (smtp_send_envelope(parcel, batch, &next))
+      {
+         if (parcel->OnlySendEnvelope)
+         {
+            if (!smtp_reset_transaction(parcel))
+               break;
+         }
+         else if (!smtp_send_rendered(parcel, &mxd->rendered))
+         {
+            smtp_fail_transaction(batch, next, 0);
+            break;
+         }
+         else if (0 == smtp_finish_data(parcel, batch, next))
+            break;
+
+         accepted = 1;
+      }
+      // A server that can't answer RSET wasn't refusing, it was gone:
+      else if (!smtp_reset_transaction(parcel))
+         break;
+
+      // Later connections to this server start with what was learned:
+      conn->caps = parcel->caps;
+      *resume = next;
+   }
+
+   if (*resume)
+   {
+      conn->broken = 1;
+      return MXD_BROKEN;
+   }
+
+   return accepted ? MXD_DONE : MXD_REFUSED;
+}
+
+/**
+ * @brief Deliver to one domain's recipients, trying its MXs in order of preference.
+ *
+ * @return 1 if the transaction completed, 0 if not.
+ */
+int mxd_send_domain(MXDelivery *mxd, const char *domain, RecipLink *group)
+{
+   MParcel *parcel = mxd->parcel;
+   MXHost hosts[MXD_MAX_HOSTS];
+   MXConnection *conn;
+   RecipLink *ptr, *resume = group;
+   int host_count, i, reused;
+
+   host_count = mxd_lookup(mxd, domain, hosts);
+   if (host_count < 0)
+   {
+      // Like a 451 from the server, so the recipients are tried later:
+      for (ptr = group; ptr; ptr = ptr->next)
+         ptr->rcpt_status = 451;
+
+      mcb_log_message(parcel, "The mail exchanger lookup for domain ", domain, " failed for now.", NULL);
+      return 0;
+   }
+   else if (host_count == 0)
+   {
+      mcb_log_message(parcel, "No mail exchanger for domain ", domain, ".", NULL);
+      return 0;
+   }
+
+   for (i=0; i < host_count; ++i)
+   {
+      // A reused connection may have gone stale, so a failure on one
+      // earns a retry on a fresh connection:
+      do
+      {
+         if (!(conn = mxd_get_connection(mxd, hosts[i].name, &reused)))
+            break;
+
+         mxd_activate(mxd, conn);
+         switch(mxd_transaction(mxd, conn, &resume))
+         {
+            case MXD_DONE:
+               return 1;
+            case MXD_REFUSED:
+               return 0;
+            case MXD_BROKEN:
+               mxd_drop_connection(mxd, conn);
+               break;
+         }
+      }
+      while (reused);
+   }
+
+   for (ptr = resume; ptr; ptr = ptr->next)
+      ptr->rcpt_status = 0;
+
+   mcb_log_message(parcel, "No mail exchanger for domain ", domain, " could take the message.", NULL);
+   return 0;
+}
+
+int mxd_send_email(MXDelivery *mxd,
+                   RecipLink *recipients,
+                   const HeaderField *headers,
+                   const EmailBody *body)
+{
+   MParcel *parcel = mxd->parcel;
+   RecipLink *ptr, *copies = NULL, *head, *tail;
+   RecipLink **originals = NULL;
+   char *grouped = NULL;
+   const char *domain, *other;
+   int count = 0, i, j;
+   int domains_done = 0;
+
+   // Save what mxd_activate() will change:
+   STalker    *saved_talker = parcel->stalker;
+   const char *saved_host = parcel->host_url;
+   SmtpCaps   saved_caps = parcel->caps;
+
+   ++mxd->messages;
+
+   rb_reset(&mxd->rendered);
+   if (!mcb_render_message(parcel, recipients, headers, body, &mxd->rendered))
+   {
+      mcb_log_message(parcel, "Out of memory while rendering message.", NULL);
+      goto report;
+   }
+
+   // Rendered, so SIZE= can be exact:
+   parcel->message_size = mxd->rendered.len;
+
+   for (ptr = recipients; ptr; ptr = ptr->next)
+      if (ptr->rtype != RT_SKIP)
+         ++count;
+
+   if (count == 0)
+      goto report;
+
+   // Work on copies so the caller's chain keeps its order and links:
+   copies = (RecipLink*)malloc(count * sizeof(RecipLink));
+   originals = (RecipLink**)malloc(count * sizeof(RecipLink*));
+   grouped = (char*)calloc(count, 1);
+   if (!copies || !originals || !grouped)
+   {
+      mcb_log_message(parcel, "Out of memory while grouping recipients.", NULL);
+      goto report;
+   }
+
+   for (i=0, ptr = recipients; ptr; ptr = ptr->next)
+   {
+      if (ptr->rtype != RT_SKIP)
+      {
+         originals[i] = ptr;
+         copies[i] = *ptr;
+         copies[i].next = NULL;
+         ++i;
+      }
+   }
+
+   for (i=0; i < count; ++i)
+   {
+      if (grouped[i])
+         continue;
+
+      grouped[i] = 1;
+      domain = mxd_address_domain(copies[i].address);
+      if (!domain)
+      {
+         mcb_log_message(parcel, "Recipient, ", copies[i].address, ", has no domain.", NULL);
+         continue;
+      }
+
+      // Chain every later recipient of the same domain:
+      head = tail = &copies[i];
+      for (j = i+1; j < count; ++j)
+      {
+         if (!grouped[j]
+             && (other = mxd_address_domain(copies[j].address))
+             && 0 == strcasecmp(domain, other))
+         {
+            grouped[j] = 1;
+            tail->next = &copies[j];
+            tail = &copies[j];
+         }
+      }
+
+      domains_done += mxd_send_domain(mxd, domain, head);
+   }
+
+   for (i=0; i < count; ++i)
+   {
+      originals[i]->rcpt_status = copies[i].rcpt_status;
+      originals[i]->enh_status = copies[i].enh_status;
+   }
+
+  report:
+   parcel->stalker = saved_talker;
+   parcel->host_url = saved_host;
+   parcel->caps = saved_caps;
+   parcel->message_size = 0;
+
+   if (copies)
+      free(copies);
+   if (originals)
+      free(originals);
+   if (grouped)
+      free(grouped);
+
+   if (parcel->report_recipients)
+      (*parcel->report_recipients)(parcel, recipients);
+
+   return domains_done;
+}
@@ -0,0 +1,147 @@
+#ifndef MXDELIVER_H
+#define MXDELIVER_H
+
+#include <time.h>
+#include "mailcb.h"
+
+/**
+ * Direct delivery to each recipient domain's mail exchangers.
+ *
+ * Instead of handing every message to the single relay at
+ * MParcel::host_url, the recipients of each message are grouped by
+ * domain and each group goes out in its own transaction to that
+ * domain's most preferred reachable MX.  The message is rendered once
+ * and the same bytes go to every domain.
+ *
+ * Connections are kept in a pool, keyed by MX host and port, so that
+ * later messages for the same MX reuse the established (and perhaps
+ * TLS-secured) session.  MX lookups are also remembered for
+ * MXDelivery::mx_ttl seconds.
+ *
+ * The MX resolver is a function pointer, so tests and local setups
+ * can point every domain at a stand-in server.  The default resolver
+ * queries DNS with res_query() and links with -lresolv.
+ *
+ * An MXDelivery belongs to one thread.  Since a pooled TLS connection
+ * the server has dropped can raise SIGPIPE when written, applications
+ * should ignore that signal.
+ */
+
+#define MXD_HOST_LEN 256
+#define MXD_MAX_HOSTS 8
+#define MXD_DEFAULT_PORT 25
+#define MXD_DEFAULT_MX_TTL 300
+#define MXD_DEFAULT_MAX_CONNECTIONS 16
+
+typedef struct _mx_host
+{
+   char name[MXD_HOST_LEN];
+   int  preference;
+} MXHost;
+
+/**
+ * @brief Find the mail exchangers for a domain, most preferred first.
+ *
+ * @return Number of hosts written to *hosts*, 0 if the domain accepts
+ *         no mail, or -1 if the lookup failed for now and may be tried
+ *         again later.  Only the hosts, or the 0, are cached.
+ */
+typedef int (*MXResolver)(void *data, const char *domain, MXHost *hosts, int max_hosts);
+
+typedef struct _mx_connection
+{
+   struct _mx_connection *next;
+   char     host[MXD_HOST_LEN];
+   int      port;
+   int      socket_handle;
+   SSL      *ssl;
+   STalker  talker;
+   SmtpCaps caps;
+   time_t   last_used;
+   int      transactions;
+   int      broken;          // don't reuse: the server closed or misbehaved
+} MXConnection;
+
+typedef struct _mx_cache_entry
+{
+   struct _mx_cache_entry *next;
+   char   domain[MXD_HOST_LEN];
+   time_t expires;
+   int    host_count;
+   MXHost hosts[MXD_MAX_HOSTS];
+} MXCacheEntry;
+
+typedef struct _mx_delivery
+{
+   /** Sender settings, logging, and report_recipients come from this parcel. */
+   MParcel    *parcel;
+
+   MXResolver resolver;
+   void       *resolver_data;
+
+   int        port;              // SMTP port on every MX, 25 by default
+   int        mx_ttl;            // seconds to remember MX lookups
+   int        max_connections;   // pool size; the least recently used is closed beyond it
+   int        use_starttls;      // upgrade connections to MXs that offer STARTTLS
+
+   MXConnection *pool;
+   MXCacheEntry *mx_cache;
+   SSL_CTX      *ssl_context;
+
+   RenderBuffer rendered;        // reused for each message
+   char         helo_buffer[MXD_HOST_LEN];
+
+   /** Statistics */
+   unsigned long messages;
+   unsigned long transactions;
+   unsigned long connections_opened;
+   unsigned long connections_reused;
+   unsigned long mx_lookups;
+   unsigned long mx_cache_hits;
+} MXDelivery;
+
+/**
+ * @brief Prepare an MXDelivery that sends on behalf of *parcel*.
+ *
+ * If MParcel::helo_name is not set, it is set to this machine's host
+ * name, since announcing the relay name to an MX makes no sense.
+ */
+void mxd_init(MXDelivery *mxd, MParcel *parcel);
+void mxd_set_resolver(MXDelivery *mxd, MXResolver resolver, void *data);
+
+/**
+ * @brief Send QUIT on every pooled connection, then release all resources.
+ */
+void mxd_close(MXDelivery *mxd);
+
+/**
+ * @brief MXResolver that looks up MX records in DNS.
+ *
+ * Follows RFC 5321 section 5.1: a domain without MX records is its own
+ * exchanger, and a "null MX" (RFC 7505) means no mail is accepted.
+ * A domain that doesn't exist gets 0 hosts; any other failure, such
+ * as a timeout or SERVFAIL, gets -1.
+ */
+int mxd_dns_resolver(void *data, const char *domain, MXHost *hosts, int max_hosts);
+
+/**
+ * @brief MXResolver that names the host in *data* (a const char*) for every domain.
+ */
+int mxd_fixed_resolver(void *data, const char *domain, MXHost *hosts, int max_hosts);
+
+/**
+ * @brief Deliver one message to the MXs of all its recipients' domains.
+ *
+ * Each RecipLink::rcpt_status is set from the reply of its own domain's
+ * server.  Recipients whose domains could not be reached keep a status of 0,
+ * but those whose domain's MX lookup failed for now get 451.
+ * MParcel::report_recipients, if set, is called once with the whole chain.
+ *
+ * @return Number of domains whose transaction completed.
+ */
+int mxd_send_email(MXDelivery *mxd,
+                   RecipLink *recipients,
+                   const HeaderField *headers,
+                   const EmailBody *body);
+
+#endif
@@ -0,0 +1,524 @@
+#include <stdlib.h>       // for malloc(), realloc(), free()
+#include <string.h>       // for memcpy(), memset()
+#include <time.h>         // for clock_gettime()
+
+#include "buffread.h"
+#include "parseahead.h"
+
+#define PA_READ_BUFFER_LEN 16384
+#define PA_SEND_BUFFER_LEN 16384
+#define PA_INITIAL_ARENA   4096
+#define PA_INITIAL_SPANS   16
+
+// Private, internal functions
+long long pa_now_usecs(void);
+int pa_reserve(PAMessage *message, size_t len);
+int pa_add_span(PAMessage *message, PASpanKind kind, RecipType rtype, const char *str, int len);
+int pa_append_line(PAMessage *message, const char *line, int line_len);
+int pa_build_links(PAMessage *message);
+void pa_skip_to_end(EmailLineJudge line_judger, BuffControl *bc);
+int pa_push(PAQueue *queue, PAMessage *message);
+void *pa_parser_thread(void *data);
+
+long long pa_now_usecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Make room for *len* more bytes in the message's arena.
+ */
+int pa_reserve(PAMessage *message, size_t len)
+{
+   size_t size = message->arena_size ? message->arena_size : PA_INITIAL_ARENA;
+   char *arena;
+
+   if (message->arena_len + len <= message->arena_size)
+      return 1;
+
+   while (size < message->arena_len + len)
+      size *= 2;
+
+   if (!(arena = (char*)realloc(message->arena, size)))
+      return 0;
+
+   message->arena = arena;
+   message->arena_size = size;
+   return 1;
+}
+
+/**
+ * @brief Copy a string into the arena, \0-terminated, and record where it is.
+ */
+int pa_add_span(PAMessage *message, PASpanKind kind, RecipType rtype, const char *str, int len)
+{
+   PASpan *span;
+
+   if (message->span_count == message->span_size)
+   {
+      int size = message->span_size ? message->span_size * 2 : PA_INITIAL_SPANS;
+      PASpan *spans = (PASpan*)realloc(message->spans, size * sizeof(PASpan));
+      if (!spans)
+         return 0;
+
+      message->spans = spans;
+      message->span_size = size;
+   }
+
+   if (!pa_reserve(message, len + 1))
+      return 0;
+
+   span = &message->spans[message->span_count++];
+   span->kind = kind;
+   span->rtype = rtype;
+   span->offset = message->arena_len;
+   span->len = len;
+
+   memcpy(&message->arena[message->arena_len], str, len);
+   message->arena[message->arena_len + len] = '\0';
+   message->arena_len += len + 1;
+
+   return 1;
+}
+
+int pa_append_line(PAMessage *message, const char *line, int line_len)
+{
+   if (!pa_reserve(message, line_len + 1))
+      return 0;
+
+   memcpy(&message->arena[message->arena_len], line, line_len);
+   message->arena[message->arena_len + line_len] = '\n';
+   message->arena_len += line_len + 1;
+   ++message->body_lines;
+
+   // In the parser thread, so the sender has its encoding at hand:
+   cl_scan_line(&message->content_class, line, line_len);
+
+   return 1;
+}
+
+/**
+ * @brief Turn the spans of a complete message into RecipLink and HeaderField chains.
+ */
+int pa_build_links(PAMessage *message)
+{
+   int counts[3] = { 0, 0, 0 };
+   int i;
+
+   for (i=0; i < message->span_count; ++i)
+      ++counts[message->spans[i].kind];
+
+   message->links = calloc(1,
+                           counts[PA_RECIPIENT] * sizeof(RecipLink)
+                           + counts[PA_HEADER_NAME] * sizeof(HeaderField)
+                           + counts[PA_HEADER_VALUE] * sizeof(FieldValue)
+                           + 1);
+   if (!message->links)
+      return 0;
+
+   RecipLink   *rlink = (RecipLink*)message->links;
+   HeaderField *field = (HeaderField*)(rlink + counts[PA_RECIPIENT]);
+   FieldValue  *fvalue = (FieldValue*)(field + counts[PA_HEADER_NAME]);
+
+   RecipLink   **rtail = &message->recipients;
+   HeaderField **ftail = &message->headers;
+   FieldValue  **vtail = NULL;
+
+   for (i=0; i < message->span_count; ++i)
+   {
+      const PASpan *span = &message->spans[i];
+      const char *str = &message->arena[span->offset];
+
+      switch(span->kind)
+      {
+         case PA_RECIPIENT:
+            rlink->rtype = span->rtype;
+            rlink->address = str;
+            *rtail = rlink;
+            rtail = &(rlink++)->next;
+            break;
+         case PA_HEADER_NAME:
+            field->name = str;
+            *ftail = field;
+            vtail = &field->value;
+            ftail = &(field++)->next;
+            break;
+         case PA_HEADER_VALUE:
+            fvalue->value = str;
+            *vtail = fvalue;
+            vtail = &(fvalue++)->next;
+            break;
+      }
+   }
+
+   // The arena no longer moves, and the spans are no longer needed:
+   free(message->spans);
+   message->spans = NULL;
+   message->span_count = message->span_size = 0;
+
+   return 1;
+}
+
+void pa_skip_to_end(EmailLineJudge line_judger, BuffControl *bc)
+{
+   const char *line;
+   int line_len;
+
+   while (bc_get_next_line(bc, &line, &line_len))
+      if (LJ_End_Message == (*line_judger)(line, line_len))
+         break;
+}
+
+int pa_read_message(const MParcel *parcel,
+                    EmailLineJudge line_judger,
+                    BuffControl *bc,
+                    PAMessage **message)
+{
+   const char *line, *name, *value;
+   int line_len, name_len, value_len;
+   int got_line = 0, recipient_count = 0, have_field = 0;
+   RecipType rtype;
+   LJOutcomes judgement = LJ_Continue;
+   PAMessage *pm;
+
+   *message = NULL;
+
+   if (!(pm = (PAMessage*)calloc(1, sizeof(PAMessage))))
+      goto out_of_memory;
+
+   while (bc_get_next_line(bc, &line, &line_len))
+   {
+      got_line = 1;
+      if (LJ_Continue != (judgement = (*line_judger)(line, line_len)))
+         break;
+
+      switch(line_len ? *line : '\0')
+      {
+         case '+':
+            rtype = RT_CC;
+            break;
+         case '-':
+            rtype = RT_BCC;
+            break;
+         case '#':
+            rtype = RT_SKIP;
+            break;
+         default:
+            rtype = RT_TO;
+            break;
+      }
+
+      if (rtype != RT_TO)
+      {
+         ++line;
+         --line_len;
+      }
+
+      if (rtype != RT_SKIP)
+         ++recipient_count;
+
+      if (!pa_add_span(pm, PA_RECIPIENT, rtype, line, line_len))
+         goto out_of_memory;
+   }
+
+   if (!got_line)
+   {
+      pa_free_message(pm);
+      return -1;
+   }
+
+   if (judgement != LJ_End_Section || recipient_count == 0)
+   {
+      if (recipient_count == 0)
+         mcb_log_message(parcel, "No recipients for this email, which will now not be sent.", NULL);
+      else
+         mcb_log_message(parcel, "Incomplete email, not sent.", NULL);
+
+      if (judgement == LJ_End_Section)
+         pa_skip_to_end(line_judger, bc);
+
+      pa_free_message(pm);
+      return 0;
+   }
+
+   judgement = LJ_Continue;
+   while (bc_get_next_line(bc, &line, &line_len))
+   {
+      if (LJ_Continue != (judgement = (*line_judger)(line, line_len)))
+         break;
+
+      mcb_parse_header_line(line, &line[line_len], &name, &name_len, &value, &value_len);
+
+      if (name_len)
+      {
+         if (!pa_add_span(pm, PA_HEADER_NAME, RT_TO, line, name_len))
+            goto out_of_memory;
+         have_field = 1;
+      }
+
+      // Header field values may span multiple lines:
+      if (value_len && have_field)
+         if (!pa_add_span(pm, PA_HEADER_VALUE, RT_TO, value, value_len))
+            goto out_of_memory;
+   }
+
+   // The body starts with the section line that ended the headers,
+   // since smtp_send_body() takes it from the current line:
+   pm->body_offset = pm->arena_len;
+   if (judgement == LJ_End_Section)
+   {
+      do
+      {
+         if (!pa_append_line(pm, line, line_len))
+            goto out_of_memory;
+      }
+      while (bc_get_next_line(bc, &line, &line_len)
+             && LJ_End_Message != (*line_judger)(line, line_len));
+   }
+
+   if (!pa_build_links(pm))
+      goto out_of_memory;
+
+   *message = pm;
+   return 1;
+
+  out_of_memory:
+   mcb_log_message(parcel, "Out of memory while parsing a message, stopping.", NULL);
+   if (pm)
+      pa_free_message(pm);
+   return -2;
+}
+
+/**
+ * @brief Queue a parsed message, waiting for room if the queue is full.
+ *
+ * @return 0 if the sender has stopped, in which case the message is not queued.
+ */
+int pa_push(PAQueue *queue, PAMessage *message)
+{
+   long long start;
+
+   pthread_mutex_lock(&queue->mutex);
+
+   if (queue->count >= queue->depth && !queue->stopping)
+   {
+      ++queue->stats.parser_stalls;
+      start = pa_now_usecs();
+
+      while (queue->count >= queue->depth && !queue->stopping)
+         pthread_cond_wait(&queue->not_full, &queue->mutex);
+
+      queue->stats.parser_stall_usecs += pa_now_usecs() - start;
+   }
+
+   if (queue->stopping)
+   {
+      pthread_mutex_unlock(&queue->mutex);
+      return 0;
+   }
+
+   if (queue->tail)
+      queue->tail->next = message;
+   else
+      queue->head = message;
+   queue->tail = message;
+
+   if (message->recipients)
+      ++queue->stats.messages;
+   if (++queue->count > queue->stats.max_depth)
+      queue->stats.max_depth = queue->count;
+
+   pthread_cond_signal(&queue->not_empty);
+   pthread_mutex_unlock(&queue->mutex);
+
+   return 1;
+}
+
+void *pa_parser_thread(void *data)
+{
+   PAQueue *queue = (PAQueue*)data;
+   char buffer[PA_READ_BUFFER_LEN];
+   BuffControl bc;
+   PAMessage *message;
+   unsigned long index = 0;
+   off_t offset;
+   int result;
+
+   init_buff_control(&bc, buffer, sizeof(buffer), bc_file_reader, (void*)queue->source);
+
+   while (1)
+   {
+      // Pass over other shards' messages without parsing them:
+      if (queue->shard && !sh_seek_own_message(queue->shard, &bc, &index))
+         break;
+
+      offset = queue->base_offset + bc_offset(&bc);
+
+      if ((result = pa_read_message(queue->parcel, queue->line_judger, &bc, &message)) < 0)
+         break;
+
+      if (result == 0)
+      {
+         // Queue a stand-in, so the sender knows of the message:
+         if (!(message = (PAMessage*)calloc(1, sizeof(PAMessage))))
+            break;
+
+         pthread_mutex_lock(&queue->mutex);
+         ++queue->stats.skipped;
+         pthread_mutex_unlock(&queue->mutex);
+      }
+
+      message->index = index++;
+      message->offset = offset;
+      message->end_offset = queue->base_offset + bc_offset(&bc);
+
+      if (!pa_push(queue, message))
+      {
+         pa_free_message(message);
+         break;
+      }
+   }
+
+   pthread_mutex_lock(&queue->mutex);
+   queue->finished = 1;
+   pthread_cond_broadcast(&queue->not_empty);
+   pthread_mutex_unlock(&queue->mutex);
+
+   return NULL;
+}
+
+int pa_start(PAQueue *queue,
+             const MParcel *parcel,
+             FILE *source,
+             EmailLineJudge line_judger,
+             int depth,
+             const Shard *shard)
+{
+   memset(queue, 0, sizeof(PAQueue));
+   queue->parcel = parcel;
+   queue->source = source;
+   queue->shard = shard;
+   queue->base_offset = ftello(source);
+   if (queue->base_offset < 0)
+      queue->base_offset = 0;
+   queue->line_judger = line_judger;
+   queue->depth = depth > 0 ? depth : PA_DEFAULT_DEPTH;
+
+   pthread_mutex_init(&queue->mutex, NULL);
+   pthread_cond_init(&queue->not_empty, NULL);
+   pthread_cond_init(&queue->not_full, NULL);
+
+   if (pthread_create(&queue->thread, NULL, pa_parser_thread, queue))
+   {
+      pthread_cond_destroy(&queue->not_full);
+      pthread_cond_destroy(&queue->not_empty);
+      pthread_mutex_destroy(&queue->mutex);
+      return 0;
+   }
+
+   return 1;
+}
+
+PAMessage *pa_next(PAQueue *queue)
+{
+   PAMessage *message;
+   long long start;
+
+   pthread_mutex_lock(&queue->mutex);
+
+   if (queue->count == 0 && !queue->finished)
+   {
+      ++queue->stats.sender_stalls;
+      start = pa_now_usecs();
+
+      while (queue->count == 0 && !queue->finished)
+         pthread_cond_wait(&queue->not_empty, &queue->mutex);
+
+      queue->stats.sender_stall_usecs += pa_now_usecs() - start;
+   }
+
+   if ((message = queue->head))
+   {
+      queue->stats.depth_total += queue->count;
+      ++queue->stats.sent;
+
+      if (!(queue->head = message->next))
+         queue->tail = NULL;
+      --queue->count;
+      message->next = NULL;
+
+      pthread_cond_signal(&queue->not_full);
+   }
+
+   pthread_mutex_unlock(&queue->mutex);
+
+   return message;
+}
+
+void pa_send_message(PAQueue *queue,
+                     MParcel *parcel,
+                     PAMessage *message,
+                     EmailSectionPrinter section_printer)
+{
+   char buffer[PA_SEND_BUFFER_LEN];
+   BuffControl bc;
+   BCMemorySource source = { message->arena + message->body_offset,
+                             message->arena + message->arena_len };
+   EmailBody body = { &bc, queue->line_judger, section_printer, NULL, NULL, 0, &message->content_class, NULL };
+   const char *line;
+   int line_len;
+
+   if (!message->recipients)
+      return;
+
+   init_buff_control(&bc, buffer, sizeof(buffer), bc_memory_reader, (void*)&source);
+
+   // Make the section line current, as mcb_send_email_simple() leaves it:
+   bc_get_next_line(&bc, &line, &line_len);
+
+   // The whole body is at hand, so its size is known but for dot-stuffing:
+   body.size_hint = message->arena_len - message->body_offset + message->body_lines;
+
+   mcb_send_email_body(parcel, message->recipients, message->headers, &body);
+}
+
+void pa_free_message(PAMessage *message)
+{
+   free(message->links);
+   free(message->spans);
+   free(message->arena);
+   free(message);
+}
+
+void pa_stop(PAQueue *queue)
+{
+   PAMessage *message;
+
+   pthread_mutex_lock(&queue->mutex);
+   queue->stopping = 1;
+   pthread_cond_broadcast(&queue->not_full);
+   pthread_mutex_unlock(&queue->mutex);
+
+   pthread_join(queue->thread, NULL);
+
+   while ((message = queue->head))
+   {
+      queue->head = message->next;
+      pa_free_message(message);
+   }
+   queue->tail = NULL;
+   queue->count = 0;
+
+   pthread_cond_destroy(&queue->not_full);
+   pthread_cond_destroy(&queue->not_empty);
+   pthread_mutex_destroy(&queue->mutex);
+}
+
+void pa_get_stats(PAQueue *queue, PAStats *stats)
+{
+   pthread_mutex_lock(&queue->mutex);
+   *stats = queue->stats;
+   pthread_mutex_unlock(&queue->mutex);
+}
@@ -0,0 +1,172 @@
+#ifndef PARSEAHEAD_H
+#define PARSEAHEAD_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>    // for off_t
+#include "mailcb.h"
+#include "shard.h"
+
+/**
+ * Background parsing of batch input.
+ *
+ * A parser thread reads the \f/\v-delimited batch format from a FILE*
+ * and queues fully parsed messages, so the sending thread never waits
+ * on the input while the server could be busy, and the parser reads
+ * ahead while the sender waits on the network.
+ *
+ * Each message owns a single arena that holds the recipient and header
+ * strings and the body.  While a message is being read, its strings are
+ * recorded as spans (offsets into the arena, which may move as it
+ * grows).  When the message is complete, the spans become the usual
+ * RecipLink and HeaderField chains, in one more allocation.
+ *
+ * The queue is bounded by PAQueue::depth, so a large batch file
+ * doesn't end up in memory all at once.
+ *
+ * Messages that can't be sent are queued too, without recipients, so
+ * the sender can account for every message in the input, as a journal
+ * must.  pa_send_message() ignores them.
+ */
+
+#define PA_DEFAULT_DEPTH 8
+
+typedef enum _pa_span_kind
+{
+   PA_RECIPIENT = 0,
+   PA_HEADER_NAME,
+   PA_HEADER_VALUE
+} PASpanKind;
+
+typedef struct _pa_span
+{
+   PASpanKind kind;
+   RecipType  rtype;      // for PA_RECIPIENT
+   size_t     offset;     // into PAMessage::arena
+   size_t     len;
+} PASpan;
+
+typedef struct _pa_message
+{
+   struct _pa_message *next;
+
+   unsigned long index;        // counting every message in the input
+   off_t         offset;       // where the message starts in the input
+   off_t         end_offset;   // where the next one starts
+
+   char        *arena;
+   size_t      arena_len;
+   size_t      arena_size;
+
+   PASpan      *spans;
+   int         span_count;
+   int         span_size;
+
+   /** Built from the spans when the message is complete: */
+   void        *links;
+   RecipLink   *recipients;
+   HeaderField *headers;
+
+   /** The body, starting with the section line that ended the headers. */
+   size_t      body_offset;
+   size_t      body_lines;     // each will gain a CR, for EmailBody::size_hint
+   ContentClass content_class; // of the body, classified as it is read
+} PAMessage;
+
+typedef struct _pa_stats
+{
+   unsigned long      messages;            // parsed and queued
+   unsigned long      skipped;             // queued without recipients, since they can't be sent
+   unsigned long      sent;                // handed to the sender
+   int                max_depth;           // most messages ever waiting
+   unsigned long long depth_total;         // sum of depths seen by the sender, for the average
+   unsigned long      sender_stalls;       // times the sender found the queue empty
+   unsigned long long sender_stall_usecs;  // time the sender waited for the parser
+   unsigned long      parser_stalls;       // times the parser found the queue full
+   unsigned long long parser_stall_usecs;  // time the parser waited for the sender
+} PAStats;
+
+typedef struct _pa_queue
+{
+   const MParcel   *parcel;        // for logging
+   FILE            *source;
+   off_t           base_offset;    // position of source when the parser started
+   EmailLineJudge  line_judger;
+   int             depth;
+   const Shard     *shard;         // NULL to parse every message
+
+   pthread_t       thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t  not_empty;
+   pthread_cond_t  not_full;
+
+   PAMessage       *head;
+   PAMessage       *tail;
+   int             count;
+   int             finished;       // the parser reached the end of the input
+   int             stopping;       // the sender wants no more
+
+   PAStats         stats;
+} PAQueue;
+
+/**
+ * @brief Start a parser thread reading *source*.
+ *
+ * @param depth  Most parsed messages to hold, PA_DEFAULT_DEPTH if 0.
+ * @param shard  If not NULL, only this shard's messages are parsed and
+ *               queued, keeping their indexes in the whole input.
+ *
+ * @return 1 if the thread started.
+ */
+int pa_start(PAQueue *queue,
+             const MParcel *parcel,
+             FILE *source,
+             EmailLineJudge line_judger,
+             int depth,
+             const Shard *shard);
+
+/**
+ * @brief Read one message from *bc*, following the rules of mcb_send_email_simple().
+ *
+ * Used by the parser thread, and by anything else that wants a batch
+ * message in one piece.
+ *
+ * @return 1 with *message* set, 0 if a message was read but can't be
+ *         sent, -1 at the end of the input, -2 if memory ran out.
+ */
+int pa_read_message(const MParcel *parcel,
+                    EmailLineJudge line_judger,
+                    BuffControl *bc,
+                    PAMessage **message);
+
+/**
+ * @brief Wait for the next parsed message.
+ *
+ * @return The message, to be released with pa_free_message(), or NULL
+ *         when the input is exhausted.
+ */
+PAMessage *pa_next(PAQueue *queue);
+
+/**
+ * @brief Send a parsed message with mcb_send_email_body(), with the
+ *        size of the body for SIZE=.
+ */
+void pa_send_message(PAQueue *queue,
+                     MParcel *parcel,
+                     PAMessage *message,
+                     EmailSectionPrinter section_printer);
+
+void pa_free_message(PAMessage *message);
+
+/**
+ * @brief Stop the parser thread, if it hasn't finished, and release
+ *        any messages still queued.
+ */
+void pa_stop(PAQueue *queue);
+
+/**
+ * @brief Copy the statistics, which are safe to read while both threads run.  Call before pa_stop().
+ */
+void pa_get_stats(PAQueue *queue, PAStats *stats);
+
+#endif
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>     // for malloc(), free()
+#include <string.h>     // for memcpy(), memcmp(), memset()
+#include <fcntl.h>      // for open()
+#include <unistd.h>     // for pwrite(), close(), unlink()
+#include <sys/mman.h>   // for mmap(), munmap()
+
+#include <openssl/evp.h>  // for EVP_Digest(), EVP_EncodeBlock()
+
+#include "partcache.h"
+
+#define QP_LINE_MAX 76
+#define B64_INPUT_CHUNK 57   // 57 input bytes make one 76-character base64 line
+
+// Private, internal functions
+int pcb_reserve(PCBuff *buff, size_t more);
+void pcb_add(PCBuff *buff, const char *str, size_t len);
+void pcb_add_char(PCBuff *buff, char chr);
+void pcb_add_newline(PCBuff *buff, int *at_line_start);
+int pc_encode_plain(PCBuff *buff, const char *content, size_t len);
+int pc_encode_qp(PCBuff *buff, const char *content, size_t len);
+int pc_encode_base64(PCBuff *buff, const char *content, size_t len);
+PartEntry *pc_find(PartCache *pc, const uint8_t *digest, PartEncoding encoding);
+void pc_lru_unlink(PartCache *pc, PartEntry *entry);
+void pc_lru_push(PartCache *pc, PartEntry *entry);
+void pc_unhash(PartCache *pc, PartEntry *entry);
+void pc_evict(PartCache *pc);
+
+int pcb_reserve(PCBuff *buff, size_t more)
+{
+   if (buff->len + more > buff->cap)
+   {
+      size_t newcap = buff->cap ? buff->cap : 1024;
+      while (newcap < buff->len + more)
+         newcap *= 2;
+
+      char *newdata = (char*)realloc(buff->data, newcap);
+      if (!newdata)
+      {
+         buff->failed = 1;
+         return 0;
+      }
+
+      buff->data = newdata;
+      buff->cap = newcap;
+   }
+
+   return 1;
+}
+
+void pcb_add(PCBuff *buff, const char *str, size_t len)
+{
+   if (pcb_reserve(buff, len))
+   {
+      memcpy(&buff->data[buff->len], str, len);
+      buff->len += len;
+   }
+}
+
+void pcb_add_char(PCBuff *buff, char chr)
+{
+   if (pcb_reserve(buff, 1))
+      buff->data[buff->len++] = chr;
+}
+
+void pcb_add_newline(PCBuff *buff, int *at_line_start)
+{
+   pcb_add(buff, "\r\n", 2);
+   *at_line_start = 1;
+}
+
+/**
+ * @brief 7bit and 8bit "encoding": normalize line endings and double leading dots.
+ */
+int pc_encode_plain(PCBuff *buff, const char *content, size_t len)
+{
+   const char *ptr = content;
+   const char *end = content + len;
+   int at_line_start = 1;
+
+   while (ptr < end)
+   {
+      if (*ptr == '\r' || *ptr == '\n')
+      {
+         // Treat \r\n, \n, and bare \r all as one line break:
+         if (*ptr == '\r' && ptr+1 < end && *(ptr+1) == '\n')
+            ++ptr;
+
+         pcb_add_newline(buff, &at_line_start);
+      }
+      else
+      {
+         if (at_line_start && *ptr == '.')
+            pcb_add_char(buff, '.');
+
+         pcb_add_char(buff, *ptr);
+         at_line_start = 0;
+      }
+
+      ++ptr;
+   }
+
+   if (!at_line_start)
+      pcb_add_newline(buff, &at_line_start);
+
+   return !buff->failed;
+}
+
+/**
+ * @brief RFC 2045 quoted-printable, with soft breaks keeping lines under 76 characters.
+ *
+ * Line breaks in the content are treated as text line breaks and
+ * are emitted as hard CRLF breaks.  Any dot that would begin a line
+ * is encoded, so no dot-stuffing is needed.
+ */
+int pc_encode_qp(PCBuff *buff, const char *content, size_t len)
+{
+   static const char hexchars[] = "0123456789ABCDEF";
+
+   const char *ptr = content;
+   const char *end = content + len;
+   int line_len = 0;
+   int at_line_start = 1;
+
+   char encoded[3];
+   int  encoded_len;
+   unsigned char chr;
+
+   while (ptr < end)
+   {
+      chr = (unsigned char)*ptr;
+
+      if (chr == '\r' || chr == '\n')
+      {
+         if (chr == '\r' && ptr+1 < end && *(ptr+1) == '\n')
+            ++ptr;
+
+         pcb_add_newline(buff, &at_line_start);
+         line_len = 0;
+         ++ptr;
+         continue;
+      }
+
+      // Trailing whitespace must be encoded to survive transport:
+      int before_break = (ptr+1 == end || *(ptr+1) == '\r' || *(ptr+1) == '\n');
+
+      if ((chr >= 33 && chr <= 126 && chr != '=' && !(at_line_start && chr == '.'))
+          || ((chr == ' ' || chr == '\t') && !before_break))
+      {
+         encoded[0] = chr;
+         encoded_len = 1;
+      }
+      else
+      {
+         encoded[0] = '=';
+         encoded[1] = hexchars[chr >> 4];
+         encoded[2] = hexchars[chr & 15];
+         encoded_len = 3;
+      }
+
+      // Leave room for the '=' of a soft line break:
+      if (line_len + encoded_len > QP_LINE_MAX - 1)
+      {
+         pcb_add_char(buff, '=');
+         pcb_add_newline(buff, &at_line_start);
+         line_len = 0;
+
+         if (encoded_len == 1 && chr == '.')
+         {
+            encoded[0] = '=';
+            encoded[1] = hexchars[chr >> 4];
+            encoded[2] = hexchars[chr & 15];
+            encoded_len = 3;
+         }
+      }
+
+      pcb_add(buff, encoded, encoded_len);
+      line_len += encoded_len;
+      at_line_start = 0;
+      ++ptr;
+   }
+
+   if (!at_line_start)
+      pcb_add_newline(buff, &at_line_start);
+
+   return !buff->failed;
+}
+
+/**
+ * @brief Base64 in 76-character lines.  The alphabet has no '.', so no stuffing.
+ */
+int pc_encode_base64(PCBuff *buff, const char *content, size_t len)
+{
+   const unsigned char *ptr = (const unsigned char*)content;
+   const unsigned char *end = ptr + len;
+   int chunk_len, line_len;
+
+   while (ptr < end)
+   {
+      chunk_len = (end - ptr) < B64_INPUT_CHUNK ? (end - ptr) : B64_INPUT_CHUNK;
+
+      // Room for 76 characters, the \0 EVP_EncodeBlock adds, and the CRLF
+      if (!pcb_reserve(buff, 80))
+         return 0;
+
+      line_len = EVP_EncodeBlock((unsigned char*)&buff->data[buff->len], ptr, chunk_len);
+      buff->len += line_len;
+      pcb_add(buff, "\r\n", 2);
+
+      ptr += chunk_len;
+   }
+
+   return !buff->failed;
+}
+
+PartEntry *pc_find(PartCache *pc, const uint8_t *digest, PartEncoding encoding)
+{
+   PartEntry *ptr = pc->buckets[(digest[0] ^ encoding) % PC_BUCKET_COUNT];
+   while (ptr)
+   {
+      if (ptr->encoding == encoding && 0 == memcmp(ptr->digest, digest, PC_DIGEST_LEN))
+         return ptr;
+
+      ptr = ptr->hash_next;
+   }
+
+   return NULL;
+}
+
+void pc_lru_unlink(PartCache *pc, PartEntry *entry)
+{
+   if (entry->lru_prev)
+      entry->lru_prev->lru_next = entry->lru_next;
+   else
+      pc->lru_head = entry->lru_next;
+
+   if (entry->lru_next)
+      entry->lru_next->lru_prev = entry->lru_prev;
+   else
+      pc->lru_tail = entry->lru_prev;
+
+   entry->lru_prev = entry->lru_next = NULL;
+}
+
+void pc_lru_push(PartCache *pc, PartEntry *entry)
+{
+   entry->lru_prev = NULL;
+   entry->lru_next = pc->lru_head;
+
+   if (pc->lru_head)
+      pc->lru_head->lru_prev = entry;
+   else
+      pc->lru_tail = entry;
+
+   pc->lru_head = entry;
+}
+
+void pc_unhash(PartCache *pc, PartEntry *entry)
+{
+   PartEntry **link = &pc->buckets[(entry->digest[0] ^ entry->encoding) % PC_BUCKET_COUNT];
+   while (*link)
+   {
+      if (*link == entry)
+      {
+         *link = entry->hash_next;
+         break;
+      }
+
+      link = &(*link)->hash_next;
+   }
+}
+
+/**
+ * @brief Move least-recently-used entries out of memory until under the limit.
+ *
+ * Entries are appended to the spill file, if there is one, otherwise
+ * they are dropped and will be re-encoded if requested again.  The
+ * most recent entry always stays resident so the caller can use it.
+ */
+void pc_evict(PartCache *pc)
+{
+   PartEntry *victim;
+
+   while (pc->mem_used > pc->mem_limit && pc->lru_tail && pc->lru_tail != pc->lru_head)
+   {
+      victim = pc->lru_tail;
+      pc_lru_unlink(pc, victim);
+      pc->mem_used -= victim->data_len;
+
+      if (pc->spill_fd >= 0
+          && (ssize_t)victim->data_len == pwrite(pc->spill_fd, victim->data, victim->data_len, pc->spill_used))
+      {
+         victim->spill_offset = pc->spill_used;
+         pc->spill_used += victim->data_len;
+         ++pc->spills;
+
+         free(victim->data);
+         victim->data = NULL;
+      }
+      else
+      {
+         pc_unhash(pc, victim);
+         free(victim->data);
+         free(victim);
+      }
+   }
+}
+
+int pc_init(PartCache *pc, size_t mem_limit, const char *spill_path)
+{
+   memset(pc, 0, sizeof(PartCache));
+   pc->mem_limit = mem_limit;
+   pc->spill_fd = -1;
+
+   if (spill_path)
+   {
+      pc->spill_fd = open(spill_path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+      if (pc->spill_fd < 0)
+         return 0;
+
+      // The file is private scratch space, so it needn't outlive us:
+      unlink(spill_path);
+   }
+
+   return 1;
+}
+
+void pc_destroy(PartCache *pc)
+{
+   PartEntry *ptr, *next;
+   int i;
+
+   for (i=0; i < PC_BUCKET_COUNT; ++i)
+   {
+      ptr = pc->buckets[i];
+      while (ptr)
+      {
+         next = ptr->hash_next;
+         free(ptr->data);
+         free(ptr);
+         ptr = next;
+      }
+   }
+
+   if (pc->spill_map)
+      munmap(pc->spill_map, pc->spill_map_len);
+
+   if (pc->spill_fd >= 0)
+      close(pc->spill_fd);
+
+   memset(pc, 0, sizeof(PartCache));
+   pc->spill_fd = -1;
+}
+
+const PartEntry *pc_get_part(PartCache *pc,
+                             const char *content,
+                             size_t content_len,
+                             PartEncoding encoding)
+{
+   uint8_t digest[EVP_MAX_MD_SIZE];
+   unsigned int digest_len;
+   PartEntry *entry;
+
+   if (!EVP_Digest(content, content_len, digest, &digest_len, EVP_sha256(), NULL))
+      return NULL;
+
+   entry = pc_find(pc, digest, encoding);
+   if (entry)
+   {
+      ++pc->hits;
+
+      // Spilled entries are read through the map and stay off the LRU list:
+      if (entry->data)
+      {
+         pc_lru_unlink(pc, entry);
+         pc_lru_push(pc, entry);
+      }
+
+      return entry;
+   }
+
+   ++pc->misses;
+
+   PCBuff buff;
+   int encoded;
+   memset(&buff, 0, sizeof(buff));
+
+   encoded = pc_encode(&buff, content, content_len, encoding);
+
+   if (!encoded || !(entry = (PartEntry*)malloc(sizeof(PartEntry))))
+   {
+      free(buff.data);
+      return NULL;
+   }
+
+   memset(entry, 0, sizeof(PartEntry));
+   memcpy(entry->digest, digest, PC_DIGEST_LEN);
+   entry->encoding = encoding;
+   entry->data = buff.data;
+   entry->data_len = buff.len;
+
+   PartEntry **bucket = &pc->buckets[(digest[0] ^ encoding) % PC_BUCKET_COUNT];
+   entry->hash_next = *bucket;
+   *bucket = entry;
+
+   pc_lru_push(pc, entry);
+   pc->mem_used += entry->data_len;
+   pc_evict(pc);
+
+   return entry;
+}
+
+int pc_encode(PCBuff *buff, const char *content, size_t len, PartEncoding encoding)
+{
+   size_t start_len = buff->len;
+   int encoded;
+
+   buff->failed = 0;
+
+   switch(encoding)
+   {
+      case PE_QUOTED_PRINTABLE:
+         encoded = pc_encode_qp(buff, content, len);
+         break;
+      case PE_BASE64:
+         encoded = pc_encode_base64(buff, content, len);
+         break;
+      case PE_7BIT:
+      case PE_8BIT:
+      default:
+         encoded = pc_encode_plain(buff, content, len);
+         break;
+   }
+
+   // Drop what did fit, rather than leave a truncated part to be sent:
+   if (!encoded)
+      buff->len = start_len;
+
+   return encoded;
+}
+
+int pc_entry_bytes(PartCache *pc, const PartEntry *entry, const char **data, size_t *data_len)
+{
+   if (entry->data || entry->data_len == 0)
+   {
+      *data = entry->data;
+      *data_len = entry->data_len;
+      return 1;
+   }
+
+   // Remap if the spill file has grown since the last mapping:
+   if (pc->spill_map_len < pc->spill_used)
+   {
+      if (pc->spill_map)
+         munmap(pc->spill_map, pc->spill_map_len);
+
+      pc->spill_map = (char*)mmap(NULL, pc->spill_used, PROT_READ, MAP_SHARED, pc->spill_fd, 0);
+      if (pc->spill_map == MAP_FAILED)
+      {
+         pc->spill_map = NULL;
+         pc->spill_map_len = 0;
+         return 0;
+      }
+
+      pc->spill_map_len = pc->spill_used;
+   }
+
+   *data = &pc->spill_map[entry->spill_offset];
+   *data_len = entry->data_len;
+   return 1;
+}
+
+int pc_entry_file(const PartCache *pc, const PartEntry *entry, int *fd, off_t *offset)
+{
+   if (entry->data || entry->data_len == 0)
+      return 0;
+
+   *fd = pc->spill_fd;
+   *offset = entry->spill_offset;
+   return 1;
+}
+
+const char *pc_encoding_name(PartEncoding encoding)
+{
+   switch(encoding)
+   {
+      case PE_8BIT:
+         return "8bit";
+      case PE_QUOTED_PRINTABLE:
+         return "quoted-printable";
+      case PE_BASE64:
+         return "base64";
+      case PE_7BIT:
+      default:
+         return "7bit";
+   }
+}
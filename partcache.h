@@ -0,0 +1,132 @@
+#ifndef PARTCACHE_H
+#define PARTCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Content-Transfer-Encoding applied to a cached MIME part.
+ */
+typedef enum _part_encoding
+{
+   PE_7BIT = 0,
+   PE_8BIT,
+   PE_QUOTED_PRINTABLE,
+   PE_BASE64
+} PartEncoding;
+
+/**
+ * @brief Growable output buffer for the encoders.
+ */
+typedef struct _pc_buff
+{
+   char   *data;
+   size_t len;
+   size_t cap;
+   int    failed;    // an addition didn't fit, so the contents are incomplete
+} PCBuff;
+
+#define PC_DIGEST_LEN 32
+#define PC_BUCKET_COUNT 256
+
+/**
+ * @brief One encoded MIME part, identified by the SHA-256 of its
+ *        unencoded content and the encoding used.
+ *
+ * The stored bytes are ready for the DATA stream: CRLF line endings,
+ * lines wrapped for the encoding, and leading dots doubled.
+ */
+typedef struct _part_entry
+{
+   uint8_t      digest[PC_DIGEST_LEN];
+   PartEncoding encoding;
+
+   char         *data;          // encoded bytes while resident, NULL when spilled
+   size_t       data_len;
+   off_t        spill_offset;   // location of bytes in the spill file when data==NULL
+
+   struct _part_entry *hash_next;
+   struct _part_entry *lru_prev;
+   struct _part_entry *lru_next;
+} PartEntry;
+
+typedef struct _part_cache
+{
+   PartEntry  *buckets[PC_BUCKET_COUNT];
+
+   // Resident entries only, most recently used at the head:
+   PartEntry  *lru_head;
+   PartEntry  *lru_tail;
+
+   size_t     mem_used;
+   size_t     mem_limit;
+
+   // Entries evicted from memory are appended here, then read through spill_map:
+   int        spill_fd;
+   char       *spill_map;
+   size_t     spill_map_len;
+   size_t     spill_used;
+
+   // Statistics
+   int        hits;
+   int        misses;
+   int        spills;
+} PartCache;
+
+/**
+ * @brief Prepare a PartCache.
+ *
+ * @param mem_limit   Number of encoded bytes to keep in memory before
+ *                    least-recently-used entries are spilled.
+ * @param spill_path  File to which evicted entries are written, or NULL
+ *                    to simply discard evicted entries.  The file is
+ *                    truncated, and unlinked as soon as it is open, so
+ *                    it is gone when the cache is destroyed or the
+ *                    process ends.
+ *
+ * @return 1 for success, 0 if the spill file could not be opened.
+ */
+int pc_init(PartCache *pc, size_t mem_limit, const char *spill_path);
+void pc_destroy(PartCache *pc);
+
+/**
+ * @brief Return the cache entry for the content and encoding, encoding
+ *        and storing the content if it is not already cached.
+ */
+const PartEntry *pc_get_part(PartCache *pc,
+                             const char *content,
+                             size_t content_len,
+                             PartEncoding encoding);
+
+/**
+ * @brief Encode content as pc_get_part() would, without caching it.
+ *
+ * The encoded bytes are appended to *buff*, which starts zeroed and
+ * can be reused by setting PCBuff::len to 0.  Free PCBuff::data when
+ * done.
+ *
+ * @return 1 for success, 0 if memory ran out, with nothing appended.
+ */
+int pc_encode(PCBuff *buff, const char *content, size_t len, PartEncoding encoding);
+
+/**
+ * @brief Get the encoded bytes of an entry, wherever they are stored.
+ *
+ * The returned pointer is only valid until the next call to pc_get_part().
+ */
+int pc_entry_bytes(PartCache *pc, const PartEntry *entry, const char **data, size_t *data_len);
+
+/**
+ * @brief Find the encoded bytes of a spilled entry in the spill file,
+ *        to send with stk_send_file().
+ *
+ * @return 1 if the entry is spilled, 0 if it is held in memory.
+ */
+int pc_entry_file(const PartCache *pc, const PartEntry *entry, int *fd, off_t *offset);
+
+/**
+ * @brief Value for the Content-Transfer-Encoding header field.
+ */
+const char *pc_encoding_name(PartEncoding encoding);
+
+#endif
@@ -0,0 +1,526 @@
+// -*- compile-command: "gcc -Wall -Werror -DRATELIMIT_MAIN -ggdb -I. -o ratelimit ratelimit.c -L. -Wl,-R,. -lmailcb -lpthread" -*-
+#include <stdio.h>        // for snprintf(), sscanf()
+#include <stdlib.h>       // for calloc(), free(), atoi()
+#include <string.h>       // for memset(), strrchr()
+#include <strings.h>      // for strcasecmp()
+#include <time.h>         // for clock_gettime(), nanosleep()
+
+#include "ratelimit.h"
+
+// Private, internal functions
+const char *rl_account_key(const MParcel *parcel);
+const char *rl_domain_key(const char *recipient);
+RLBucket *rl_find(RateLimits *rl, RLKind kind, const char *key);
+RLBucket *rl_add(RateLimits *rl, RLKind kind, const char *key);
+RLBucket *rl_bucket(RateLimits *rl, RLKind kind, const char *key);
+void rl_reset(RLBucket *bucket, double rate, double burst);
+void rl_refill(RLBucket *bucket, long long now);
+int rl_decrease(RateLimits *rl, RLBucket *bucket, long long issued);
+void rl_increase(RateLimits *rl, RLBucket *bucket);
+void rl_advise_rate(const MParcel *parcel, const char *key, double rate);
+
+long long rl_now_usecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void rl_sleep_usecs(long long usecs)
+{
+   struct timespec ts = { usecs / 1000000, (usecs % 1000000) * 1000 };
+
+   while (nanosleep(&ts, &ts))
+      ;
+}
+
+const char *rl_account_key(const MParcel *parcel)
+{
+   if (parcel->account)
+      return parcel->account;
+   else if (parcel->login)
+      return parcel->login;
+   else
+      return parcel->host_url ? parcel->host_url : "";
+}
+
+const char *rl_domain_key(const char *recipient)
+{
+   const char *at = strrchr(recipient, '@');
+   return at ? at + 1 : recipient;
+}
+
+RLBucket *rl_find(RateLimits *rl, RLKind kind, const char *key)
+{
+   RLBucket *bucket;
+
+   for (bucket = rl->buckets[kind]; bucket; bucket = bucket->next)
+      if (0 == strcasecmp(bucket->key, key))
+         break;
+
+   return bucket;
+}
+
+RLBucket *rl_add(RateLimits *rl, RLKind kind, const char *key)
+{
+   RLBucket *bucket;
+
+   if ((bucket = (RLBucket*)calloc(1, sizeof(RLBucket))))
+   {
+      snprintf(bucket->key, sizeof(bucket->key), "%s", key);
+      bucket->next = rl->buckets[kind];
+      rl->buckets[kind] = bucket;
+   }
+
+   return bucket;
+}
+
+/**
+ * @brief The key's bucket, made from the defaults if it has none.
+ *
+ * @return NULL if the key isn't limited, or there's no memory for its
+ *         bucket, so it can't be.
+ */
+RLBucket *rl_bucket(RateLimits *rl, RLKind kind, const char *key)
+{
+   RLBucket *bucket;
+
+   if (!(bucket = rl_find(rl, kind, key)))
+   {
+      if (rl->defaults[kind].rate <= 0 || !(bucket = rl_add(rl, kind, key)))
+         return NULL;
+
+      rl_reset(bucket, rl->defaults[kind].rate, rl->defaults[kind].burst);
+   }
+
+   return bucket->limit.rate > 0 ? bucket : NULL;
+}
+
+void rl_reset(RLBucket *bucket, double rate, double burst)
+{
+   bucket->limit.rate = rate;
+   bucket->limit.burst = burst >= 1 ? burst : 1;
+   bucket->rate = rate;
+   bucket->throttled_rate = 0;
+   bucket->tokens = bucket->limit.burst;
+   bucket->refilled_usecs = rl_now_usecs();
+   bucket->decreased_usecs = 0;
+}
+
+void rl_refill(RLBucket *bucket, long long now)
+{
+   if (now > bucket->refilled_usecs)
+   {
+      bucket->tokens += bucket->rate * (now - bucket->refilled_usecs) / 1e6;
+      if (bucket->tokens > bucket->limit.burst)
+         bucket->tokens = bucket->limit.burst;
+      bucket->refilled_usecs = now;
+   }
+}
+
+/**
+ * @brief Slow the bucket for a throttling reply to a command whose
+ *        token was taken at *issued*.
+ *
+ * @return 1 if the rate came down.
+ */
+int rl_decrease(RateLimits *rl, RLBucket *bucket, long long issued)
+{
+   long long now = rl_now_usecs();
+   double floor = bucket->limit.rate * rl->floor;
+
+   ++bucket->throttles;
+
+   // Sent at the old rate, which has been paid for:
+   if (issued < bucket->decreased_usecs)
+      return 0;
+
+   rl_refill(bucket, now);
+
+   bucket->throttled_rate = bucket->rate;
+   bucket->rate *= rl->backoff;
+   if (bucket->rate < floor)
+      bucket->rate = floor;
+
+   if (bucket->tokens > 0)
+      bucket->tokens = 0;
+
+   bucket->decreased_usecs = now;
+   ++bucket->decreases;
+
+   return 1;
+}
+
+void rl_increase(RateLimits *rl, RLBucket *bucket)
+{
+   double step;
+
+   if (bucket->rate >= bucket->limit.rate)
+      return;
+
+   rl_refill(bucket, rl_now_usecs());
+
+   // Spread over the commands of a second at this rate:
+   step = rl->increase * bucket->limit.rate / bucket->rate;
+
+   if (bucket->throttled_rate
+       && bucket->rate > bucket->throttled_rate * 0.9
+       && bucket->rate < bucket->throttled_rate * 1.1)
+      step /= 4;
+
+   bucket->rate += step;
+   if (bucket->rate > bucket->limit.rate)
+      bucket->rate = bucket->limit.rate;
+}
+
+void rl_advise_rate(const MParcel *parcel, const char *key, double rate)
+{
+   char rate_str[24];
+
+   snprintf(rate_str, sizeof(rate_str), "%.2f", rate);
+   mcb_advise_message(parcel, "Throttled by the server, slowing ", key, " to ", rate_str, " a second.", NULL);
+}
+
+void rl_init(RateLimits *rl)
+{
+   memset(rl, 0, sizeof(RateLimits));
+   pthread_mutex_init(&rl->mutex, NULL);
+
+   rl->backoff = RL_DEFAULT_BACKOFF;
+   rl->increase = RL_DEFAULT_INCREASE;
+   rl->floor = RL_DEFAULT_FLOOR;
+}
+
+void rl_free(RateLimits *rl)
+{
+   RLBucket *bucket;
+   int kind;
+
+   for (kind = 0; kind < RL_KINDS; ++kind)
+   {
+      while ((bucket = rl->buckets[kind]))
+      {
+         rl->buckets[kind] = bucket->next;
+         free(bucket);
+      }
+   }
+
+   pthread_mutex_destroy(&rl->mutex);
+}
+
+int rl_set_limit(RateLimits *rl, RLKind kind, const char *key, double rate, double burst)
+{
+   RLBucket *bucket;
+   int result = 1;
+
+   pthread_mutex_lock(&rl->mutex);
+
+   if (!key)
+   {
+      rl->defaults[kind].rate = rate;
+      rl->defaults[kind].burst = burst;
+   }
+   else if ((bucket = rl_find(rl, kind, key)) || (bucket = rl_add(rl, kind, key)))
+      rl_reset(bucket, rate, burst);
+   else
+      result = 0;
+
+   pthread_mutex_unlock(&rl->mutex);
+
+   return result;
+}
+
+long long rl_pace(MParcel *parcel, const char *recipient)
+{
+   long long due, now = rl_reserve(parcel, recipient, &due);
+
+   if (due)
+      rl_sleep_usecs(due - now);
+
+   return now;
+}
+
+long long rl_reserve(MParcel *parcel, const char *recipient, long long *due_usecs)
+{
+   RateLimits *rl = parcel->rate_limits;
+   RLBucket *bucket;
+   long long now, wait = 0;
+
+   *due_usecs = 0;
+
+   if (!rl)
+      return 0;
+
+   now = rl_now_usecs();
+
+   pthread_mutex_lock(&rl->mutex);
+
+   if (!(bucket = recipient
+         ? rl_bucket(rl, RL_DOMAIN, rl_domain_key(recipient))
+         : rl_bucket(rl, RL_ACCOUNT, rl_account_key(parcel))))
+   {
+      pthread_mutex_unlock(&rl->mutex);
+      return now;
+   }
+
+   rl_refill(bucket, now);
+
+   // Take the token, if need be one that is still to come:
+   bucket->tokens -= 1;
+   ++bucket->granted;
+
+   if (bucket->tokens < 0)
+   {
+      wait = (long long)(-bucket->tokens / bucket->rate * 1e6);
+      ++bucket->delayed;
+      bucket->delay_usecs += wait;
+   }
+
+   pthread_mutex_unlock(&rl->mutex);
+
+   if (wait > 0)
+      *due_usecs = now + wait;
+
+   return now;
+}
+
+void rl_note_reply(MParcel *parcel, const char *recipient, int reply_status, const char *reply, long long issued)
+{
+   RateLimits *rl = parcel->rate_limits;
+   RLBucket *bucket;
+   const char *key;
+   double rate = 0, account_rate = 0;
+   int throttling;
+
+   if (!rl || !issued)
+      return;
+
+   // Other refusals say nothing of the rate:
+   throttling = rl_is_throttling(reply_status, reply);
+   if (!throttling && (reply_status < 200 || reply_status >= 300))
+      return;
+
+   key = recipient ? rl_domain_key(recipient) : rl_account_key(parcel);
+
+   pthread_mutex_lock(&rl->mutex);
+
+   if ((bucket = rl_find(rl, recipient ? RL_DOMAIN : RL_ACCOUNT, key)))
+   {
+      if (!throttling)
+         rl_increase(rl, bucket);
+      else if (rl_decrease(rl, bucket, issued))
+         rate = bucket->rate;
+   }
+
+   if (throttling && recipient && reply_status == 421
+       && (bucket = rl_find(rl, RL_ACCOUNT, rl_account_key(parcel)))
+       && rl_decrease(rl, bucket, issued))
+      account_rate = bucket->rate;
+
+   pthread_mutex_unlock(&rl->mutex);
+
+   if (rate && parcel->verbose)
+      rl_advise_rate(parcel, key, rate);
+   if (account_rate && parcel->verbose)
+      rl_advise_rate(parcel, rl_account_key(parcel), account_rate);
+}
+
+int rl_is_throttling(int reply_status, const char *reply)
+{
+   const char *text;
+   int subject, detail;
+
+   if (reply_status == 421)
+      return 1;
+
+   if (reply_status < 450 || reply_status > 452 || !reply)
+      return 0;
+
+   text = reply + 3;
+   while (*text == ' ' || *text == '-')
+      ++text;
+
+   // No enhanced status code to say otherwise:
+   if (2 != sscanf(text, "4.%d.%d", &subject, &detail))
+      return 1;
+
+   return !(subject == 1
+            || (subject == 2 && detail == 2)
+            || (subject == 5 && detail == 3));
+}
+
+int rl_get_bucket(RateLimits *rl, RLKind kind, const char *key, RLBucket *copy)
+{
+   RLBucket *bucket;
+
+   pthread_mutex_lock(&rl->mutex);
+   if ((bucket = rl_find(rl, kind, key)))
+   {
+      *copy = *bucket;
+      copy->next = NULL;
+   }
+   pthread_mutex_unlock(&rl->mutex);
+
+   return bucket != NULL;
+}
+
+
+#ifdef RATELIMIT_MAIN
+
+/**
+ * Threads sending to a stand-in for a provider that takes a steady
+ * rate of recipients and throttles the rest, from a limit set three
+ * times too high.  Each second shows the recipients accepted and
+ * throttled, and the rate the bucket has come to.
+ */
+
+#define DEMO_THREADS        8
+#define DEMO_SECONDS        6
+#define DEMO_SERVER_RATE    200.0
+#define DEMO_RECIPIENT      "someone@throttled.test"
+
+typedef struct _demo_server
+{
+   pthread_mutex_t mutex;
+   RLBucket        bucket;       // the provider's own limit
+   unsigned long   accepted[DEMO_SECONDS];
+   unsigned long   throttled[DEMO_SECONDS];
+   long long       start;
+   int             stop;
+} DemoServer;
+
+typedef struct _demo_thread
+{
+   pthread_t  thread;
+   DemoServer *server;
+   RateLimits *limits;
+} DemoThread;
+
+/**
+ * @brief Judge a RCPT TO, as the provider would.
+ */
+const char *demo_rcpt(DemoServer *server)
+{
+   long long now = rl_now_usecs();
+   int second = (now - server->start) / 1000000;
+   const char *reply = NULL;
+
+   pthread_mutex_lock(&server->mutex);
+
+   if (second >= DEMO_SECONDS)
+      server->stop = 1;
+   else
+   {
+      rl_refill(&server->bucket, now);
+      if (server->bucket.tokens >= 1)
+      {
+         server->bucket.tokens -= 1;
+         ++server->accepted[second];
+         reply = "250 2.1.5 OK";
+      }
+      else
+      {
+         ++server->throttled[second];
+         reply = "451 4.7.1 Rate limited, try again later";
+      }
+   }
+
+   pthread_mutex_unlock(&server->mutex);
+
+   return reply;
+}
+
+void *demo_thread(void *data)
+{
+   DemoThread *dt = (DemoThread*)data;
+   MParcel parcel;
+   const char *reply;
+   long long issued;
+
+   memset(&parcel, 0, sizeof(MParcel));
+   parcel.rate_limits = dt->limits;
+
+   while (1)
+   {
+      issued = rl_pace(&parcel, DEMO_RECIPIENT);
+      if (!(reply = demo_rcpt(dt->server)))
+         break;
+
+      rl_note_reply(&parcel, DEMO_RECIPIENT, atoi(reply), reply, issued);
+   }
+
+   return NULL;
+}
+
+int main(int argc, const char **argv)
+{
+   RateLimits  limits;
+   DemoServer  server;
+   DemoThread  threads[DEMO_THREADS];
+   RLBucket    bucket;
+   unsigned long accepted = 0, throttled = 0;
+   int i;
+
+   const char *replies[] = {
+      "421 4.7.0 Try again later, closing connection",
+      "450 4.2.1 The user you are trying to contact is receiving mail too quickly",
+      "451 4.7.1 Greylisted",
+      "451 Temporary local problem",
+      "452 4.2.2 Mailbox full",
+      "452 4.5.3 Too many recipients",
+      "450 4.1.8 Sender address rejected: Domain not found",
+      "550 5.7.1 Refused"
+   };
+
+   for (i = 0; i < (int)(sizeof(replies) / sizeof(replies[0])); ++i)
+      printf("%s: %s\n", rl_is_throttling(atoi(replies[i]), replies[i]) ? "throttling" : "not throttling", replies[i]);
+
+   rl_init(&limits);
+   rl_set_limit(&limits, RL_DOMAIN, "throttled.test", 3 * DEMO_SERVER_RATE, 10);
+
+   memset(&server, 0, sizeof(server));
+   pthread_mutex_init(&server.mutex, NULL);
+   rl_reset(&server.bucket, DEMO_SERVER_RATE, 10);
+   server.start = rl_now_usecs();
+
+   printf("\n%d threads, limited to %.0f a second, sending to a server that takes %.0f:\n\n",
+          DEMO_THREADS, 3 * DEMO_SERVER_RATE, DEMO_SERVER_RATE);
+
+   for (i = 0; i < DEMO_THREADS; ++i)
+   {
+      threads[i].server = &server;
+      threads[i].limits = &limits;
+      pthread_create(&threads[i].thread, NULL, demo_thread, &threads[i]);
+   }
+
+   for (i = 0; i < DEMO_SECONDS; ++i)
+   {
+      rl_sleep_usecs(server.start + (i + 1) * 1000000LL - rl_now_usecs());
+
+      rl_get_bucket(&limits, RL_DOMAIN, "throttled.test", &bucket);
+      pthread_mutex_lock(&server.mutex);
+      printf("second %d: %4lu accepted, %4lu throttled, rate %.1f\n",
+             i + 1, server.accepted[i], server.throttled[i], bucket.rate);
+      pthread_mutex_unlock(&server.mutex);
+   }
+
+   for (i = 0; i < DEMO_THREADS; ++i)
+      pthread_join(threads[i].thread, NULL);
+
+   for (i = 0; i < DEMO_SECONDS; ++i)
+   {
+      accepted += server.accepted[i];
+      throttled += server.throttled[i];
+   }
+
+   rl_get_bucket(&limits, RL_DOMAIN, "throttled.test", &bucket);
+   printf("\n%lu accepted, %lu throttled; %lu throttling replies, %lu decreases, %lu waits.\n",
+          accepted, throttled, bucket.throttles, bucket.decreases, bucket.delayed);
+
+   rl_free(&limits);
+   pthread_mutex_destroy(&server.mutex);
+
+   return 0;
+}
+
+#endif  // RATELIMIT_MAIN
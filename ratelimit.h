@@ -0,0 +1,161 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include "mailcb.h"
+
+/**
+ * Rate limits: token buckets that pace MAIL FROM per relay account
+ * and RCPT TO per recipient domain.
+ *
+ * Providers limit how fast an account may send, and how fast a domain
+ * takes mail, answering the excess with 421 or 45x replies.  Sending
+ * into those limits wastes the transactions, and often the
+ * connections, that the server turns away.  With
+ * MParcel::rate_limits set, smtp_send_envelope() waits for a token
+ * from the account's bucket before each MAIL FROM, and from the
+ * recipient domain's bucket before each RCPT TO.  So the account's
+ * rate counts transactions: a message split by the server's
+ * recipient limit takes a token for each.
+ *
+ * A bucket holds up to *burst* tokens, and gains *rate* tokens a
+ * second.  A command that finds it empty reserves the next token and
+ * sleeps until it is due, outside the lock, so threads sharing a
+ * bucket go out evenly spaced, however many there are.
+ *
+ * The rate adapts, additive increase and multiplicative decrease as
+ * for TCP's congestion window:
+ *
+ * - A throttling reply, see rl_is_throttling(), multiplies the rate
+ *   by RateLimits::backoff, no lower than RateLimits::floor of the
+ *   configured rate, and empties the bucket.  Replies to commands sent
+ *   before the last decrease were a response to the old rate, so they
+ *   don't bring it down again.
+ * - Each accepted command raises the rate so that a bucket in full
+ *   use gains RateLimits::increase of its configured rate each
+ *   second, back up to the configured rate.  Within a tenth of the
+ *   rate that was last throttled, it gains a quarter of that, so the
+ *   rate lingers near the server's limit instead of overshooting it.
+ *
+ * The account is MParcel::account, or else the login, or else the
+ * host.  Keys without a limit of their own get RateLimits::defaults,
+ * and aren't limited if that rate is 0.
+ *
+ * A RateLimits is guarded by a mutex, so parcels on different threads
+ * may share one, and must, to share its limits, as the sessions of a
+ * send pool (sendpool.h) do.  Pipelined commands are sent before
+ * each wait for a token, even through talkers that hold writes for
+ * the next read, memory-BIO TLS (tlsmem.h) and io_uring (uring.h).
+ */
+
+#define RL_KEY_LEN           256
+#define RL_DEFAULT_BACKOFF   0.7
+#define RL_DEFAULT_INCREASE  0.02    // of the configured rate, each second
+#define RL_DEFAULT_FLOOR     0.05
+
+typedef enum _rl_kind
+{
+   RL_ACCOUNT = 0,     // paces MAIL FROM
+   RL_DOMAIN,          // paces RCPT TO
+   RL_KINDS
+} RLKind;
+
+typedef struct _rl_limit
+{
+   double rate;        // tokens a second, 0 for no limit
+   double burst;       // most tokens saved up, 1 if 0
+} RLLimit;
+
+typedef struct _rl_bucket
+{
+   struct _rl_bucket *next;
+   char      key[RL_KEY_LEN];
+
+   RLLimit   limit;             // as configured
+   double    rate;              // now
+   double    throttled_rate;    // when last throttled, 0 if never
+   double    tokens;            // less than 0 while commands wait for them
+   long long refilled_usecs;
+   long long decreased_usecs;
+
+   /** Statistics */
+   unsigned long      granted;
+   unsigned long      delayed;
+   unsigned long long delay_usecs;
+   unsigned long      throttles;
+   unsigned long      decreases;
+} RLBucket;
+
+typedef struct _rate_limits
+{
+   pthread_mutex_t mutex;
+   RLBucket        *buckets[RL_KINDS];
+   RLLimit         defaults[RL_KINDS];
+
+   double          backoff;
+   double          increase;
+   double          floor;
+} RateLimits;
+
+void rl_init(RateLimits *rl);
+void rl_free(RateLimits *rl);
+
+/**
+ * @brief Set the limit for an account or domain, or with a NULL *key*,
+ *        the default for those without their own.
+ *
+ * @return 0 if out of memory.
+ */
+int rl_set_limit(RateLimits *rl, RLKind kind, const char *key, double rate, double burst);
+
+/**
+ * @brief Wait for a token to send MAIL FROM, if *recipient* is NULL,
+ *        or RCPT TO for the recipient.
+ *
+ * @return The time its token was taken, for rl_note_reply(), 0
+ *         without MParcel::rate_limits.
+ */
+long long rl_pace(MParcel *parcel, const char *recipient);
+
+/**
+ * @brief Take the token as rl_pace() does, without waiting for it.
+ *
+ * For a caller that waits by other means, like the coroutines of
+ * mailcb.hpp.
+ *
+ * @param due_usecs  Set to when the token comes, by rl_now_usecs(),
+ *                   or 0 if it may be used at once.
+ *
+ * @return As rl_pace().
+ */
+long long rl_reserve(MParcel *parcel, const char *recipient, long long *due_usecs);
+
+/** @brief Microseconds on the monotonic clock the buckets keep time by. */
+long long rl_now_usecs(void);
+
+void rl_sleep_usecs(long long usecs);
+
+/**
+ * @brief Adapt the rate of the command's bucket to its reply.
+ *
+ * A 421, which closes the session, also slows the account.
+ */
+void rl_note_reply(MParcel *parcel, const char *recipient, int reply_status, const char *reply, long long issued);
+
+/**
+ * @brief Returns 1 if a reply says to send more slowly.
+ *
+ * That is 421, or 450, 451, or 452 but for the enhanced codes of a
+ * problem with the address (X.1.x), a full mailbox (X.2.2), or too
+ * many recipients (X.5.3), which waiting would not solve.
+ */
+int rl_is_throttling(int reply_status, const char *reply);
+
+/**
+ * @brief Copy the bucket for an account or domain, for its statistics.
+ *
+ * @return 0 if it has none.
+ */
+int rl_get_bucket(RateLimits *rl, RLKind kind, const char *key, RLBucket *copy);
+
+#endif
@@ -0,0 +1,413 @@
+#include <stdio.h>        // for snprintf()
+#include <stdlib.h>       // for malloc(), realloc(), free()
+#include <string.h>       // for memchr(), memmove()
+#include <errno.h>
+#include <alloca.h>
+#include <fcntl.h>        // for open()
+#include <unistd.h>       // for close()
+#include <sys/mman.h>     // for mmap(), munmap()
+#include <sys/stat.h>     // for fstat()
+
+#include "rawmsg.h"
+#include "classify.h"
+#include "mailcb_internal.h"
+
+#define RM_STAGE_LEN 16384   // converted lines, per write
+
+// Private, internal functions
+void rm_scan(RawMessage *rm);
+int rm_send_content(MParcel *parcel, const RawMessage *rm, int stuff);
+int rm_send_range(MParcel *parcel, const RawMessage *rm, const char *start, const char *end);
+int rm_send_stuffed(MParcel *parcel, const RawMessage *rm);
+int rm_send_lines(MParcel *parcel, const RawMessage *rm, int stuff);
+int rm_send_chunk(MParcel *parcel, const RawMessage *rm);
+
+int rm_open(RawMessage *rm, MParcel *parcel, const char *path)
+{
+   struct stat st;
+
+   memset(rm, 0, sizeof(RawMessage));
+   rm->path = path;
+
+   if ((rm->fd = open(path, O_RDONLY)) < 0)
+   {
+      mcb_log_message(parcel, "Failed to open \"", path, "\", ", strerror(errno), NULL);
+      return 0;
+   }
+
+   if (fstat(rm->fd, &st))
+   {
+      mcb_log_message(parcel, "Failed to read \"", path, "\", ", strerror(errno), NULL);
+      goto close_file;
+   }
+
+   rm->size = st.st_size;
+   if (rm->size)
+   {
+      rm->map = (const char*)mmap(NULL, rm->size, PROT_READ, MAP_SHARED, rm->fd, 0);
+      if (rm->map == MAP_FAILED)
+      {
+         rm->map = NULL;
+         mcb_log_message(parcel, "Failed to map \"", path, "\", ", strerror(errno), NULL);
+         goto close_file;
+      }
+
+      madvise((void*)rm->map, rm->size, MADV_SEQUENTIAL);
+   }
+
+   rm_scan(rm);
+   return 1;
+
+  close_file:
+   close(rm->fd);
+   rm->fd = -1;
+   return 0;
+}
+
+void rm_close(RawMessage *rm)
+{
+   if (rm->map)
+      munmap((void*)rm->map, rm->size);
+
+   if (rm->fd >= 0)
+      close(rm->fd);
+
+   memset(rm, 0, sizeof(RawMessage));
+   rm->fd = -1;
+}
+
+/**
+ * @brief Learn, in one pass, what the file needs to go on the wire.
+ */
+void rm_scan(RawMessage *rm)
+{
+   const char *ptr = rm->map;
+   const char *end = ptr + rm->size;
+   const char *eol, *header_end = NULL;
+   size_t line_len;
+
+   rm->wire_ready = 1;
+
+   while (ptr < end)
+   {
+      if ((eol = (const char*)memchr(ptr, '\n', end - ptr)))
+      {
+         line_len = eol - ptr;
+         if (line_len && eol[-1] == '\r')
+            --line_len;
+         else
+            rm->wire_ready = 0;
+      }
+      else
+      {
+         // A last line without a line ending gets one:
+         line_len = end - ptr;
+         eol = end - 1;
+         rm->wire_ready = 0;
+      }
+
+      if (line_len && *ptr == '.')
+         ++rm->dot_lines;
+
+      if (!line_len && !header_end)
+         header_end = ptr;
+
+      rm->wire_size += line_len + 2;
+      ptr = eol + 1;
+   }
+
+   if (!header_end)
+      header_end = end;
+
+   rm->header_utf8 = cl_has_8bit(rm->map, header_end - rm->map);
+   rm->body_8bit = cl_has_8bit(header_end, end - header_end);
+}
+
+/**
+ * @brief Send part of the file, from the file itself if the talker can.
+ */
+int rm_send_range(MParcel *parcel, const RawMessage *rm, const char *start, const char *end)
+{
+   size_t len = end - start;
+   size_t sent;
+
+   if (!len)
+      return 1;
+
+   sent = stk_send_file(parcel->stalker, rm->fd, start - rm->map, len);
+   parcel->total_sent += sent;
+
+   return sent == len;
+}
+
+/**
+ * @brief Send a wire-ready file as DATA content, in the ranges between
+ *        the dots that must be doubled.
+ */
+int rm_send_stuffed(MParcel *parcel, const RawMessage *rm)
+{
+   const char *start = rm->map;
+   const char *end = start + rm->size;
+   const char *search = start;
+   const char *dot;
+   int line_state = 2;
+
+   while ((dot = ds_find_line_dot(line_state, search, end)))
+   {
+      if (!rm_send_range(parcel, rm, start, dot)
+          || 1 != stk_simple_send_unlined(parcel->stalker, ".", 1))
+         return 0;
+
+      ++parcel->total_stuffed;
+
+      // The original dot begins the next range:
+      start = dot;
+      search = dot + 1;
+      line_state = 0;
+   }
+
+   return rm_send_range(parcel, rm, start, end);
+}
+
+/**
+ * @brief Send a file that isn't wire-ready a line at a time, ending
+ *        each line with CRLF, and dot-stuffing if *stuff*.
+ */
+int rm_send_lines(MParcel *parcel, const RawMessage *rm, int stuff)
+{
+   char stage[RM_STAGE_LEN];
+   size_t stage_len = 0;
+   const char *ptr = rm->map;
+   const char *end = ptr + rm->size;
+   const char *eol;
+   size_t line_len, chunk;
+   DotStuffer ds;
+
+   ds_init(&ds);
+
+   while (ptr < end)
+   {
+      if (!(eol = (const char*)memchr(ptr, '\n', end - ptr)))
+         eol = end;
+
+      line_len = eol - ptr;
+      if (line_len && eol < end && eol[-1] == '\r')
+         --line_len;
+
+      // The line, and its CRLF, through the stage:
+      while (1)
+      {
+         chunk = line_len < RM_STAGE_LEN - stage_len ? line_len : RM_STAGE_LEN - stage_len;
+         memcpy(stage + stage_len, ptr, chunk);
+         stage_len += chunk;
+         ptr += chunk;
+         line_len -= chunk;
+
+         if (!line_len && stage_len + 2 <= RM_STAGE_LEN)
+            break;
+
+         if (stuff)
+            parcel->total_sent += ds_send_block(&ds, parcel->stalker, stage, stage_len);
+         else if (stage_len != stk_simple_send_unlined(parcel->stalker, stage, stage_len))
+            return 0;
+         else
+            parcel->total_sent += stage_len;
+
+         stage_len = 0;
+      }
+
+      memcpy(stage + stage_len, "\r\n", 2);
+      stage_len += 2;
+      ptr = eol < end ? eol + 1 : end;
+   }
+
+   if (stage_len)
+   {
+      if (stuff)
+         parcel->total_sent += ds_send_block(&ds, parcel->stalker, stage, stage_len);
+      else if (stage_len != stk_simple_send_unlined(parcel->stalker, stage, stage_len))
+         return 0;
+      else
+         parcel->total_sent += stage_len;
+   }
+
+   parcel->total_stuffed += ds.bytes_added;
+   return 1;
+}
+
+/**
+ * @brief Send the message's content, after DATA if *stuff*, else after BDAT.
+ *
+ * @return 1 if every byte was written.
+ */
+int rm_send_content(MParcel *parcel, const RawMessage *rm, int stuff)
+{
+   if (!rm->size)
+      return 1;
+   else if (!rm->wire_ready)
+      return rm_send_lines(parcel, rm, stuff);
+   else if (stuff && rm->dot_lines)
+      return rm_send_stuffed(parcel, rm);
+   else
+      return rm_send_range(parcel, rm, rm->map, rm->map + rm->size);
+}
+
+/**
+ * @brief Send the whole message in one BDAT chunk, RFC 3030.
+ */
+int rm_send_chunk(MParcel *parcel, const RawMessage *rm)
+{
+   char size[24];
+
+   snprintf(size, sizeof(size), "%lu", (unsigned long)rm->wire_size);
+   mcb_send_data(parcel, "BDAT ", size, " LAST", NULL);
+
+   return rm_send_content(parcel, rm, 0);
+}
+
+void rm_send(MParcel *parcel, RawMessage *rm, RecipLink *recipients)
+{
+   RecipLink *batch = recipients, *next = NULL, *rptr;
+   int connected = 1;
+
+   if (rm->body_8bit && !parcel->caps.cap_8bitmime)
+   {
+      mcb_log_message(parcel, "\"", rm->path, "\" is 8bit, and the server lacks 8BITMIME, not sent.", NULL);
+
+      // 5.6.3, conversion required but not supported:
+      for (rptr = recipients; rptr; rptr = rptr->next)
+         if (rptr->rtype != RT_SKIP)
+            rptr->rcpt_status = 554;
+
+      goto report;
+   }
+
+   parcel->body_8bit = rm->body_8bit;
+   parcel->message_utf8 = rm->header_utf8 || smtp_message_has_utf8(parcel, recipients, NULL);
+   parcel->message_size = rm->wire_size;
+   parcel->chunked_transfer = parcel->caps.cap_chunking && !parcel->OnlySendEnvelope;
+
+   if (!smtp_size_fits(parcel, recipients, NULL))
+      batch = NULL;
+
+   while (batch && connected)
+   {
+      if (smtp_send_envelope(parcel, batch, &next))
+      {
+         if (parcel->OnlySendEnvelope)
+            connected = smtp_reset_transaction(parcel);
+         else
+         {
+            if (parcel->chunked_transfer)
+               connected = rm_send_chunk(parcel, rm)
+                  && 0 != smtp_read_data_verdict(parcel, batch, next);
+            else
+               connected = rm_send_content(parcel, rm, 1)
+                  && 0 != smtp_finish_data(parcel, batch, next);
+
+            // If the content didn't all go out, no verdict was read:
+            if (!connected)
+               smtp_fail_transaction(batch, next, 0);
+         }
+      }
+      else
+      {
+         mcb_log_message(parcel, "Envelope not accepted.", NULL);
+         connected = smtp_reset_transaction(parcel);
+      }
+
+      batch = next;
+   }
+
+   parcel->chunked_transfer = 0;
+   parcel->message_size = 0;
+   smtp_clear_classification(parcel);
+
+  report:
+   if (parcel->report_recipients)
+      (*parcel->report_recipients)(parcel, recipients);
+}
+
+RecipLink *rm_read_sidecar(MParcel *parcel, const char *message_path)
+{
+   size_t path_len = strlen(message_path);
+   char *sidecar = (char*)alloca(path_len + sizeof(RM_SIDECAR_SUFFIX));
+   RecipLink *chain = NULL, *tail = NULL, *link;
+   char *block, *text, *ptr, *end, *eol;
+   size_t text_len, links_len;
+   int count = 1;
+   FILE *file;
+   struct stat st;
+
+   memcpy(sidecar, message_path, path_len);
+   strcpy(sidecar + path_len, RM_SIDECAR_SUFFIX);
+
+   if (!(file = fopen(sidecar, "r")))
+      return NULL;
+
+   if (fstat(fileno(file), &st) || !(block = (char*)malloc(st.st_size + 1)))
+   {
+      fclose(file);
+      return NULL;
+   }
+
+   text_len = fread(block, 1, st.st_size, file);
+   fclose(file);
+
+   // The links go before the text, in the same allocation:
+   for (ptr = block; (ptr = (char*)memchr(ptr, '\n', block + text_len - ptr)); ++ptr)
+      ++count;
+
+   links_len = count * sizeof(RecipLink);
+   if (!(text = (char*)realloc(block, links_len + text_len + 1)))
+   {
+      mcb_log_message(parcel, "Out of memory for the recipients in \"", sidecar, "\".", NULL);
+      free(block);
+      return NULL;
+   }
+
+   block = text;
+   text = memmove(block + links_len, block, text_len);
+   text[text_len] = '\0';
+   link = (RecipLink*)block;
+
+   for (ptr = text, end = text + text_len; ptr < end; ptr = eol + 1)
+   {
+      if (!(eol = (char*)memchr(ptr, '\n', end - ptr)))
+         eol = end;
+
+      *eol = '\0';
+      if (eol > ptr && eol[-1] == '\r')
+         eol[-1] = '\0';
+
+      memset(link, 0, sizeof(RecipLink));
+      switch(*ptr)
+      {
+         case '+':
+            link->rtype = RT_CC;
+            break;
+         case '-':
+            link->rtype = RT_BCC;
+            break;
+         case '#':
+            link->rtype = RT_SKIP;
+            break;
+      }
+
+      link->address = link->rtype ? ptr + 1 : ptr;
+      if (!*link->address)
+         continue;
+
+      if (tail)
+         tail->next = link;
+      else
+         chain = link;
+
+      tail = link++;
+   }
+
+   if (!chain)
+      free(block);
+
+   return chain;
+}
@@ -0,0 +1,67 @@
+#ifndef RAWMSG_H
+#define RAWMSG_H
+
+#include <sys/types.h>
+#include "mailcb.h"
+
+/**
+ * Raw messages: RFC 5322 files, such as .eml files or the messages of
+ * a Maildir, sent as they are.
+ *
+ * The file is mapped and scanned once, to learn if it is ready for the
+ * wire, every line ending in CRLF, and where it needs dot-stuffing.  A
+ * ready file goes out with stk_send_file(), by sendfile() on a plain
+ * socket and in large writes from the mapping over TLS, with a dot
+ * added before each line that begins with one.  If the server offers
+ * CHUNKING (RFC 3030), BDAT sends it with no stuffing at all.  A file
+ * with bare LF line endings is sent a line at a time, with CRLFs.
+ *
+ * The headers go as they are in the file, so the envelope recipients
+ * come from elsewhere: the caller, or a sidecar file, see rm_read_sidecar().
+ */
+
+typedef struct _raw_message
+{
+   const char    *path;
+   int           fd;
+   const char    *map;           // the whole file, NULL if empty
+   size_t        size;
+   size_t        wire_size;      // with CRLF line endings, before dot-stuffing
+   int           wire_ready;     // every line ends with CRLF, the last too
+   unsigned long dot_lines;      // lines that begin with a dot
+   int           body_8bit;      // for BODY=8BITMIME
+   int           header_utf8;    // for SMTPUTF8
+} RawMessage;
+
+/**
+ * @brief Map and scan a message file.
+ *
+ * @return 1 for success, 0 if the file can't be read, after logging why.
+ */
+int rm_open(RawMessage *rm, MParcel *parcel, const char *path);
+void rm_close(RawMessage *rm);
+
+/**
+ * @brief Send a raw message to *recipients*, in as many transactions
+ *        as the server needs, and report them.
+ *
+ * A message with 8-bit content can't be re-encoded, so it is refused
+ * (554) if the server lacks 8BITMIME.
+ */
+void rm_send(MParcel *parcel, RawMessage *rm, RecipLink *recipients);
+
+/**
+ * @brief Read the envelope recipients of *message_path* from its
+ *        sidecar, the same path with RM_SIDECAR_SUFFIX.
+ *
+ * One address per line, with the '+', '-' and '#' prefixes of the
+ * mailer's batch format allowed and '#' skipping the address.
+ *
+ * @return The recipients, in one allocation to free(), or NULL if
+ *         there is no sidecar or it lists nobody.
+ */
+RecipLink *rm_read_sidecar(MParcel *parcel, const char *message_path);
+
+#define RM_SIDECAR_SUFFIX ".rcpt"
+
+#endif
@@ -0,0 +1,383 @@
+// -*- compile-command: "gcc -Wall -Werror -DRESOLVER_MAIN -O2 -ggdb -o resolver resolver.c -lpthread" -*-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>       // for memcpy(), memcmp(), strcmp()
+#include <time.h>         // for clock_gettime()
+#include <netdb.h>        // for getaddrinfo()
+#include <arpa/inet.h>    // for inet_ntop()
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "resolver.h"
+
+#define RSV_BUCKET_COUNT 64
+
+typedef struct _rsv_entry
+{
+   struct _rsv_entry *next;
+   const char        *key;          // "host:port", stored after the addrs array
+   time_t            expires;
+   int               gai_error;     // non-zero for a cached failure
+   int               addr_count;
+   ResolvedAddr      addrs[RSV_MAX_ADDRS];
+} RsvEntry;
+
+RsvEntry *rsv_buckets[RSV_BUCKET_COUNT];
+pthread_mutex_t rsv_mutex = PTHREAD_MUTEX_INITIALIZER;
+int rsv_ttl = RSV_DEFAULT_TTL;
+int rsv_negative_ttl = RSV_DEFAULT_NEGATIVE_TTL;
+RsvStats rsv_stats;
+
+// Private, internal functions
+time_t rsv_now(void);
+unsigned int rsv_hash(const char *key);
+void rsv_make_key(char *buffer, int buffer_len, const char *host, int port);
+RsvEntry **rsv_find_link(const char *key);
+RsvEntry *rsv_new_entry(const char *key, const char *host, int port);
+int rsv_entry_keeps(const RsvEntry *entry);
+void rsv_copy_ordered(const RsvEntry *entry, ResolvedAddr *addrs, int count);
+
+time_t rsv_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec;
+}
+
+unsigned int rsv_hash(const char *key)
+{
+   // FNV-1a
+   unsigned int hash = 2166136261u;
+   while (*key)
+   {
+      hash ^= (unsigned char)*key++;
+      hash *= 16777619u;
+   }
+   return hash % RSV_BUCKET_COUNT;
+}
+
+void rsv_make_key(char *buffer, int buffer_len, const char *host, int port)
+{
+   snprintf(buffer, buffer_len, "%s:%d", host, port);
+}
+
+/**
+ * @brief Find the link that points to the entry for *key*, or to the
+ *        end of its bucket if there is no such entry.  Call while locked.
+ */
+RsvEntry **rsv_find_link(const char *key)
+{
+   RsvEntry **link = &rsv_buckets[rsv_hash(key)];
+   while (*link && strcmp((*link)->key, key))
+      link = &(*link)->next;
+   return link;
+}
+
+/**
+ * @brief Run getaddrinfo() and package the results in a new, unlinked entry.
+ */
+RsvEntry *rsv_new_entry(const char *key, const char *host, int port)
+{
+   struct addrinfo hints, *ai_chain, *rp;
+   char port_buffer[12];
+   int key_len = strlen(key);
+
+   RsvEntry *entry = (RsvEntry*)malloc(sizeof(RsvEntry) + key_len + 1);
+   if (!entry)
+      return NULL;
+
+   memset(entry, 0, sizeof(RsvEntry));
+   memcpy((char*)(entry+1), key, key_len + 1);
+   entry->key = (const char*)(entry+1);
+
+   snprintf(port_buffer, sizeof(port_buffer), "%d", port);
+
+   memset(&hints, 0, sizeof(struct addrinfo));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_protocol = IPPROTO_TCP;
+   hints.ai_flags = AI_ADDRCONFIG;
+
+   entry->gai_error = getaddrinfo(host, port_buffer, &hints, &ai_chain);
+   if (entry->gai_error == 0)
+   {
+      for (rp = ai_chain; rp && entry->addr_count < RSV_MAX_ADDRS; rp = rp->ai_next)
+      {
+         if ((rp->ai_family == AF_INET || rp->ai_family == AF_INET6)
+             && rp->ai_addrlen <= sizeof(struct sockaddr_storage))
+         {
+            ResolvedAddr *ra = &entry->addrs[entry->addr_count++];
+            memcpy(&ra->addr, rp->ai_addr, rp->ai_addrlen);
+            ra->addrlen = rp->ai_addrlen;
+            ra->family = rp->ai_family;
+         }
+      }
+
+      freeaddrinfo(ai_chain);
+
+      if (entry->addr_count == 0)
+         entry->gai_error = EAI_NONAME;
+   }
+
+   entry->expires = rsv_now() + (entry->gai_error ? rsv_negative_ttl : rsv_ttl);
+
+   return entry;
+}
+
+/**
+ * @brief Returns 1 if the lookup's outcome will hold for a while.
+ *
+ * That is a success, or a name that doesn't exist.  Other failures,
+ * EAI_AGAIN above all, may clear up by the next try.
+ */
+int rsv_entry_keeps(const RsvEntry *entry)
+{
+   switch(entry->gai_error)
+   {
+      case 0:
+      case EAI_NONAME:
+#ifdef EAI_NODATA
+      case EAI_NODATA:
+#endif
+         return 1;
+      default:
+         return 0;
+   }
+}
+
+/**
+ * @brief Copy the addresses, keeping the resolver's order except that
+ *        addresses with fewer consecutive failures come first.
+ */
+void rsv_copy_ordered(const RsvEntry *entry, ResolvedAddr *addrs, int count)
+{
+   int i, j;
+   for (i=0; i < count; ++i)
+   {
+      // Insertion sort, stable, on a handful of elements:
+      j = i;
+      while (j > 0 && addrs[j-1].failures > entry->addrs[i].failures)
+      {
+         addrs[j] = addrs[j-1];
+         --j;
+      }
+      addrs[j] = entry->addrs[i];
+   }
+}
+
+void rsv_set_ttl(int ttl_secs, int negative_ttl_secs)
+{
+   pthread_mutex_lock(&rsv_mutex);
+   rsv_ttl = ttl_secs;
+   rsv_negative_ttl = negative_ttl_secs;
+   pthread_mutex_unlock(&rsv_mutex);
+}
+
+void rsv_flush(void)
+{
+   int i;
+   RsvEntry *entry, *next;
+
+   pthread_mutex_lock(&rsv_mutex);
+   for (i=0; i < RSV_BUCKET_COUNT; ++i)
+   {
+      for (entry = rsv_buckets[i]; entry; entry = next)
+      {
+         next = entry->next;
+         free(entry);
+      }
+      rsv_buckets[i] = NULL;
+   }
+   pthread_mutex_unlock(&rsv_mutex);
+}
+
+void rsv_get_stats(RsvStats *stats)
+{
+   pthread_mutex_lock(&rsv_mutex);
+   *stats = rsv_stats;
+   pthread_mutex_unlock(&rsv_mutex);
+}
+
+int rsv_resolve(const char *host, int port, ResolvedAddr *addrs, int max_addrs, int *gai_error)
+{
+   char key[300];
+   RsvEntry **link, *entry, *fresh = NULL;
+   int count = 0;
+
+   rsv_make_key(key, sizeof(key), host, port);
+
+   pthread_mutex_lock(&rsv_mutex);
+   ++rsv_stats.lookups;
+
+   link = rsv_find_link(key);
+   if ((entry = *link) && entry->expires <= rsv_now())
+   {
+      *link = entry->next;
+      free(entry);
+      entry = NULL;
+      ++rsv_stats.expirations;
+   }
+
+   if (entry)
+   {
+      ++rsv_stats.hits;
+      if (entry->gai_error)
+         ++rsv_stats.negative_hits;
+   }
+   else
+   {
+      // Don't hold the lock during the lookup:
+      pthread_mutex_unlock(&rsv_mutex);
+      fresh = rsv_new_entry(key, host, port);
+      pthread_mutex_lock(&rsv_mutex);
+
+      if (!fresh)
+      {
+         pthread_mutex_unlock(&rsv_mutex);
+         *gai_error = EAI_MEMORY;
+         return 0;
+      }
+
+      // Another thread may have added the key meanwhile.  An outcome
+      // worth keeping replaces its entry, a temporary failure leaves it:
+      link = rsv_find_link(key);
+      if (rsv_ttl > 0 && rsv_entry_keeps(fresh))
+      {
+         if (*link)
+         {
+            fresh->next = (*link)->next;
+            free(*link);
+         }
+
+         *link = entry = fresh;
+         fresh = NULL;
+      }
+      else
+         entry = fresh;
+   }
+
+   *gai_error = entry->gai_error;
+   if (entry->gai_error == 0)
+   {
+      count = entry->addr_count < max_addrs ? entry->addr_count : max_addrs;
+      rsv_copy_ordered(entry, addrs, count);
+   }
+
+   pthread_mutex_unlock(&rsv_mutex);
+
+   // Only set if not cached:
+   if (fresh)
+      free(fresh);
+
+   return count;
+}
+
+void rsv_report(const char *host, int port, const ResolvedAddr *addr, int connected, unsigned int usecs)
+{
+   char key[300];
+   RsvEntry *entry;
+   int i;
+
+   rsv_make_key(key, sizeof(key), host, port);
+
+   pthread_mutex_lock(&rsv_mutex);
+   if ((entry = *rsv_find_link(key)))
+   {
+      for (i=0; i < entry->addr_count; ++i)
+      {
+         ResolvedAddr *ra = &entry->addrs[i];
+         if (ra->addrlen == addr->addrlen && 0 == memcmp(&ra->addr, &addr->addr, ra->addrlen))
+         {
+            if (connected)
+            {
+               ra->failures = 0;
+               ra->connect_usecs = usecs;
+            }
+            else
+               ++ra->failures;
+            break;
+         }
+      }
+   }
+   pthread_mutex_unlock(&rsv_mutex);
+}
+
+const char *rsv_describe(const ResolvedAddr *addr, char *buffer, int buffer_len)
+{
+   char ip[INET6_ADDRSTRLEN];
+
+   if (addr->family == AF_INET6)
+   {
+      const struct sockaddr_in6 *sa = (const struct sockaddr_in6*)&addr->addr;
+      inet_ntop(AF_INET6, &sa->sin6_addr, ip, sizeof(ip));
+      snprintf(buffer, buffer_len, "[%s]:%d", ip, ntohs(sa->sin6_port));
+   }
+   else
+   {
+      const struct sockaddr_in *sa = (const struct sockaddr_in*)&addr->addr;
+      inet_ntop(AF_INET, &sa->sin_addr, ip, sizeof(ip));
+      snprintf(buffer, buffer_len, "%s:%d", ip, ntohs(sa->sin_port));
+   }
+
+   return buffer;
+}
+
+
+#ifdef RESOLVER_MAIN
+
+double elapsed(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv)
+{
+   const char *host = argc > 1 ? argv[1] : "localhost";
+   const int reps = 2000;
+   ResolvedAddr addrs[RSV_MAX_ADDRS];
+   struct timespec start;
+   char desc[80];
+   int i, count = 0, gai_error;
+
+   rsv_set_ttl(0, 0);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i < reps; ++i)
+      count = rsv_resolve(host, 25, addrs, RSV_MAX_ADDRS, &gai_error);
+   double uncached = elapsed(&start);
+
+   rsv_set_ttl(RSV_DEFAULT_TTL, RSV_DEFAULT_NEGATIVE_TTL);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i=0; i < reps; ++i)
+      count = rsv_resolve(host, 25, addrs, RSV_MAX_ADDRS, &gai_error);
+   double cached = elapsed(&start);
+
+   printf("getaddrinfo() each time: %10.1f ns per lookup\n", uncached * 1e9 / reps);
+   printf("cached:                  %10.1f ns per lookup\n", cached * 1e9 / reps);
+
+   if (count == 0)
+      printf("%s: %s\n", host, gai_strerror(gai_error));
+
+   for (i=0; i < count; ++i)
+      printf("   %s\n", rsv_describe(&addrs[i], desc, sizeof(desc)));
+
+   // A failing address moves behind the others:
+   if (count > 1)
+   {
+      rsv_report(host, 25, &addrs[0], 0, 0);
+      rsv_resolve(host, 25, addrs, RSV_MAX_ADDRS, &gai_error);
+      printf("after a failure, first is %s\n", rsv_describe(&addrs[0], desc, sizeof(desc)));
+   }
+
+   RsvStats stats;
+   rsv_get_stats(&stats);
+   printf("lookups %lu, hits %lu, negative hits %lu, expirations %lu\n",
+          stats.lookups, stats.hits, stats.negative_hits, stats.expirations);
+
+   rsv_flush();
+   return count == 0;
+}
+
+#endif // RESOLVER_MAIN
@@ -0,0 +1,72 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+
+/**
+ * Process-wide cache of resolved host addresses.
+ *
+ * Lookups are keyed by "host:port" and kept for a configurable time,
+ * so a sender that reconnects for every session doesn't repeat the
+ * resolver round trip.  Names that don't exist are cached too, for a
+ * shorter time, but temporary failures like EAI_AGAIN are not.  Both
+ * IPv4 and IPv6 addresses are kept, in the order returned by
+ * getaddrinfo(), and each address records its last connect time and
+ * consecutive failures so that failing addresses are tried last.
+ *
+ * The cache is guarded by a mutex and may be used from several threads.
+ */
+
+#define RSV_MAX_ADDRS 16
+#define RSV_DEFAULT_TTL 300
+#define RSV_DEFAULT_NEGATIVE_TTL 30
+
+typedef struct _resolved_addr
+{
+   struct sockaddr_storage addr;
+   socklen_t               addrlen;
+   int                     family;
+   unsigned int            connect_usecs;   // most recent successful connect, 0 if none
+   unsigned int            failures;        // consecutive failed connects
+} ResolvedAddr;
+
+typedef struct _rsv_stats
+{
+   unsigned long lookups;
+   unsigned long hits;
+   unsigned long negative_hits;
+   unsigned long expirations;
+} RsvStats;
+
+/**
+ * @brief Set how long, in seconds, successful lookups, and names
+ *        that don't exist, are kept.
+ *
+ * A *ttl_secs* of 0 disables caching.
+ */
+void rsv_set_ttl(int ttl_secs, int negative_ttl_secs);
+
+/** @brief Discard all cached lookups. */
+void rsv_flush(void);
+
+void rsv_get_stats(RsvStats *stats);
+
+/**
+ * @brief Copy the addresses for host:port, best candidates first.
+ *
+ * @return Number of addresses copied to *addrs*, 0 if the name didn't
+ *         resolve, in which case *gai_error* holds the getaddrinfo() error.
+ */
+int rsv_resolve(const char *host, int port, ResolvedAddr *addrs, int max_addrs, int *gai_error);
+
+/**
+ * @brief Record the outcome of a connect attempt to an address from rsv_resolve().
+ */
+void rsv_report(const char *host, int port, const ResolvedAddr *addr, int connected, unsigned int usecs);
+
+/**
+ * @brief Write the numeric address and port, like "[::1]:25" or "127.0.0.1:25".
+ */
+const char *rsv_describe(const ResolvedAddr *addr, char *buffer, int buffer_len);
+
+#endif
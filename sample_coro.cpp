@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>        // for atoi()
+#include <string.h>        // for memset()
+#include <time.h>          // for clock_gettime()
+
+#include "mailcb.hpp"
+
+/**
+ * Sends *count* copies of a message, over *connections* sessions at
+ * once, all on one thread:
+ *
+ *   sample_coro host port from to [count [connections [starttls]]]
+ *
+ * Each session is a coroutine that connects, logs in if the
+ * MCB_LOGIN and MCB_PASSWORD environment variables are set, sends
+ * its share of the messages, and quits.
+ */
+
+struct Tally
+{
+   unsigned long accepted = 0;
+   unsigned long refused = 0;
+   unsigned long failed_sessions = 0;
+};
+
+mcb::Task<void> run_session(mcb::Loop &loop, const MParcel &settings, const char *to, int messages, Tally &tally)
+{
+   try
+   {
+      auto connection = co_await mcb::Connection::connect(loop, settings);
+      co_await connection->authorize();
+
+      for (int i = 0; i < messages; ++i)
+      {
+         mcb::Message message;
+         message.add_recipient(to);
+         message.add_header("Subject", "Sample coroutine message " + std::to_string(i + 1));
+         message.set_body("This message was sent by a coroutine.\n"
+                          "\n"
+                          ".A line that begins with a dot.\n");
+
+         if (co_await connection->send(message) / 100 == 2)
+            ++tally.accepted;
+         else
+            ++tally.refused;
+      }
+
+      co_await connection->quit();
+   }
+   catch (const mcb::Error &error)
+   {
+      fprintf(stderr, "%s\n", error.what());
+      ++tally.failed_sessions;
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   MParcel  parcel;
+   Tally    tally;
+   int      count, connections, i;
+   struct timespec started, finished;
+
+   if (argc < 5)
+   {
+      printf("Usage: %s host port from to [count [connections [starttls]]]\n", argv[0]);
+      return 1;
+   }
+
+   memset(&parcel, 0, sizeof(MParcel));
+   parcel.host_url = argv[1];
+   parcel.host_port = atoi(argv[2]);
+   parcel.from = argv[3];
+   parcel.starttls = argc > 7 && atoi(argv[7]);
+   parcel.login = getenv("MCB_LOGIN");
+   parcel.password = getenv("MCB_PASSWORD");
+   parcel.logfile = stderr;
+
+   count = argc > 5 ? atoi(argv[5]) : 1;
+   connections = argc > 6 ? atoi(argv[6]) : 1;
+   if (connections < 1)
+      connections = 1;
+
+   clock_gettime(CLOCK_MONOTONIC, &started);
+
+   try
+   {
+      mcb::Loop loop;
+
+      // Share the messages out, the first sessions taking any remainder:
+      for (i = 0; i < connections; ++i)
+         loop.spawn(run_session(loop, parcel, argv[4], count / connections + (i < count % connections), tally));
+
+      loop.run();
+   }
+   catch (const mcb::Error &error)
+   {
+      fprintf(stderr, "%s\n", error.what());
+      return 1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &finished);
+
+   printf("%lu accepted, %lu refused, %lu sessions failed, in %.3f seconds.\n",
+          tally.accepted,
+          tally.refused,
+          tally.failed_sessions,
+          (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+
+   return tally.failed_sessions || tally.refused;
+}
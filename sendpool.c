@@ -0,0 +1,779 @@
+// -*- compile-command: "make sendpool_demo" -*-
+#include <stdio.h>        // for printf()
+#include <stdlib.h>       // for calloc(), free()
+#include <string.h>       // for memset()
+#include <time.h>         // for clock_gettime()
+
+#include "sendpool.h"
+
+// Private, internal functions
+long long sp_now_usecs(void);
+void sp_push(SPQueue *queue, SPJob *job);
+SPJob *sp_pop_head(SPQueue *queue);
+SPJob *sp_cut_tail(SPQueue *queue, unsigned long count);
+void sp_append(SPQueue *queue, SPJob *chain, unsigned long count);
+int sp_claim_session(SendPool *pool, int relay);
+void sp_release_session(SendPool *pool, int relay);
+void sp_count_taken(SendPool *pool);
+SPJob *sp_steal(SPWorker *worker, int relay, unsigned int relay_start);
+SPJob *sp_take_any(SPWorker *worker);
+SPJob *sp_take_for_relay(SPWorker *worker, int relay);
+void sp_session(MParcel *parcel);
+void sp_drop_relay_jobs(SPWorker *worker, MParcel *parcel);
+void sp_run_session(SPWorker *worker, SPJob *job);
+void *sp_worker_thread(void *data);
+
+// The worker whose session sp_session() is called for:
+__thread SPWorker *sp_current_worker = NULL;
+
+long long sp_now_usecs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sp_push(SPQueue *queue, SPJob *job)
+{
+   job->next = NULL;
+   job->prev = queue->tail;
+
+   if (queue->tail)
+      queue->tail->next = job;
+   else
+      queue->head = job;
+   queue->tail = job;
+
+   ++queue->count;
+}
+
+SPJob *sp_pop_head(SPQueue *queue)
+{
+   SPJob *job;
+
+   if ((job = queue->head))
+   {
+      if ((queue->head = job->next))
+         queue->head->prev = NULL;
+      else
+         queue->tail = NULL;
+
+      --queue->count;
+      job->next = NULL;
+   }
+
+   return job;
+}
+
+/**
+ * @brief Detach the last *count* jobs, which must be there, keeping their order.
+ */
+SPJob *sp_cut_tail(SPQueue *queue, unsigned long count)
+{
+   SPJob *chain = queue->tail;
+   unsigned long i;
+
+   for (i = 1; i < count; ++i)
+      chain = chain->prev;
+
+   queue->tail = chain->prev;
+   if (queue->tail)
+      queue->tail->next = NULL;
+   else
+      queue->head = NULL;
+
+   queue->count -= count;
+   chain->prev = NULL;
+
+   return chain;
+}
+
+void sp_append(SPQueue *queue, SPJob *chain, unsigned long count)
+{
+   SPJob *last = chain;
+
+   if (!chain)
+      return;
+
+   while (last->next)
+      last = last->next;
+
+   chain->prev = queue->tail;
+   if (queue->tail)
+      queue->tail->next = chain;
+   else
+      queue->head = chain;
+   queue->tail = last;
+
+   queue->count += count;
+}
+
+/**
+ * @brief Count a new session with the relay, if it has one to spare.
+ */
+int sp_claim_session(SendPool *pool, int relay)
+{
+   SPRelay *sr = &pool->relays[relay];
+   int cap = sr->max_sessions > 0 ? sr->max_sessions : pool->worker_count;
+   int claimed = 0;
+
+   pthread_mutex_lock(&pool->mutex);
+   if (sr->sessions < cap)
+   {
+      ++sr->sessions;
+      claimed = 1;
+   }
+   pthread_mutex_unlock(&pool->mutex);
+
+   return claimed;
+}
+
+/**
+ * @brief End the count of a session, and wake the workers whose jobs
+ *        may have waited for it.
+ */
+void sp_release_session(SendPool *pool, int relay)
+{
+   pthread_mutex_lock(&pool->mutex);
+   --pool->relays[relay].sessions;
+   ++pool->generation;
+   pthread_cond_broadcast(&pool->work_ready);
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+void sp_count_taken(SendPool *pool)
+{
+   pthread_mutex_lock(&pool->mutex);
+   --pool->queued;
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * @brief Take half of another worker's jobs for a relay, from the tail.
+ *
+ * The first stolen job is returned to send, the rest go to the
+ * thief's own queue.  Only one worker's mutex is held at a time, so
+ * two thieves stealing from each other can't deadlock.
+ *
+ * @param relay  The relay of the thief's open session, or -1 to steal
+ *               for any relay that has a session to spare, claiming it.
+ */
+SPJob *sp_steal(SPWorker *worker, int relay, unsigned int relay_start)
+{
+   SendPool *pool = worker->pool;
+   SPWorker *victim;
+   SPQueue  *queue;
+   SPJob    *chain = NULL;
+   unsigned long count = 0;
+   unsigned int start = worker->next_victim++;
+   int v, i, r;
+
+   for (v = 1; v < pool->worker_count && !chain; ++v)
+   {
+      victim = &pool->workers[(worker->index + (start + v - 1) % (pool->worker_count - 1) + 1)
+                              % pool->worker_count];
+
+      pthread_mutex_lock(&victim->mutex);
+
+      for (i = 0; i < (relay < 0 ? pool->relay_count : 1); ++i)
+      {
+         r = relay < 0 ? (relay_start + i) % pool->relay_count : relay;
+         queue = &victim->queues[r];
+
+         if (queue->count && (relay >= 0 || sp_claim_session(pool, r)))
+         {
+            count = (queue->count + 1) / 2;
+            chain = sp_cut_tail(queue, count);
+            break;
+         }
+      }
+
+      pthread_mutex_unlock(&victim->mutex);
+   }
+
+   pthread_mutex_lock(&worker->mutex);
+   if (chain)
+   {
+      ++worker->stats.steals;
+      worker->stats.stolen += count;
+
+      if (chain->next)
+      {
+         chain->next->prev = NULL;
+         sp_append(&worker->queues[chain->relay], chain->next, count - 1);
+         chain->next = NULL;
+      }
+   }
+   else
+      ++worker->stats.failed_steals;
+   pthread_mutex_unlock(&worker->mutex);
+
+   if (chain)
+      sp_count_taken(pool);
+
+   return chain;
+}
+
+/**
+ * @brief Find a job to open a session with, the worker's own first,
+ *        then another's, claiming a session with its relay.
+ */
+SPJob *sp_take_any(SPWorker *worker)
+{
+   SendPool *pool = worker->pool;
+   SPQueue  *queue;
+   SPJob    *job = NULL;
+   unsigned int start = worker->next_relay++;
+   int i, r;
+
+   pthread_mutex_lock(&worker->mutex);
+   for (i = 0; i < pool->relay_count; ++i)
+   {
+      r = (start + i) % pool->relay_count;
+      queue = &worker->queues[r];
+
+      if (queue->count && sp_claim_session(pool, r))
+      {
+         job = sp_pop_head(queue);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&worker->mutex);
+
+   if (job)
+   {
+      sp_count_taken(pool);
+      return job;
+   }
+
+   if (pool->worker_count > 1)
+      return sp_steal(worker, -1, start);
+
+   return NULL;
+}
+
+/**
+ * @brief Find the next job for the relay of the open session.
+ */
+SPJob *sp_take_for_relay(SPWorker *worker, int relay)
+{
+   SPJob *job;
+
+   pthread_mutex_lock(&worker->mutex);
+   job = sp_pop_head(&worker->queues[relay]);
+   pthread_mutex_unlock(&worker->mutex);
+
+   if (job)
+   {
+      sp_count_taken(worker->pool);
+      return job;
+   }
+
+   if (worker->pool->worker_count > 1)
+      return sp_steal(worker, relay, 0);
+
+   return NULL;
+}
+
+/**
+ * @brief ServerReady function: send the job that opened the session,
+ *        then every other for the relay the worker can find, while
+ *        the session lasts.
+ */
+void sp_session(MParcel *parcel)
+{
+   SPWorker *worker = sp_current_worker;
+   SPJob *job = worker->first;
+   int usable;
+
+   if (parcel->login && !mcb_smtp_authorize_session(parcel))
+   {
+      mcb_log_message(parcel, "SMTP session authorization failed.", NULL);
+      mcb_smtp_quit_server(parcel);
+      return;
+   }
+
+   worker->first = NULL;
+
+   do
+   {
+      usable = (*job->send)(parcel, job);
+
+      pthread_mutex_lock(&worker->mutex);
+      ++worker->stats.messages;
+      pthread_mutex_unlock(&worker->mutex);
+   }
+   while (usable && (job = sp_take_for_relay(worker, worker->relay)));
+
+   if (usable)
+      mcb_smtp_quit_server(parcel);
+   else
+      sp_drop_relay_jobs(worker, parcel);
+}
+
+/**
+ * @brief Pass the jobs the worker holds for the relay of a session
+ *        that was lost to the pool's unsent callback.
+ *
+ * They were the session's to send, and as for a relay that couldn't
+ * be reached, trying them again is the callback's choice.
+ */
+void sp_drop_relay_jobs(SPWorker *worker, MParcel *parcel)
+{
+   SendPool *pool = worker->pool;
+   SPJob *job;
+
+   while (1)
+   {
+      pthread_mutex_lock(&worker->mutex);
+      if ((job = sp_pop_head(&worker->queues[worker->relay])))
+         ++worker->stats.unsent;
+      pthread_mutex_unlock(&worker->mutex);
+
+      if (!job)
+         break;
+
+      sp_count_taken(pool);
+      if (pool->unsent)
+         (*pool->unsent)(parcel, job);
+   }
+}
+
+/**
+ * @brief Open a session with the job's relay, whose session the
+ *        worker has claimed, and release it when done.
+ */
+void sp_run_session(SPWorker *worker, SPJob *job)
+{
+   SendPool *pool = worker->pool;
+   MParcel  parcel = *pool->relays[job->relay].settings;
+   long long start = sp_now_usecs();
+   int unsent = 0;
+
+   // What would be shared between sessions, or is left from another:
+   parcel.part_cache = NULL;
+   parcel.mx_delivery = NULL;
+   parcel.stalker = NULL;
+   parcel.pending_message = NULL;
+
+   worker->relay = job->relay;
+   worker->first = job;
+
+   sp_current_worker = worker;
+   mcb_prepare_talker(&parcel, sp_session);
+   sp_current_worker = NULL;
+
+   // The session never started, so the job wasn't sent:
+   if (worker->first)
+   {
+      unsent = 1;
+      if (pool->unsent)
+         (*pool->unsent)(&parcel, worker->first);
+      worker->first = NULL;
+   }
+
+   pthread_mutex_lock(&worker->mutex);
+   ++worker->stats.sessions;
+   worker->stats.unsent += unsent;
+   worker->stats.busy_usecs += sp_now_usecs() - start;
+   pthread_mutex_unlock(&worker->mutex);
+
+   sp_release_session(pool, worker->relay);
+   worker->relay = -1;
+}
+
+void *sp_worker_thread(void *data)
+{
+   SPWorker *worker = (SPWorker*)data;
+   SendPool *pool = worker->pool;
+   unsigned long generation;
+   long long start;
+   SPJob *job;
+   int done;
+
+   while (1)
+   {
+      // Read before looking, so work that comes while looking isn't missed:
+      pthread_mutex_lock(&pool->mutex);
+      generation = pool->generation;
+      pthread_mutex_unlock(&pool->mutex);
+
+      if ((job = sp_take_any(worker)))
+      {
+         sp_run_session(worker, job);
+         continue;
+      }
+
+      start = sp_now_usecs();
+
+      pthread_mutex_lock(&pool->mutex);
+      while (generation == pool->generation && !(pool->closing && pool->queued == 0))
+         pthread_cond_wait(&pool->work_ready, &pool->mutex);
+      done = pool->closing && pool->queued == 0;
+      pthread_mutex_unlock(&pool->mutex);
+
+      pthread_mutex_lock(&worker->mutex);
+      worker->stats.idle_usecs += sp_now_usecs() - start;
+      pthread_mutex_unlock(&worker->mutex);
+
+      if (done)
+         break;
+   }
+
+   return NULL;
+}
+
+int sp_start(SendPool *pool,
+             const MParcel *parcel,
+             SPRelay *relays,
+             int relay_count,
+             int worker_count,
+             SPUnsent unsent)
+{
+   SPWorker *worker;
+   int i;
+
+   if (relay_count < 1 || worker_count < 1 || worker_count > SP_MAX_WORKERS)
+   {
+      mcb_log_message(parcel, "A send pool needs at least one relay, and from 1 to 256 workers.", NULL);
+      return 0;
+   }
+
+   memset(pool, 0, sizeof(SendPool));
+   pool->relays = relays;
+   pool->relay_count = relay_count;
+   pool->worker_count = worker_count;
+   pool->unsent = unsent;
+
+   for (i = 0; i < relay_count; ++i)
+      relays[i].sessions = 0;
+
+   if (!(pool->workers = (SPWorker*)calloc(worker_count, sizeof(SPWorker))))
+   {
+      mcb_log_message(parcel, "Out of memory for the send pool's workers.", NULL);
+      return 0;
+   }
+
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->work_ready, NULL);
+
+   for (i = 0; i < worker_count; ++i)
+   {
+      worker = &pool->workers[i];
+      worker->pool = pool;
+      worker->index = i;
+      worker->relay = -1;
+      pthread_mutex_init(&worker->mutex, NULL);
+
+      if (!(worker->queues = (SPQueue*)calloc(relay_count, sizeof(SPQueue))))
+      {
+         mcb_log_message(parcel, "Out of memory for the send pool's queues.", NULL);
+         pool->worker_count = i + 1;
+         sp_destroy(pool);
+         return 0;
+      }
+   }
+
+   for (i = 0; i < worker_count; ++i)
+   {
+      if (pthread_create(&pool->workers[i].thread, NULL, sp_worker_thread, &pool->workers[i]))
+      {
+         mcb_log_message(parcel, "Failed to start a send pool worker.", NULL);
+
+         // The started workers have nothing to send, so finish at once:
+         pool->worker_count = i;
+         sp_finish(pool);
+         pool->worker_count = worker_count;
+         sp_destroy(pool);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+void sp_submit(SendPool *pool, SPJob *job)
+{
+   SPWorker *worker;
+
+   pthread_mutex_lock(&pool->mutex);
+   worker = &pool->workers[pool->next_worker++ % pool->worker_count];
+   ++pool->queued;
+   pthread_mutex_unlock(&pool->mutex);
+
+   pthread_mutex_lock(&worker->mutex);
+   sp_push(&worker->queues[job->relay], job);
+   pthread_mutex_unlock(&worker->mutex);
+
+   // Only once it's there to find:
+   pthread_mutex_lock(&pool->mutex);
+   ++pool->generation;
+   pthread_cond_signal(&pool->work_ready);
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+void sp_finish(SendPool *pool)
+{
+   int i;
+
+   pthread_mutex_lock(&pool->mutex);
+   pool->closing = 1;
+   pthread_cond_broadcast(&pool->work_ready);
+   pthread_mutex_unlock(&pool->mutex);
+
+   for (i = 0; i < pool->worker_count; ++i)
+      pthread_join(pool->workers[i].thread, NULL);
+}
+
+void sp_destroy(SendPool *pool)
+{
+   int i;
+
+   if (!pool->workers)
+      return;
+
+   for (i = 0; i < pool->worker_count; ++i)
+   {
+      free(pool->workers[i].queues);
+      pthread_mutex_destroy(&pool->workers[i].mutex);
+   }
+
+   free(pool->workers);
+   pool->workers = NULL;
+
+   pthread_cond_destroy(&pool->work_ready);
+   pthread_mutex_destroy(&pool->mutex);
+}
+
+void sp_get_stats(SendPool *pool, int worker, SPWorkerStats *stats)
+{
+   pthread_mutex_lock(&pool->workers[worker].mutex);
+   *stats = pool->workers[worker].stats;
+   pthread_mutex_unlock(&pool->workers[worker].mutex);
+}
+
+double sp_utilization(const SPWorkerStats *stats)
+{
+   unsigned long long total = stats->busy_usecs + stats->idle_usecs;
+
+   return total ? (double)stats->busy_usecs / total : 0.0;
+}
+
+
+#ifdef SENDPOOL_MAIN
+
+#include <signal.h>
+#include <strings.h>     // for strncasecmp()
+#include <unistd.h>      // for usleep()
+
+#include "loopback.h"
+
+#define DEMO_RELAYS   3
+#define DEMO_WORKERS  8
+#define DEMO_MESSAGES 600
+
+/**
+ * Loopback relays of different speeds, the slowest allowing the
+ * fewest sessions.  Each refuses the recipients of a session beyond
+ * its cap, so a pool that broke the cap wouldn't have every message
+ * accepted.
+ */
+typedef struct _demo_relay
+{
+   int      delay_usecs;      // before each message's verdict
+   int      max_sessions;
+   LBServer server;
+} DemoRelay;
+
+DemoRelay demo_relays[DEMO_RELAYS] = {
+   { 500,   0 },
+   { 4000,  4 },
+   { 20000, 2 }
+};
+
+const char *demo_body =
+   "\v\n"
+   "A message sent from a send pool.\n";
+
+pthread_mutex_t demo_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+int demo_sessions = 0;     // open with the server's relay
+
+unsigned long demo_accepted = 0;
+unsigned long demo_refused = 0;
+unsigned long demo_unsent = 0;
+
+void demo_serve_connection(LBConnection *lc)
+{
+   DemoRelay *relay = (DemoRelay*)lc->data;
+   const char *line;
+   int line_len, in_data = 0, counted = 1, over_cap;
+
+   pthread_mutex_lock(&demo_sessions_mutex);
+   over_cap = ++demo_sessions > relay->max_sessions && relay->max_sessions;
+   pthread_mutex_unlock(&demo_sessions_mutex);
+
+   lb_send(lc, "220 sendpool.test ready\r\n");
+
+   while (lb_next_line(lc, &line, &line_len))
+   {
+      if (in_data)
+      {
+         if (lb_line_is(line, line_len, "."))
+         {
+            usleep(relay->delay_usecs);
+            lb_send(lc, "250 OK\r\n");
+            in_data = 0;
+         }
+      }
+      else if (0 == strncasecmp(line, "EHLO", 4))
+         lb_send(lc, "250-sendpool.test\r\n250 8BITMIME\r\n");
+      else if (0 == strncasecmp(line, "RCPT", 4))
+         lb_send(lc, over_cap ? "451 Too many sessions\r\n" : "250 OK\r\n");
+      else if (0 == strncasecmp(line, "DATA", 4))
+      {
+         lb_send(lc, "354 Go ahead\r\n");
+         in_data = 1;
+      }
+      else if (0 == strncasecmp(line, "QUIT", 4))
+      {
+         // Before the reply, so the client's next session can't be counted first:
+         pthread_mutex_lock(&demo_sessions_mutex);
+         --demo_sessions;
+         pthread_mutex_unlock(&demo_sessions_mutex);
+         counted = 0;
+
+         lb_send(lc, "221 Bye\r\n");
+         break;
+      }
+      else
+         lb_send(lc, "250 OK\r\n");
+   }
+
+   if (counted)
+   {
+      pthread_mutex_lock(&demo_sessions_mutex);
+      --demo_sessions;
+      pthread_mutex_unlock(&demo_sessions_mutex);
+   }
+}
+
+int demo_send_job(MParcel *parcel, SPJob *job)
+{
+   char buffer[1024];
+   BuffControl bc;
+   BCMemorySource source = { demo_body, demo_body + strlen(demo_body) };
+   RecipLink recipient;
+   FieldValue subject_value = { "Send pool demonstration", NULL };
+   HeaderField subject = { "Subject", &subject_value, NULL };
+   const char *line;
+   int line_len;
+
+   memset(&recipient, 0, sizeof(recipient));
+   recipient.address = "someone@sendpool.test";
+
+   init_buff_control(&bc, buffer, sizeof(buffer), bc_memory_reader, (void*)&source);
+
+   // Make the section line current, as mcb_send_email_simple() leaves it:
+   bc_get_next_line(&bc, &line, &line_len);
+
+   mcb_send_email_new(parcel, &recipient, &subject, &bc, mcb_basic_line_judger, mcb_basic_section_printer);
+
+   __atomic_add_fetch(recipient.rcpt_status == 250 ? &demo_accepted : &demo_refused, 1, __ATOMIC_RELAXED);
+
+   return !parcel->session_broken;
+}
+
+void demo_unsent_job(MParcel *parcel, SPJob *job)
+{
+   __atomic_add_fetch(&demo_unsent, 1, __ATOMIC_RELAXED);
+}
+
+int main(int argc, const char **argv)
+{
+   MParcel       settings[DEMO_RELAYS];
+   SPRelay       relays[DEMO_RELAYS];
+   SendPool      pool;
+   SPWorkerStats stats;
+   SPJob         *jobs;
+   int           workers = argc > 1 ? atoi(argv[1]) : DEMO_WORKERS;
+   int           messages = argc > 2 ? atoi(argv[2]) : DEMO_MESSAGES;
+   int           i, result;
+   struct timespec start, now;
+   double secs;
+
+   if (workers < 1 || messages < 1)
+   {
+      printf("Usage: %s [workers [messages]]\n", argv[0]);
+      return 1;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   memset(settings, 0, sizeof(settings));
+   memset(relays, 0, sizeof(relays));
+
+   for (i = 0; i < DEMO_RELAYS; ++i)
+   {
+      demo_relays[i].server.handler = demo_serve_connection;
+      demo_relays[i].server.data = &demo_relays[i];
+      if (!lb_start(&demo_relays[i].server))
+         return 1;
+
+      settings[i].host_url = "127.0.0.1";
+      settings[i].host_port = demo_relays[i].server.port;
+      settings[i].from = "sender@sendpool.test";
+      settings[i].logfile = stderr;
+
+      relays[i].settings = &settings[i];
+      relays[i].max_sessions = demo_relays[i].max_sessions;
+   }
+
+   if (!(jobs = (SPJob*)calloc(messages, sizeof(SPJob)))
+       || !sp_start(&pool, &settings[0], relays, DEMO_RELAYS, workers, demo_unsent_job))
+      return 1;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (i = 0; i < messages; ++i)
+   {
+      jobs[i].relay = i % DEMO_RELAYS;
+      jobs[i].send = demo_send_job;
+      sp_submit(&pool, &jobs[i]);
+   }
+
+   sp_finish(&pool);
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+   printf("Relays: ");
+   for (i = 0; i < DEMO_RELAYS; ++i)
+      printf("%s%.1f ms per message, %d sessions", i ? "; " : "",
+             demo_relays[i].delay_usecs / 1000.0,
+             demo_relays[i].max_sessions ? demo_relays[i].max_sessions : workers);
+   printf(".\n\n");
+
+   printf("worker  sessions  messages  steals  stolen  failed  busy\n");
+   for (i = 0; i < workers; ++i)
+   {
+      sp_get_stats(&pool, i, &stats);
+      printf("%6d  %8lu  %8lu  %6lu  %6lu  %6lu  %3.0f%%\n",
+             i, stats.sessions, stats.messages, stats.steals, stats.stolen,
+             stats.failed_steals, 100 * sp_utilization(&stats));
+   }
+
+   printf("\n%lu of %d messages accepted, %lu refused, %lu unsent, in %.3f s.\n",
+          demo_accepted, messages, demo_refused, demo_unsent, secs);
+
+   result = demo_accepted == (unsigned long)messages;
+
+   sp_destroy(&pool);
+   free(jobs);
+
+   for (i = 0; i < DEMO_RELAYS; ++i)
+      lb_stop(&demo_relays[i].server);
+
+   return !result;
+}
+
+#endif  // SENDPOOL_MAIN
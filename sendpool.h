@@ -0,0 +1,179 @@
+#ifndef SENDPOOL_H
+#define SENDPOOL_H
+
+#include <pthread.h>
+#include "mailcb.h"
+
+/**
+ * Send pool: worker threads sending through several relays, with
+ * work stealing.
+ *
+ * Splitting the messages between threads ahead of time leaves threads
+ * idle when their share is done while others, on a slower relay or
+ * with larger messages, are still behind.  Here, each worker has its
+ * own queue of jobs, a queue for each relay, and a worker with nothing
+ * to do steals half of another worker's queue for a relay, from the
+ * end the owner takes from last.
+ *
+ * A worker sends in a session with one relay at a time, opened with
+ * mcb_prepare_talker() from a copy of the relay's settings.  The job
+ * that opened it goes first, then every job for the same relay the
+ * worker has or can steal, before it quits the session.  A relay's
+ * SPRelay::max_sessions caps the sessions open with it at once: a
+ * worker only opens a session, for its own job or a stolen one, if
+ * the relay has one to spare, so jobs for a busy relay wait for the
+ * workers already in session with it.
+ *
+ * A job whose session couldn't be opened goes to the pool's unsent
+ * callback, and the next job for the relay tries a session of its
+ * own.  Once open, a session is the send callbacks' to use until one
+ * reports it lost: the worker then takes no more jobs for it, and
+ * passes those it holds for the relay to the unsent callback, rather
+ * than send them on a dead connection.
+ *
+ * Each session is one parcel on one thread, as mailcb.h requires, so
+ * the relays' settings must not carry a PartCache or MXDelivery,
+ * which the sessions would share; they are cleared in the copies.
+ * A RateLimits (ratelimit.h) is kept, so every session with a relay
+ * draws on the same buckets.
+ * The send callbacks run on the workers, so anything they share,
+ * MParcel::report_recipients included, must be safe for threads.
+ *
+ * Each worker counts its sessions, messages, steals, and the time it
+ * spends in sessions and waiting for work, see sp_get_stats().
+ */
+
+#define SP_MAX_WORKERS 256
+
+struct _sp_job;
+
+/**
+ * @brief Send the job's message on *parcel*, in session with its relay.
+ *
+ * The job is done with when it returns, and may be freed.
+ *
+ * @return 1 if the session can send another message, 0 if it was
+ *         lost, as MParcel::session_broken shows after the library's
+ *         send functions.
+ */
+typedef int (*SPSend)(MParcel *parcel, struct _sp_job *job);
+
+/**
+ * @brief Account for a job whose relay couldn't be reached, or whose
+ *        worker's session with it was lost before the job's turn.
+ *
+ * *parcel* has the relay's settings, and no session that can be used.
+ */
+typedef void (*SPUnsent)(MParcel *parcel, struct _sp_job *job);
+
+/** A message to send, queued with sp_submit(). */
+typedef struct _sp_job
+{
+   int            relay;      // index in SendPool::relays
+   SPSend         send;
+   void           *data;
+
+   struct _sp_job *next;      // in a worker's queue
+   struct _sp_job *prev;
+} SPJob;
+
+typedef struct _sp_relay
+{
+   const MParcel *settings;        // host, port, TLS, login, and from, for every session
+   int           max_sessions;     // open at once, 0 for one per worker
+   int           sessions;         // open now
+} SPRelay;
+
+typedef struct _sp_queue
+{
+   SPJob         *head;            // taken first by the owner
+   SPJob         *tail;            // stolen first
+   unsigned long count;
+} SPQueue;
+
+typedef struct _sp_worker_stats
+{
+   unsigned long      sessions;
+   unsigned long      messages;
+   unsigned long      unsent;          // jobs whose relay couldn't be reached, or whose session was lost
+   unsigned long      steals;          // successful steals
+   unsigned long      stolen;          // jobs taken by them
+   unsigned long      failed_steals;   // searches of other workers that found nothing to take
+   unsigned long long busy_usecs;      // in sessions, connecting included
+   unsigned long long idle_usecs;      // waiting for work
+} SPWorkerStats;
+
+typedef struct _sp_worker
+{
+   struct _send_pool *pool;
+   int               index;
+   pthread_t         thread;
+
+   pthread_mutex_t   mutex;        // for the queues and stats
+   SPQueue           *queues;      // one per relay
+   unsigned int      next_relay;   // where the search for a new session starts
+   unsigned int      next_victim;  // and its search of other workers
+
+   int               relay;        // of the open session, -1 if none
+   SPJob             *first;       // the job that opened it, until sent
+
+   SPWorkerStats     stats;
+} SPWorker;
+
+typedef struct _send_pool
+{
+   SPRelay         *relays;
+   int             relay_count;
+   SPWorker        *workers;
+   int             worker_count;
+   SPUnsent        unsent;         // NULL to drop unsent jobs
+
+   pthread_mutex_t mutex;          // for waiting for work
+   pthread_cond_t  work_ready;
+   unsigned long   generation;     // changed when a job is queued or a session ends
+   unsigned long   queued;         // jobs not yet taken to send
+   unsigned int    next_worker;    // to queue the next job for
+   int             closing;        // no more jobs are coming
+} SendPool;
+
+/**
+ * @brief Start *worker_count* workers sending through *relays*.
+ *
+ * @param unsent  Called for jobs whose relay couldn't be reached, or
+ *                NULL to drop them.
+ *
+ * @return 1 if the workers started, 0 after logging why not.
+ */
+int sp_start(SendPool *pool,
+             const MParcel *parcel,
+             SPRelay *relays,
+             int relay_count,
+             int worker_count,
+             SPUnsent unsent);
+
+/**
+ * @brief Queue a job, with the workers in turn.
+ *
+ * The job must last until its send or unsent callback.
+ */
+void sp_submit(SendPool *pool, SPJob *job);
+
+/**
+ * @brief Wait for every queued job to be sent, and stop the workers.
+ *
+ * The statistics are still there to read, until sp_destroy().
+ */
+void sp_finish(SendPool *pool);
+void sp_destroy(SendPool *pool);
+
+/**
+ * @brief Copy a worker's statistics, safe while it runs.
+ */
+void sp_get_stats(SendPool *pool, int worker, SPWorkerStats *stats);
+
+/**
+ * @brief Share of the worker's time spent in sessions, from 0 to 1.
+ */
+double sp_utilization(const SPWorkerStats *stats);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdlib.h>       // for strtoul()
+#include <string.h>       // for strlen()
+#include <ctype.h>        // for tolower()
+
+#include "shard.h"
+
+#define SH_FNV_OFFSET 2166136261UL
+#define SH_FNV_PRIME  16777619UL
+
+int sh_parse(Shard *shard, const char *spec, char delimiter)
+{
+   char *end;
+
+   memset(shard, 0, sizeof(Shard));
+   shard->delimiter = delimiter;
+
+   shard->index = strtoul(spec, &end, 10);
+   if (end == spec || *end != '/')
+      return 0;
+
+   spec = end + 1;
+   shard->count = strtoul(spec, &end, 10);
+   if (end == spec || *end || shard->count == 0 || shard->index >= shard->count)
+      return 0;
+
+   return 1;
+}
+
+unsigned long sh_hash_address(const char *address, int len)
+{
+   // 32 bits, so every machine computes the same shards:
+   unsigned long hash = SH_FNV_OFFSET;
+   const char *end = address + len;
+
+   while (address < end)
+   {
+      hash ^= (unsigned char)tolower((unsigned char)*address++);
+      hash = (hash * SH_FNV_PRIME) & 0xffffffffUL;
+   }
+
+   return hash;
+}
+
+int sh_owns_index(const Shard *shard, unsigned long index)
+{
+   return shard->count <= 1 || index % shard->count == shard->index;
+}
+
+int sh_owns_address(const Shard *shard, const char *address, int len)
+{
+   return shard->count <= 1 || sh_hash_address(address, len) % shard->count == shard->index;
+}
+
+int sh_owns_recipients(const Shard *shard, const RecipLink *recipients)
+{
+   if (shard->count <= 1)
+      return 1;
+   else if (!recipients)
+      return sh_owns_address(shard, "", 0);
+   else
+      return sh_owns_address(shard, recipients->address, strlen(recipients->address));
+}
+
+int sh_seek_own_message(const Shard *shard, BuffControl *bc, unsigned long *index)
+{
+   const char *line;
+   int line_len;
+   int at_delimiter;
+
+   while (1)
+   {
+      if (shard->by_recipient)
+      {
+         if (!bc_get_next_line(bc, &line, &line_len))
+            return 0;
+
+         at_delimiter = line_len && *line == shard->delimiter;
+
+         // The same address as a RecipLink, without its type prefix:
+         if (line_len && (*line == '+' || *line == '-' || *line == '#'))
+         {
+            ++line;
+            --line_len;
+         }
+
+         if (sh_owns_address(shard, line, line_len))
+         {
+            bc_unget_line(bc);
+            return 1;
+         }
+
+         if (!at_delimiter && !bc_skip_past_delimiter(bc, shard->delimiter))
+            return 0;
+      }
+      else
+      {
+         if (sh_owns_index(shard, *index))
+            return 1;
+
+         if (!bc_skip_past_delimiter(bc, shard->delimiter))
+            return 0;
+      }
+
+      ++*index;
+   }
+}
@@ -0,0 +1,62 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "mailcb.h"
+
+/**
+ * Deterministic sharding of a batch.
+ *
+ * Several processes, on one machine or many, can share a batch file
+ * without splitting it: each is given its shard, i of N, and sends
+ * only the messages that fall in it, either by message index (i is
+ * the index modulo N) or by a hash of the first recipient's address,
+ * which keeps each address on one shard whatever the order of the
+ * batch.
+ *
+ * Messages of other shards are passed over with
+ * bc_skip_past_delimiter(), which looks for the message delimiter
+ * without parsing the lines in between.  The index still counts them,
+ * so a shard's journal uses the same numbering as the others', and
+ * jn_merge() can put the shards' journals back together.
+ */
+
+typedef struct _shard
+{
+   unsigned long index;        // this shard, counting from 0
+   unsigned long count;        // shards in all, 0 or 1 for no sharding
+   int           by_recipient; // shard by the first recipient rather than the index
+   char          delimiter;    // first character of a line ending a message
+} Shard;
+
+/**
+ * @brief Set a shard from "i/N".
+ *
+ * @return 1 for success, 0 if *spec* is not "i/N" with i < N.
+ */
+int sh_parse(Shard *shard, const char *spec, char delimiter);
+
+/**
+ * @brief FNV-1a hash of an address, ignoring case.
+ */
+unsigned long sh_hash_address(const char *address, int len);
+
+int sh_owns_index(const Shard *shard, unsigned long index);
+int sh_owns_address(const Shard *shard, const char *address, int len);
+
+/**
+ * @brief Check a message's first RecipLink, for a parsed or compiled message.
+ */
+int sh_owns_recipients(const Shard *shard, const RecipLink *recipients);
+
+/**
+ * @brief Skip the messages of other shards, up to the next of this one.
+ *
+ * *bc* must be at the start of message *index*, and is left at the
+ * start of the first message of this shard, with *index* counting the
+ * messages skipped.
+ *
+ * @return 1 at a message of this shard, 0 at the end of the input.
+ */
+int sh_seek_own_message(const Shard *shard, BuffControl *bc, unsigned long *index);
+
+#endif
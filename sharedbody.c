@@ -0,0 +1,202 @@
+#include <stdio.h>        // for printf()
+#include <stdlib.h>       // for calloc(), free()
+#include <string.h>       // for memset()
+
+#include "sharedbody.h"
+#include "mailcb_internal.h"
+
+// Private, internal functions
+void sb_send_envelopes(MParcel *parcel, SharedBody *sb, RecipLink *recipients);
+
+SharedBody *sb_render(MParcel *parcel,
+                      RecipLink *recipients,
+                      const HeaderField *headers,
+                      const EmailBody *body)
+{
+   SharedBody *sb;
+   const char *line;
+   int line_len;
+
+   if (!(sb = (SharedBody*)calloc(1, sizeof(SharedBody))))
+   {
+      mcb_log_message(parcel, "Out of memory for a shared body.", NULL);
+      goto flush_body;
+   }
+
+   rb_init(&sb->rendered);
+   sb->refcount = 1;
+
+   smtp_classify_message(parcel,
+                         recipients,
+                         headers,
+                         body,
+                         !parcel->mx_delivery && parcel->caps.cap_8bitmime);
+
+   if (!mcb_render_message(parcel, recipients, headers, body, &sb->rendered))
+   {
+      mcb_log_message(parcel, "Out of memory while rendering message.", NULL);
+      smtp_clear_classification(parcel);
+      rb_free(&sb->rendered);
+      free(sb);
+      return NULL;
+   }
+
+   sb->body_8bit = parcel->body_8bit;
+   sb->message_utf8 = parcel->message_utf8;
+   sb->bytes_rendered = sb->rendered.len;
+
+   smtp_clear_classification(parcel);
+   return sb;
+
+  flush_body:
+   if (!body->writer)
+      while (bc_get_next_line(body->bc, &line, &line_len))
+         if (LJ_End_Message == (*body->line_judger)(line, line_len))
+            break;
+
+   return NULL;
+}
+
+SharedBody *sb_ref(SharedBody *sb)
+{
+   __atomic_add_fetch(&sb->refcount, 1, __ATOMIC_RELAXED);
+   return sb;
+}
+
+void sb_release(SharedBody *sb)
+{
+   if (sb && 0 == __atomic_sub_fetch(&sb->refcount, 1, __ATOMIC_ACQ_REL))
+   {
+      rb_free(&sb->rendered);
+      free(sb);
+   }
+}
+
+/**
+ * @brief Send a shared body to *recipients*, leaving their statuses
+ *        for the caller to report.
+ */
+void sb_send_envelopes(MParcel *parcel, SharedBody *sb, RecipLink *recipients)
+{
+   RecipLink *batch = recipients, *next = NULL, *rptr;
+   int connected = 1;
+
+   if (parcel->session_broken)
+   {
+      for (rptr = recipients; rptr; rptr = rptr->next)
+         rptr->rcpt_status = 0;
+
+      return;
+   }
+
+   if (sb->body_8bit && !parcel->caps.cap_8bitmime)
+   {
+      mcb_log_message(parcel, "The shared body is 8bit, and the server lacks 8BITMIME, not sent.", NULL);
+
+      // 5.6.3, conversion required but not supported:
+      for (rptr = recipients; rptr; rptr = rptr->next)
+         if (rptr->rtype != RT_SKIP)
+            rptr->rcpt_status = 554;
+
+      return;
+   }
+
+   parcel->body_8bit = sb->body_8bit;
+   parcel->message_utf8 = sb->message_utf8 || smtp_message_has_utf8(parcel, recipients, NULL);
+   parcel->message_size = sb->rendered.len;
+
+   if (!smtp_size_fits(parcel, recipients, NULL))
+      batch = NULL;
+
+   while (batch && connected)
+   {
+      if (smtp_send_envelope(parcel, batch, &next))
+      {
+         if (parcel->OnlySendEnvelope)
+            connected = smtp_reset_transaction(parcel);
+         else if (!smtp_send_rendered(parcel, &sb->rendered))
+         {
+            smtp_fail_transaction(batch, next, 0);
+            connected = 0;
+         }
+         else
+         {
+            __atomic_add_fetch(&sb->transactions, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&sb->bytes_sent, sb->rendered.len, __ATOMIC_RELAXED);
+
+            connected = 0 != smtp_finish_data(parcel, batch, next);
+         }
+      }
+      else
+      {
+         mcb_log_message(parcel, "Envelope not accepted.", NULL);
+         connected = smtp_reset_transaction(parcel);
+      }
+
+      batch = next;
+   }
+
+   if (!connected)
+      parcel->session_broken = 1;
+
+   parcel->message_size = 0;
+   smtp_clear_classification(parcel);
+}
+
+void sb_send(MParcel *parcel, SharedBody *sb, RecipLink *recipients)
+{
+   sb_send_envelopes(parcel, sb, recipients);
+
+   if (parcel->report_recipients)
+      (*parcel->report_recipients)(parcel, recipients);
+}
+
+void sb_send_separately(MParcel *parcel,
+                        RecipLink *recipients,
+                        const HeaderField *headers,
+                        const EmailBody *body)
+{
+   RecipLink undisclosed, *rptr, *next;
+   SharedBody *sb;
+
+   memset(&undisclosed, 0, sizeof(undisclosed));
+   undisclosed.rtype = RT_TO;
+   undisclosed.address = SB_UNDISCLOSED;
+
+   if ((sb = sb_render(parcel, &undisclosed, headers, body)))
+   {
+      // Each recipient alone, in a chain of one, while the connection lasts:
+      for (rptr = recipients; rptr; rptr = next)
+      {
+         next = rptr->next;
+         if (rptr->rtype == RT_SKIP)
+            continue;
+
+         if (parcel->session_broken)
+         {
+            rptr->rcpt_status = 0;
+            continue;
+         }
+
+         rptr->next = NULL;
+         sb_send_envelopes(parcel, sb, rptr);
+         rptr->next = next;
+      }
+
+      if (parcel->verbose)
+         printf("Shared body: %lu bytes rendered once, %llu sent in %lu transactions.\n",
+                (unsigned long)sb->bytes_rendered,
+                sb->bytes_sent,
+                sb->transactions);
+
+      sb_release(sb);
+   }
+   else
+   {
+      for (rptr = recipients; rptr; rptr = rptr->next)
+         rptr->rcpt_status = 0;
+   }
+
+   if (parcel->report_recipients)
+      (*parcel->report_recipients)(parcel, recipients);
+}
@@ -0,0 +1,77 @@
+#ifndef SHAREDBODY_H
+#define SHAREDBODY_H
+
+#include "mailcb.h"
+
+/**
+ * Shared bodies: a message rendered once, sent to many envelopes.
+ *
+ * sb_render() reads and renders the header fields and content of a
+ * message into a buffer that is never changed again, so the same bytes
+ * can go to any number of transactions, on any number of connections,
+ * with no line judging or dot-stuffing after the first time.  Each
+ * holder of a SharedBody takes a reference with sb_ref() and gives it
+ * up with sb_release(); the last release frees it.
+ *
+ * The content is classified when it is rendered, for the session the
+ * parcel has then.  A body that goes out in 8bit needs 8BITMIME of
+ * every server it is sent to, so sb_send() refuses it to others.
+ *
+ * MParcel::separate_envelopes sends every message this way, one
+ * transaction per recipient, so no recipient sees the others: To:
+ * shows SB_UNDISCLOSED instead of the recipients.
+ */
+
+#define SB_UNDISCLOSED "undisclosed-recipients:;"
+
+typedef struct _shared_body
+{
+   RenderBuffer  rendered;       // DATA content, dot-stuffed, without the final "."
+   int           body_8bit;      // for BODY=8BITMIME, see MParcel::body_8bit
+   int           message_utf8;   // for SMTPUTF8, see MParcel::message_utf8
+
+   int           refcount;
+   size_t        bytes_rendered;       // once, when rendered
+   unsigned long transactions;         // DATA sent with the body
+   unsigned long long bytes_sent;      // by those transactions
+} SharedBody;
+
+/**
+ * @brief Render a message once for sending with sb_send().
+ *
+ * @param recipients  Listed by To: and Cc:, not the envelope, which is
+ *                    given to sb_send().
+ *
+ * @return A SharedBody with one reference, NULL if memory ran out.
+ */
+SharedBody *sb_render(MParcel *parcel,
+                      RecipLink *recipients,
+                      const HeaderField *headers,
+                      const EmailBody *body);
+
+SharedBody *sb_ref(SharedBody *sb);
+void sb_release(SharedBody *sb);
+
+/**
+ * @brief Send a shared body to *recipients*, in as many transactions
+ *        as the server needs, and report them.
+ *
+ * Safe to call from several threads at once, each with its own parcel.
+ * Once the connection is lost, see MParcel::session_broken, nothing
+ * more is sent, and the recipients are left at 0.
+ */
+void sb_send(MParcel *parcel, SharedBody *sb, RecipLink *recipients);
+
+/**
+ * @brief Render a message once, and send it in one transaction per recipient.
+ *
+ * mcb_send_email_body() does this with MParcel::separate_envelopes.
+ * If the connection is lost, the recipients not yet sent to are left
+ * at 0.
+ */
+void sb_send_separately(MParcel *parcel,
+                        RecipLink *recipients,
+                        const HeaderField *headers,
+                        const EmailBody *body);
+
+#endif
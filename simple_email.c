@@ -210,7 +210,7 @@ void int_collect_headers(SSEClosure *ssec)
          tline[name_len] = '\0';
 
          h_cur->name = tline;
-         v_cur = NULL;
+         v_cur = v_tail = NULL;
       }
 
       // Note that header field values may span multiple lines.
@@ -0,0 +1,399 @@
+// -*- compile-command: "gcc -Wall -Werror -DSMTPKEYS_MAIN -O2 -ggdb -o smtpkeys smtpkeys.c" -*-
+
+#include <stdio.h>
+#include <string.h>
+
+#include "smtpkeys.h"
+
+// Private, internal functions
+char sk_upper(char chr);
+int sk_is(const char *word, const char *key, int len);
+
+char sk_upper(char chr)
+{
+   return (chr >= 'a' && chr <= 'z') ? chr - ('a' - 'A') : chr;
+}
+
+/**
+ * @brief Case-insensitive match of *word against upper-case *key of the same length.
+ */
+int sk_is(const char *word, const char *key, int len)
+{
+   while (len-- > 0)
+      if (sk_upper(*word++) != *key++)
+         return 0;
+
+   return 1;
+}
+
+int sk_keyword_len(const char *line, int line_len)
+{
+   const char *ptr = line;
+   const char *end = line + line_len;
+
+   while (ptr < end && *ptr != ' ' && *ptr != '=' && *ptr != '\r')
+      ++ptr;
+
+   return ptr - line;
+}
+
+SmtpKeyword smtp_keyword_lookup(const char *word, int len)
+{
+   if (len < 3)
+      return SK_UNKNOWN;
+
+   switch(len)
+   {
+      case 3:
+         return sk_is(word, "DSN", 3) ? SK_DSN : SK_UNKNOWN;
+
+      case 4:
+         switch(sk_upper(*word))
+         {
+            case 'A':
+               if (sk_is(word, "AUTH", 4)) return SK_AUTH;
+               if (sk_is(word, "ATRN", 4)) return SK_ATRN;
+               break;
+            case 'B':
+               if (sk_is(word, "BURL", 4)) return SK_BURL;
+               break;
+            case 'E':
+               if (sk_is(word, "ETRN", 4)) return SK_ETRN;
+               if (sk_is(word, "EXPN", 4)) return SK_EXPN;
+               break;
+            case 'H':
+               if (sk_is(word, "HELP", 4)) return SK_HELP;
+               break;
+            case 'M':
+               if (sk_is(word, "MTRK", 4)) return SK_MTRK;
+               break;
+            case 'O':
+               if (sk_is(word, "ONEX", 4)) return SK_ONEX;
+               break;
+            case 'R':
+               if (sk_is(word, "RRVS", 4)) return SK_RRVS;
+               break;
+            case 'S':
+               if (sk_is(word, "SIZE", 4)) return SK_SIZE;
+               if (sk_is(word, "SEND", 4)) return SK_SEND;
+               if (sk_is(word, "SAML", 4)) return SK_SAML;
+               if (sk_is(word, "SOML", 4)) return SK_SOML;
+               break;
+            case 'T':
+               if (sk_is(word, "TURN", 4)) return SK_TURN;
+               break;
+            case 'V':
+               if (sk_is(word, "VRFY", 4)) return SK_VRFY;
+               if (sk_is(word, "VERB", 4)) return SK_VERB;
+               break;
+            case 'X':
+               if (sk_is(word, "XUSR", 4)) return SK_XUSR;
+               break;
+         }
+         break;
+
+      case 6:
+         switch(sk_upper(*word))
+         {
+            case 'C':
+               if (sk_is(word, "CONNEG", 6)) return SK_CONNEG;
+               break;
+            case 'L':
+               if (sk_is(word, "LIMITS", 6)) return SK_LIMITS;
+               break;
+         }
+         break;
+
+      case 7:
+         return sk_is(word, "CONPERM", 7) ? SK_CONPERM : SK_UNKNOWN;
+
+      case 8:
+         switch(sk_upper(*word))
+         {
+            case '7':
+               if (sk_is(word, "7BITMIME", 8)) return SK_7BITMIME;
+               break;
+            case '8':
+               if (sk_is(word, "8BITMIME", 8)) return SK_8BITMIME;
+               break;
+            case 'C':
+               if (sk_is(word, "CHUNKING", 8)) return SK_CHUNKING;
+               break;
+            case 'S':
+               // Distinguish SMTPUTF8 and STARTTLS by the second character:
+               if (sk_upper(word[1]) == 'M')
+                  return sk_is(word, "SMTPUTF8", 8) ? SK_SMTPUTF8 : SK_UNKNOWN;
+               if (sk_is(word, "STARTTLS", 8)) return SK_STARTTLS;
+               break;
+            case 'U':
+               if (sk_is(word, "UTF8SMTP", 8)) return SK_UTF8SMTP;
+               break;
+         }
+         break;
+
+      case 9:
+         switch(sk_upper(*word))
+         {
+            case 'D':
+               if (sk_is(word, "DELIVERBY", 9)) return SK_DELIVERBY;
+               break;
+            case 'S':
+               if (sk_is(word, "SUBMITTER", 9)) return SK_SUBMITTER;
+               break;
+         }
+         break;
+
+      case 10:
+         switch(sk_upper(*word))
+         {
+            case 'B':
+               if (sk_is(word, "BINARYMIME", 10)) return SK_BINARYMIME;
+               break;
+            case 'C':
+               if (sk_is(word, "CHECKPOINT", 10)) return SK_CHECKPOINT;
+               break;
+            case 'P':
+               if (sk_is(word, "PIPELINING", 10)) return SK_PIPELINING;
+               break;
+            case 'R':
+               if (sk_is(word, "REQUIRETLS", 10)) return SK_REQUIRETLS;
+               break;
+         }
+         break;
+
+      case 11:
+         return sk_is(word, "MT-PRIORITY", 11) ? SK_MT_PRIORITY : SK_UNKNOWN;
+
+      case 13:
+         switch(sk_upper(*word))
+         {
+            case 'F':
+               if (sk_is(word, "FUTURERELEASE", 13)) return SK_FUTURERELEASE;
+               break;
+            case 'N':
+               if (sk_is(word, "NO-SOLICITING", 13)) return SK_NO_SOLICITING;
+               break;
+         }
+         break;
+
+      case 19:
+         return sk_is(word, "ENHANCEDSTATUSCODES", 19) ? SK_ENHANCEDSTATUSCODES : SK_UNKNOWN;
+   }
+
+   return SK_UNKNOWN;
+}
+
+SmtpAuthMech smtp_auth_lookup(const char *word, int len)
+{
+   switch(len)
+   {
+      case 3:
+         if (sk_is(word, "MD5", 3)) return SA_MD5;
+         break;
+      case 5:
+         if (sk_is(word, "PLAIN", 5)) return SA_PLAIN;
+         if (sk_is(word, "LOGIN", 5)) return SA_LOGIN;
+         break;
+      case 6:
+         if (sk_is(word, "GSSAPI", 6)) return SA_GSSAPI;
+         if (sk_is(word, "XOAUTH", 6)) return SA_XOAUTH;
+         break;
+      case 7:
+         if (sk_is(word, "XOAUTH2", 7)) return SA_XOAUTH2;
+         break;
+      case 8:
+         if (sk_is(word, "CRAM-MD5", 8)) return SA_CRAM_MD5;
+         if (sk_is(word, "OAUTH10A", 8)) return SA_OAUTH10A;
+         break;
+      case 10:
+         if (sk_is(word, "DIGEST-MD5", 10)) return SA_DIGEST_MD5;
+         break;
+      case 11:
+         if (sk_is(word, "OAUTHBEARER", 11)) return SA_OAUTHBEARER;
+         break;
+   }
+
+   return SA_UNKNOWN;
+}
+
+PopCapa pop_capa_lookup(const char *word, int len)
+{
+   switch(len)
+   {
+      case 3:
+         if (sk_is(word, "TOP", 3)) return PC_TOP;
+         break;
+      case 4:
+         switch(sk_upper(*word))
+         {
+            case 'U':
+               if (sk_is(word, "USER", 4)) return PC_USER;
+               if (sk_is(word, "UIDL", 4)) return PC_UIDL;
+               if (sk_is(word, "UTF8", 4)) return PC_UTF8;
+               break;
+            case 'S':
+               if (sk_is(word, "SASL", 4)) return PC_SASL;
+               if (sk_is(word, "STLS", 4)) return PC_STLS;
+               break;
+            case 'L':
+               if (sk_is(word, "LANG", 4)) return PC_LANG;
+               break;
+         }
+         break;
+      case 6:
+         if (sk_is(word, "EXPIRE", 6)) return PC_EXPIRE;
+         break;
+      case 10:
+         if (sk_is(word, "RESP-CODES", 10)) return PC_RESP_CODES;
+         if (sk_is(word, "PIPELINING", 10)) return PC_PIPELINING;
+         break;
+      case 11:
+         if (sk_is(word, "LOGIN-DELAY", 11)) return PC_LOGIN_DELAY;
+         break;
+      case 14:
+         if (sk_is(word, "IMPLEMENTATION", 14)) return PC_IMPLEMENTATION;
+         if (sk_is(word, "AUTH-RESP-CODE", 14)) return PC_AUTH_RESP_CODE;
+         break;
+   }
+
+   return PC_UNKNOWN;
+}
+
+
+#ifdef SMTPKEYS_MAIN
+
+#include <time.h>
+
+/**
+ * EHLO responses captured from real servers, status prefixes removed.
+ */
+const char *captured_gmail[] = {
+   "smtp.gmail.com at your service, [203.0.113.9]",
+   "SIZE 35882577",
+   "8BITMIME",
+   "AUTH LOGIN PLAIN XOAUTH2 PLAIN-CLIENTTOKEN OAUTHBEARER XOAUTH",
+   "ENHANCEDSTATUSCODES",
+   "PIPELINING",
+   "CHUNKING",
+   "SMTPUTF8",
+   NULL
+};
+
+const char *captured_office365[] = {
+   "BN9PR03CA0123.outlook.office365.com Hello [203.0.113.9]",
+   "SIZE 157286400",
+   "PIPELINING",
+   "DSN",
+   "ENHANCEDSTATUSCODES",
+   "AUTH LOGIN XOAUTH2",
+   "8BITMIME",
+   "BINARYMIME",
+   "CHUNKING",
+   "SMTPUTF8",
+   NULL
+};
+
+const char *captured_postfix[] = {
+   "mail.example.org",
+   "PIPELINING",
+   "SIZE 10240000",
+   "VRFY",
+   "ETRN",
+   "STARTTLS",
+   "ENHANCEDSTATUSCODES",
+   "8BITMIME",
+   "DSN",
+   "SMTPUTF8",
+   "CHUNKING",
+   NULL
+};
+
+const char **captured[] = { captured_gmail, captured_office365, captured_postfix, NULL };
+
+/**
+ * The strncmp() table scan the dispatcher replaced, for comparison.
+ */
+typedef struct _old_cap { const char *str; int len; int id; } OldCap;
+
+OldCap old_caps[] = {
+   {"AUTH",                 4, SK_AUTH},
+   {"SIZE",                 4, SK_SIZE},
+   {"STARTTLS",             8, SK_STARTTLS},
+   {"ENHANCEDSTATUSCODES", 19, SK_ENHANCEDSTATUSCODES},
+   {"8BITMIME",             8, SK_8BITMIME},
+   {"7BITMIME",             8, SK_7BITMIME},
+   {"PIPELINING",          10, SK_PIPELINING},
+   {"SMTPUTF8",             8, SK_SMTPUTF8},
+   {"CHUNKING",             8, SK_CHUNKING}
+};
+
+int old_lookup(const char *line)
+{
+   int found = SK_UNKNOWN;
+   const OldCap *ptr = old_caps;
+   const OldCap *end = &old_caps[sizeof(old_caps) / sizeof(OldCap)];
+
+   // Like the old code, every entry is compared against every line:
+   while (ptr < end)
+   {
+      if (0 == strncmp(line, ptr->str, ptr->len))
+         found = ptr->id;
+      ++ptr;
+   }
+
+   return found;
+}
+
+double elapsed(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv)
+{
+   const int reps = 2000000;
+   const char ***server, **line;
+   struct timespec start;
+   long checksum_old = 0, checksum_new = 0, lines = 0;
+   int r;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+      for (server = captured; *server; ++server)
+         for (line = *server; *line; ++line)
+         {
+            checksum_old += old_lookup(*line);
+            ++lines;
+         }
+   double old_secs = elapsed(&start);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (r=0; r < reps; ++r)
+      for (server = captured; *server; ++server)
+         for (line = *server; *line; ++line)
+            checksum_new += smtp_keyword_lookup(*line, sk_keyword_len(*line, strlen(*line)));
+   double new_secs = elapsed(&start);
+
+   printf("%ld EHLO lines\n", lines);
+   printf("strncmp table: %6.1f ns/line (checksum %ld)\n", old_secs * 1e9 / lines, checksum_old);
+   printf("dispatch:      %6.1f ns/line (checksum %ld)\n", new_secs * 1e9 / lines, checksum_new);
+
+   // The dispatcher must agree with the old table wherever the old table had an answer:
+   for (server = captured; *server; ++server)
+      for (line = *server; *line; ++line)
+      {
+         int old_id = old_lookup(*line);
+         int new_id = smtp_keyword_lookup(*line, sk_keyword_len(*line, strlen(*line)));
+         if (old_id != SK_UNKNOWN && old_id != new_id)
+         {
+            printf("Mismatch on \"%s\": %d vs %d\n", *line, old_id, new_id);
+            return 1;
+         }
+      }
+
+   return 0;
+}
+
+#endif // SMTPKEYS_MAIN
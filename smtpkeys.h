@@ -0,0 +1,103 @@
+#ifndef SMTPKEYS_H
+#define SMTPKEYS_H
+
+/**
+ * Keyword identifiers for the EHLO, AUTH, and POP CAPA vocabularies.
+ *
+ * The lookup functions switch on the keyword length and first
+ * character, so each word is confirmed with at most a couple of
+ * comparisons instead of a scan of every known keyword.
+ * Comparisons are case-insensitive, as the RFCs require.
+ */
+
+/** SMTP service extensions from the IANA registry, plus 7BITMIME seen in the wild. */
+typedef enum _smtp_keyword
+{
+   SK_UNKNOWN = 0,
+   SK_7BITMIME,
+   SK_8BITMIME,
+   SK_ATRN,
+   SK_AUTH,
+   SK_BINARYMIME,
+   SK_BURL,
+   SK_CHECKPOINT,
+   SK_CHUNKING,
+   SK_CONNEG,
+   SK_CONPERM,
+   SK_DELIVERBY,
+   SK_DSN,
+   SK_ENHANCEDSTATUSCODES,
+   SK_ETRN,
+   SK_EXPN,
+   SK_FUTURERELEASE,
+   SK_HELP,
+   SK_LIMITS,
+   SK_MT_PRIORITY,
+   SK_MTRK,
+   SK_NO_SOLICITING,
+   SK_ONEX,
+   SK_PIPELINING,
+   SK_REQUIRETLS,
+   SK_RRVS,
+   SK_SAML,
+   SK_SEND,
+   SK_SIZE,
+   SK_SMTPUTF8,
+   SK_SOML,
+   SK_STARTTLS,
+   SK_SUBMITTER,
+   SK_TURN,
+   SK_UTF8SMTP,
+   SK_VERB,
+   SK_VRFY,
+   SK_XUSR,
+   SK_COUNT
+} SmtpKeyword;
+
+/** SASL mechanisms that may follow the AUTH keyword. */
+typedef enum _smtp_auth_mech
+{
+   SA_UNKNOWN = 0,
+   SA_PLAIN,
+   SA_LOGIN,
+   SA_GSSAPI,
+   SA_DIGEST_MD5,
+   SA_MD5,
+   SA_CRAM_MD5,
+   SA_OAUTH10A,
+   SA_OAUTHBEARER,
+   SA_XOAUTH,
+   SA_XOAUTH2,
+   SA_COUNT
+} SmtpAuthMech;
+
+/** POP3 CAPA tags (RFC 2449, 2595, 3206, 6856). */
+typedef enum _pop_capa
+{
+   PC_UNKNOWN = 0,
+   PC_TOP,
+   PC_USER,
+   PC_SASL,
+   PC_RESP_CODES,
+   PC_LOGIN_DELAY,
+   PC_PIPELINING,
+   PC_EXPIRE,
+   PC_UIDL,
+   PC_IMPLEMENTATION,
+   PC_STLS,
+   PC_UTF8,
+   PC_LANG,
+   PC_AUTH_RESP_CODE,
+   PC_COUNT
+} PopCapa;
+
+/**
+ * @brief Number of characters from *line that form the keyword (up to space, '=', or end).
+ */
+int sk_keyword_len(const char *line, int line_len);
+
+SmtpKeyword smtp_keyword_lookup(const char *word, int len);
+SmtpAuthMech smtp_auth_lookup(const char *word, int len);
+PopCapa pop_capa_lookup(const char *word, int len);
+
+#endif
@@ -1,7 +1,29 @@
 #include <stdarg.h>    // for va_arg, etc.
 #include <string.h>    // for memset, etc;
+#include <stdlib.h>    // for realloc(), free()
+#include <limits.h>    // for IOV_MAX
+#include <unistd.h>    // for sysconf()
+#include <sys/mman.h>  // for mmap(), munmap()
+#include <sys/sendfile.h>
+#include <signal.h>    // for pthread_sigmask(), sigtimedwait()
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>      // for struct timespec
 #include "socktalk.h"
 
+#define STK_GATHER_LEN 16384   // the most a TLS record holds
+#define STK_MAP_LEN    (4 << 20)   // most of a file mapped at once
+
+// SSL_sendfile() and kernel TLS came with OpenSSL 3:
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define STK_KTLS 1
+#endif
+
+// Without _XOPEN_SOURCE, limits.h may not say; Linux takes 1024:
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 
 int walk_status_reply(const char *str, int *status, const char** line, int *line_len)
 {
@@ -118,7 +140,8 @@ int log_status_reply_errors(const char *buffer, int buffer_len)
 
 int stk_sock_talker(const struct _stalker* talker, const void *data, int data_len)
 {
-   return send(talker->socket_handle, (void*)data, data_len, 0);
+   // A server that drops an idle connection must not raise SIGPIPE:
+   return send(talker->socket_handle, (void*)data, data_len, MSG_NOSIGNAL);
 }
 
 int stk_ssl_talker(const struct _stalker* talker, const void *data, int data_len)
@@ -126,6 +149,157 @@ int stk_ssl_talker(const struct _stalker* talker, const void *data, int data_len
    return SSL_write(talker->ssl_handle, data, data_len);
 }
 
+int stk_sock_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = (struct iovec*)iov;
+   msg.msg_iovlen = iov_count;
+
+   return sendmsg(talker->socket_handle, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Gather small pieces into full records, since each SSL_write() makes at least one.
+ */
+int stk_ssl_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   char   gather[STK_GATHER_LEN];
+   size_t gathered = 0;
+   int    total = 0, written;
+   const struct iovec *end = iov + iov_count;
+
+   for (; iov < end; ++iov)
+   {
+      if (gathered + iov->iov_len > sizeof(gather) && gathered)
+      {
+         if ((written = SSL_write(talker->ssl_handle, gather, gathered)) <= 0)
+            return total ? total : written;
+
+         total += written;
+         gathered = 0;
+      }
+
+      if (iov->iov_len > sizeof(gather))
+      {
+         if ((written = SSL_write(talker->ssl_handle, iov->iov_base, iov->iov_len)) <= 0)
+            return total ? total : written;
+
+         total += written;
+      }
+      else
+      {
+         memcpy(&gather[gathered], iov->iov_base, iov->iov_len);
+         gathered += iov->iov_len;
+      }
+   }
+
+   if (gathered)
+   {
+      if ((written = SSL_write(talker->ssl_handle, gather, gathered)) <= 0)
+         return total ? total : written;
+
+      total += written;
+   }
+
+   return total;
+}
+
+/**
+ * @brief sendfile() to the socket, without raising SIGPIPE.
+ *
+ * sendfile() has no MSG_NOSIGNAL, so SIGPIPE is blocked in the thread
+ * while it runs, and the one a dropped connection raises is taken off
+ * the thread before it is unblocked.  The caller sees EPIPE instead.
+ */
+ssize_t stk_sock_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len)
+{
+   struct timespec no_wait = { 0, 0 };
+   sigset_t sigpipe, old_mask, pending;
+   int was_pending, saved_errno;
+   ssize_t sent;
+
+   sigemptyset(&sigpipe);
+   sigaddset(&sigpipe, SIGPIPE);
+
+   // Leave alone a SIGPIPE that was waiting before ours:
+   sigpending(&pending);
+   was_pending = sigismember(&pending, SIGPIPE);
+
+   pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+   sent = sendfile(talker->socket_handle, fd, &offset, len);
+
+   if (sent < 0 && errno == EPIPE && !was_pending)
+   {
+      saved_errno = errno;
+      while (sigtimedwait(&sigpipe, NULL, &no_wait) < 0 && errno == EINTR)
+         ;
+      errno = saved_errno;
+   }
+
+   pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+   return sent;
+}
+
+/**
+ * @brief With kTLS, SSL_sendfile(); otherwise records from a mapping of the file.
+ */
+ssize_t stk_ssl_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len)
+{
+#ifdef STK_KTLS
+   if (stk_ktls_send(talker))
+      return SSL_sendfile(talker->ssl_handle, fd, offset, len, 0);
+#endif
+
+   return stk_mapped_filetalker(talker, fd, offset, len);
+}
+
+/**
+ * @brief Write from a file mapped into memory, for talkers that can't
+ *        send from the file itself.
+ */
+ssize_t stk_mapped_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len)
+{
+   long   page = sysconf(_SC_PAGESIZE);
+   off_t  map_offset = offset - offset % page;
+   size_t lead = offset - map_offset;
+   size_t chunk, done = 0;
+   char   *map;
+   int    written;
+
+   if (len > STK_MAP_LEN)
+      len = STK_MAP_LEN;
+
+   map = (char*)mmap(NULL, lead + len, PROT_READ, MAP_SHARED, fd, map_offset);
+   if (map == MAP_FAILED)
+      return -1;
+
+   madvise(map, lead + len, MADV_SEQUENTIAL);
+
+   while (done < len)
+   {
+      chunk = len - done < STK_GATHER_LEN ? len - done : STK_GATHER_LEN;
+      if ((written = (*talker->writer)(talker, map + lead + done, chunk)) <= 0)
+         break;
+
+      done += written;
+   }
+
+   munmap(map, lead + len);
+   return done ? (ssize_t)done : -1;
+}
+
+int stk_ktls_send(const struct _stalker* talker)
+{
+#ifdef STK_KTLS
+   return talker->ssl_handle && BIO_get_ktls_send(SSL_get_wbio(talker->ssl_handle));
+#else
+   return 0;
+#endif
+}
+
 int stk_sock_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
    return recv(talker->socket_handle, buffer, buff_len, 0);
@@ -136,12 +310,96 @@ int stk_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len)
    return SSL_read(talker->ssl_handle, buffer, buff_len);
 }
 
+/**
+ * @brief Append to the talker's RenderBuffer instead of sending.
+ */
+int stk_buffer_talker(const struct _stalker* talker, const void *data, int data_len)
+{
+   if (rb_append(talker->render_buffer, data, data_len))
+      return data_len;
+   else
+      return 0;
+}
+
+int stk_buffer_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   int total = 0;
+   const struct iovec *end = iov + iov_count;
+
+   for (; iov < end; ++iov)
+   {
+      if (!rb_append(talker->render_buffer, iov->iov_base, iov->iov_len))
+         break;
+
+      total += iov->iov_len;
+   }
+
+   return total;
+}
+
+/**
+ * @brief Nothing ever answers a buffer talker.
+ */
+int stk_buffer_reader(const struct _stalker* talker, void *buffer, int buff_len)
+{
+   return 0;
+}
+
+void rb_init(RenderBuffer *rb)
+{
+   memset(rb, 0, sizeof(RenderBuffer));
+}
+
+/**
+ * @brief Empty the buffer, keeping its memory for the next message.
+ */
+void rb_reset(RenderBuffer *rb)
+{
+   rb->len = 0;
+   rb->failed = 0;
+}
+
+void rb_free(RenderBuffer *rb)
+{
+   if (rb->data)
+      free(rb->data);
+   rb_init(rb);
+}
+
+int rb_append(RenderBuffer *rb, const void *data, size_t data_len)
+{
+   if (data_len == 0)
+      return 1;
+
+   if (rb->len + data_len > rb->size)
+   {
+      size_t new_size = rb->size ? rb->size : 16384;
+      while (new_size < rb->len + data_len)
+         new_size *= 2;
+
+      char *new_data = (char*)realloc(rb->data, new_size);
+      if (!new_data)
+      {
+         rb->failed = 1;
+         return 0;
+      }
+
+      rb->data = new_data;
+      rb->size = new_size;
+   }
+
+   memcpy(&rb->data[rb->len], data, data_len);
+   rb->len += data_len;
+   return 1;
+}
 
 void init_ssl_talker(struct _stalker* talker, SSL* ssl)
 {
    memset(talker, 0, sizeof(struct _stalker));
    talker->ssl_handle = (void*)ssl;
    talker->writer = stk_ssl_talker;
+   talker->vwriter = stk_ssl_vtalker;
+   talker->filewriter = stk_ssl_filetalker;
    talker->reader = stk_ssl_reader;
 }
 
@@ -150,9 +408,48 @@ void init_sock_talker(struct _stalker* talker, int socket)
    memset(talker, 0, sizeof(struct _stalker));
    talker->socket_handle = socket;
    talker->writer = stk_sock_talker;
+   talker->vwriter = stk_sock_vtalker;
+   talker->filewriter = stk_sock_filetalker;
    talker->reader = stk_sock_reader;
 }
 
+void init_buffer_talker(struct _stalker* talker, RenderBuffer *rb)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->socket_handle = -1;
+   talker->render_buffer = rb;
+   talker->writer = stk_buffer_talker;
+   talker->vwriter = stk_buffer_vtalker;
+   talker->filewriter = stk_mapped_filetalker;
+   talker->reader = stk_buffer_reader;
+}
+
+/**
+ * @brief Send *len* bytes of a file, from *offset*, without reading them
+ *        into the program if the talker can.
+ *
+ * Plain sockets use sendfile(), and TLS with kTLS SSL_sendfile().  A
+ * talker without a SockFileWriter writes from a mapping of the file.
+ *
+ * @return Number of bytes written, less than the whole if writing failed.
+ */
+size_t stk_send_file(const struct _stalker* talker, int fd, off_t offset, size_t len)
+{
+   SockFileWriter filewriter = talker->filewriter ? talker->filewriter : stk_mapped_filetalker;
+   size_t total = 0;
+   ssize_t written;
+
+   while (total < len)
+   {
+      if ((written = (*filewriter)(talker, fd, offset + total, len - total)) <= 0)
+         break;
+
+      total += written;
+   }
+
+   return total;
+}
+
 /**
  * @brief Sends data by char* and byte count.  To be paired with use of BuffControl object.
  */
@@ -174,8 +471,73 @@ size_t stk_simple_send_unlined(const struct _stalker* talker, const char *data,
    return (*talker->writer)(talker, data, data_len);
 }
 
+/**
+ * @brief Send the pieces of *iov* in order, in as few writes as the talker can.
+ *
+ * Many small pieces cost one system call, or one TLS record per 16K,
+ * instead of one each.  A talker without a SockVWriter writes them
+ * one at a time.
+ *
+ * @return Number of bytes written, less than the whole if writing failed.
+ */
+size_t stk_send_iovec(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   size_t total = 0;
+   int    count, written, rest;
+
+   if (!talker->vwriter)
+   {
+      for (; iov_count > 0; ++iov, --iov_count)
+         total += (*talker->writer)(talker, iov->iov_base, iov->iov_len);
+
+      return total;
+   }
+
+   while (iov_count > 0)
+   {
+      count = iov_count < IOV_MAX ? iov_count : IOV_MAX;
+      if ((written = (*talker->vwriter)(talker, iov, count)) <= 0)
+         break;
+
+      total += written;
+
+      // Move past what was written:
+      while (iov_count > 0 && (size_t)written >= iov->iov_len)
+      {
+         written -= iov->iov_len;
+         ++iov;
+         --iov_count;
+      }
+
+      // Finish a piece written in part:
+      if (written > 0)
+      {
+         rest = (*talker->writer)(talker, (const char*)iov->iov_base + written, iov->iov_len - written);
+         if (rest <= 0)
+            break;
+
+         total += rest;
+         ++iov;
+         --iov_count;
+      }
+   }
+
+   return total;
+}
+
+/**
+ * @brief Write the strings in *args* and "\r\n" as a single write when
+ *        they fit in a line buffer.
+ *
+ * A command sent in several small writes leaves its tail waiting for
+ * the ACK of its head (Nagle), which the server delays because it has
+ * nothing to say until the command is complete.  That costs a delayed
+ * ACK timeout on every command.
+ */
 size_t stk_vsend_line(const struct _stalker* talker, va_list args)
 {
+   char   line[1024];
+   size_t line_len = 0;
    size_t bytes_sent, total_bytes = 0;
    size_t bite_len;
 
@@ -186,16 +548,36 @@ size_t stk_vsend_line(const struct _stalker* talker, va_list args)
    while (bite)
    {
       bite_len = strlen(bite);
-      total_bytes += bytes_sent = (*talker->writer)(talker, bite, bite_len);
-      if (bytes_sent != bite_len)
-         fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+      if (line_len + bite_len + 2 <= sizeof(line))
+      {
+         memcpy(&line[line_len], bite, bite_len);
+         line_len += bite_len;
+      }
+      else
+      {
+         // Too long to gather, so send what's gathered and this piece as they are:
+         if (line_len)
+         {
+            total_bytes += (*talker->writer)(talker, line, line_len);
+            line_len = 0;
+         }
+
+         total_bytes += bytes_sent = (*talker->writer)(talker, bite, bite_len);
+         if (bytes_sent != bite_len)
+            fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+      }
 
       bite = va_arg(args_copy, const char*);
    }
 
    va_end(args_copy);
 
-   total_bytes += bytes_sent = (*talker->writer)(talker, "\r\n", 2);
+   memcpy(&line[line_len], "\r\n", 2);
+   line_len += 2;
+
+   total_bytes += bytes_sent = (*talker->writer)(talker, line, line_len);
+   if (bytes_sent != line_len)
+      fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
 
    return total_bytes;
 }
@@ -212,26 +594,12 @@ size_t stk_vsend_line(const struct _stalker* talker, va_list args)
  */
 size_t stk_send_line(const struct _stalker* talker, ...)
 {
-   size_t bytes_sent, total_bytes = 0;
-   size_t bite_len;
+   size_t total_bytes;
    va_list ap;
    va_start(ap, talker);
-
-   const char *bite = va_arg(ap, const char*);
-   while (bite)
-   {
-      bite_len = strlen(bite);
-      total_bytes += bytes_sent = (*talker->writer)(talker, bite, bite_len);
-      if (bytes_sent != bite_len)
-         fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
-
-      bite = va_arg(ap, const char*);
-   }
-
+   total_bytes = stk_vsend_line(talker, ap);
    va_end(ap);
 
-   total_bytes += bytes_sent = (*talker->writer)(talker, "\r\n", 2);
-
    return total_bytes;
 }
 
@@ -240,7 +608,9 @@ size_t stk_send_line(const struct _stalker* talker, ...)
  */
 size_t stk_recv_line(const struct _stalker* talker, void* buffer, int buff_len)
 {
-   size_t bytes_read = (*talker->reader)(talker, buffer, buff_len);
+   int result = (*talker->reader)(talker, buffer, buff_len);
+   // Treat a failed read, like a reset connection, as an empty one:
+   size_t bytes_read = result > 0 ? result : 0;
    if (bytes_read+1 < buff_len)
       ((char*)buffer)[bytes_read] = '\0';
    return bytes_read;
@@ -2,6 +2,7 @@
 #define SOCKTALK_H
 
 #include <sys/types.h>
+#include <sys/uio.h>      // for struct iovec
 
 #include <sys/socket.h>
 #include <openssl/ssl.h>
@@ -13,6 +14,8 @@ struct _stalker;
 
 typedef int (*SockWriter)(const struct _stalker*, const void *data, int data_len);
 typedef int (*SockReader)(const struct _stalker*, void *buffer, int buff_len);
+typedef int (*SockVWriter)(const struct _stalker*, const struct iovec *iov, int iov_count);
+typedef ssize_t (*SockFileWriter)(const struct _stalker*, int fd, off_t offset, size_t len);
 
 
 /**
@@ -42,6 +45,23 @@ int log_status_reply_errors(const char *buffer, int buffer_len);
 int stk_sock_talker(const struct _stalker* talker, const void *data, int data_len);
 int stk_ssl_talker(const struct _stalker* talker, const void *data, int data_len);
 
+int stk_sock_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+int stk_ssl_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+
+ssize_t stk_sock_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len);
+ssize_t stk_ssl_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len);
+ssize_t stk_mapped_filetalker(const struct _stalker* talker, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Report if the kernel encrypts what the talker sends, with kTLS.
+ *
+ * ssl_new_context() asks OpenSSL for kernel TLS, which it uses if the
+ * kernel has the tls module and the cipher suits it.  Then
+ * stk_send_file() sends from a file with SSL_sendfile(), so the bytes
+ * never pass through user space.  If not, nothing changes.
+ */
+int stk_ktls_send(const struct _stalker* talker);
+
 int stk_sock_reader(const struct _stalker* talker, void *buffer, int buff_len);
 int stk_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len);
 
@@ -56,17 +76,46 @@ typedef struct _status_line
 } Status_Line;
 
 
+/**
+ * @brief Growable memory target for a buffer talker.
+ *
+ * Rendering a message into memory once lets it be sent to several
+ * servers, or several times to one, without reading the input again.
+ */
+typedef struct _render_buffer
+{
+   char   *data;
+   size_t len;
+   size_t size;
+   int    failed;     // set if an allocation failed, leaving the contents incomplete
+} RenderBuffer;
+
+void rb_init(RenderBuffer *rb);
+void rb_reset(RenderBuffer *rb);
+void rb_free(RenderBuffer *rb);
+int rb_append(RenderBuffer *rb, const void *data, size_t data_len);
+
 typedef struct _stalker
 {
-   SSL*       ssl_handle;       // pointer to socket handle OR SSH structure
-   int        socket_handle;
-   SockWriter writer;
-   SockReader reader;
+   SSL*         ssl_handle;       // pointer to socket handle OR SSH structure
+   int          socket_handle;
+   SockWriter   writer;
+   SockReader   reader;
+   SockVWriter  vwriter;          // gathering writer, may write less than all
+   SockFileWriter filewriter;     // writer from a file, may write less than all
+   RenderBuffer *render_buffer;   // target of a buffer talker
+   struct _ur_session *uring_session;   // state of an io_uring talker, see uring.h
+   struct _tm_session *tls_session;     // state of a memory-BIO TLS talker, see tlsmem.h
 } STalker;
 
+int stk_buffer_talker(const struct _stalker* talker, const void *data, int data_len);
+int stk_buffer_reader(const struct _stalker* talker, void *buffer, int buff_len);
+int stk_buffer_vtalker(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+
 /** STalker initialization functions to prepare STalker to call send_line, recv_line. */
 void init_ssl_talker(struct _stalker* talker, SSL* ssl);
 void init_sock_talker(struct _stalker* talker, int socket);
+void init_buffer_talker(struct _stalker* talker, RenderBuffer *rb);
 
 
 /**
@@ -74,6 +123,8 @@ void init_sock_talker(struct _stalker* talker, int socket);
  */
 size_t stk_simple_send_line(const struct _stalker* talker, const char *data, int data_len);
 size_t stk_simple_send_unlined(const struct _stalker* talker, const char *data, int data_len);
+size_t stk_send_iovec(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+size_t stk_send_file(const struct _stalker* talker, int fd, off_t offset, size_t len);
 size_t stk_vsend_line(const struct _stalker* talker, va_list args);
 size_t stk_send_line(const struct _stalker* talker, ...);
 size_t stk_recv_line(const struct _stalker* talker, void *buffer, int buff_len);
@@ -0,0 +1,291 @@
+#include <stdio.h>        // for printf()
+#include <stdlib.h>       // for calloc(), free()
+#include <string.h>       // for memset()
+
+#include "tlsmem.h"
+#include "uring.h"
+#include "mailcb_internal.h"
+
+// Private, internal functions
+void tm_count_record(int write_p,
+                     int version,
+                     int content_type,
+                     const void *buf,
+                     size_t len,
+                     SSL *ssl,
+                     void *arg);
+int tm_flush(TMSession *ts);
+int tm_fill(TMSession *ts);
+int tm_handshake(MParcel *parcel, TMSession *ts);
+
+/**
+ * @brief SSL message callback that counts records as their headers pass.
+ */
+void tm_count_record(int write_p,
+                     int version,
+                     int content_type,
+                     const void *buf,
+                     size_t len,
+                     SSL *ssl,
+                     void *arg)
+{
+   TMSession *ts = (TMSession*)arg;
+
+   if (content_type == SSL3_RT_HEADER)
+   {
+      if (write_p)
+         ++ts->records_out;
+      else
+         ++ts->records_in;
+   }
+}
+
+/**
+ * @brief Write the waiting ciphertext to the transport, straight from the write BIO.
+ *
+ * @return 1 if it was all written.
+ */
+int tm_flush(TMSession *ts)
+{
+   char *data;
+   long len;
+   int  written;
+
+   if (ts->failed)
+      return 0;
+
+   len = BIO_get_mem_data(ts->wbio, &data);
+   while (len > 0)
+   {
+      ++ts->writes;
+      if ((written = (*ts->transport.writer)(&ts->transport, data, len)) <= 0)
+      {
+         ts->failed = 1;
+         return 0;
+      }
+
+      ts->cipher_out += written;
+      data += written;
+      len -= written;
+   }
+
+   (void)BIO_reset(ts->wbio);
+   return 1;
+}
+
+/**
+ * @brief Read what ciphertext has arrived, waiting for some, and give
+ *        it to OpenSSL.
+ */
+int tm_fill(TMSession *ts)
+{
+   int received;
+
+   if (ts->failed)
+      return 0;
+
+   ++ts->reads;
+   if ((received = (*ts->transport.reader)(&ts->transport, ts->in, sizeof(ts->in))) <= 0)
+   {
+      ts->failed = 1;
+      return 0;
+   }
+
+   ts->cipher_in += received;
+   return received == BIO_write(ts->rbio, ts->in, received);
+}
+
+/**
+ * @brief Drive SSL_connect() with the ciphertext moved by hand.
+ *
+ * The client's Finished message is left waiting, to go with the first command.
+ */
+int tm_handshake(MParcel *parcel, TMSession *ts)
+{
+   int result;
+
+   while ((result = SSL_connect(ts->ssl)) != 1)
+   {
+      if (SSL_get_error(ts->ssl, result) != SSL_ERROR_WANT_READ
+          || !tm_flush(ts)
+          || !tm_fill(ts))
+      {
+         log_ssl_error(parcel, ts->ssl, result);
+         mcb_log_message(parcel, "ssl connection through memory BIOs failed.", NULL);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+int tm_start(MParcel *parcel, STalker *talker, SSL_CTX *context, int socket_handle)
+{
+   TMSession *ts;
+
+   if (!(ts = (TMSession*)calloc(1, sizeof(TMSession))))
+   {
+      mcb_log_message(parcel, "Out of memory for a TLS session.", NULL);
+      return 0;
+   }
+
+   if (!(ts->ssl = SSL_new(context)))
+   {
+      mcb_log_message(parcel, "Failed to create a new SSL instance.", NULL);
+      free(ts);
+      return 0;
+   }
+
+   ts->rbio = BIO_new(BIO_s_mem());
+   ts->wbio = BIO_new(BIO_s_mem());
+   if (!ts->rbio || !ts->wbio)
+   {
+      mcb_log_message(parcel, "Failed to create memory BIOs.", NULL);
+      BIO_free(ts->rbio);
+      BIO_free(ts->wbio);
+      SSL_free(ts->ssl);
+      free(ts);
+      return 0;
+   }
+
+   // An empty read BIO means "wait for more", not end of file:
+   BIO_set_mem_eof_return(ts->rbio, -1);
+
+   // The SSL owns the BIOs from here:
+   SSL_set_bio(ts->ssl, ts->rbio, ts->wbio);
+   SSL_set_connect_state(ts->ssl);
+   SSL_set_msg_callback(ts->ssl, tm_count_record);
+   SSL_set_msg_callback_arg(ts->ssl, ts);
+
+   if (!ur_init_talker(&ts->transport, socket_handle))
+      init_sock_talker(&ts->transport, socket_handle);
+
+   if (!tm_handshake(parcel, ts))
+   {
+      ur_end_talker(&ts->transport);
+      SSL_free(ts->ssl);
+      free(ts);
+      return 0;
+   }
+
+   memset(talker, 0, sizeof(STalker));
+   talker->ssl_handle = ts->ssl;
+   talker->socket_handle = socket_handle;
+   talker->writer = tm_talker;
+   talker->reader = tm_reader;
+   talker->vwriter = tm_vtalker;
+   talker->tls_session = ts;
+
+   return 1;
+}
+
+void tm_end_talker(const MParcel *parcel, STalker *talker, int notify)
+{
+   TMSession *ts = talker->tls_session;
+
+   if (!ts)
+      return;
+
+   if (notify && !ts->failed)
+      SSL_shutdown(ts->ssl);
+
+   tm_flush(ts);
+   ur_end_talker(&ts->transport);
+
+   if (parcel && parcel->verbose)
+      printf("TLS through memory BIOs: %lu records in %lu writes (%llu bytes), "
+             "%lu records from %lu reads (%llu bytes).\n",
+             ts->records_out,
+             ts->writes,
+             ts->cipher_out,
+             ts->records_in,
+             ts->reads,
+             ts->cipher_in);
+
+   SSL_free(ts->ssl);
+   free(ts);
+
+   talker->tls_session = NULL;
+   talker->ssl_handle = NULL;
+}
+
+int tm_send_waiting(const STalker *talker)
+{
+   TMSession *ts = talker->tls_session;
+
+   if (!ts)
+      return 1;
+
+   // The transport may hold it in turn:
+   return tm_flush(ts) && ur_flush(&ts->transport);
+}
+
+/**
+ * @brief Encrypt into the write BIO, sending only once enough is waiting.
+ */
+int tm_talker(const STalker *talker, const void *data, int data_len)
+{
+   TMSession *ts = talker->tls_session;
+   int written;
+
+   if (ts->failed)
+      return -1;
+
+   if ((written = SSL_write(ts->ssl, data, data_len)) > 0
+       && BIO_ctrl_pending(ts->wbio) >= TM_FLUSH_LEN
+       && !tm_flush(ts))
+      return -1;
+
+   return written;
+}
+
+/**
+ * @brief Gather small pieces into full records, as stk_ssl_vtalker()
+ *        does, then as tm_talker().
+ */
+int tm_vtalker(const STalker *talker, const struct iovec *iov, int iov_count)
+{
+   TMSession *ts = talker->tls_session;
+   int written;
+
+   if (ts->failed)
+      return -1;
+
+   if ((written = stk_ssl_vtalker(talker, iov, iov_count)) > 0
+       && BIO_ctrl_pending(ts->wbio) >= TM_FLUSH_LEN
+       && !tm_flush(ts))
+      return -1;
+
+   return written;
+}
+
+/**
+ * @brief Send what is waiting, then decrypt as much as has arrived into *buffer*.
+ *
+ * Only waits for ciphertext if nothing has been decrypted yet.
+ */
+int tm_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   TMSession *ts = talker->tls_session;
+   int got = 0, result = -1;
+
+   // Commands go before their replies are awaited:
+   if (!tm_flush(ts))
+      return -1;
+
+   while (got < buff_len)
+   {
+      if ((result = SSL_read(ts->ssl, (char*)buffer + got, buff_len - got)) > 0)
+         got += result;
+      else if (got
+               || SSL_get_error(ts->ssl, result) != SSL_ERROR_WANT_READ
+               || !tm_fill(ts))
+         break;
+   }
+
+   // Reading may have made records to send, a key update for one:
+   if (BIO_ctrl_pending(ts->wbio) && !tm_flush(ts))
+      return got ? got : -1;
+
+   return got ? got : result;
+}
@@ -0,0 +1,83 @@
+#ifndef TLSMEM_H
+#define TLSMEM_H
+
+#include "socktalk.h"
+#include "mailcb.h"
+
+/**
+ * Memory-BIO TLS: OpenSSL kept away from the socket.
+ *
+ * An SSL bound to the socket with SSL_set_fd() makes a system call
+ * for every SSL_write() and SSL_read(), so every command or block of
+ * content costs one.  With MParcel::tls_memory_bio, the SSL reads and
+ * writes memory BIOs instead, and the library moves the ciphertext:
+ *
+ * - Records are collected in the write BIO, and only go to the socket
+ *   when TM_FLUSH_LEN of them are waiting or the session is about to
+ *   read, so a transaction's commands and content go in a few large
+ *   writes.
+ * - Ciphertext is read into the session's own buffer, TM_CIPHER_LEN at
+ *   a time, and decrypted in bulk: a read fills the caller's buffer,
+ *   BuffControl's for instance, with every record that has arrived.
+ * - The ciphertext goes through a socket talker, or an io_uring talker
+ *   (see uring.h), so the writes waiting when the session reads are
+ *   submitted with the read in one system call.
+ *
+ * The session counts records each way, and the transport's reads and
+ * writes, to show how many records each system call carries.
+ *
+ * Kernel TLS, which needs OpenSSL on the socket, is not used.
+ */
+
+#define TM_CIPHER_LEN  65536   // ciphertext read at once
+#define TM_FLUSH_LEN   65536   // ciphertext waiting that forces a write
+
+typedef struct _tm_session
+{
+   SSL           *ssl;
+   BIO           *rbio;          // ciphertext received, for OpenSSL to decrypt
+   BIO           *wbio;          // ciphertext from OpenSSL, waiting to be sent
+   STalker       transport;      // carries the ciphertext
+   int           failed;         // the transport failed, so the session is over
+
+   char          in[TM_CIPHER_LEN];
+
+   unsigned long records_out;
+   unsigned long records_in;
+   unsigned long writes;         // transport writes of ciphertext
+   unsigned long reads;          // transport reads of ciphertext
+   unsigned long long cipher_out;
+   unsigned long long cipher_in;
+} TMSession;
+
+/**
+ * @brief Perform the TLS handshake on an open socket, through memory
+ *        BIOs, and prepare *talker* to use the session.
+ *
+ * @return 1 for success, 0 if the handshake failed, after logging why.
+ */
+int tm_start(MParcel *parcel, STalker *talker, SSL_CTX *context, int socket_handle);
+
+/**
+ * @brief Send what is waiting, and release the session.
+ *
+ * Harmless for a talker of another kind.  With *notify*, the server
+ * is sent a close_notify alert first.  With MParcel::verbose, the
+ * session's counters are shown.
+ */
+void tm_end_talker(const MParcel *parcel, STalker *talker, int notify);
+
+/**
+ * @brief Send the waiting ciphertext now, rather than with the next read.
+ *
+ * Harmless for a talker of another kind.
+ *
+ * @return 1 for success, 0 if the session failed.
+ */
+int tm_send_waiting(const STalker *talker);
+
+int tm_talker(const STalker *talker, const void *data, int data_len);
+int tm_vtalker(const STalker *talker, const struct iovec *iov, int iov_count);
+int tm_reader(const STalker *talker, void *buffer, int buff_len);
+
+#endif
@@ -0,0 +1,696 @@
+// -*- compile-command: "gcc -Wall -Werror -DMCB_USE_IO_URING -DURING_MAIN -O2 -ggdb -o uring uring.c socktalk.c -lssl -lcrypto" -*-
+
+#ifdef MCB_USE_IO_URING
+
+#include <stdlib.h>       // for calloc(), free(), posix_memalign()
+#include <string.h>       // for memset(), memcpy()
+#include <errno.h>
+#include <unistd.h>       // for syscall(), close()
+#include <sys/mman.h>     // for mmap()
+#include <sys/syscall.h>  // for __NR_io_uring_*
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/**
+ * @brief A thread's ring, and the buffers registered with it.
+ */
+typedef struct _ur_ring
+{
+   int                 fd;
+   int                 sessions;      // talkers using the ring
+
+   unsigned            *sq_head;
+   unsigned            *sq_tail;
+   unsigned            *sq_mask;
+   unsigned            *sq_array;
+   struct io_uring_sqe *sqes;
+
+   unsigned            *cq_head;
+   unsigned            *cq_tail;
+   unsigned            *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   void                *sq_ring;
+   size_t              sq_ring_len;
+   void                *cq_ring;      // the same mapping as sq_ring, with IORING_FEAT_SINGLE_MMAP
+   size_t              cq_ring_len;
+   size_t              sqes_len;
+
+   char                *buffers;      // UR_BUFFER_COUNT of UR_BUFFER_LEN
+   int                 free_buffers[UR_BUFFER_COUNT];
+   int                 free_count;
+
+   int                 retired;       // operations out of reach, see ur_retire_ring()
+} URRing;
+
+__thread URRing *ur_thread_ring = NULL;
+__thread int ur_unavailable = 0;        // io_uring_setup() failed once, so don't retry
+
+// Private, internal functions
+URRing *ur_open_ring(void);
+void ur_close_ring(URRing *ring);
+void ur_retire_ring(URRing *ring);
+char *ur_buffer(const URRing *ring, int buffer);
+void ur_queue_fill(URSession *session);
+int ur_send_all(int socket_handle, const char *data, size_t len);
+int ur_submit(URSession *session, void *target, int target_len);
+
+URRing *ur_open_ring(void)
+{
+   struct io_uring_params params;
+   struct iovec iov[UR_BUFFER_COUNT];
+   URRing *ring;
+   void *buffers;
+   int i;
+
+   if (!(ring = (URRing*)calloc(1, sizeof(URRing))))
+      return NULL;
+
+   memset(&params, 0, sizeof(params));
+   if ((ring->fd = syscall(__NR_io_uring_setup, UR_RING_ENTRIES, &params)) < 0)
+   {
+      free(ring);
+      return NULL;
+   }
+
+   ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (ring->cq_ring_len > ring->sq_ring_len)
+         ring->sq_ring_len = ring->cq_ring_len;
+      ring->cq_ring_len = 0;
+   }
+
+   ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sq_ring == MAP_FAILED)
+      goto failed_sq;
+
+   if (ring->cq_ring_len)
+   {
+      ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+         goto failed_cq;
+   }
+   else
+      ring->cq_ring = ring->sq_ring;
+
+   ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED)
+      goto failed_sqes;
+
+   ring->sq_head = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+   ring->sq_tail = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+   ring->sq_mask = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+   ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+   ring->cq_head = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+   ring->cq_tail = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+   ring->cq_mask = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+
+   // Registered, the buffers are pinned once instead of at every read:
+   if (posix_memalign(&buffers, 4096, UR_BUFFER_COUNT * UR_BUFFER_LEN))
+      goto failed_buffers;
+
+   ring->buffers = (char*)buffers;
+   for (i = 0; i < UR_BUFFER_COUNT; ++i)
+   {
+      iov[i].iov_base = ring->buffers + i * UR_BUFFER_LEN;
+      iov[i].iov_len = UR_BUFFER_LEN;
+      ring->free_buffers[i] = UR_BUFFER_COUNT - 1 - i;
+   }
+   ring->free_count = UR_BUFFER_COUNT;
+
+   if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, UR_BUFFER_COUNT) < 0)
+      goto failed_register;
+
+   return ring;
+
+  failed_register:
+   free(ring->buffers);
+  failed_buffers:
+   munmap(ring->sqes, ring->sqes_len);
+  failed_sqes:
+   if (ring->cq_ring_len)
+      munmap(ring->cq_ring, ring->cq_ring_len);
+  failed_cq:
+   munmap(ring->sq_ring, ring->sq_ring_len);
+  failed_sq:
+   close(ring->fd);
+   free(ring);
+   return NULL;
+}
+
+void ur_close_ring(URRing *ring)
+{
+   munmap(ring->sqes, ring->sqes_len);
+   if (ring->cq_ring_len)
+      munmap(ring->cq_ring, ring->cq_ring_len);
+   munmap(ring->sq_ring, ring->sq_ring_len);
+
+   // Closing the ring unregisters the buffers:
+   close(ring->fd);
+
+   // But a retired ring's operations may still be using them:
+   if (!ring->retired)
+      free(ring->buffers);
+   free(ring);
+}
+
+/**
+ * @brief Stop using a ring whose operations are out of reach.
+ *
+ * After io_uring_enter() fails, operations it submitted may still be
+ * running, writing into or sending from their registered buffers, and
+ * their completions would be taken for those of the next submission.
+ * So no session submits on the ring again, its buffers are never
+ * freed, and the thread's next talker opens a new ring.
+ */
+void ur_retire_ring(URRing *ring)
+{
+   ring->retired = 1;
+
+   if (ring == ur_thread_ring)
+      ur_thread_ring = NULL;
+}
+
+char *ur_buffer(const URRing *ring, int buffer)
+{
+   return ring->buffers + buffer * UR_BUFFER_LEN;
+}
+
+/**
+ * @brief Queue the buffer taking writes, or give it back if it is empty.
+ */
+void ur_queue_fill(URSession *session)
+{
+   URRing *ring = session->ring;
+   UROp *op;
+
+   if (session->fill < 0)
+      return;
+
+   if (session->fill_len)
+   {
+      op = &session->ops[session->op_count++];
+      op->buffer = session->fill;
+      op->len = session->fill_len;
+      op->is_read = 0;
+   }
+   else
+      ring->free_buffers[ring->free_count++] = session->fill;
+
+   session->fill = -1;
+   session->fill_len = 0;
+}
+
+int ur_send_all(int socket_handle, const char *data, size_t len)
+{
+   ssize_t sent;
+
+   while (len)
+   {
+      if ((sent = send(socket_handle, data, len, MSG_NOSIGNAL)) <= 0)
+         return 0;
+
+      data += sent;
+      len -= sent;
+   }
+
+   return 1;
+}
+
+/**
+ * @brief Submit the queued operations, linked so they run in order,
+ *        and wait for all of them.
+ *
+ * The rest of a link chain is cancelled if a write comes up short, so
+ * whatever a cancelled or short write left is sent with send(), and a
+ * cancelled read is done with recv().
+ *
+ * If io_uring_enter() fails, the ring is retired with the
+ * operations' buffers, see ur_retire_ring(), and the session fails.
+ *
+ * @param target      Where a queued read's data goes
+ * @param target_len  Room in *target*
+ *
+ * @return The result of the read, as recv() would give it, 0 if none was queued.
+ */
+int ur_submit(URSession *session, void *target, int target_len)
+{
+   URRing *ring = session->ring;
+   int results[UR_BUFFER_COUNT + 1];
+   int count = session->op_count, to_submit = count, reaped = 0, result = 0, ret, i;
+   unsigned tail, head, index;
+   struct io_uring_sqe *sqe;
+   struct io_uring_cqe *cqe;
+   const UROp *op;
+   const char *data;
+
+   if (ring->retired)
+   {
+      // Nothing was submitted, so the buffers are the ring's again:
+      for (i = 0; i < count; ++i)
+         ring->free_buffers[ring->free_count++] = session->ops[i].buffer;
+
+      session->failed = 1;
+      session->op_count = 0;
+      return -1;
+   }
+
+   tail = *ring->sq_tail;
+   for (i = 0; i < count; ++i, ++tail)
+   {
+      op = &session->ops[i];
+      index = tail & *ring->sq_mask;
+      sqe = &ring->sqes[index];
+
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->fd = session->socket_handle;
+      sqe->addr = (unsigned long)ur_buffer(ring, op->buffer);
+      sqe->len = op->len;
+      sqe->user_data = i;
+      sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+
+      if (op->is_read)
+      {
+         sqe->opcode = IORING_OP_READ_FIXED;
+         sqe->off = (__u64)-1;
+         sqe->buf_index = op->buffer;
+      }
+      else
+      {
+         // Like stk_sock_talker(), a dropped connection must not raise SIGPIPE:
+         sqe->opcode = IORING_OP_SEND;
+         sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      }
+
+      ring->sq_array[index] = index;
+   }
+
+   __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+   while (reaped < count)
+   {
+      ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, count - reaped,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+      ++session->enters;
+
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         // With operations still in the kernel, nothing can be trusted,
+         // and their buffers mustn't be taken for other writes:
+         ur_retire_ring(ring);
+         session->failed = 1;
+         session->op_count = 0;
+         return -1;
+      }
+
+      to_submit -= ret;
+
+      head = *ring->cq_head;
+      while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      {
+         cqe = &ring->cqes[head & *ring->cq_mask];
+         results[cqe->user_data] = cqe->res;
+         ++reaped;
+         ++head;
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   for (i = 0; i < count; ++i)
+   {
+      op = &session->ops[i];
+      data = ur_buffer(ring, op->buffer);
+
+      if (session->failed)
+         result = -1;
+      else if (op->is_read)
+      {
+         if (results[i] >= 0)
+         {
+            memcpy(target, data, results[i]);
+            result = results[i];
+         }
+         else if (results[i] == -ECANCELED)
+            result = recv(session->socket_handle, target, target_len, 0);
+         else
+         {
+            errno = -results[i];
+            result = -1;
+         }
+      }
+      else if (results[i] != (int)op->len)
+      {
+         if (results[i] >= 0)
+            session->failed = !ur_send_all(session->socket_handle,
+                                           data + results[i],
+                                           op->len - results[i]);
+         else if (results[i] == -ECANCELED)
+            session->failed = !ur_send_all(session->socket_handle, data, op->len);
+         else
+            session->failed = 1;
+      }
+
+      ring->free_buffers[ring->free_count++] = op->buffer;
+   }
+
+   session->op_count = 0;
+   return result;
+}
+
+int ur_init_talker(STalker *talker, int socket_handle)
+{
+   URSession *session;
+
+   if (ur_unavailable)
+      return 0;
+
+   if (!ur_thread_ring && !(ur_thread_ring = ur_open_ring()))
+   {
+      ur_unavailable = 1;
+      return 0;
+   }
+
+   if (!(session = (URSession*)calloc(1, sizeof(URSession))))
+      return 0;
+
+   session->ring = ur_thread_ring;
+   session->socket_handle = socket_handle;
+   session->fill = -1;
+   ++ur_thread_ring->sessions;
+
+   init_sock_talker(talker, socket_handle);
+   talker->writer = ur_talker;
+   talker->vwriter = ur_vtalker;
+   talker->filewriter = NULL;   // sendfile() would pass the queued writes
+   talker->reader = ur_reader;
+   talker->uring_session = session;
+
+   return 1;
+}
+
+void ur_end_talker(STalker *talker)
+{
+   URSession *session = talker->uring_session;
+   URRing *ring;
+
+   if (!session)
+      return;
+
+   ring = session->ring;
+
+   ur_queue_fill(session);
+   if (session->op_count)
+      ur_submit(session, NULL, 0);
+
+   if (0 == --ring->sessions)
+   {
+      ur_close_ring(ring);
+      if (ring == ur_thread_ring)
+         ur_thread_ring = NULL;
+   }
+
+   free(session);
+   talker->uring_session = NULL;
+}
+
+int ur_flush(const STalker *talker)
+{
+   URSession *session = talker->uring_session;
+
+   if (!session)
+      return 1;
+
+   ur_queue_fill(session);
+   if (session->op_count)
+      ur_submit(session, NULL, 0);
+
+   return !session->failed;
+}
+
+int ur_talker(const STalker *talker, const void *data, int data_len)
+{
+   URSession *session = talker->uring_session;
+   URRing *ring = session->ring;
+   const char *ptr = (const char*)data;
+   size_t left = data_len, chunk;
+
+   ++session->writes;
+
+   while (left && !session->failed)
+   {
+      if (session->fill < 0)
+      {
+         if (session->op_count < UR_BUFFER_COUNT && ring->free_count)
+         {
+            session->fill = ring->free_buffers[--ring->free_count];
+            session->fill_len = 0;
+         }
+         else if (session->op_count)
+         {
+            // Every buffer is queued, so send them and carry on:
+            ur_submit(session, NULL, 0);
+            continue;
+         }
+         else
+         {
+            // Other talkers hold every buffer, and nothing of ours waits:
+            session->failed = !ur_send_all(session->socket_handle, ptr, left);
+            break;
+         }
+      }
+
+      chunk = UR_BUFFER_LEN - session->fill_len;
+      if (chunk > left)
+         chunk = left;
+
+      memcpy(ur_buffer(ring, session->fill) + session->fill_len, ptr, chunk);
+      session->fill_len += chunk;
+      ptr += chunk;
+      left -= chunk;
+
+      if (session->fill_len == UR_BUFFER_LEN)
+         ur_queue_fill(session);
+   }
+
+   return session->failed ? -1 : data_len;
+}
+
+int ur_vtalker(const STalker *talker, const struct iovec *iov, int iov_count)
+{
+   const struct iovec *end = iov + iov_count;
+   int total = 0;
+
+   for (; iov < end; ++iov)
+   {
+      if (ur_talker(talker, iov->iov_base, iov->iov_len) < 0)
+         return total ? total : -1;
+
+      total += iov->iov_len;
+   }
+
+   return total;
+}
+
+int ur_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   URSession *session = talker->uring_session;
+   URRing *ring = session->ring;
+   UROp *op;
+
+   ur_queue_fill(session);
+
+   if (session->failed)
+      return -1;
+
+   if (!ring->free_count)
+   {
+      // No buffer to read into, so only the writes go by io_uring:
+      if (session->op_count)
+         ur_submit(session, NULL, 0);
+
+      return session->failed ? -1 : recv(session->socket_handle, buffer, buff_len, 0);
+   }
+
+   op = &session->ops[session->op_count++];
+   op->buffer = ring->free_buffers[--ring->free_count];
+   op->len = buff_len < UR_BUFFER_LEN ? buff_len : UR_BUFFER_LEN;
+   op->is_read = 1;
+
+   return ur_submit(session, buffer, buff_len);
+}
+
+
+#ifdef URING_MAIN
+
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define ROUND_TRIPS   20000
+#define LINES_PER_TRIP 8
+
+const char *trip_lines[LINES_PER_TRIP] = {
+   "MAIL FROM: <sender@example.com> SIZE=4096",
+   "RCPT TO: <first@example.com>",
+   "RCPT TO: <second@example.com>",
+   "RCPT TO: <third@example.com>",
+   "RCPT TO: <fourth@example.com>",
+   "RCPT TO: <fifth@example.com>",
+   "RCPT TO: <sixth@example.com>",
+   "DATA"
+};
+
+/**
+ * Loopback server: answers each LINES_PER_TRIP lines with one reply,
+ * as a pipelining SMTP server answers an envelope.
+ */
+void serve(int listener, int connections)
+{
+   char buffer[16384];
+   int sock, lines, bytes, i;
+
+   while (connections--)
+   {
+      if ((sock = accept(listener, NULL, NULL)) < 0)
+         exit(1);
+
+      lines = 0;
+      while ((bytes = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+      {
+         for (i = 0; i < bytes; ++i)
+         {
+            if (buffer[i] == '\n' && ++lines == LINES_PER_TRIP)
+            {
+               lines = 0;
+               send(sock, "250 OK\r\n", 8, MSG_NOSIGNAL);
+            }
+         }
+      }
+
+      close(sock);
+   }
+
+   exit(0);
+}
+
+int connect_loopback(int port)
+{
+   struct sockaddr_in addr;
+   int sock = socket(AF_INET, SOCK_STREAM, 0);
+   int nodelay = 1;
+
+   // As the library's connections are:
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)))
+   {
+      perror("connect");
+      exit(1);
+   }
+
+   return sock;
+}
+
+double run_trips(STalker *talker)
+{
+   struct timespec start, now;
+   char reply[512];
+   int trip, line, got;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   for (trip = 0; trip < ROUND_TRIPS; ++trip)
+   {
+      for (line = 0; line < LINES_PER_TRIP; ++line)
+         stk_simple_send_line(talker, trip_lines[line], strlen(trip_lines[line]));
+
+      got = (*talker->reader)(talker, reply, sizeof(reply));
+      if (got <= 0 || 0 != strncmp(reply, "250", 3))
+      {
+         printf("round trip %d failed\n", trip);
+         exit(1);
+      }
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   int listener, sock, status;
+   pid_t server;
+   STalker talker;
+   double secs;
+
+   listener = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+       || listen(listener, 4)
+       || getsockname(listener, (struct sockaddr*)&addr, &addr_len))
+   {
+      perror("loopback server");
+      return 1;
+   }
+
+   if (!(server = fork()))
+      serve(listener, 2);
+   close(listener);
+
+   printf("%d round trips of %d lines, each line two writes:\n", ROUND_TRIPS, LINES_PER_TRIP);
+
+   sock = connect_loopback(ntohs(addr.sin_port));
+   init_sock_talker(&talker, sock);
+   secs = run_trips(&talker);
+   printf("send/recv:  %6.3f s, %8.0f trips/s, %d system calls per trip\n",
+          secs, ROUND_TRIPS / secs, LINES_PER_TRIP * 2 + 1);
+   close(sock);
+
+   sock = connect_loopback(ntohs(addr.sin_port));
+   if (!ur_init_talker(&talker, sock))
+   {
+      printf("io_uring is not available.\n");
+      kill(server, SIGTERM);
+      return 1;
+   }
+
+   secs = run_trips(&talker);
+   printf("io_uring:   %6.3f s, %8.0f trips/s, %.2f system calls per trip\n",
+          secs, ROUND_TRIPS / secs,
+          (double)talker.uring_session->enters / ROUND_TRIPS);
+   ur_end_talker(&talker);
+   close(sock);
+
+   waitpid(server, &status, 0);
+   return 0;
+}
+
+#endif  // URING_MAIN
+
+#endif  // MCB_USE_IO_URING
@@ -0,0 +1,98 @@
+#ifndef URING_H
+#define URING_H
+
+#include "socktalk.h"
+
+/**
+ * io_uring socket backend for STalker, built with -DMCB_USE_IO_URING
+ * (make IO_URING=1), for Linux 5.6 and later.  No liburing is needed.
+ *
+ * A plain socket talker costs a send() per write, and the library
+ * writes a command, a header field, or a block of content at a time.
+ * An io_uring talker copies writes into buffers registered with the
+ * kernel and queues them, and only submits when the session reads:
+ * the queued writes, linked in order, and the read of the reply go in
+ * one io_uring_enter(), so a round trip costs one system call however
+ * many writes it took.  A session that fills every buffer before it
+ * reads submits and waits for what it queued.
+ *
+ * The ring and its registered buffers belong to the thread, and are
+ * shared by every io_uring talker the thread has open.  If
+ * io_uring_enter() fails, every talker on the ring fails, and the
+ * thread's next talker opens a new one.
+ *
+ * Since writes are only queued, a failed send is reported by the
+ * next read, or by ur_end_talker().
+ *
+ * TLS sessions keep their socket talker, since OpenSSL writes to the
+ * socket itself, unless MParcel::tls_memory_bio has the library carry
+ * the ciphertext, through an io_uring talker, see tlsmem.h.
+ */
+
+#ifdef MCB_USE_IO_URING
+
+#define UR_RING_ENTRIES  64
+#define UR_BUFFER_COUNT  16      // registered, per thread
+#define UR_BUFFER_LEN    16384
+
+typedef struct _ur_op
+{
+   int    buffer;     // registered buffer index
+   size_t len;        // bytes to write from it, or most to read into it
+   int    is_read;
+} UROp;
+
+typedef struct _ur_session
+{
+   struct _ur_ring *ring;
+   int           socket_handle;
+   int           failed;        // a queued write failed, so the session is over
+
+   int           fill;          // registered buffer taking writes, -1 if none
+   size_t        fill_len;
+
+   UROp          ops[UR_BUFFER_COUNT + 1];   // queued writes, and a read, in order
+   int           op_count;
+
+   unsigned long enters;        // io_uring_enter() calls
+   unsigned long writes;        // writer calls, for comparison
+} URSession;
+
+/**
+ * @brief Prepare a talker for a connected socket that queues with io_uring.
+ *
+ * @return 1 for success, 0 if io_uring isn't available, leaving the
+ *         talker for init_sock_talker().
+ */
+int ur_init_talker(STalker *talker, int socket_handle);
+
+/**
+ * @brief Send what is still queued, and release the session.
+ *
+ * Harmless for a talker of another kind.
+ */
+void ur_end_talker(STalker *talker);
+
+/**
+ * @brief Submit the queued writes now, rather than with the next read.
+ *
+ * Harmless for a talker of another kind.
+ *
+ * @return 1 for success, 0 if the session failed.
+ */
+int ur_flush(const STalker *talker);
+
+int ur_talker(const STalker *talker, const void *data, int data_len);
+int ur_vtalker(const STalker *talker, const struct iovec *iov, int iov_count);
+int ur_reader(const STalker *talker, void *buffer, int buff_len);
+
+#else
+
+// Without io_uring, every talker is a socket talker:
+#define ur_init_talker(talker, socket_handle) ((void)(talker), (void)(socket_handle), 0)
+#define ur_end_talker(talker) ((void)(talker))
+#define ur_flush(talker) ((void)(talker), 1)
+
+#endif  // MCB_USE_IO_URING
+
+#endif